@@ -0,0 +1,277 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <algorithm>
+#include <evcollect/util/stringutil.h>
+#include "batch_encoder.h"
+
+namespace evcollect {
+namespace plugin_eventql {
+
+ReturnCode BatchEncoder::create(
+    const std::string& name,
+    std::unique_ptr<BatchEncoder>* encoder) {
+  if (name == "eventql") {
+    encoder->reset(new EventQLEncoder());
+    return ReturnCode::success();
+  }
+
+  if (name == "ndjson") {
+    encoder->reset(new NDJSONEncoder());
+    return ReturnCode::success();
+  }
+
+  if (name == "json_array") {
+    encoder->reset(new JSONArrayEncoder());
+    return ReturnCode::success();
+  }
+
+  if (name == "elasticsearch_bulk") {
+    encoder->reset(new ElasticsearchBulkEncoder());
+    return ReturnCode::success();
+  }
+
+  if (name == "clickhouse") {
+    encoder->reset(new ClickHouseEncoder());
+    return ReturnCode::success();
+  }
+
+  return ReturnCode::error(
+      "EINVAL",
+      "invalid encoder: '%s' -- must be 'eventql', 'ndjson', 'json_array', " \
+      "'elasticsearch_bulk' or 'clickhouse'",
+      name.c_str());
+}
+
+ReturnCode BatchEncoder::parseTarget(
+    const std::string& target,
+    TargetTable* table) const {
+  if (target.empty()) {
+    return ReturnCode::error("EINVAL", "empty target specification");
+  }
+
+  table->database.clear();
+  table->table = target;
+  return ReturnCode::success();
+}
+
+bool BatchEncoder::isSingleTarget() const {
+  return false;
+}
+
+ReturnCode BatchEncoder::checkResponse(
+    const std::string& /* response */) const {
+  return ReturnCode::success();
+}
+
+namespace {
+
+/* events are usually single line JSON, but a raw newline would split the
+   event into two lines (and JSON only allows it as whitespace) */
+void appendLine(const std::string& data, std::string* body) {
+  auto begin = body->size();
+  *body += data;
+  if (data.find('\n') != std::string::npos) {
+    std::replace(body->begin() + begin, body->end(), '\n', ' ');
+  }
+
+  *body += "\n";
+}
+
+}
+
+const char* EventQLEncoder::getContentType() const {
+  return "application/json; charset=utf-8";
+}
+
+ReturnCode EventQLEncoder::parseTarget(
+    const std::string& target,
+    TargetTable* table) const {
+  auto target_parts = StringUtil::split(target, "/");
+  if (target_parts.size() != 2 ||
+      target_parts[0].empty() ||
+      target_parts[1].empty()) {
+    return ReturnCode::error(
+        "EINVAL",
+        "invalid target specification '%s'. format is: database/table",
+        target.c_str());
+  }
+
+  table->database = target_parts[0];
+  table->table = target_parts[1];
+  return ReturnCode::success();
+}
+
+void EventQLEncoder::encodeBatch(
+    const std::vector<const EnqueuedEvent*>& events,
+    size_t size_hint,
+    std::string* body) const {
+  body->clear();
+  body->reserve(size_hint + events.size() * 48 + 2);
+  *body += "[";
+  std::string database_json;
+  std::string table_json;
+  for (size_t i = 0; i < events.size(); ++i) {
+    const auto& ev = *events[i];
+    if (i == 0 || ev.database != events[i - 1]->database) {
+      database_json = StringUtil::jsonEscape(ev.database);
+    }
+    if (i == 0 || ev.table != events[i - 1]->table) {
+      table_json = StringUtil::jsonEscape(ev.table);
+    }
+
+    if (i > 0) {
+      *body += ",";
+    }
+
+    *body += "{\"database\":\"";
+    *body += database_json;
+    *body += "\",\"table\":\"";
+    *body += table_json;
+    *body += "\",\"data\":";
+    *body += ev.data;
+    *body += "}";
+  }
+  *body += "]";
+}
+
+const char* NDJSONEncoder::getContentType() const {
+  return "application/x-ndjson";
+}
+
+void NDJSONEncoder::encodeBatch(
+    const std::vector<const EnqueuedEvent*>& events,
+    size_t size_hint,
+    std::string* body) const {
+  body->clear();
+  body->reserve(size_hint + events.size());
+  for (const auto ev : events) {
+    appendLine(ev->data, body);
+  }
+}
+
+const char* JSONArrayEncoder::getContentType() const {
+  return "application/json; charset=utf-8";
+}
+
+void JSONArrayEncoder::encodeBatch(
+    const std::vector<const EnqueuedEvent*>& events,
+    size_t size_hint,
+    std::string* body) const {
+  body->clear();
+  body->reserve(size_hint + events.size() + 2);
+  *body += "[";
+  for (size_t i = 0; i < events.size(); ++i) {
+    if (i > 0) {
+      *body += ",";
+    }
+
+    *body += events[i]->data;
+  }
+  *body += "]";
+}
+
+const char* ElasticsearchBulkEncoder::getContentType() const {
+  return "application/x-ndjson";
+}
+
+void ElasticsearchBulkEncoder::encodeBatch(
+    const std::vector<const EnqueuedEvent*>& events,
+    size_t size_hint,
+    std::string* body) const {
+  body->clear();
+  body->reserve(size_hint + events.size() * 48);
+  std::string action;
+  for (size_t i = 0; i < events.size(); ++i) {
+    const auto& ev = *events[i];
+    if (i == 0 || ev.table != events[i - 1]->table) {
+      action = StringUtil::format(
+          "{\"index\":{\"_index\":\"$0\"}}\n",
+          StringUtil::jsonEscape(ev.table));
+    }
+
+    *body += action;
+    appendLine(ev.data, body);
+  }
+}
+
+/**
+ * The _bulk API responds with 200 even if some of the events were rejected
+ * and sets "errors" to true in that case
+ */
+ReturnCode ElasticsearchBulkEncoder::checkResponse(
+    const std::string& response) const {
+  static const std::string kErrorsKey = "\"errors\"";
+
+  auto pos = response.find(kErrorsKey);
+  if (pos == std::string::npos) {
+    return ReturnCode::success();
+  }
+
+  pos = response.find_first_not_of(" \t\r\n", pos + kErrorsKey.size());
+  if (pos == std::string::npos || response[pos] != ':') {
+    return ReturnCode::success();
+  }
+
+  pos = response.find_first_not_of(" \t\r\n", pos + 1);
+  if (pos == std::string::npos || response.compare(pos, 4, "true") != 0) {
+    return ReturnCode::success();
+  }
+
+  auto reason = response.find("\"reason\":");
+  return ReturnCode::error(
+      "EINVAL",
+      "bulk request failed for some events: %s",
+      reason == std::string::npos ?
+          "unknown reason" :
+          response.substr(reason, 256).c_str());
+}
+
+const char* ClickHouseEncoder::getContentType() const {
+  return "text/plain; charset=utf-8";
+}
+
+bool ClickHouseEncoder::isSingleTarget() const {
+  return true;
+}
+
+void ClickHouseEncoder::encodeBatch(
+    const std::vector<const EnqueuedEvent*>& events,
+    size_t size_hint,
+    std::string* body) const {
+  body->clear();
+  if (events.empty()) {
+    return;
+  }
+
+  body->reserve(size_hint + events.size() + 64);
+  *body += "INSERT INTO ";
+  *body += events[0]->table;
+  *body += " FORMAT JSONEachRow\n";
+  for (const auto ev : events) {
+    appendLine(ev->data, body);
+  }
+}
+
+} // namespace plugins_eventql
+} // namespace evcollect
@@ -0,0 +1,161 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include <evcollect/util/return_code.h>
+
+namespace evcollect {
+namespace plugin_eventql {
+
+struct TargetTable {
+  std::string database;
+  std::string table;
+};
+
+struct EnqueuedEvent {
+  EnqueuedEvent() : spool_cursor(0) {}
+  std::string database;
+  std::string table;
+  std::string data;
+  uint64_t spool_cursor; /* the spool read the event came from, if any */
+};
+
+/**
+ * Encodes a batch of events into an HTTP request body. The events are passed
+ * sorted by target, so all events for the same target are adjacent
+ */
+class BatchEncoder {
+public:
+
+  /**
+   * Create an encoder by name: eventql, ndjson, json_array,
+   * elasticsearch_bulk or clickhouse
+   */
+  static ReturnCode create(
+      const std::string& name,
+      std::unique_ptr<BatchEncoder>* encoder);
+
+  virtual ~BatchEncoder() = default;
+
+  virtual const char* getContentType() const = 0;
+
+  /**
+   * Parse the target of a route. By default the target is a single name
+   * (e.g. an index or table name) that is stored in table
+   */
+  virtual ReturnCode parseTarget(
+      const std::string& target,
+      TargetTable* table) const;
+
+  /**
+   * Returns true if a request body can only contain events for one target
+   */
+  virtual bool isSingleTarget() const;
+
+  virtual void encodeBatch(
+      const std::vector<const EnqueuedEvent*>& events,
+      size_t size_hint,
+      std::string* body) const = 0;
+
+  /**
+   * Check the body of a 2xx response, for APIs that report errors for
+   * individual events in an otherwise successful response
+   */
+  virtual ReturnCode checkResponse(const std::string& response) const;
+
+};
+
+/**
+ * [{"database":"<db>","table":"<table>","data":<event>},...] as expected by
+ * the EventQL insert API. Targets have the format database/table
+ */
+class EventQLEncoder : public BatchEncoder {
+public:
+  const char* getContentType() const override;
+  ReturnCode parseTarget(
+      const std::string& target,
+      TargetTable* table) const override;
+  void encodeBatch(
+      const std::vector<const EnqueuedEvent*>& events,
+      size_t size_hint,
+      std::string* body) const override;
+};
+
+/**
+ * One event per line
+ */
+class NDJSONEncoder : public BatchEncoder {
+public:
+  const char* getContentType() const override;
+  void encodeBatch(
+      const std::vector<const EnqueuedEvent*>& events,
+      size_t size_hint,
+      std::string* body) const override;
+};
+
+/**
+ * [<event>,<event>,...]
+ */
+class JSONArrayEncoder : public BatchEncoder {
+public:
+  const char* getContentType() const override;
+  void encodeBatch(
+      const std::vector<const EnqueuedEvent*>& events,
+      size_t size_hint,
+      std::string* body) const override;
+};
+
+/**
+ * The Elasticsearch _bulk API: an index action line followed by the event
+ * for each event. The target is the name of the index
+ */
+class ElasticsearchBulkEncoder : public BatchEncoder {
+public:
+  const char* getContentType() const override;
+  void encodeBatch(
+      const std::vector<const EnqueuedEvent*>& events,
+      size_t size_hint,
+      std::string* body) const override;
+  ReturnCode checkResponse(const std::string& response) const override;
+};
+
+/**
+ * An "INSERT INTO <target> FORMAT JSONEachRow" query followed by one event
+ * per line, for the ClickHouse HTTP interface. The target is the name of the
+ * table (optionally prefixed with "<database>.")
+ */
+class ClickHouseEncoder : public BatchEncoder {
+public:
+  const char* getContentType() const override;
+  bool isSingleTarget() const override;
+  void encodeBatch(
+      const std::vector<const EnqueuedEvent*>& events,
+      size_t size_hint,
+      std::string* body) const override;
+};
+
+} // namespace plugins_eventql
+} // namespace evcollect
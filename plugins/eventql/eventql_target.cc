@@ -0,0 +1,1668 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <algorithm>
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <evcollect/util/base64.h>
+#include <evcollect/util/stringutil.h>
+#include "eventql_target.h"
+
+namespace evcollect {
+namespace plugin_eventql {
+
+EventQLTarget::EventQLTarget() :
+    name_("eventql"),
+    url_is_template_(false),
+    encoder_(new EventQLEncoder()),
+    host_selection_(HostSelection::LEAST_OUTSTANDING),
+    next_host_(0),
+    queue_(new UploadQueue<EnqueuedEvent>(kDefaultMaxQueueLength)),
+    producers_waiting_(0),
+    consumer_state_(ConsumerState::RUNNING),
+    poll_wakeup_threshold_(0),
+    batch_max_events_(kDefaultBatchMaxEvents),
+    batch_max_bytes_(kDefaultBatchMaxBytes),
+    batch_linger_(kDefaultBatchLingerMicros),
+    pending_deadline_(0),
+    thread_running_(false),
+    thread_shutdown_(false),
+    curl_multi_(nullptr),
+    req_headers_(nullptr),
+    max_inflight_(kDefaultMaxInflight),
+    http_timeout_(kDefaultHTTPTimeoutMicros),
+    retry_queue_max_length_(kDefaultRetryQueueLength),
+    retry_inflight_(0),
+    retry_max_attempts_(kDefaultRetryMaxAttempts),
+    retry_backoff_(kDefaultRetryBackoffMicros),
+    retry_backoff_max_(kDefaultRetryBackoffMaxMicros),
+    retry_rng_(std::random_device()()),
+    circuit_state_(CircuitState::CLOSED),
+    circuit_failures_(0),
+    circuit_threshold_(kDefaultCircuitBreakerThreshold),
+    circuit_cooldown_base_(kDefaultCircuitBreakerCooldownMicros),
+    circuit_cooldown_(kDefaultCircuitBreakerCooldownMicros),
+    circuit_open_until_(0),
+    circuit_probe_inflight_(false),
+    unhealthy_until_(0),
+    adaptive_(false),
+    latency_target_(0),
+    batch_window_(kDefaultBatchMaxEvents),
+    inflight_window_(kDefaultMaxInflight),
+    adapt_last_eval_(0),
+    adapt_last_decrease_(0) {
+  pending_batch_.size_bytes = 0;
+}
+
+EventQLTarget::~EventQLTarget() {
+  for (auto& req : requests_) {
+    if (curl_multi_) {
+      curl_multi_remove_handle(curl_multi_, req->curl);
+    }
+
+    curl_easy_cleanup(req->curl);
+  }
+
+  if (curl_multi_) {
+    curl_multi_cleanup(curl_multi_);
+  }
+
+  if (req_headers_) {
+    curl_slist_free_all(req_headers_);
+  }
+}
+
+void EventQLTarget::addHost(
+    const std::string& hostname,
+    uint16_t port) {
+  UploadHost host;
+  host.hostname = hostname;
+  host.port = port;
+  host.url = StringUtil::format(
+      hostname.find(':') == std::string::npos ?
+          "http://$0:$1/api/v1/tables/insert" :
+          "http://[$0]:$1/api/v1/tables/insert",
+      hostname,
+      port);
+  host.inflight = 0;
+  hosts_.emplace_back(host);
+}
+
+ReturnCode EventQLTarget::addURL(const std::string& url) {
+  auto scheme_end = url.find("://");
+  if (scheme_end == std::string::npos) {
+    return ReturnCode::error(
+        "EINVAL",
+        "invalid url '%s'. format is: http[s]://host[:port]/path",
+        url.c_str());
+  }
+
+  auto scheme = url.substr(0, scheme_end);
+  if (scheme != "http" && scheme != "https") {
+    return ReturnCode::error(
+        "EINVAL",
+        "invalid url scheme '%s' -- must be 'http' or 'https'",
+        scheme.c_str());
+  }
+
+  auto host_begin = scheme_end + 3;
+  auto host_end = url.find_first_of("/?", host_begin);
+  auto hostport = url.substr(host_begin, host_end - host_begin);
+
+  UploadHost host;
+  host.port = scheme == "https" ? 443 : 80;
+  auto rc = parseHostPort(hostport, &host.hostname, &host.port);
+  if (!rc.isSuccess()) {
+    return ReturnCode::error(
+        "EINVAL",
+        "invalid url '%s': %s",
+        url.c_str(),
+        rc.getMessage().c_str());
+  }
+
+  host.url = url;
+  host.inflight = 0;
+  hosts_.emplace_back(host);
+
+  if (url.find("%T") != std::string::npos) {
+    url_is_template_ = true;
+  }
+
+  return ReturnCode::success();
+}
+
+ReturnCode EventQLTarget::parseHostPort(
+    const std::string& hostport,
+    std::string* host,
+    uint16_t* port) {
+  auto port_pos = std::string::npos;
+  if (!hostport.empty() && hostport[0] == '[') {
+    auto end = hostport.find(']');
+    if (end == std::string::npos ||
+        (end + 1 < hostport.size() && hostport[end + 1] != ':')) {
+      return ReturnCode::error(
+          "EINVAL",
+          "invalid host '%s'",
+          hostport.c_str());
+    }
+
+    *host = hostport.substr(1, end - 1);
+    if (end + 1 < hostport.size()) {
+      port_pos = end + 1;
+    }
+  } else {
+    port_pos = hostport.find(':');
+    if (port_pos != std::string::npos &&
+        hostport.find(':', port_pos + 1) != std::string::npos) {
+      port_pos = std::string::npos;
+    }
+
+    *host = hostport.substr(0, port_pos);
+  }
+
+  if (host->empty()) {
+    return ReturnCode::error(
+        "EINVAL",
+        "missing host in '%s'",
+        hostport.c_str());
+  }
+
+  if (port_pos == std::string::npos) {
+    return ReturnCode::success();
+  }
+
+  auto port_str = hostport.c_str() + port_pos + 1;
+  char* end;
+  errno = 0;
+  auto value = strtoul(port_str, &end, 10);
+  if (!isdigit(*port_str) ||
+      errno != 0 ||
+      *end != 0 ||
+      value == 0 ||
+      value > 65535) {
+    return ReturnCode::error(
+        "EINVAL",
+        "invalid port in '%s'",
+        hostport.c_str());
+  }
+
+  *port = value;
+  return ReturnCode::success();
+}
+
+void EventQLTarget::setEncoder(std::unique_ptr<BatchEncoder> encoder) {
+  encoder_ = std::move(encoder);
+}
+
+void EventQLTarget::addHeader(const std::string& header) {
+  headers_.emplace_back(header);
+}
+
+void EventQLTarget::setName(const std::string& name) {
+  name_ = name;
+  if (spool_) {
+    spool_->setName(name);
+  }
+}
+
+ReturnCode EventQLTarget::setHostSelection(const std::string& mode) {
+  if (mode == "round_robin") {
+    host_selection_ = HostSelection::ROUND_ROBIN;
+    return ReturnCode::success();
+  }
+
+  if (mode == "least_outstanding") {
+    host_selection_ = HostSelection::LEAST_OUTSTANDING;
+    return ReturnCode::success();
+  }
+
+  return ReturnCode::error(
+      "EINVAL",
+      "invalid host_selection: '%s' -- " \
+      "must be 'round_robin' or 'least_outstanding'",
+      mode.c_str());
+}
+
+ReturnCode EventQLTarget::addRoute(
+    const std::string& event_name_match,
+    const std::string& target) {
+  EventRouting r;
+  auto rc = encoder_->parseTarget(target, &r.target);
+  if (!rc.isSuccess()) {
+    return rc;
+  }
+
+  r.event_name_match = event_name_match;
+  r.target_is_template = target.find("%E") != std::string::npos;
+
+  auto idx = routes_.size();
+  routes_.emplace_back(r);
+
+  if (event_name_match.find_first_of("*?[") == std::string::npos) {
+    exact_routes_[event_name_match].emplace_back(idx);
+  } else {
+    glob_routes_.emplace_back(idx);
+  }
+
+  std::unique_lock<std::mutex> lk(route_cache_mutex_);
+  route_cache_.clear();
+  return ReturnCode::success();
+}
+
+void EventQLTarget::setAuthToken(const std::string& auth_token) {
+  auth_token_ = auth_token;
+}
+
+void EventQLTarget::setCredentials(
+    const std::string& username,
+    const std::string& password) {
+  username_ = username;
+  password_ = password;
+}
+
+void EventQLTarget::setHTTPTimeout(uint64_t usecs) {
+  http_timeout_ = usecs;
+}
+
+void EventQLTarget::setMaxQueueLength(size_t queue_len) {
+  queue_.reset(new UploadQueue<EnqueuedEvent>(queue_len));
+}
+
+void EventQLTarget::setMaxInflight(size_t max_inflight) {
+  max_inflight_ = max_inflight;
+}
+
+void EventQLTarget::setBatchMaxEvents(size_t max_events) {
+  batch_max_events_ = max_events;
+}
+
+void EventQLTarget::setBatchMaxBytes(size_t max_bytes) {
+  batch_max_bytes_ = max_bytes;
+}
+
+void EventQLTarget::setBatchLinger(uint64_t usecs) {
+  batch_linger_ = usecs;
+}
+
+void EventQLTarget::setRetryMaxAttempts(size_t max_attempts) {
+  retry_max_attempts_ = max_attempts;
+}
+
+void EventQLTarget::setRetryBackoff(uint64_t base_usecs, uint64_t max_usecs) {
+  retry_backoff_ = base_usecs;
+  retry_backoff_max_ = std::max(base_usecs, max_usecs);
+}
+
+void EventQLTarget::setRetryQueueLength(size_t max_queue_len) {
+  retry_queue_max_length_ = max_queue_len;
+}
+
+uint64_t EventQLTarget::getRetryBackoff(
+    uint64_t base_usecs,
+    uint64_t max_usecs,
+    size_t attempt) {
+  if (attempt >= 64 || base_usecs > (max_usecs >> attempt)) {
+    return max_usecs;
+  }
+
+  return base_usecs << attempt;
+}
+
+void EventQLTarget::setAdaptiveBatching(bool enable, uint64_t latency_target) {
+  adaptive_ = enable;
+  latency_target_ = latency_target;
+}
+
+void EventQLTarget::setCircuitBreaker(size_t threshold, uint64_t cooldown) {
+  circuit_threshold_ = threshold;
+  circuit_cooldown_base_ = cooldown;
+  circuit_cooldown_ = cooldown;
+}
+
+ReturnCode EventQLTarget::setCompression(
+    const std::string& compression,
+    int level) {
+  if (compression == "none") {
+#ifdef HAVE_ZLIB
+    gzip_.reset(nullptr);
+#endif
+    return ReturnCode::success();
+  }
+
+  if (compression == "gzip") {
+#ifdef HAVE_ZLIB
+    if (level < -1 || level > 9) {
+      return ReturnCode::error(
+          "EINVAL",
+          "invalid compression level: %i -- must be 0-9",
+          level);
+    }
+
+    gzip_.reset(new GzipCompressor(level));
+    return ReturnCode::success();
+#else
+    return ReturnCode::error(
+        "EINVAL",
+        "gzip compression is not supported (compiled without zlib)");
+#endif
+  }
+
+  return ReturnCode::error(
+      "EINVAL",
+      "invalid compression: '%s' -- must be 'gzip' or 'none'",
+      compression.c_str());
+}
+
+ReturnCode EventQLTarget::setSpool(
+    const std::string& spool_dir,
+    uint64_t segment_size,
+    uint64_t sync_interval) {
+  std::unique_ptr<UploadSpool> spool(new UploadSpool(spool_dir));
+  spool->setName(name_);
+  spool->setSegmentSize(segment_size);
+  spool->setSyncInterval(sync_interval);
+
+  auto rc = spool->open();
+  if (!rc.isSuccess()) {
+    return rc;
+  }
+
+  spool_ = std::move(spool);
+  return ReturnCode::success();
+}
+
+ReturnCode EventQLTarget::emitEvent(
+    const std::string& event_name,
+    const std::string& event_data) {
+  TargetList uncached;
+  auto targets = resolveRoutes(event_name, &uncached);
+
+  for (const auto& target : *targets) {
+    EnqueuedEvent e;
+    e.database = target.database;
+    e.table = target.table;
+    e.data = event_data;
+
+    auto rc = enqueueEvent(std::move(e));
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  return ReturnCode::success();
+}
+
+namespace {
+void expandTemplate(const std::string& event_name, std::string* str) {
+  size_t pos = 0;
+  while ((pos = str->find("%E", pos)) != std::string::npos) {
+    str->replace(pos, 2, event_name);
+    pos += event_name.size();
+  }
+}
+}
+
+/**
+ * Returns the list of target tables for an event. The list is computed once
+ * per event name and then served from the route cache, so the cost of
+ * routing an event does not depend on the number of routes. If the cache is
+ * full, the list is computed into uncached
+ */
+const EventQLTarget::TargetList* EventQLTarget::resolveRoutes(
+    const std::string& event_name,
+    TargetList* uncached) {
+  std::unique_lock<std::mutex> lk(route_cache_mutex_);
+  auto cached = route_cache_.find(event_name);
+  if (cached != route_cache_.end()) {
+    return &cached->second;
+  }
+
+  /* collect the indexes of all matching routes in config order */
+  std::vector<size_t> matches;
+  auto exact = exact_routes_.find(event_name);
+  if (exact != exact_routes_.end()) {
+    matches = exact->second;
+  }
+
+  for (auto idx : glob_routes_) {
+    const auto& pattern = routes_[idx].event_name_match;
+    if (fnmatch(pattern.c_str(), event_name.c_str(), 0) == 0) {
+      matches.emplace_back(idx);
+    }
+  }
+
+  std::sort(matches.begin(), matches.end());
+
+  TargetList targets;
+  for (auto idx : matches) {
+    auto target = routes_[idx].target;
+    if (routes_[idx].target_is_template) {
+      expandTemplate(event_name, &target.database);
+      expandTemplate(event_name, &target.table);
+    }
+
+    targets.emplace_back(std::move(target));
+  }
+
+  /* entries are never removed (until the routes change), and references
+     into an unordered_map stay valid on rehash, so the returned pointer can
+     be used without holding the lock */
+  if (route_cache_.size() < kMaxRouteCacheSize) {
+    return &(route_cache_[event_name] = std::move(targets));
+  }
+
+  *uncached = std::move(targets);
+  return uncached;
+}
+
+ReturnCode EventQLTarget::enqueueEvent(EnqueuedEvent&& event) {
+  metrics_.increment(UploadMetrics::ENQUEUED);
+
+  /* once we started spooling, all events go through the spool until it is
+     drained so that the upload order is preserved */
+  if (spool_ && !spool_->empty()) {
+    return spoolEvent(event, true);
+  }
+
+  if (!queue_->push(std::move(event))) {
+    if (spool_) {
+      return spoolEvent(event, true);
+    }
+
+    /* the queue is full, wait for the upload thread to make room */
+    auto wait_t0 = MonotonicClock::now();
+    metrics_.increment(UploadMetrics::ENQUEUE_BLOCKED);
+
+    std::unique_lock<std::mutex> lk(mutex_);
+    ++producers_waiting_;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!queue_->push(std::move(event))) {
+      if (thread_shutdown_) {
+        --producers_waiting_;
+        return ReturnCode::error(
+            "EIO",
+            "%s upload thread stopped",
+            name_.c_str());
+      }
+
+      queue_space_cv_.wait(lk);
+    }
+
+    --producers_waiting_;
+    lk.unlock();
+
+    metrics_.record(
+        UploadMetrics::ENQUEUE_WAIT,
+        MonotonicClock::now() - wait_t0);
+  }
+
+  wakeUploadThread(false);
+  return ReturnCode::success();
+}
+
+/**
+ * Wake up the upload thread if (and only if) it is parked. If it is polling
+ * on in-flight requests, it is only woken up once enough events for a full
+ * batch are queued (or if force is true)
+ */
+void EventQLTarget::wakeUploadThread(bool force) {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  auto state = consumer_state_.load();
+  switch (state) {
+
+    case ConsumerState::RUNNING:
+      return;
+
+    case ConsumerState::WAITING:
+      if (consumer_state_.compare_exchange_strong(
+              state,
+              ConsumerState::RUNNING)) {
+        std::unique_lock<std::mutex> lk(mutex_);
+        cv_.notify_one();
+      }
+      return;
+
+    case ConsumerState::POLLING:
+      if ((force || queue_->size() >= poll_wakeup_threshold_) &&
+          consumer_state_.compare_exchange_strong(
+              state,
+              ConsumerState::RUNNING)) {
+        curl_multi_wakeup(curl_multi_);
+      }
+      return;
+
+  }
+}
+
+/**
+ * Wake up producers that are blocked on a full queue
+ */
+void EventQLTarget::wakeProducers() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (producers_waiting_.load() > 0) {
+    std::unique_lock<std::mutex> lk(mutex_);
+    queue_space_cv_.notify_all();
+  }
+}
+
+/**
+ * Spool records are encoded as <dblen:u32><db><tbllen:u32><table><data>
+ */
+ReturnCode EventQLTarget::spoolEvent(const EnqueuedEvent& event, bool notify) {
+  std::string record;
+  record.reserve(
+      8 + event.database.size() + event.table.size() + event.data.size());
+
+  uint32_t database_len = event.database.size();
+  record.append((const char*) &database_len, sizeof(database_len));
+  record.append(event.database);
+  uint32_t table_len = event.table.size();
+  record.append((const char*) &table_len, sizeof(table_len));
+  record.append(event.table);
+  record.append(event.data);
+
+  bool was_empty = false;
+  auto rc = spool_->append(record.data(), record.size(), &was_empty);
+  if (!rc.isSuccess()) {
+    return rc;
+  }
+
+  metrics_.increment(UploadMetrics::SPOOLED);
+
+  if (was_empty && notify) {
+    wakeUploadThread(true);
+  }
+
+  return ReturnCode::success();
+}
+
+/**
+ * Read up to max_events events from the spool and append them to batch. The
+ * events keep the spool cursor and have to be passed to commitSpooled once
+ * they are delivered or dropped. Must be called without holding mutex_
+ */
+size_t EventQLTarget::readSpool(
+    size_t max_events,
+    size_t max_bytes,
+    UploadBatch* batch) {
+  auto first = batch->events.size();
+  UploadSpool::Cursor cursor;
+  auto nrecords = spool_->read(
+      max_events,
+      max_bytes,
+      [batch] (const char* data, size_t size) {
+    uint32_t database_len;
+    uint32_t table_len;
+    if (size < sizeof(database_len)) {
+      return;
+    }
+
+    memcpy(&database_len, data, sizeof(database_len));
+    size -= sizeof(database_len);
+    data += sizeof(database_len);
+    if (size < database_len + sizeof(table_len)) {
+      return;
+    }
+
+    EnqueuedEvent ev;
+    ev.database.assign(data, database_len);
+    size -= database_len;
+    data += database_len;
+
+    memcpy(&table_len, data, sizeof(table_len));
+    size -= sizeof(table_len);
+    data += sizeof(table_len);
+    if (size < table_len) {
+      return;
+    }
+
+    ev.table.assign(data, table_len);
+    ev.data.assign(data + table_len, size - table_len);
+    batch->size_bytes += ev.database.size() + ev.table.size() + ev.data.size();
+    batch->events.emplace_back(std::move(ev));
+  },
+  &cursor);
+
+  for (auto i = first; i < batch->events.size(); ++i) {
+    batch->events[i].spool_cursor = cursor;
+  }
+
+  /* malformed records are skipped */
+  auto nevents = batch->events.size() - first;
+  if (nevents < nrecords) {
+    spool_->commit(cursor, nrecords - nevents);
+  }
+
+  return nevents;
+}
+
+/**
+ * Commit the events in batch that were read from the spool
+ */
+void EventQLTarget::commitSpooled(const UploadBatch& batch) {
+  UploadSpool::Cursor cursor = 0;
+  size_t n = 0;
+  for (const auto& ev : batch.events) {
+    if (ev.spool_cursor != cursor) {
+      if (n > 0) {
+        spool_->commit(cursor, n);
+      }
+
+      cursor = ev.spool_cursor;
+      n = 0;
+    }
+
+    if (cursor != 0) {
+      ++n;
+    }
+  }
+
+  if (n > 0) {
+    spool_->commit(cursor, n);
+  }
+}
+
+/**
+ * Requests that can only carry a single target keep the events for the
+ * target of the first event in batch. The other events are put back in front
+ * of the pending batch (they already waited for the linger time) and are
+ * sent with the next request
+ */
+void EventQLTarget::splitBatch(UploadBatch* batch) {
+  if (batch->events.empty()) {
+    return;
+  }
+
+  auto database = batch->events.front().database;
+  auto table = batch->events.front().table;
+
+  UploadBatch rest;
+  rest.size_bytes = 0;
+  size_t n = 0;
+  for (auto& ev : batch->events) {
+    if (ev.database == database && ev.table == table) {
+      if (&batch->events[n] != &ev) {
+        batch->events[n] = std::move(ev);
+      }
+
+      ++n;
+    } else {
+      auto size = ev.database.size() + ev.table.size() + ev.data.size();
+      batch->size_bytes -= size;
+      rest.size_bytes += size;
+      rest.events.emplace_back(std::move(ev));
+    }
+  }
+
+  batch->events.resize(n);
+  if (rest.events.empty()) {
+    return;
+  }
+
+  auto& pending = pending_batch_;
+  for (auto& ev : pending.events) {
+    rest.events.emplace_back(std::move(ev));
+  }
+
+  rest.size_bytes += pending.size_bytes;
+  std::swap(pending, rest);
+  pending_deadline_ = MonotonicClock::now();
+}
+
+/**
+ * Collect events from the queue into the pending batch. The pending batch is
+ * returned once it is full (max events or max bytes) or the linger time since
+ * its first event has expired. If block is false, returns false immediately
+ * if the batch is not ready yet. Also returns false on shutdown.
+ *
+ * If a spool is configured, the in-memory queue is drained first (it holds
+ * the events that were enqueued before we started spooling) and the pending
+ * batch is then filled from the spool.
+ *
+ * Only called from the upload thread, which owns the pending batch
+ */
+bool EventQLTarget::awaitBatch(UploadBatch* batch, bool block) {
+  while (true) {
+    auto& pending = pending_batch_;
+    if (pending.events.size() < batch_window_ &&
+        pending.size_bytes < batch_max_bytes_) {
+      bool was_empty = pending.events.empty();
+      auto n = queue_->popBatch(
+          batch_window_ - pending.events.size(),
+          [this, &pending] (EnqueuedEvent&& ev) {
+        pending.size_bytes +=
+            ev.database.size() + ev.table.size() + ev.data.size();
+        pending.events.emplace_back(std::move(ev));
+        return pending.size_bytes < batch_max_bytes_;
+      });
+
+      if (n > 0) {
+        if (was_empty) {
+          pending_deadline_ = MonotonicClock::now() + batch_linger_;
+        }
+
+        wakeProducers();
+      }
+    }
+
+    if (thread_shutdown_) {
+      return false;
+    }
+
+    if (spool_ &&
+        queue_->empty() &&
+        !spool_->empty() &&
+        pending.events.size() < batch_window_ &&
+        pending.size_bytes < batch_max_bytes_) {
+      UploadBatch spooled;
+      spooled.size_bytes = 0;
+      auto max_events = batch_window_ - pending.events.size();
+      auto max_bytes = batch_max_bytes_ - pending.size_bytes;
+
+      readSpool(max_events, max_bytes, &spooled);
+
+      if (!spooled.events.empty()) {
+        if (pending.events.empty()) {
+          pending_deadline_ = MonotonicClock::now() + batch_linger_;
+        }
+
+        pending.size_bytes += spooled.size_bytes;
+        for (auto& ev : spooled.events) {
+          pending.events.emplace_back(std::move(ev));
+        }
+
+        continue;
+      }
+    }
+
+    auto now = MonotonicClock::now();
+    if (pending.events.size() >= batch_window_ ||
+        pending.size_bytes >= batch_max_bytes_ ||
+        (!pending.events.empty() && now >= pending_deadline_)) {
+      std::swap(*batch, pending);
+      pending.events.clear();
+      pending.size_bytes = 0;
+      return true;
+    }
+
+    if (!block) {
+      return false;
+    }
+
+    /* park until a producer wakes us up. the state has to be published
+       before re-checking the queue so that we can't miss a wakeup */
+    std::unique_lock<std::mutex> lk(mutex_);
+    consumer_state_ = ConsumerState::WAITING;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    auto woken = [this] () {
+      return consumer_state_ != ConsumerState::WAITING || thread_shutdown_;
+    };
+
+    if (queue_->empty() && (!spool_ || spool_->empty()) && !woken()) {
+      if (pending.events.empty()) {
+        cv_.wait(lk, woken);
+      } else {
+        cv_.wait_for(
+            lk,
+            std::chrono::microseconds(pending_deadline_ - now),
+            woken);
+      }
+    }
+
+    consumer_state_ = ConsumerState::RUNNING;
+  }
+}
+
+ReturnCode EventQLTarget::startUploadThread() {
+  if (thread_running_) {
+    return ReturnCode::error("RTERROR", "upload thread is already running");
+  }
+
+  if (hosts_.empty()) {
+    return ReturnCode::error("EINVAL", "no hosts configured");
+  }
+
+  curl_multi_ = curl_multi_init();
+  if (!curl_multi_) {
+    return ReturnCode::error("EIO", "curl_multi_init() failed");
+  }
+
+  bool has_content_type = false;
+  for (const auto& hdr : headers_) {
+    req_headers_ = curl_slist_append(req_headers_, hdr.c_str());
+    if (strncasecmp(hdr.c_str(), "content-type:", 13) == 0) {
+      has_content_type = true;
+    }
+  }
+
+  if (!has_content_type) {
+    auto hdr = std::string("Content-Type: ") + encoder_->getContentType();
+    req_headers_ = curl_slist_append(req_headers_, hdr.c_str());
+  }
+
+#ifdef HAVE_ZLIB
+  if (gzip_) {
+    req_headers_ = curl_slist_append(req_headers_, "Content-Encoding: gzip");
+  }
+#endif
+
+  if (!auth_token_.empty()) {
+    auto hdr = "Authorization: Token " + auth_token_;
+    req_headers_ = curl_slist_append(req_headers_, hdr.c_str());
+  }
+
+  if (!username_.empty() || !password_.empty()) {
+    std::string hdr = "Authorization: Basic ";
+    hdr += Base64::encode(username_ + ":" + password_);
+    req_headers_ = curl_slist_append(req_headers_, hdr.c_str());
+  }
+
+  for (size_t i = 0; i < std::max(max_inflight_, size_t(1)); ++i) {
+    std::unique_ptr<UploadRequest> req(new UploadRequest());
+    req->curl = curl_easy_init();
+    if (!req->curl) {
+      return ReturnCode::error("EIO", "curl_easy_init() failed");
+    }
+
+    idle_requests_.emplace_back(req.get());
+    requests_.emplace_back(std::move(req));
+  }
+
+  batch_window_ = batch_max_events_;
+  inflight_window_ = requests_.size();
+
+  /* the adaptive windows start at a quarter of the batch size and half of
+     the request slots */
+  if (adaptive_) {
+    if (latency_target_ == 0) {
+      latency_target_ = http_timeout_ / 4;
+    }
+
+    batch_window_ = std::max(
+        batch_max_events_ / 4,
+        std::min(batch_max_events_, size_t(kAdaptiveMinBatchEvents)));
+    inflight_window_ = std::max(requests_.size() / 2, size_t(1));
+  }
+
+  adapt_last_eval_ = MonotonicClock::now();
+  consumer_state_ = ConsumerState::RUNNING;
+  thread_running_ = true;
+  thread_shutdown_ = false;
+  thread_ = std::thread(&EventQLTarget::runUploadThread, this);
+  return ReturnCode::success();
+}
+
+void EventQLTarget::stopUploadThread() {
+  if (!thread_running_) {
+    return;
+  }
+
+  {
+    std::unique_lock<std::mutex> lk(mutex_);
+    thread_shutdown_ = true;
+    cv_.notify_all();
+    queue_space_cv_.notify_all();
+  }
+
+  curl_multi_wakeup(curl_multi_);
+  thread_.join();
+  thread_running_ = false;
+
+  /* keep the events we didn't get to for the next run. events that were
+     read from the spool are not committed, so they are replayed anyway */
+  if (spool_) {
+    size_t spooled = 0;
+    auto spool = [this, &spooled] (const EnqueuedEvent& ev) {
+      if (ev.spool_cursor == 0 && spoolEvent(ev, false).isSuccess()) {
+        ++spooled;
+      }
+    };
+
+    for (auto& retry : retry_queue_) {
+      for (const auto& ev : retry.second.batch.events) {
+        spool(ev);
+      }
+    }
+
+    retry_queue_.clear();
+    for (auto& ev : pending_batch_.events) {
+      spool(ev);
+    }
+
+    EnqueuedEvent ev;
+    while (queue_->pop(&ev)) {
+      spooled += spoolEvent(ev, false).isSuccess() ? 1 : 0;
+    }
+
+    pending_batch_.events.clear();
+    pending_batch_.size_bytes = 0;
+    spool_->sync(true);
+
+    if (spooled > 0) {
+      auto msg = StringUtil::format(
+          "$0 upload stopped, spooled $1 queued events",
+          name_,
+          spooled);
+
+      evcollect_log(EVCOLLECT_LOG_INFO, msg.c_str());
+    }
+  }
+
+  auto dropped = queue_->size() + pending_batch_.events.size();
+  for (const auto& retry : retry_queue_) {
+    dropped += retry.second.batch.events.size();
+  }
+
+  if (dropped > 0) {
+    auto msg = StringUtil::format(
+        "$0 upload stopped, dropping $1 queued events",
+        name_,
+        dropped);
+
+    evcollect_log(EVCOLLECT_LOG_WARNING, msg.c_str());
+  }
+}
+
+void EventQLTarget::getStats(std::string* stats) const {
+  metrics_.toJSON(queue_->size(), stats);
+}
+
+/**
+ * The upload thread keeps up to max_inflight requests in flight. While no
+ * request is in flight it blocks on the queue, otherwise it polls the curl
+ * multi handle and checks the queue for new batches in between.
+ *
+ * Failed batches are put into the retry queue and sent again once their
+ * backoff has expired. Retries only ever use half of the request slots so
+ * that new batches keep flowing while a backlog of retries builds up. While
+ * the circuit breaker is open no requests are sent at all
+ */
+void EventQLTarget::runUploadThread() {
+  auto max_retry_inflight = std::max(requests_.size() / 2, size_t(1));
+
+  while (true) {
+    if (spool_) {
+      auto rc = spool_->sync();
+      if (!rc.isSuccess()) {
+        evcollect_log(EVCOLLECT_LOG_ERROR, rc.getMessage().c_str());
+      }
+    }
+
+    while (!idle_requests_.empty()) {
+      if (requests_.size() - idle_requests_.size() >= inflight_window_) {
+        break;
+      }
+
+      auto now = MonotonicClock::now();
+      if (!circuitAllowsRequest(now)) {
+        break;
+      }
+
+      auto req = idle_requests_.back();
+      auto retry = retry_queue_.begin();
+      if (retry != retry_queue_.end() &&
+          retry->first <= now &&
+          retry_inflight_ < max_retry_inflight) {
+        req->batch = std::move(retry->second.batch);
+        req->attempt = retry->second.attempt;
+        retry_queue_.erase(retry);
+        ++retry_inflight_;
+      } else {
+        /* don't block on the queue while retries are waiting */
+        bool block =
+            idle_requests_.size() == requests_.size() &&
+            retry_queue_.empty();
+
+        if (!awaitBatch(&req->batch, block)) {
+          break;
+        }
+
+        if (url_is_template_ || encoder_->isSingleTarget()) {
+          splitBatch(&req->batch);
+        }
+
+        req->attempt = 0;
+      }
+
+      idle_requests_.pop_back();
+      if (circuit_state_ == CircuitState::HALF_OPEN) {
+        circuit_probe_inflight_ = true;
+      }
+
+      auto rc = startRequest(req);
+      if (!rc.isSuccess()) {
+        auto msg = StringUtil::format(
+            "error while uploading batch of $0 events: $1",
+            req->batch.events.size(),
+            rc.getMessage());
+
+        evcollect_log(EVCOLLECT_LOG_ERROR, msg.c_str());
+        if (req->attempt > 0) {
+          --retry_inflight_;
+        }
+
+        circuit_probe_inflight_ = false;
+        commitSpooled(req->batch);
+        req->batch.events.clear();
+        idle_requests_.emplace_back(req);
+      }
+    }
+
+    bool idle = idle_requests_.size() == requests_.size();
+    auto now = MonotonicClock::now();
+    if (idle) {
+      if (thread_shutdown_) {
+        return;
+      }
+
+      /* nothing in flight and nothing to wait for but the queue */
+      if (retry_queue_.empty() && circuitAllowsRequest(now)) {
+        continue;
+      }
+    }
+
+    int running = 0;
+    curl_multi_perform(curl_multi_, &running);
+    completeRequests();
+
+    if (idle_requests_.empty() || running > 0 || idle) {
+      uint64_t timeout = kMaxPollIntervalMicros;
+      if (!pending_batch_.events.empty()) {
+        timeout = pending_deadline_ > now ?
+            std::min(timeout, pending_deadline_ - now) :
+            0;
+      }
+
+      if (!retry_queue_.empty()) {
+        auto retry_at = retry_queue_.begin()->first;
+        timeout = retry_at > now ? std::min(timeout, retry_at - now) : 0;
+      }
+
+      /* let producers wake us up once there is enough for a full batch */
+      poll_wakeup_threshold_ = batch_window_ > pending_batch_.events.size() ?
+          batch_window_ - pending_batch_.events.size() :
+          1;
+      consumer_state_ = ConsumerState::POLLING;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (queue_->size() >= poll_wakeup_threshold_ || thread_shutdown_) {
+        timeout = 0;
+      }
+
+      curl_multi_poll(
+          curl_multi_,
+          NULL,
+          0,
+          (timeout + kMicrosPerMilli - 1) / kMicrosPerMilli,
+          NULL);
+
+      consumer_state_ = ConsumerState::RUNNING;
+    }
+  }
+}
+
+namespace {
+size_t curl_write_cb(void* data, size_t size, size_t nmemb, std::string* s) {
+  size_t pos = s->size();
+  size_t len = pos + size * nmemb;
+  s->resize(len);
+  memcpy((char*) s->data() + pos, data, size * nmemb);
+  return size * nmemb;
+}
+
+/**
+ * Replace "%T" in url with the target of event. The target is percent
+ * encoded, so it is safe to use in both the path and the query string
+ */
+void expandURLTemplate(const EnqueuedEvent& event, std::string* url) {
+  static const char kHexDigits[] = "0123456789ABCDEF";
+
+  std::string target;
+  if (!event.database.empty()) {
+    target = event.database + "/";
+  }
+
+  for (unsigned char c : event.table) {
+    if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+      target += c;
+    } else {
+      target += '%';
+      target += kHexDigits[c >> 4];
+      target += kHexDigits[c & 0xf];
+    }
+  }
+
+  size_t pos = 0;
+  while ((pos = url->find("%T", pos)) != std::string::npos) {
+    url->replace(pos, 2, target);
+    pos += target.size();
+  }
+}
+}
+
+/**
+ * Encode the batch into a request body. Events for the same target are
+ * grouped together
+ */
+void EventQLTarget::encodeBatch(const UploadBatch& batch, std::string* body) {
+  std::vector<const EnqueuedEvent*> events;
+  events.reserve(batch.events.size());
+  for (const auto& ev : batch.events) {
+    events.emplace_back(&ev);
+  }
+
+  std::stable_sort(
+      events.begin(),
+      events.end(),
+      [] (const EnqueuedEvent* a, const EnqueuedEvent* b) {
+        return a->database < b->database ||
+            (a->database == b->database && a->table < b->table);
+      });
+
+  encoder_->encodeBatch(events, batch.size_bytes, body);
+}
+
+ReturnCode EventQLTarget::startRequest(UploadRequest* req) {
+  encodeBatch(req->batch, &req->body);
+
+  const std::string* payload = &req->body;
+  req->compress_cpu = 0;
+#ifdef HAVE_ZLIB
+  if (gzip_) {
+    auto cpu_t0 = ThreadCPUClock::now();
+    auto rc = gzip_->compress(req->body, &req->payload);
+    req->compress_cpu = ThreadCPUClock::now() - cpu_t0;
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+
+    payload = &req->payload;
+  }
+#endif
+
+  req->host_idx = selectHost();
+  req->response.clear();
+  req->start_time = MonotonicClock::now();
+
+  const auto* url = &hosts_[req->host_idx].url;
+  if (url_is_template_ && !req->batch.events.empty()) {
+    req->url = *url;
+    expandURLTemplate(req->batch.events.front(), &req->url);
+    url = &req->url;
+  }
+
+  auto curl = req->curl;
+  curl_easy_setopt(curl, CURLOPT_URL, url->c_str());
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, http_timeout_ / kMicrosPerMilli);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req_headers_);
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, payload->data());
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) payload->size());
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->response);
+  curl_easy_setopt(curl, CURLOPT_PRIVATE, req);
+
+  auto curl_rc = curl_multi_add_handle(curl_multi_, curl);
+  if (curl_rc != CURLM_OK) {
+    return ReturnCode::error(
+        "EIO",
+        "curl_multi_add_handle() failed: %s",
+        curl_multi_strerror(curl_rc));
+  }
+
+  ++hosts_[req->host_idx].inflight;
+  return ReturnCode::success();
+}
+
+void EventQLTarget::completeRequests() {
+  CURLMsg* msg;
+  int msgs_left;
+  while ((msg = curl_multi_info_read(curl_multi_, &msgs_left))) {
+    if (msg->msg != CURLMSG_DONE) {
+      continue;
+    }
+
+    auto curl = msg->easy_handle;
+    auto curl_res = msg->data.result;
+
+    UploadRequest* req;
+    curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char**) &req);
+    auto rc = getResponseCode(req, curl_res);
+    curl_multi_remove_handle(curl_multi_, curl);
+    --hosts_[req->host_idx].inflight;
+
+    auto now = MonotonicClock::now();
+    reportBatch(*req, now - req->start_time, rc);
+
+    if (req->attempt > 0) {
+      --retry_inflight_;
+    }
+
+    /* 4xx errors mean that the cluster is up but rejected the batch, so
+       only EIO (5xx or transport errors) counts towards the breaker */
+    bool retryable = !rc.isSuccess() && rc.getCode() == "EIO";
+    recordRequestResult(retryable, now);
+    adaptWindow(*req, retryable, now);
+
+    if (retryable) {
+      retryBatch(req, rc);
+    } else {
+      if (!rc.isSuccess()) {
+        auto msg = StringUtil::format(
+            "error while uploading batch of $0 events to $1:$2, dropping " \
+            "batch: $3",
+            req->batch.events.size(),
+            hosts_[req->host_idx].hostname,
+            hosts_[req->host_idx].port,
+            rc.getMessage());
+
+        evcollect_log(EVCOLLECT_LOG_ERROR, msg.c_str());
+      }
+
+      commitSpooled(req->batch);
+    }
+
+    req->batch.events.clear();
+    req->batch.size_bytes = 0;
+    idle_requests_.emplace_back(req);
+  }
+}
+
+void EventQLTarget::retryBatch(UploadRequest* req, const ReturnCode& rc) {
+  auto host = StringUtil::format(
+      "$0:$1",
+      hosts_[req->host_idx].hostname,
+      hosts_[req->host_idx].port);
+
+  if (req->attempt >= retry_max_attempts_) {
+    auto msg = StringUtil::format(
+        "error while uploading batch of $0 events to $1, giving up after " \
+        "$2 attempts: $3",
+        req->batch.events.size(),
+        host,
+        req->attempt + 1,
+        rc.getMessage());
+
+    evcollect_log(EVCOLLECT_LOG_ERROR, msg.c_str());
+    commitSpooled(req->batch);
+    return;
+  }
+
+  if (retry_queue_.size() >= retry_queue_max_length_) {
+    if (spool_) {
+      spoolBatch(req->batch);
+    } else {
+      auto msg = StringUtil::format(
+          "error while uploading batch of $0 events to $1, retry queue " \
+          "is full, dropping batch: $2",
+          req->batch.events.size(),
+          host,
+          rc.getMessage());
+
+      evcollect_log(EVCOLLECT_LOG_ERROR, msg.c_str());
+    }
+
+    return;
+  }
+
+  auto backoff = getRetryBackoff(
+      retry_backoff_,
+      retry_backoff_max_,
+      req->attempt);
+
+  backoff = backoff / 2 + retry_rng_() % (backoff / 2 + 1);
+
+  auto msg = StringUtil::format(
+      "error while uploading batch of $0 events to $1, retrying in " \
+      "$2ms: $3",
+      req->batch.events.size(),
+      host,
+      backoff / kMicrosPerMilli,
+      rc.getMessage());
+
+  evcollect_log(EVCOLLECT_LOG_WARNING, msg.c_str());
+
+  RetryBatch retry;
+  retry.batch = std::move(req->batch);
+  retry.attempt = req->attempt + 1;
+  retry_queue_.emplace(MonotonicClock::now() + backoff, std::move(retry));
+  metrics_.increment(UploadMetrics::RETRIES);
+}
+
+/**
+ * Append the events in batch to the spool again. Events that were read from
+ * the spool are committed at their old position once they are appended
+ */
+size_t EventQLTarget::spoolBatch(const UploadBatch& batch) {
+  size_t spooled = 0;
+  for (const auto& ev : batch.events) {
+    auto rc = spoolEvent(ev, true);
+    if (!rc.isSuccess()) {
+      evcollect_log(EVCOLLECT_LOG_ERROR, rc.getMessage().c_str());
+      break;
+    }
+
+    if (ev.spool_cursor != 0) {
+      spool_->commit(ev.spool_cursor, 1);
+    }
+
+    ++spooled;
+  }
+
+  return spooled;
+}
+
+bool EventQLTarget::isHealthy() const {
+  auto until = unhealthy_until_.load();
+  return until == 0 || MonotonicClock::now() >= until;
+}
+
+bool EventQLTarget::circuitAllowsRequest(uint64_t now) {
+  switch (circuit_state_) {
+
+    case CircuitState::CLOSED:
+      return true;
+
+    case CircuitState::OPEN:
+      if (now < circuit_open_until_) {
+        return false;
+      }
+
+      circuit_state_ = CircuitState::HALF_OPEN;
+      circuit_probe_inflight_ = false;
+      return true;
+
+    case CircuitState::HALF_OPEN:
+      return !circuit_probe_inflight_;
+
+  }
+
+  return true;
+}
+
+void EventQLTarget::recordRequestResult(bool failed, uint64_t now) {
+  if (!failed) {
+    if (circuit_state_ != CircuitState::CLOSED) {
+      auto msg = StringUtil::format(
+          "$0 circuit breaker closed, resuming uploads",
+          name_);
+
+      evcollect_log(EVCOLLECT_LOG_NOTICE, msg.c_str());
+    }
+
+    circuit_state_ = CircuitState::CLOSED;
+    unhealthy_until_ = 0;
+    circuit_failures_ = 0;
+    circuit_cooldown_ = circuit_cooldown_base_;
+    circuit_probe_inflight_ = false;
+    return;
+  }
+
+  ++circuit_failures_;
+  switch (circuit_state_) {
+
+    case CircuitState::CLOSED:
+      if (circuit_threshold_ == 0 || circuit_failures_ < circuit_threshold_) {
+        return;
+      }
+      break;
+
+    /* the probe request failed */
+    case CircuitState::HALF_OPEN: {
+      uint64_t max_cooldown = kMaxCircuitBreakerCooldownMicros;
+      circuit_cooldown_ = std::min(
+          circuit_cooldown_ * 2,
+          std::max(max_cooldown, circuit_cooldown_base_));
+      break;
+    }
+
+    case CircuitState::OPEN:
+      return;
+
+  }
+
+  circuit_state_ = CircuitState::OPEN;
+  circuit_open_until_ = now + circuit_cooldown_;
+  unhealthy_until_ = circuit_open_until_;
+  circuit_probe_inflight_ = false;
+
+  auto msg = StringUtil::format(
+      "$0 circuit breaker opened after $1 consecutive failures, " \
+      "pausing uploads for $2ms",
+      name_,
+      circuit_failures_,
+      circuit_cooldown_ / kMicrosPerMilli);
+
+  evcollect_log(EVCOLLECT_LOG_WARNING, msg.c_str());
+}
+
+/**
+ * AIMD control of the batch window (events per batch) and the in-flight
+ * window. Latencies of successful requests are sampled and evaluated every
+ * kAdaptiveSampleSize requests (or once per second): if the p99 is below the
+ * target, the batch window grows by 1/16 of the max batch size and, once
+ * the batch window is maxed out, the in-flight window by one. Timeouts and
+ * 5xx responses (and a p99 above the target) halve both windows. Failures
+ * of requests that were started before the last decrease are ignored, so a
+ * single overload event only shrinks the windows once
+ */
+void EventQLTarget::adaptWindow(
+    const UploadRequest& req,
+    bool failed,
+    uint64_t now) {
+  if (!adaptive_) {
+    return;
+  }
+
+  auto min_batch = std::min(
+      batch_max_events_,
+      size_t(kAdaptiveMinBatchEvents));
+  auto decrease = [this, now, min_batch] () {
+    batch_window_ = std::max(batch_window_ / 2, min_batch);
+    inflight_window_ = std::max(inflight_window_ / 2, size_t(1));
+    latency_samples_.clear();
+    adapt_last_eval_ = now;
+    adapt_last_decrease_ = now;
+
+    auto msg = StringUtil::format(
+        "$0 upload window decreased to batch=$1 inflight=$2",
+        name_,
+        batch_window_,
+        inflight_window_);
+
+    evcollect_log(EVCOLLECT_LOG_DEBUG, msg.c_str());
+  };
+
+  if (failed) {
+    if (req.start_time >= adapt_last_decrease_) {
+      decrease();
+    }
+
+    return;
+  }
+
+  latency_samples_.emplace_back(now - req.start_time);
+  if (latency_samples_.size() < kAdaptiveSampleSize &&
+      now - adapt_last_eval_ < kAdaptiveIntervalMicros) {
+    return;
+  }
+
+  auto p99_idx = latency_samples_.size() * 99 / 100;
+  std::nth_element(
+      latency_samples_.begin(),
+      latency_samples_.begin() + p99_idx,
+      latency_samples_.end());
+
+  auto p99 = latency_samples_[p99_idx];
+  latency_samples_.clear();
+  adapt_last_eval_ = now;
+
+  if (p99 > latency_target_) {
+    decrease();
+    return;
+  }
+
+  if (batch_window_ < batch_max_events_) {
+    batch_window_ = std::min(
+        batch_window_ + std::max(batch_max_events_ / 16, size_t(1)),
+        batch_max_events_);
+  } else if (inflight_window_ < requests_.size()) {
+    ++inflight_window_;
+  }
+}
+
+size_t EventQLTarget::selectHost() {
+  auto offset = next_host_++;
+
+  switch (host_selection_) {
+
+    case HostSelection::ROUND_ROBIN:
+      return offset % hosts_.size();
+
+    /* pick the host with the fewest in-flight requests, rotating the start
+       offset so that ties are broken in round robin order */
+    case HostSelection::LEAST_OUTSTANDING: {
+      size_t best = offset % hosts_.size();
+      for (size_t i = 1; i < hosts_.size(); ++i) {
+        auto idx = (offset + i) % hosts_.size();
+        if (hosts_[idx].inflight < hosts_[best].inflight) {
+          best = idx;
+        }
+      }
+
+      return best;
+    }
+
+  }
+
+  return 0;
+}
+
+ReturnCode EventQLTarget::getResponseCode(
+    UploadRequest* req,
+    CURLcode curl_res) {
+  if (curl_res != CURLE_OK) {
+    return ReturnCode::error(
+        "EIO",
+        "http request failed: %s",
+        curl_easy_strerror(curl_res));
+  }
+
+  long http_res_code = 0;
+  curl_easy_getinfo(req->curl, CURLINFO_RESPONSE_CODE, &http_res_code);
+
+  const auto& res_body = req->response;
+  if (http_res_code >= 200 && http_res_code < 300) {
+    return encoder_->checkResponse(res_body);
+  }
+
+  switch (http_res_code) {
+    case 400:
+      return ReturnCode::error(
+          "EINVAL",
+          "http error: %li -- %.*s",
+          http_res_code,
+          res_body.size(),
+          res_body.data());
+    case 403:
+    case 401:
+      return ReturnCode::error(
+          "EACCESS",
+          "auth error: %li -- %.*s",
+          http_res_code,
+          res_body.size(),
+          res_body.data());
+    case 408:
+    case 429:
+      return ReturnCode::error(
+          "EIO",
+          "http error: %li -- %.*s",
+          http_res_code,
+          res_body.size(),
+          res_body.data());
+    default:
+      if (http_res_code >= 400 && http_res_code < 500) {
+        return ReturnCode::error(
+            "EINVAL",
+            "http error: %li -- %.*s",
+            http_res_code,
+            res_body.size(),
+            res_body.data());
+      }
+
+      return ReturnCode::error(
+          "EIO",
+          "http error: %li -- %.*s",
+          http_res_code,
+          res_body.size(),
+          res_body.data());
+  }
+}
+
+void EventQLTarget::reportBatch(
+    const UploadRequest& req,
+    uint64_t latency,
+    const ReturnCode& rc) {
+  size_t body_size = req.body.size();
+  size_t payload_size = body_size;
+#ifdef HAVE_ZLIB
+  if (gzip_) {
+    payload_size = req.payload.size();
+  }
+#endif
+
+  auto msg = StringUtil::format(
+      "$0 batch upload: host=$1:$2 events=$3 bytes=$4 " \
+      "uncompressed_bytes=$5 compress_cpu=$6ms latency=$7ms status=$8",
+      name_,
+      hosts_[req.host_idx].hostname,
+      hosts_[req.host_idx].port,
+      req.batch.events.size(),
+      payload_size,
+      body_size,
+      req.compress_cpu / double(kMicrosPerMilli),
+      latency / double(kMicrosPerMilli),
+      rc.isSuccess() ? "OK" : rc.getCode());
+
+  evcollect_log(EVCOLLECT_LOG_DEBUG, msg.c_str());
+
+  metrics_.increment(UploadMetrics::REQUESTS);
+  metrics_.increment(UploadMetrics::BYTES_UNCOMPRESSED, body_size);
+  metrics_.increment(UploadMetrics::BYTES_COMPRESSED, payload_size);
+  metrics_.increment(UploadMetrics::COMPRESS_CPU, req.compress_cpu);
+  metrics_.record(UploadMetrics::REQUEST_LATENCY, latency);
+  metrics_.record(UploadMetrics::EVENTS_PER_REQUEST, req.batch.events.size());
+
+  if (rc.isSuccess()) {
+    metrics_.increment(UploadMetrics::EVENTS_SENT, req.batch.events.size());
+  } else {
+    metrics_.recordError(rc.getCode());
+  }
+}
+
+} // namespace plugins_eventql
+} // namespace evcollect
@@ -0,0 +1,345 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <atomic>
+#include <map>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <curl/curl.h>
+#include <evcollect/evcollect.h>
+#include <evcollect/util/gzip.h>
+#include <evcollect/util/time.h>
+#include <evcollect/util/return_code.h>
+#include "batch_encoder.h"
+#include "upload_metrics.h"
+#include "upload_queue.h"
+#include "upload_spool.h"
+
+namespace evcollect {
+namespace plugin_eventql {
+
+/**
+ * Uploads events in batches over HTTP. By default the batches are sent to
+ * the EventQL insert API, but the body encoding, URLs and headers can be
+ * changed to feed other HTTP APIs (this is what the http plugin does)
+ */
+class EventQLTarget {
+public:
+
+  static const size_t kDefaultHTTPTimeoutMicros = 30 * kMicrosPerSecond;
+  static const size_t kDefaultMaxQueueLength = 8192;
+  static const size_t kDefaultBatchMaxEvents = 1024;
+  static const size_t kDefaultBatchMaxBytes = 1024 * 1024;
+  static const uint64_t kDefaultBatchLingerMicros = 100 * kMicrosPerMilli;
+  static const size_t kDefaultMaxInflight = 4;
+  static const uint64_t kMaxPollIntervalMicros = 10 * kMicrosPerMilli;
+  static const size_t kDefaultRetryMaxAttempts = 8;
+  static const size_t kDefaultRetryQueueLength = 64;
+  static const uint64_t kDefaultRetryBackoffMicros = 100 * kMicrosPerMilli;
+  static const uint64_t kDefaultRetryBackoffMaxMicros = 30 * kMicrosPerSecond;
+  static const size_t kDefaultCircuitBreakerThreshold = 5;
+  static const uint64_t kDefaultCircuitBreakerCooldownMicros =
+      1 * kMicrosPerSecond;
+  static const uint64_t kMaxCircuitBreakerCooldownMicros =
+      60 * kMicrosPerSecond;
+  static const size_t kMaxRouteCacheSize = 4096;
+  static const size_t kAdaptiveMinBatchEvents = 16;
+  static const size_t kAdaptiveSampleSize = 32;
+  static const uint64_t kAdaptiveIntervalMicros = 1 * kMicrosPerSecond;
+
+  EventQLTarget();
+  ~EventQLTarget();
+
+  void addHost(
+      const std::string& hostname,
+      uint16_t port);
+
+  /**
+   * Add a host by URL. If the URL contains "%T", it is replaced by the
+   * (URL-encoded) target of the events in the request and each request only
+   * contains events for a single target
+   */
+  ReturnCode addURL(const std::string& url);
+
+  /**
+   * Split "host", "host:port", "[addr]" or "[addr]:port" into the host
+   * (without brackets) and port. port is only changed if the string carries
+   * one. An IPv6 address without brackets is taken as a host without port
+   */
+  static ReturnCode parseHostPort(
+      const std::string& hostport,
+      std::string* host,
+      uint16_t* port);
+
+  /**
+   * Use encoder for request bodies. Must be called before adding routes
+   */
+  void setEncoder(std::unique_ptr<BatchEncoder> encoder);
+
+  /**
+   * Add a request header ("Name: value"). A Content-Type header replaces the
+   * content type of the encoder
+   */
+  void addHeader(const std::string& header);
+
+  /**
+   * The name is used as a prefix for log messages (default: "eventql")
+   */
+  void setName(const std::string& name);
+
+  ReturnCode setHostSelection(const std::string& mode);
+
+  /**
+   * Route events matching event_name_match to target. event_name_match is
+   * either an exact event name or a glob pattern (e.g. "*" or "app.*").
+   * target has the format "database/table" (or whatever the encoder
+   * expects), where "%E" is replaced by the event name
+   */
+  ReturnCode addRoute(
+      const std::string& event_name_match,
+      const std::string& target);
+
+  void setHTTPTimeout(uint64_t usecs);
+  void setMaxQueueLength(size_t queue_len);
+  void setMaxInflight(size_t max_inflight);
+  void setBatchMaxEvents(size_t max_events);
+  void setBatchMaxBytes(size_t max_bytes);
+  void setBatchLinger(uint64_t usecs);
+
+  /**
+   * Failed batches are retried up to max_attempts times. The delay before
+   * the n-th retry is drawn from [d/2, d] with d = min(base * 2^n, max). At
+   * most max_queue_len batches are waiting for a retry at any time
+   */
+  void setRetryMaxAttempts(size_t max_attempts);
+  void setRetryBackoff(uint64_t base_usecs, uint64_t max_usecs);
+  void setRetryQueueLength(size_t max_queue_len);
+
+  /**
+   * Returns the upper bound d = min(base * 2^attempt, max) of the delay
+   * before a retry
+   */
+  static uint64_t getRetryBackoff(
+      uint64_t base_usecs,
+      uint64_t max_usecs,
+      size_t attempt);
+
+  /**
+   * Stop sending requests for cooldown microseconds after threshold
+   * consecutive requests failed with a retryable error. After the cooldown a
+   * single probe request is sent; if it fails as well the cooldown is doubled
+   */
+  void setCircuitBreaker(size_t threshold, uint64_t cooldown_usecs);
+
+  /**
+   * Returns false while the circuit breaker is open. Once its cooldown has
+   * expired the target counts as healthy again, so that new events are sent
+   * to it as the probe request. May be called from any thread
+   */
+  bool isHealthy() const;
+
+  /**
+   * Adjust the batch size (up to the batch max events) and the number of
+   * in-flight requests (up to max inflight) in an AIMD loop: both grow
+   * additively while the p99 request latency stays below latency_target and
+   * shrink multiplicatively on timeouts and 5xx responses. A latency_target
+   * of zero means a quarter of the http timeout
+   */
+  void setAdaptiveBatching(bool enable, uint64_t latency_target);
+  ReturnCode setCompression(const std::string& compression, int level);
+
+  /**
+   * Overflow events into a disk-backed spool in spool_dir when the in-memory
+   * queue is full instead of blocking the caller. Spooled events are replayed
+   * before any new events are sent (and also after a restart)
+   */
+  ReturnCode setSpool(
+      const std::string& spool_dir,
+      uint64_t segment_size,
+      uint64_t sync_interval);
+
+  void setAuthToken(const std::string& auth_token);
+  void setCredentials(
+      const std::string& username,
+      const std::string& password);
+
+  ReturnCode emitEvent(
+    const std::string& event_name,
+    const std::string& event_data);
+
+  ReturnCode startUploadThread();
+  void stopUploadThread();
+
+  /**
+   * Write the metrics of this target as a JSON object to stats. May be called
+   * from any thread
+   */
+  void getStats(std::string* stats) const;
+
+protected:
+
+  enum class HostSelection { ROUND_ROBIN, LEAST_OUTSTANDING };
+  enum class CircuitState { CLOSED, OPEN, HALF_OPEN };
+  enum class ConsumerState { RUNNING, WAITING, POLLING };
+
+  struct EventRouting {
+    std::string event_name_match;
+    TargetTable target;
+    bool target_is_template;
+  };
+
+  using TargetList = std::vector<TargetTable>;
+
+  struct UploadBatch {
+    std::vector<EnqueuedEvent> events;
+    size_t size_bytes;
+  };
+
+  struct UploadHost {
+    std::string hostname;
+    uint16_t port;
+    std::string url;
+    size_t inflight;
+  };
+
+  /**
+   * A slot in the request pool. Each slot owns a curl easy handle that is
+   * reused for all requests sent through the slot (so connections are kept
+   * alive) as well as the request and response buffers
+   */
+  struct UploadRequest {
+    CURL* curl;
+    UploadBatch batch;
+    std::string body;
+    std::string payload;
+    std::string response;
+    std::string url;
+    size_t host_idx;
+    size_t attempt;
+    uint64_t compress_cpu;
+    uint64_t start_time;
+  };
+
+  struct RetryBatch {
+    UploadBatch batch;
+    size_t attempt;
+  };
+
+  ReturnCode enqueueEvent(EnqueuedEvent&& event);
+  void wakeUploadThread(bool force);
+  void wakeProducers();
+  ReturnCode spoolEvent(const EnqueuedEvent& event, bool notify);
+  size_t readSpool(size_t max_events, size_t max_bytes, UploadBatch* batch);
+  bool awaitBatch(UploadBatch* batch, bool block);
+  void splitBatch(UploadBatch* batch);
+  const TargetList* resolveRoutes(
+      const std::string& event_name,
+      TargetList* uncached);
+  void runUploadThread();
+  ReturnCode startRequest(UploadRequest* req);
+  void completeRequests();
+  void retryBatch(UploadRequest* req, const ReturnCode& rc);
+  size_t spoolBatch(const UploadBatch& batch);
+  void commitSpooled(const UploadBatch& batch);
+  bool circuitAllowsRequest(uint64_t now);
+  void recordRequestResult(bool failed, uint64_t now);
+  void adaptWindow(const UploadRequest& req, bool failed, uint64_t now);
+  size_t selectHost();
+  void encodeBatch(const UploadBatch& batch, std::string* body);
+  ReturnCode getResponseCode(UploadRequest* req, CURLcode curl_res);
+  void reportBatch(
+      const UploadRequest& req,
+      uint64_t latency,
+      const ReturnCode& rc);
+
+  std::string name_;
+  std::vector<UploadHost> hosts_;
+  bool url_is_template_;
+  std::unique_ptr<BatchEncoder> encoder_;
+  std::vector<std::string> headers_;
+  HostSelection host_selection_;
+  size_t next_host_;
+  std::string username_;
+  std::string password_;
+  std::string auth_token_;
+  std::unique_ptr<UploadQueue<EnqueuedEvent>> queue_;
+  std::atomic<size_t> producers_waiting_;
+  std::atomic<ConsumerState> consumer_state_;
+  std::atomic<size_t> poll_wakeup_threshold_;
+  mutable std::mutex mutex_;
+  mutable std::condition_variable cv_;
+  mutable std::condition_variable queue_space_cv_;
+  size_t batch_max_events_;
+  size_t batch_max_bytes_;
+  uint64_t batch_linger_;
+  UploadBatch pending_batch_;
+  uint64_t pending_deadline_;
+  UploadMetrics metrics_;
+  std::thread thread_;
+  bool thread_running_;
+  std::atomic<bool> thread_shutdown_;
+  std::vector<EventRouting> routes_;
+  std::unordered_map<std::string, std::vector<size_t>> exact_routes_;
+  std::vector<size_t> glob_routes_;
+  std::unordered_map<std::string, TargetList> route_cache_;
+  std::mutex route_cache_mutex_;
+  CURLM* curl_multi_;
+  struct curl_slist* req_headers_;
+  std::vector<std::unique_ptr<UploadRequest>> requests_;
+  std::vector<UploadRequest*> idle_requests_;
+  size_t max_inflight_;
+  uint64_t http_timeout_;
+  std::unique_ptr<UploadSpool> spool_;
+  std::multimap<uint64_t, RetryBatch> retry_queue_;
+  size_t retry_queue_max_length_;
+  size_t retry_inflight_;
+  size_t retry_max_attempts_;
+  uint64_t retry_backoff_;
+  uint64_t retry_backoff_max_;
+  std::minstd_rand retry_rng_;
+  CircuitState circuit_state_;
+  size_t circuit_failures_;
+  size_t circuit_threshold_;
+  uint64_t circuit_cooldown_base_;
+  uint64_t circuit_cooldown_;
+  uint64_t circuit_open_until_;
+  bool circuit_probe_inflight_;
+  std::atomic<uint64_t> unhealthy_until_; /* 0 while the breaker is closed */
+  bool adaptive_;
+  uint64_t latency_target_;
+  size_t batch_window_;
+  size_t inflight_window_;
+  std::vector<uint64_t> latency_samples_;
+  uint64_t adapt_last_eval_;
+  uint64_t adapt_last_decrease_;
+#ifdef HAVE_ZLIB
+  std::unique_ptr<GzipCompressor> gzip_;
+#endif
+};
+
+} // namespace plugins_eventql
+} // namespace evcollect
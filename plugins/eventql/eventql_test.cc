@@ -0,0 +1,1282 @@
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <evcollect/evcollect.h>
+#include <evcollect/util/testing.h>
+#include <evcollect/util/time.h>
+#include "eventql_target.h"
+#include "hash_ring.h"
+#include "sharded_target.h"
+
+using namespace evcollect::plugin_eventql;
+
+/* the plugin usually resolves this symbol from the evcollectd binary */
+void evcollect_log(evcollect_loglevel level, const char* msg) {}
+
+/**
+ * A minimal HTTP/1.1 server that answers each insert request with the status
+ * code returned by the handler and records the number of events per request
+ * as well as the number of requests that were in flight at the same time and
+ * the raw requests
+ */
+class MockEventQLServer {
+public:
+
+  using HandlerFn = std::function<int (size_t request_idx)>;
+
+  MockEventQLServer(HandlerFn handler) :
+      handler_(handler),
+      num_requests_(0),
+      num_events_(0),
+      num_events_ok_(0),
+      num_inflight_(0),
+      max_inflight_(0) {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    bind(listen_fd_, (struct sockaddr*) &addr, sizeof(addr));
+    listen(listen_fd_, 16);
+
+    socklen_t addr_len = sizeof(addr);
+    getsockname(listen_fd_, (struct sockaddr*) &addr, &addr_len);
+    port_ = ntohs(addr.sin_port);
+
+    thread_ = std::thread([this] () {
+      int fd;
+      while ((fd = accept(listen_fd_, NULL, NULL)) >= 0) {
+        std::unique_lock<std::mutex> lk(mutex_);
+        conns_.emplace_back(fd);
+        conn_threads_.emplace_back(&MockEventQLServer::serve, this, fd);
+      }
+    });
+  }
+
+  ~MockEventQLServer() {
+    shutdown(listen_fd_, SHUT_RDWR);
+    close(listen_fd_);
+    thread_.join();
+
+    for (auto fd : conns_) {
+      shutdown(fd, SHUT_RDWR);
+    }
+
+    for (auto& t : conn_threads_) {
+      t.join();
+    }
+
+    for (auto fd : conns_) {
+      close(fd);
+    }
+  }
+
+  uint16_t getPort() const {
+    return port_;
+  }
+
+  size_t getNumRequests() const {
+    return num_requests_;
+  }
+
+  size_t getNumEvents() const {
+    return num_events_;
+  }
+
+  size_t getNumEventsOK() const {
+    return num_events_ok_;
+  }
+
+  size_t getMaxInflight() const {
+    return max_inflight_;
+  }
+
+  size_t getNumConnections() {
+    std::unique_lock<std::mutex> lk(mutex_);
+    return conns_.size();
+  }
+
+  std::vector<size_t> getBatchSizes() {
+    std::unique_lock<std::mutex> lk(mutex_);
+    return batch_sizes_;
+  }
+
+  std::map<std::string, size_t> getTables() {
+    std::unique_lock<std::mutex> lk(mutex_);
+    return tables_;
+  }
+
+  /**
+   * Returns the header and body of each request
+   */
+  std::vector<std::pair<std::string, std::string>> getRequests() {
+    std::unique_lock<std::mutex> lk(mutex_);
+    return requests_;
+  }
+
+  /**
+   * Wait until fn returns true, returns false after timeout microseconds
+   */
+  bool waitFor(std::function<bool ()> fn, uint64_t timeout) {
+    auto deadline = MonotonicClock::now() + timeout;
+    while (!fn()) {
+      if (MonotonicClock::now() > deadline) {
+        return false;
+      }
+
+      usleep(1000);
+    }
+
+    return true;
+  }
+
+protected:
+
+  void serve(int fd) {
+    std::string buf;
+    char chunk[4096];
+    while (true) {
+      auto hdr_end = buf.find("\r\n\r\n");
+      if (hdr_end == std::string::npos) {
+        auto n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) {
+          return;
+        }
+
+        buf.append(chunk, n);
+        continue;
+      }
+
+      size_t body_len = 0;
+      auto cl = buf.find("Content-Length: ");
+      if (cl != std::string::npos && cl < hdr_end) {
+        body_len = std::stoul(buf.substr(cl + 16));
+      }
+
+      while (buf.size() < hdr_end + 4 + body_len) {
+        auto n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) {
+          return;
+        }
+
+        buf.append(chunk, n);
+      }
+
+      auto header = buf.substr(0, hdr_end);
+      auto body = buf.substr(hdr_end + 4, body_len);
+      buf.erase(0, hdr_end + 4 + body_len);
+
+      size_t num_events = 0;
+      std::map<std::string, size_t> tables;
+      for (auto pos = body.find("{\"database\":\"");
+           pos != std::string::npos;
+           pos = body.find("{\"database\":\"", pos + 1)) {
+        auto db_begin = pos + 13;
+        auto db_end = body.find('"', db_begin);
+        auto tbl_begin = body.find("\"table\":\"", db_end) + 9;
+        auto tbl_end = body.find('"', tbl_begin);
+        auto db = body.substr(db_begin, db_end - db_begin);
+        ++tables[db + "/" + body.substr(tbl_begin, tbl_end - tbl_begin)];
+        ++num_events;
+      }
+
+      auto inflight = ++num_inflight_;
+      for (auto max = max_inflight_.load(); inflight > max; ) {
+        if (max_inflight_.compare_exchange_weak(max, inflight)) {
+          break;
+        }
+      }
+
+      num_events_ += num_events;
+
+      {
+        std::unique_lock<std::mutex> lk(mutex_);
+        batch_sizes_.emplace_back(num_events);
+        requests_.emplace_back(header, body);
+      }
+
+      auto status = handler_(num_requests_++);
+      if (status == 201) {
+        std::unique_lock<std::mutex> lk(mutex_);
+        for (const auto& t : tables) {
+          tables_[t.first] += t.second;
+        }
+
+        num_events_ok_ += num_events;
+      }
+
+      --num_inflight_;
+
+      auto res = StringUtil::format(
+          "HTTP/1.1 $0 Mock\r\nContent-Length: 0\r\n\r\n",
+          status);
+
+      if (write(fd, res.data(), res.size()) != (ssize_t) res.size()) {
+        return;
+      }
+    }
+  }
+
+  HandlerFn handler_;
+  int listen_fd_;
+  uint16_t port_;
+  std::atomic<size_t> num_requests_;
+  std::atomic<size_t> num_events_;
+  std::atomic<size_t> num_events_ok_;
+  std::atomic<size_t> num_inflight_;
+  std::atomic<size_t> max_inflight_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::vector<int> conns_;
+  std::vector<std::thread> conn_threads_;
+  std::map<std::string, size_t> tables_;
+  std::vector<size_t> batch_sizes_;
+  std::vector<std::pair<std::string, std::string>> requests_;
+};
+
+static void configureTarget(EventQLTarget* target, uint16_t port) {
+  target->addHost("127.0.0.1", port);
+  target->addRoute("test", "db/tbl");
+  target->setMaxInflight(1);
+  target->setBatchMaxEvents(10);
+  target->setBatchLinger(kMicrosPerMilli);
+  target->setRetryBackoff(10 * kMicrosPerMilli, 20 * kMicrosPerMilli);
+}
+
+/**
+ * A slow server fills up the request pool, but never more than max_inflight
+ * requests are sent at once. Each slot keeps its connection alive
+ */
+TEST(EventQLTarget, request_pool_limits_inflight) {
+  MockEventQLServer server([] (size_t) {
+    usleep(20 * kMicrosPerMilli);
+    return 201;
+  });
+
+  EventQLTarget target;
+  configureTarget(&target, server.getPort());
+  target.setMaxInflight(3);
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  for (size_t i = 0; i < 200; ++i) {
+    ASSERT_TRUE(target.emitEvent("test", "{}").isSuccess());
+  }
+
+  EXPECT_TRUE(server.waitFor([&server] () {
+    return server.getNumEventsOK() == 200;
+  }, 5 * kMicrosPerSecond));
+
+  target.stopUploadThread();
+  EXPECT_EQ(server.getMaxInflight(), 3);
+  EXPECT_LE(server.getNumConnections(), 3);
+  EXPECT_GE(server.getNumRequests(), 20);
+}
+
+/**
+ * A rejected batch releases its slot like a successful one, so the batches
+ * after it are still sent
+ */
+TEST(EventQLTarget, request_pool_completion) {
+  MockEventQLServer server([] (size_t idx) {
+    return idx % 2 == 0 ? 400 : 201;
+  });
+
+  EventQLTarget target;
+  configureTarget(&target, server.getPort());
+  target.setMaxInflight(2);
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  for (size_t round = 0; round < 3; ++round) {
+    for (size_t i = 0; i < 100; ++i) {
+      ASSERT_TRUE(target.emitEvent("test", "{}").isSuccess());
+    }
+
+    auto num_events = (round + 1) * 100;
+    EXPECT_TRUE(server.waitFor([&server, num_events] () {
+      return server.getNumEvents() == num_events;
+    }, 5 * kMicrosPerSecond));
+  }
+
+  target.stopUploadThread();
+  EXPECT_GE(server.getNumRequests(), 30);
+  EXPECT_GT(server.getNumEventsOK(), 0);
+  EXPECT_LT(server.getNumEventsOK(), 300);
+}
+
+TEST(EventQLTarget, retries_server_errors) {
+  MockEventQLServer server([] (size_t idx) {
+    return idx < 2 ? 503 : 201;
+  });
+
+  EventQLTarget target;
+  configureTarget(&target, server.getPort());
+  target.setBatchMaxEvents(10);
+  target.setBatchLinger(kMicrosPerSecond);
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  for (size_t i = 0; i < 10; ++i) {
+    ASSERT_TRUE(target.emitEvent("test", "{}").isSuccess());
+  }
+
+  EXPECT_TRUE(server.waitFor([&server] () {
+    return server.getNumEventsOK() == 10;
+  }, 5 * kMicrosPerSecond));
+
+  target.stopUploadThread();
+  EXPECT_EQ(server.getNumRequests(), 3);
+  EXPECT_EQ(server.getNumEventsOK(), 10);
+}
+
+TEST(EventQLTarget, drops_client_errors) {
+  MockEventQLServer server([] (size_t) {
+    return 400;
+  });
+
+  EventQLTarget target;
+  configureTarget(&target, server.getPort());
+  target.setBatchMaxEvents(10);
+  target.setBatchLinger(kMicrosPerSecond);
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  for (size_t i = 0; i < 10; ++i) {
+    ASSERT_TRUE(target.emitEvent("test", "{}").isSuccess());
+  }
+
+  EXPECT_TRUE(server.waitFor([&server] () {
+    return server.getNumRequests() == 1;
+  }, 5 * kMicrosPerSecond));
+
+  usleep(100 * kMicrosPerMilli);
+  target.stopUploadThread();
+  EXPECT_EQ(server.getNumRequests(), 1);
+}
+
+TEST(EventQLTarget, metrics) {
+  MockEventQLServer server([] (size_t idx) {
+    return idx < 1 ? 503 : 201;
+  });
+
+  EventQLTarget target;
+  configureTarget(&target, server.getPort());
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  for (size_t i = 0; i < 10; ++i) {
+    ASSERT_TRUE(target.emitEvent("test", "{}").isSuccess());
+  }
+
+  EXPECT_TRUE(server.waitFor([&server] () {
+    return server.getNumEventsOK() == 10;
+  }, 5 * kMicrosPerSecond));
+
+  target.stopUploadThread();
+
+  std::string stats;
+  target.getStats(&stats);
+  EXPECT_TRUE(stats.front() == '{');
+  EXPECT_TRUE(stats.back() == '}');
+  EXPECT_TRUE(stats.find("\"queue_depth\":0,") != std::string::npos);
+  EXPECT_TRUE(stats.find("\"enqueued\":10,") != std::string::npos);
+  EXPECT_TRUE(stats.find("\"events_sent\":10,") != std::string::npos);
+  EXPECT_TRUE(stats.find("\"retries\":1,") != std::string::npos);
+  EXPECT_TRUE(stats.find("\"compress_cpu_us\":") != std::string::npos);
+  EXPECT_TRUE(
+      stats.find("\"errors\":{\"EINVAL\":0,\"EACCESS\":0,\"EIO\":1}") !=
+      std::string::npos);
+
+  auto requests = StringUtil::format(
+      "\"requests\":$0,",
+      server.getNumRequests());
+  EXPECT_TRUE(stats.find(requests) != std::string::npos);
+
+  auto latency = StringUtil::format(
+      "\"request_latency_us\":{\"count\":$0,",
+      server.getNumRequests());
+  EXPECT_TRUE(stats.find(latency) != std::string::npos);
+}
+
+/**
+ * 408 and 429 mean the server is busy, so the batch is retried like after a
+ * 5xx error
+ */
+TEST(EventQLTarget, retries_throttled_requests) {
+  MockEventQLServer server([] (size_t idx) {
+    switch (idx) {
+      case 0: return 408;
+      case 1: return 429;
+      default: return 201;
+    }
+  });
+
+  EventQLTarget target;
+  configureTarget(&target, server.getPort());
+  target.setBatchMaxEvents(10);
+  target.setBatchLinger(kMicrosPerSecond);
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  for (size_t i = 0; i < 10; ++i) {
+    ASSERT_TRUE(target.emitEvent("test", "{}").isSuccess());
+  }
+
+  EXPECT_TRUE(server.waitFor([&server] () {
+    return server.getNumEventsOK() == 10;
+  }, 5 * kMicrosPerSecond));
+
+  target.stopUploadThread();
+  EXPECT_EQ(server.getNumRequests(), 3);
+  EXPECT_EQ(server.getNumEventsOK(), 10);
+}
+
+/**
+ * Any other 4xx status means the batch itself is bad and is dropped
+ */
+TEST(EventQLTarget, drops_other_client_errors) {
+  MockEventQLServer server([] (size_t) {
+    return 404;
+  });
+
+  EventQLTarget target;
+  configureTarget(&target, server.getPort());
+  target.setBatchMaxEvents(10);
+  target.setBatchLinger(kMicrosPerSecond);
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  for (size_t i = 0; i < 10; ++i) {
+    ASSERT_TRUE(target.emitEvent("test", "{}").isSuccess());
+  }
+
+  EXPECT_TRUE(server.waitFor([&server] () {
+    return server.getNumRequests() == 1;
+  }, 5 * kMicrosPerSecond));
+
+  usleep(100 * kMicrosPerMilli);
+  target.stopUploadThread();
+  EXPECT_EQ(server.getNumRequests(), 1);
+}
+
+TEST(EventQLTarget, retry_backoff) {
+  uint64_t base = 100 * kMicrosPerMilli;
+  uint64_t max = 30 * kMicrosPerSecond;
+  EXPECT_EQ(EventQLTarget::getRetryBackoff(base, max, 0), base);
+  EXPECT_EQ(EventQLTarget::getRetryBackoff(base, max, 1), 2 * base);
+  EXPECT_EQ(EventQLTarget::getRetryBackoff(base, max, 8), 256 * base);
+  EXPECT_EQ(EventQLTarget::getRetryBackoff(base, max, 9), max);
+  EXPECT_EQ(EventQLTarget::getRetryBackoff(base, max, 40), max);
+  EXPECT_EQ(EventQLTarget::getRetryBackoff(base, max, 64), max);
+  EXPECT_EQ(EventQLTarget::getRetryBackoff(base, max, 1000), max);
+  EXPECT_EQ(EventQLTarget::getRetryBackoff(max, max, 0), max);
+}
+
+TEST(EventQLTarget, gives_up_after_max_attempts) {
+  MockEventQLServer server([] (size_t) {
+    return 500;
+  });
+
+  EventQLTarget target;
+  configureTarget(&target, server.getPort());
+  target.setBatchMaxEvents(10);
+  target.setBatchLinger(kMicrosPerSecond);
+  target.setRetryMaxAttempts(2);
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  for (size_t i = 0; i < 10; ++i) {
+    ASSERT_TRUE(target.emitEvent("test", "{}").isSuccess());
+  }
+
+  EXPECT_TRUE(server.waitFor([&server] () {
+    return server.getNumRequests() == 3;
+  }, 5 * kMicrosPerSecond));
+
+  usleep(200 * kMicrosPerMilli);
+  target.stopUploadThread();
+  EXPECT_EQ(server.getNumRequests(), 3);
+}
+
+TEST(EventQLTarget, circuit_breaker) {
+  std::atomic<bool> cluster_up(false);
+  MockEventQLServer server([&cluster_up] (size_t) {
+    return cluster_up ? 201 : 503;
+  });
+
+  EventQLTarget target;
+  configureTarget(&target, server.getPort());
+  target.setBatchMaxEvents(10);
+  target.setBatchLinger(kMicrosPerSecond);
+  target.setRetryBackoff(kMicrosPerMilli, kMicrosPerMilli);
+  target.setCircuitBreaker(3, 300 * kMicrosPerMilli);
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  for (size_t i = 0; i < 10; ++i) {
+    ASSERT_TRUE(target.emitEvent("test", "{}").isSuccess());
+  }
+
+  /* the breaker opens after three failures and holds off the retries */
+  EXPECT_TRUE(server.waitFor([&server] () {
+    return server.getNumRequests() == 3;
+  }, 5 * kMicrosPerSecond));
+
+  usleep(150 * kMicrosPerMilli);
+  EXPECT_EQ(server.getNumRequests(), 3);
+
+  /* after the cooldown a single probe is sent, which fails again */
+  EXPECT_TRUE(server.waitFor([&server] () {
+    return server.getNumRequests() == 4;
+  }, 5 * kMicrosPerSecond));
+
+  usleep(150 * kMicrosPerMilli);
+  EXPECT_EQ(server.getNumRequests(), 4);
+
+  /* the next probe succeeds and closes the breaker */
+  cluster_up = true;
+  EXPECT_TRUE(server.waitFor([&server] () {
+    return server.getNumEventsOK() == 10;
+  }, 5 * kMicrosPerSecond));
+
+  target.stopUploadThread();
+  EXPECT_EQ(server.getNumRequests(), 5);
+}
+
+TEST(EventQLTarget, routes) {
+  MockEventQLServer server([] (size_t) {
+    return 201;
+  });
+
+  EventQLTarget target;
+  target.addHost("127.0.0.1", server.getPort());
+  target.setBatchLinger(kMicrosPerMilli);
+  ASSERT_TRUE(target.addRoute("app.login", "users/logins").isSuccess());
+  ASSERT_TRUE(target.addRoute("app.*", "app/%E").isSuccess());
+  ASSERT_TRUE(target.addRoute("*", "%E/all").isSuccess());
+  ASSERT_FALSE(target.addRoute("*", "mydb").isSuccess());
+  ASSERT_FALSE(target.addRoute("*", "mydb/").isSuccess());
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  for (size_t i = 0; i < 3; ++i) {
+    ASSERT_TRUE(target.emitEvent("app.login", "{}").isSuccess());
+    ASSERT_TRUE(target.emitEvent("app.logout", "{}").isSuccess());
+    ASSERT_TRUE(target.emitEvent("sys", "{}").isSuccess());
+  }
+
+  EXPECT_TRUE(server.waitFor([&server] () {
+    return server.getNumEventsOK() == 18;
+  }, 5 * kMicrosPerSecond));
+
+  target.stopUploadThread();
+
+  auto tables = server.getTables();
+  EXPECT_EQ(tables.size(), 6);
+  EXPECT_EQ(tables["users/logins"], 3);
+  EXPECT_EQ(tables["app/app.login"], 3);
+  EXPECT_EQ(tables["app/app.logout"], 3);
+  EXPECT_EQ(tables["app.login/all"], 3);
+  EXPECT_EQ(tables["app.logout/all"], 3);
+  EXPECT_EQ(tables["sys/all"], 3);
+}
+
+TEST(UploadQueue, multiple_producers) {
+  static const size_t kNumProducers = 4;
+  static const size_t kNumValues = 100000;
+
+  UploadQueue<std::unique_ptr<size_t>> queue(1000);
+  EXPECT_EQ(queue.capacity(), 1024);
+  EXPECT_TRUE(queue.empty());
+
+  std::vector<std::thread> producers;
+  for (size_t p = 0; p < kNumProducers; ++p) {
+    producers.emplace_back([&queue, p] () {
+      for (size_t i = 0; i < kNumValues; ++i) {
+        std::unique_ptr<size_t> value(new size_t(p * kNumValues + i));
+        while (!queue.push(std::move(value))) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+
+  /* values from each producer have to come out in order */
+  std::vector<size_t> next(kNumProducers, 0);
+  size_t total = 0;
+  bool ordered = true;
+  while (total < kNumProducers * kNumValues) {
+    total += queue.popBatch(64, [&next, &ordered] (
+        std::unique_ptr<size_t>&& value) {
+      auto p = *value / kNumValues;
+      ordered &= *value % kNumValues == next[p]++;
+      return true;
+    });
+  }
+
+  for (auto& t : producers) {
+    t.join();
+  }
+
+  EXPECT_TRUE(ordered);
+  EXPECT_TRUE(queue.empty());
+  EXPECT_EQ(queue.size(), 0);
+}
+
+TEST(EventQLTarget, blocks_on_full_queue) {
+  MockEventQLServer server([] (size_t) {
+    return 201;
+  });
+
+  EventQLTarget target;
+  configureTarget(&target, server.getPort());
+  target.setMaxQueueLength(16);
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  std::vector<std::thread> producers;
+  for (size_t p = 0; p < 4; ++p) {
+    producers.emplace_back([&target] () {
+      for (size_t i = 0; i < 1000; ++i) {
+        target.emitEvent("test", "{}");
+      }
+    });
+  }
+
+  for (auto& t : producers) {
+    t.join();
+  }
+
+  EXPECT_TRUE(server.waitFor([&server] () {
+    return server.getNumEventsOK() == 4000;
+  }, 5 * kMicrosPerSecond));
+
+  target.stopUploadThread();
+}
+
+TEST(EventQLTarget, adaptive_batching) {
+  std::atomic<size_t> fail_at(-1);
+  MockEventQLServer server([&fail_at] (size_t idx) {
+    return idx == fail_at ? 503 : 201;
+  });
+
+  EventQLTarget target;
+  configureTarget(&target, server.getPort());
+  target.setMaxQueueLength(65536);
+  target.setBatchMaxEvents(64);
+  target.setAdaptiveBatching(true, kMicrosPerSecond);
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  for (size_t i = 0; i < 40000; ++i) {
+    ASSERT_TRUE(target.emitEvent("test", "{}").isSuccess());
+  }
+
+  /* the batch window starts at a quarter of the max and grows to the max */
+  EXPECT_TRUE(server.waitFor([&server] () {
+    auto sizes = server.getBatchSizes();
+    return std::find(sizes.begin(), sizes.end(), 64) != sizes.end();
+  }, 5 * kMicrosPerSecond));
+
+  /* a 5xx response halves it */
+  fail_at = server.getNumRequests() + 2;
+  EXPECT_TRUE(server.waitFor([&server] () {
+    return server.getNumEventsOK() == 40000;
+  }, 5 * kMicrosPerSecond));
+
+  target.stopUploadThread();
+
+  auto sizes = server.getBatchSizes();
+  ASSERT_GT(sizes.size(), fail_at + 1);
+  EXPECT_LE(sizes[0], 16);
+  EXPECT_EQ(sizes[fail_at - 1], 64);
+  EXPECT_EQ(sizes[fail_at + 1], 32);
+}
+
+TEST(BatchEncoder, formats) {
+  EnqueuedEvent a;
+  a.table = "idx1";
+  a.data = "{\"a\":\n1}";
+  EnqueuedEvent b;
+  b.table = "idx2";
+  b.data = "{\"b\":2}";
+  std::vector<const EnqueuedEvent*> events = { &a, &b };
+
+  std::unique_ptr<BatchEncoder> encoder;
+  std::string body;
+  ASSERT_FALSE(BatchEncoder::create("xml", &encoder).isSuccess());
+
+  ASSERT_TRUE(BatchEncoder::create("ndjson", &encoder).isSuccess());
+  encoder->encodeBatch(events, 0, &body);
+  EXPECT_EQ(body, "{\"a\": 1}\n{\"b\":2}\n");
+
+  ASSERT_TRUE(BatchEncoder::create("json_array", &encoder).isSuccess());
+  encoder->encodeBatch(events, 0, &body);
+  EXPECT_EQ(body, "[{\"a\":\n1},{\"b\":2}]");
+
+  ASSERT_TRUE(BatchEncoder::create("elasticsearch_bulk", &encoder).isSuccess());
+  encoder->encodeBatch(events, 0, &body);
+  EXPECT_EQ(
+      body,
+      "{\"index\":{\"_index\":\"idx1\"}}\n{\"a\": 1}\n"
+      "{\"index\":{\"_index\":\"idx2\"}}\n{\"b\":2}\n");
+  EXPECT_TRUE(encoder->checkResponse("{\"errors\":false}").isSuccess());
+  EXPECT_FALSE(encoder->checkResponse("{\"errors\":true}").isSuccess());
+  EXPECT_FALSE(
+      encoder->checkResponse("{\n  \"errors\" : true,\n}").isSuccess());
+  EXPECT_TRUE(encoder->checkResponse("{\"errors\" : false}").isSuccess());
+
+  ASSERT_TRUE(BatchEncoder::create("clickhouse", &encoder).isSuccess());
+  EXPECT_TRUE(encoder->isSingleTarget());
+  events = { &b };
+  encoder->encodeBatch(events, 0, &body);
+  EXPECT_EQ(body, "INSERT INTO idx2 FORMAT JSONEachRow\n{\"b\":2}\n");
+
+  TargetTable target;
+  ASSERT_TRUE(BatchEncoder::create("eventql", &encoder).isSuccess());
+  EXPECT_FALSE(encoder->parseTarget("mydb", &target).isSuccess());
+  EXPECT_TRUE(encoder->parseTarget("mydb/tbl", &target).isSuccess());
+  EXPECT_EQ(target.database, "mydb");
+  EXPECT_EQ(target.table, "tbl");
+}
+
+TEST(EventQLTarget, parse_host_port) {
+  std::string host;
+  uint16_t port = 9175;
+  ASSERT_TRUE(EventQLTarget::parseHostPort("db1", &host, &port).isSuccess());
+  EXPECT_EQ(host, "db1");
+  EXPECT_EQ(port, 9175);
+
+  ASSERT_TRUE(
+      EventQLTarget::parseHostPort("db1:8080", &host, &port).isSuccess());
+  EXPECT_EQ(host, "db1");
+  EXPECT_EQ(port, 8080);
+
+  port = 9175;
+  ASSERT_TRUE(
+      EventQLTarget::parseHostPort("[::1]:8081", &host, &port).isSuccess());
+  EXPECT_EQ(host, "::1");
+  EXPECT_EQ(port, 8081);
+
+  port = 9175;
+  ASSERT_TRUE(
+      EventQLTarget::parseHostPort("[fe80::1]", &host, &port).isSuccess());
+  EXPECT_EQ(host, "fe80::1");
+  EXPECT_EQ(port, 9175);
+
+  ASSERT_TRUE(
+      EventQLTarget::parseHostPort("fe80::1", &host, &port).isSuccess());
+  EXPECT_EQ(host, "fe80::1");
+  EXPECT_EQ(port, 9175);
+
+  EXPECT_FALSE(EventQLTarget::parseHostPort("[::1", &host, &port).isSuccess());
+  EXPECT_FALSE(
+      EventQLTarget::parseHostPort("[::1]x", &host, &port).isSuccess());
+  EXPECT_FALSE(EventQLTarget::parseHostPort(":80", &host, &port).isSuccess());
+  EXPECT_FALSE(
+      EventQLTarget::parseHostPort("db1:http", &host, &port).isSuccess());
+  EXPECT_FALSE(
+      EventQLTarget::parseHostPort("db1:70000", &host, &port).isSuccess());
+}
+
+/**
+ * With a "%T" in the url, each request only carries the events of a single
+ * target and goes to its own url
+ */
+TEST(EventQLTarget, url_template) {
+  MockEventQLServer server([] (size_t idx) {
+    return 200;
+  });
+
+  std::unique_ptr<BatchEncoder> encoder;
+  ASSERT_TRUE(BatchEncoder::create("ndjson", &encoder).isSuccess());
+
+  EventQLTarget target;
+  target.setEncoder(std::move(encoder));
+  target.setBatchLinger(kMicrosPerMilli);
+  target.addHeader("X-Test: 1");
+  auto url = StringUtil::format(
+      "http://127.0.0.1:$0/ingest/%T?v=1",
+      server.getPort());
+  ASSERT_TRUE(target.addURL(url).isSuccess());
+  ASSERT_FALSE(target.addURL("ftp://127.0.0.1/").isSuccess());
+  ASSERT_TRUE(target.addRoute("app.*", "app logs").isSuccess());
+  ASSERT_TRUE(target.addRoute("sys", "%E").isSuccess());
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  for (size_t i = 0; i < 5; ++i) {
+    ASSERT_TRUE(target.emitEvent("app.login", "{}").isSuccess());
+    ASSERT_TRUE(target.emitEvent("sys", "{}").isSuccess());
+  }
+
+  std::map<std::string, size_t> lines;
+  EXPECT_TRUE(server.waitFor([&server, &lines] () {
+    lines.clear();
+    for (const auto& req : server.getRequests()) {
+      auto path = req.first.substr(0, req.first.find(" HTTP/1.1"));
+      lines[path] += std::count(req.second.begin(), req.second.end(), '\n');
+    }
+
+    return lines["POST /ingest/app%20logs?v=1"] == 5 &&
+        lines["POST /ingest/sys?v=1"] == 5;
+  }, 5 * kMicrosPerSecond));
+
+  target.stopUploadThread();
+  EXPECT_EQ(lines.size(), 2);
+
+  auto requests = server.getRequests();
+  ASSERT_FALSE(requests.empty());
+  EXPECT_TRUE(requests[0].first.find("X-Test: 1\r\n") != std::string::npos);
+  EXPECT_TRUE(
+      requests[0].first.find("Content-Type: application/x-ndjson") !=
+      std::string::npos);
+}
+
+TEST(HashRing, distribution) {
+  std::vector<std::string> nodes = { "a:9175", "b:9175", "c:9175", "d:9175" };
+  HashRing ring(nodes, HashRing::kDefaultVirtualNodes);
+
+  std::vector<size_t> owners(nodes.size());
+  std::vector<size_t> keys(10000);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    auto key = StringUtil::format("key$0", i);
+    auto succ = ring.lookup(HashRing::hash(key.data(), key.size()));
+    keys[i] = succ[0];
+    ++owners[succ[0]];
+
+    /* the successors are all nodes exactly once */
+    std::vector<uint32_t> sorted(succ, succ + nodes.size());
+    std::sort(sorted.begin(), sorted.end());
+    for (size_t n = 0; n < nodes.size(); ++n) {
+      EXPECT_EQ(sorted[n], n);
+    }
+  }
+
+  for (auto n : owners) {
+    EXPECT_GT(n, 1500);
+    EXPECT_LT(n, 3500);
+  }
+
+  /* removing a node only moves the keys of that node */
+  nodes.pop_back();
+  HashRing smaller(nodes, HashRing::kDefaultVirtualNodes);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    auto key = StringUtil::format("key$0", i);
+    auto owner = smaller.lookup(HashRing::hash(key.data(), key.size()))[0];
+    if (keys[i] != 3) {
+      EXPECT_EQ(owner, keys[i]);
+    }
+  }
+}
+
+TEST(ShardedTarget, find_json_field) {
+  std::string json =
+      R"({ "a": {"x": "}"}, "b" : [1, "]"], "user": "a\"b", "n": 42 })";
+
+  const char* value;
+  size_t value_len;
+  ASSERT_TRUE(findJSONField(json, "user", &value, &value_len));
+  EXPECT_EQ(std::string(value, value_len), "a\\\"b");
+  ASSERT_TRUE(findJSONField(json, "n", &value, &value_len));
+  EXPECT_EQ(std::string(value, value_len), "42");
+  ASSERT_TRUE(findJSONField(json, "b", &value, &value_len));
+  EXPECT_EQ(std::string(value, value_len), "[1, \"]\"]");
+  EXPECT_FALSE(findJSONField(json, "x", &value, &value_len));
+  EXPECT_FALSE(findJSONField("[1]", "x", &value, &value_len));
+}
+
+/**
+ * Once the circuit breaker of a shard opens, its events are sent to the
+ * other shard
+ */
+TEST(ShardedTarget, failover) {
+  std::atomic<bool> down(true);
+  MockEventQLServer server_a([&down] (size_t idx) {
+    return down ? 503 : 201;
+  });
+
+  MockEventQLServer server_b([] (size_t idx) {
+    return 201;
+  });
+
+  ShardedTarget sharded;
+  sharded.setShardKey("user");
+  for (auto port : { server_a.getPort(), server_b.getPort() }) {
+    std::unique_ptr<EventQLTarget> shard(new EventQLTarget());
+    configureTarget(shard.get(), port);
+    shard->setCircuitBreaker(1, 2 * kMicrosPerSecond);
+    /* nothing stays queued on the failed shard that could probe it */
+    shard->setRetryMaxAttempts(0);
+    auto name = StringUtil::format("127.0.0.1:$0", port);
+    sharded.addShard(name, std::move(shard));
+  }
+
+  ASSERT_TRUE(sharded.startUploadThreads().isSuccess());
+
+  /* find a key that is owned by server a */
+  std::string event;
+  for (size_t i = 0; ; ++i) {
+    event = StringUtil::format("{\"user\":\"u$0\"}", i);
+    if (sharded.selectShard("test", event) == 0) {
+      break;
+    }
+  }
+
+  ASSERT_TRUE(sharded.emitEvent("test", event).isSuccess());
+  EXPECT_TRUE(server_a.waitFor([&server_a] () {
+    return server_a.getNumRequests() == 1;
+  }, 5 * kMicrosPerSecond));
+
+  EXPECT_TRUE(server_a.waitFor([&sharded, &event] () {
+    return sharded.selectShard("test", event) == 1;
+  }, 5 * kMicrosPerSecond));
+
+  for (size_t i = 0; i < 10; ++i) {
+    ASSERT_TRUE(sharded.emitEvent("test", event).isSuccess());
+  }
+
+  EXPECT_TRUE(server_b.waitFor([&server_b] () {
+    return server_b.getNumEventsOK() == 10;
+  }, 5 * kMicrosPerSecond));
+
+  std::string stats;
+  sharded.getStats(&stats);
+  EXPECT_TRUE(stats.find("\"failovers\":10,") != std::string::npos);
+  EXPECT_TRUE(stats.find("\"healthy\":false") != std::string::npos);
+
+  /* once the cooldown expired, the events go back to server a */
+  down = false;
+  EXPECT_TRUE(server_a.waitFor([&sharded, &event] () {
+    return sharded.selectShard("test", event) == 0;
+  }, 5 * kMicrosPerSecond));
+
+  for (size_t i = 0; i < 10; ++i) {
+    ASSERT_TRUE(sharded.emitEvent("test", event).isSuccess());
+  }
+
+  EXPECT_TRUE(server_a.waitFor([&server_a] () {
+    return server_a.getNumEventsOK() >= 10;
+  }, 5 * kMicrosPerSecond));
+
+  EXPECT_EQ(server_b.getNumEventsOK(), 10);
+
+  sharded.getStats(&stats);
+  EXPECT_TRUE(stats.find("\"failovers\":10,") != std::string::npos);
+  EXPECT_TRUE(stats.find("\"healthy\":false") == std::string::npos);
+
+  sharded.stopUploadThreads();
+}
+
+static std::string makeTempDir() {
+  char path[] = "/tmp/eventql_test.XXXXXX";
+  return mkdtemp(path);
+}
+
+static size_t countSegments(const std::string& dir) {
+  size_t n = 0;
+  auto d = opendir(dir.c_str());
+  while (auto e = readdir(d)) {
+    if (StringUtil::endsWith(e->d_name, ".spool")) {
+      ++n;
+    }
+  }
+
+  closedir(d);
+  return n;
+}
+
+static std::vector<std::string> readSpool(
+    UploadSpool* spool,
+    size_t max_records,
+    UploadSpool::Cursor* cursor) {
+  std::vector<std::string> records;
+  spool->read(
+      max_records,
+      size_t(-1),
+      [&records] (const char* data, size_t size) {
+        records.emplace_back(data, size);
+      },
+      cursor);
+
+  return records;
+}
+
+/**
+ * Records that were read but not committed are replayed after a restart
+ */
+TEST(UploadSpool, replay_after_restart) {
+  auto dir = makeTempDir();
+
+  {
+    UploadSpool spool(dir);
+    ASSERT_TRUE(spool.open().isSuccess());
+    for (size_t i = 0; i < 10; ++i) {
+      auto record = StringUtil::format("record $0", i);
+      ASSERT_TRUE(spool.append(record.data(), record.size()).isSuccess());
+    }
+
+    UploadSpool::Cursor cursor;
+    auto records = readSpool(&spool, 4, &cursor);
+    ASSERT_EQ(records.size(), 4);
+    EXPECT_EQ(records[0], "record 0");
+    EXPECT_TRUE(cursor != 0);
+  }
+
+  {
+    UploadSpool spool(dir);
+    ASSERT_TRUE(spool.open().isSuccess());
+    EXPECT_FALSE(spool.empty());
+
+    UploadSpool::Cursor cursor;
+    auto records = readSpool(&spool, 100, &cursor);
+    ASSERT_EQ(records.size(), 10);
+    EXPECT_EQ(records[0], "record 0");
+    EXPECT_EQ(records[9], "record 9");
+    EXPECT_TRUE(spool.empty());
+    spool.commit(cursor, 4);
+  }
+
+  /* only a part of the records was committed */
+  {
+    UploadSpool spool(dir);
+    ASSERT_TRUE(spool.open().isSuccess());
+
+    UploadSpool::Cursor cursor;
+    auto records = readSpool(&spool, 100, &cursor);
+    ASSERT_EQ(records.size(), 10);
+    spool.commit(cursor, 10);
+  }
+
+  {
+    UploadSpool spool(dir);
+    ASSERT_TRUE(spool.open().isSuccess());
+    EXPECT_TRUE(spool.empty());
+
+    UploadSpool::Cursor cursor;
+    EXPECT_EQ(readSpool(&spool, 100, &cursor).size(), 0);
+    EXPECT_EQ(cursor, 0);
+  }
+
+  EXPECT_EQ(countSegments(dir), 0);
+}
+
+/**
+ * The persisted cursor only moves past reads once all reads before them are
+ * committed, too
+ */
+TEST(UploadSpool, cursor_survives_reopen) {
+  auto dir = makeTempDir();
+
+  {
+    UploadSpool spool(dir);
+    ASSERT_TRUE(spool.open().isSuccess());
+    for (size_t i = 0; i < 100; ++i) {
+      auto record = StringUtil::format("record $0", i);
+      ASSERT_TRUE(spool.append(record.data(), record.size()).isSuccess());
+    }
+
+    UploadSpool::Cursor a;
+    UploadSpool::Cursor b;
+    UploadSpool::Cursor c;
+    EXPECT_EQ(readSpool(&spool, 30, &a).size(), 30);
+    EXPECT_EQ(readSpool(&spool, 30, &b).size(), 30);
+    EXPECT_EQ(readSpool(&spool, 30, &c).size(), 30);
+    spool.commit(a, 30);
+    spool.commit(c, 30);
+  }
+
+  {
+    UploadSpool spool(dir);
+    ASSERT_TRUE(spool.open().isSuccess());
+
+    UploadSpool::Cursor cursor;
+    auto records = readSpool(&spool, 1000, &cursor);
+    ASSERT_EQ(records.size(), 70);
+    EXPECT_EQ(records[0], "record 30");
+    EXPECT_EQ(records[69], "record 99");
+    spool.commit(cursor, 40);
+  }
+
+  {
+    UploadSpool spool(dir);
+    ASSERT_TRUE(spool.open().isSuccess());
+
+    /* the commit was not complete, so nothing moved */
+    UploadSpool::Cursor cursor;
+    auto records = readSpool(&spool, 1000, &cursor);
+    ASSERT_EQ(records.size(), 70);
+    EXPECT_EQ(records[0], "record 30");
+    spool.commit(cursor, 70);
+
+    auto record = std::string("record 100");
+    ASSERT_TRUE(spool.append(record.data(), record.size()).isSuccess());
+  }
+
+  {
+    UploadSpool spool(dir);
+    ASSERT_TRUE(spool.open().isSuccess());
+
+    UploadSpool::Cursor cursor;
+    auto records = readSpool(&spool, 1000, &cursor);
+    ASSERT_EQ(records.size(), 1);
+    EXPECT_EQ(records[0], "record 100");
+  }
+}
+
+/**
+ * A record with a bad checksum ends the replay of its segment, the next
+ * segment is read as usual
+ */
+TEST(UploadSpool, skips_corrupt_record) {
+  auto dir = makeTempDir();
+
+  {
+    UploadSpool spool(dir);
+    ASSERT_TRUE(spool.open().isSuccess());
+    for (size_t i = 0; i < 5; ++i) {
+      auto record = StringUtil::format("record $0", i);
+      ASSERT_TRUE(spool.append(record.data(), record.size()).isSuccess());
+    }
+  }
+
+  /* flip a payload byte of the third record. each record is a 8 byte
+     header and 8 bytes of payload, after the 8 byte segment header */
+  {
+    auto path = dir + "/1.spool";
+    int fd = open(path.c_str(), O_RDWR);
+    ASSERT_TRUE(fd >= 0);
+    char c = 'X';
+    ASSERT_EQ(pwrite(fd, &c, 1, 8 + 2 * 16 + 8 + 3), 1);
+    close(fd);
+  }
+
+  {
+    UploadSpool spool(dir);
+    ASSERT_TRUE(spool.open().isSuccess());
+    auto record = std::string("record 5");
+    ASSERT_TRUE(spool.append(record.data(), record.size()).isSuccess());
+
+    UploadSpool::Cursor cursor;
+    auto records = readSpool(&spool, 100, &cursor);
+    ASSERT_EQ(records.size(), 3);
+    EXPECT_EQ(records[0], "record 0");
+    EXPECT_EQ(records[1], "record 1");
+    EXPECT_EQ(records[2], "record 5");
+  }
+}
+
+/**
+ * Appends roll over to a new segment once the segment size is reached.
+ * Segments are only deleted once all of their records are committed
+ */
+TEST(UploadSpool, segment_rollover) {
+  auto dir = makeTempDir();
+
+  UploadSpool spool(dir);
+  spool.setSegmentSize(1024);
+  ASSERT_TRUE(spool.open().isSuccess());
+
+  std::string payload(100, 'x');
+  for (size_t i = 0; i < 100; ++i) {
+    ASSERT_TRUE(spool.append(payload.data(), payload.size()).isSuccess());
+  }
+
+  ASSERT_TRUE(spool.sync(true).isSuccess());
+  EXPECT_EQ(countSegments(dir), 10);
+
+  std::vector<UploadSpool::Cursor> cursors;
+  size_t nrecords = 0;
+  while (!spool.empty()) {
+    UploadSpool::Cursor cursor;
+    auto records = readSpool(&spool, 7, &cursor);
+    for (const auto& r : records) {
+      EXPECT_EQ(r, payload);
+    }
+
+    nrecords += records.size();
+    cursors.emplace_back(cursor);
+  }
+
+  EXPECT_EQ(nrecords, 100);
+  EXPECT_EQ(countSegments(dir), 10);
+
+  /* the first 49 records are committed. each segment holds ten records,
+     so the fifth segment is still needed for record 49 */
+  for (size_t i = 0; i < 7; ++i) {
+    spool.commit(cursors[i], 7);
+  }
+
+  EXPECT_EQ(countSegments(dir), 6);
+
+  for (size_t i = 7; i < cursors.size(); ++i) {
+    spool.commit(cursors[i], 7);
+  }
+
+  EXPECT_EQ(countSegments(dir), 0);
+}
+
+/**
+ * Events that were spooled while the cluster was down are delivered after a
+ * restart, and delivered events are not sent again
+ */
+TEST(EventQLTarget, spool_replay) {
+  auto dir = makeTempDir();
+
+  {
+    MockEventQLServer server([] (size_t) {
+      return 503;
+    });
+
+    EventQLTarget target;
+    configureTarget(&target, server.getPort());
+    target.setMaxQueueLength(2);
+    ASSERT_TRUE(target.setSpool(dir, 1024, 0).isSuccess());
+    ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+    for (size_t i = 0; i < 50; ++i) {
+      ASSERT_TRUE(target.emitEvent("test", "{}").isSuccess());
+    }
+
+    EXPECT_TRUE(server.waitFor([&server] () {
+      return server.getNumRequests() >= 3;
+    }, 5 * kMicrosPerSecond));
+
+    target.stopUploadThread();
+  }
+
+  {
+    MockEventQLServer server([] (size_t) {
+      return 201;
+    });
+
+    EventQLTarget target;
+    configureTarget(&target, server.getPort());
+    ASSERT_TRUE(target.setSpool(dir, 1024, 0).isSuccess());
+    ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+    EXPECT_TRUE(server.waitFor([&server] () {
+      return server.getNumEventsOK() == 50;
+    }, 5 * kMicrosPerSecond));
+
+    target.stopUploadThread();
+    EXPECT_EQ(server.getNumEventsOK(), 50);
+  }
+
+  {
+    MockEventQLServer server([] (size_t) {
+      return 201;
+    });
+
+    EventQLTarget target;
+    configureTarget(&target, server.getPort());
+    ASSERT_TRUE(target.setSpool(dir, 1024, 0).isSuccess());
+    ASSERT_TRUE(target.startUploadThread().isSuccess());
+    usleep(100 * kMicrosPerMilli);
+    target.stopUploadThread();
+    EXPECT_EQ(server.getNumRequests(), 0);
+  }
+
+  EXPECT_EQ(countSegments(dir), 0);
+}
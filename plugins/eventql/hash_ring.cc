@@ -0,0 +1,94 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <algorithm>
+#include "hash_ring.h"
+
+namespace evcollect {
+namespace plugin_eventql {
+
+/**
+ * FNV-1a followed by the murmur3 finalizer, since plain FNV-1a does not mix
+ * the last bytes of similar keys (like "host#1" and "host#2") well enough
+ */
+uint64_t HashRing::hash(const char* data, size_t size) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; ++i) {
+    h ^= (unsigned char) data[i];
+    h *= 1099511628211ULL;
+  }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+HashRing::HashRing(
+    const std::vector<std::string>& nodes,
+    size_t num_vnodes) :
+    num_nodes_(nodes.size()) {
+  num_vnodes = std::max(num_vnodes, size_t(1));
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    for (size_t v = 0; v < num_vnodes; ++v) {
+      auto vnode = nodes[i] + "#" + std::to_string(v);
+      ring_.emplace_back(hash(vnode.data(), vnode.size()), i);
+    }
+  }
+
+  std::sort(ring_.begin(), ring_.end());
+
+  successors_.reserve(ring_.size() * num_nodes_);
+  std::vector<bool> seen(num_nodes_);
+  for (size_t pos = 0; pos < ring_.size(); ++pos) {
+    std::fill(seen.begin(), seen.end(), false);
+    size_t found = 0;
+    for (size_t i = 0; found < num_nodes_; ++i) {
+      auto node = ring_[(pos + i) % ring_.size()].second;
+      if (!seen[node]) {
+        seen[node] = true;
+        successors_.emplace_back(node);
+        ++found;
+      }
+    }
+  }
+}
+
+size_t HashRing::getNumNodes() const {
+  return num_nodes_;
+}
+
+const uint32_t* HashRing::lookup(uint64_t hash) const {
+  auto iter = std::lower_bound(
+      ring_.begin(),
+      ring_.end(),
+      std::make_pair(hash, uint32_t(0)));
+
+  size_t pos = iter == ring_.end() ? 0 : iter - ring_.begin();
+  return &successors_[pos * num_nodes_];
+}
+
+} // namespace plugins_eventql
+} // namespace evcollect
@@ -0,0 +1,70 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace evcollect {
+namespace plugin_eventql {
+
+/**
+ * A consistent hash ring with virtual nodes. Each node is placed on the ring
+ * num_vnodes times and a key is owned by the first virtual node at or after
+ * the hash of the key. Adding or removing a node only moves the keys of that
+ * node, and the keys of a node are spread over all other nodes when walking
+ * the ring past it.
+ *
+ * For each position on the ring the list of distinct nodes in ring order is
+ * precomputed, so a lookup is a binary search and never allocates
+ */
+class HashRing {
+public:
+
+  static const size_t kDefaultVirtualNodes = 128;
+
+  static uint64_t hash(const char* data, size_t size);
+
+  /**
+   * The index of a node is its position in nodes
+   */
+  HashRing(const std::vector<std::string>& nodes, size_t num_vnodes);
+
+  size_t getNumNodes() const;
+
+  /**
+   * Returns the distinct nodes in ring order starting at the owner of hash.
+   * The returned pointer points to getNumNodes() node indexes
+   */
+  const uint32_t* lookup(uint64_t hash) const;
+
+protected:
+  size_t num_nodes_;
+  std::vector<std::pair<uint64_t, uint32_t>> ring_;
+  std::vector<uint32_t> successors_;
+};
+
+} // namespace plugins_eventql
+} // namespace evcollect
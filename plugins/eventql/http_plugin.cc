@@ -0,0 +1,209 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <string.h>
+#include <evcollect/evcollect.h>
+#include <evcollect/util/return_code.h>
+#include "batch_encoder.h"
+#include "eventql_target.h"
+#include "upload_config.h"
+
+namespace evcollect {
+namespace plugin_http {
+
+using plugin_eventql::BatchEncoder;
+using plugin_eventql::EventQLTarget;
+
+static std::vector<std::string> getOptionArgs(
+    const evcollect_plugin_cfg_t* cfg,
+    const char* key,
+    int i) {
+  std::vector<std::string> args;
+  for (int j = 0; ; ++j) {
+    const char* arg;
+    if (!evcollect_plugin_getcfgv(cfg, key, i, j, &arg)) {
+      break;
+    }
+
+    args.emplace_back(arg);
+  }
+
+  return args;
+}
+
+/**
+ * Generic HTTP output. Shares the upload machinery (batching, keep-alive
+ * connections, gzip, retries and spooling) with the eventql plugin, but
+ * posts the batches to arbitrary URLs using one of the body encoders
+ */
+int pluginAttach(
+    evcollect_ctx_t* ctx,
+    const evcollect_plugin_cfg_t* cfg,
+    void** userdata) {
+  std::unique_ptr<EventQLTarget> target(new EventQLTarget());
+  target->setName("http");
+
+  std::string encoder_name = "ndjson";
+  const char* encoder_opt;
+  if (evcollect_plugin_getcfg(cfg, "encoder", &encoder_opt)) {
+    encoder_name = encoder_opt;
+  }
+
+  std::unique_ptr<BatchEncoder> encoder;
+  auto rc = BatchEncoder::create(encoder_name, &encoder);
+  if (!rc.isSuccess()) {
+    evcollect_seterror(ctx, rc.getMessage().c_str());
+    return false;
+  }
+
+  target->setEncoder(std::move(encoder));
+
+  /* url may be given multiple times, requests are spread over all urls */
+  int nurls = 0;
+  for (; ; ++nurls) {
+    const char* url_opt;
+    if (!evcollect_plugin_getcfgv(cfg, "url", nurls, 0, &url_opt)) {
+      break;
+    }
+
+    auto rc = target->addURL(url_opt);
+    if (!rc.isSuccess()) {
+      evcollect_seterror(ctx, rc.getMessage().c_str());
+      return false;
+    }
+  }
+
+  if (nurls == 0) {
+    evcollect_seterror(ctx, "http: missing 'url' option");
+    return false;
+  }
+
+  /* header "<name>: <value>" or header <name> <value> */
+  for (int i = 0; ; ++i) {
+    auto args = getOptionArgs(cfg, "header", i);
+    if (args.empty()) {
+      break;
+    }
+
+    if (args.size() == 1 && args[0].find(':') != std::string::npos) {
+      target->addHeader(args[0]);
+    } else if (args.size() == 2) {
+      target->addHeader(args[0] + ": " + args[1]);
+    } else {
+      evcollect_seterror(
+          ctx,
+          "invalid arguments to header. " \
+          "format is: header <name> <value>");
+      return false;
+    }
+  }
+
+  if (!plugin_eventql::configureUploadTarget(ctx, cfg, target.get())) {
+    return false;
+  }
+
+  /* without any routes, all events are sent with the event name as target */
+  const char* route_opt;
+  if (!evcollect_plugin_getcfgv(cfg, "route", 0, 0, &route_opt)) {
+    auto rc = target->addRoute("*", "%E");
+    if (!rc.isSuccess()) {
+      evcollect_seterror(ctx, rc.getMessage().c_str());
+      return false;
+    }
+  }
+
+  rc = target->startUploadThread();
+  if (!rc.isSuccess()) {
+    evcollect_seterror(ctx, rc.getMessage().c_str());
+    return false;
+  }
+
+  *userdata = target.release();
+  return true;
+}
+
+int pluginDetach(evcollect_ctx_t* ctx, void* userdata) {
+  auto target = static_cast<EventQLTarget*>(userdata);
+  target->stopUploadThread();
+  delete target;
+  return true;
+}
+
+int pluginEmitEvent(
+    evcollect_ctx_t* ctx,
+    void* userdata,
+    const evcollect_event_t* event) {
+  auto target = static_cast<EventQLTarget*>(userdata);
+
+  const char* ev_name;
+  size_t ev_name_len;
+  evcollect_event_getname(event, &ev_name, &ev_name_len);
+
+  const char* ev_data;
+  size_t ev_data_len;
+  evcollect_event_getdata(event, &ev_data, &ev_data_len);
+
+  auto rc = target->emitEvent(
+      std::string(ev_name, ev_name_len),
+      std::string(ev_data, ev_data_len));
+
+  if (rc.isSuccess()) {
+    return 1;
+  } else {
+    evcollect_seterror(ctx, rc.getMessage().c_str());
+    return 0;
+  }
+}
+
+int pluginGetStats(
+    evcollect_ctx_t* ctx,
+    void* userdata,
+    evcollect_event_t* stats) {
+  auto target = static_cast<EventQLTarget*>(userdata);
+
+  std::string json;
+  target->getStats(&json);
+  evcollect_event_setdata(stats, json.data(), json.size());
+  return 1;
+}
+
+} // namespace plugins_http
+} // namespace evcollect
+
+EVCOLLECT_PLUGIN_INIT(http) {
+  evcollect_output_plugin_register(
+      ctx,
+      "http",
+      &evcollect::plugin_http::pluginEmitEvent,
+      &evcollect::plugin_http::pluginAttach,
+      &evcollect::plugin_http::pluginDetach,
+      NULL,
+      NULL);
+
+  evcollect_output_plugin_register_stats(
+      ctx,
+      "http",
+      &evcollect::plugin_http::pluginGetStats);
+
+  return true;
+}
@@ -0,0 +1,264 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <evcollect/util/stringutil.h>
+#include "sharded_target.h"
+
+namespace evcollect {
+namespace plugin_eventql {
+
+namespace {
+
+const char* skipSpace(const char* cur, const char* end) {
+  while (cur < end && (*cur == ' ' || *cur == '\t' ||
+         *cur == '\n' || *cur == '\r')) {
+    ++cur;
+  }
+
+  return cur;
+}
+
+/* returns a pointer past the closing quote, cur points at the open quote */
+const char* skipString(const char* cur, const char* end) {
+  for (++cur; cur < end; ++cur) {
+    if (*cur == '\\') {
+      ++cur;
+    } else if (*cur == '"') {
+      return cur + 1;
+    }
+  }
+
+  return end;
+}
+
+/* returns a pointer past the value (string, number, literal or nested) */
+const char* skipValue(const char* cur, const char* end) {
+  if (cur < end && *cur == '"') {
+    return skipString(cur, end);
+  }
+
+  size_t depth = 0;
+  for (; cur < end; ++cur) {
+    switch (*cur) {
+      case '"':
+        cur = skipString(cur, end) - 1;
+        break;
+      case '{':
+      case '[':
+        ++depth;
+        break;
+      case '}':
+      case ']':
+        if (depth == 0) {
+          return cur;
+        }
+        if (--depth == 0) {
+          return cur + 1;
+        }
+        break;
+      case ',':
+        if (depth == 0) {
+          return cur;
+        }
+        break;
+    }
+  }
+
+  return end;
+}
+
+}
+
+bool findJSONField(
+    const std::string& json,
+    const std::string& field,
+    const char** value,
+    size_t* value_len) {
+  auto cur = json.data();
+  auto end = cur + json.size();
+
+  cur = skipSpace(cur, end);
+  if (cur == end || *cur != '{') {
+    return false;
+  }
+
+  ++cur;
+  for (;;) {
+    cur = skipSpace(cur, end);
+    if (cur == end || *cur != '"') {
+      return false;
+    }
+
+    auto key_begin = cur + 1;
+    cur = skipString(cur, end);
+    auto key_end = cur - 1;
+
+    cur = skipSpace(cur, end);
+    if (cur == end || *cur != ':') {
+      return false;
+    }
+
+    cur = skipSpace(cur + 1, end);
+    auto value_begin = cur;
+    cur = skipValue(cur, end);
+
+    if (size_t(key_end - key_begin) == field.size() &&
+        field.compare(0, field.size(), key_begin, field.size()) == 0) {
+      auto value_end = cur;
+      while (value_end > value_begin && (value_end[-1] == ' ' ||
+             value_end[-1] == '\n' || value_end[-1] == '\t' ||
+             value_end[-1] == '\r')) {
+        --value_end;
+      }
+
+      if (value_end - value_begin >= 2 && *value_begin == '"') {
+        ++value_begin;
+        --value_end;
+      }
+
+      *value = value_begin;
+      *value_len = value_end - value_begin;
+      return true;
+    }
+
+    cur = skipSpace(cur, end);
+    if (cur == end || *cur != ',') {
+      return false;
+    }
+
+    ++cur;
+  }
+}
+
+ShardedTarget::ShardedTarget() :
+    num_vnodes_(HashRing::kDefaultVirtualNodes),
+    failovers_(0) {}
+
+void ShardedTarget::addShard(
+    const std::string& name,
+    std::unique_ptr<EventQLTarget> target) {
+  Shard shard;
+  shard.name = name;
+  shard.target = std::move(target);
+  shard.events_routed.reset(new std::atomic<uint64_t>(0));
+  shards_.emplace_back(std::move(shard));
+}
+
+void ShardedTarget::setShardKey(const std::string& field) {
+  shard_key_ = field;
+}
+
+void ShardedTarget::setVirtualNodes(size_t num_vnodes) {
+  num_vnodes_ = num_vnodes;
+}
+
+size_t ShardedTarget::selectShard(
+    const std::string& event_name,
+    const std::string& event_data,
+    bool* failover /* = nullptr */) const {
+  const char* key = event_name.data();
+  size_t key_len = event_name.size();
+  if (!shard_key_.empty()) {
+    findJSONField(event_data, shard_key_, &key, &key_len);
+  }
+
+  auto nodes = ring_->lookup(HashRing::hash(key, key_len));
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    if (shards_[nodes[i]].target->isHealthy()) {
+      if (failover) {
+        *failover = i > 0;
+      }
+
+      return nodes[i];
+    }
+  }
+
+  if (failover) {
+    *failover = false;
+  }
+
+  return nodes[0];
+}
+
+ReturnCode ShardedTarget::emitEvent(
+    const std::string& event_name,
+    const std::string& event_data) {
+  bool failover;
+  auto& shard = shards_[selectShard(event_name, event_data, &failover)];
+  ++*shard.events_routed;
+  if (failover) {
+    ++failovers_;
+  }
+
+  return shard.target->emitEvent(event_name, event_data);
+}
+
+ReturnCode ShardedTarget::startUploadThreads() {
+  if (shards_.empty()) {
+    return ReturnCode::error("EINVAL", "no shards configured");
+  }
+
+  std::vector<std::string> names;
+  for (const auto& shard : shards_) {
+    names.emplace_back(shard.name);
+  }
+
+  ring_.reset(new HashRing(names, num_vnodes_));
+
+  for (auto& shard : shards_) {
+    auto rc = shard.target->startUploadThread();
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  return ReturnCode::success();
+}
+
+void ShardedTarget::stopUploadThreads() {
+  for (auto& shard : shards_) {
+    shard.target->stopUploadThread();
+  }
+}
+
+void ShardedTarget::getStats(std::string* stats) const {
+  *stats = StringUtil::format("{\"failovers\":$0,\"shards\":{",
+      failovers_.load());
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    std::string shard_stats;
+    shards_[i].target->getStats(&shard_stats);
+
+    *stats += StringUtil::format(
+        "$0\"$1\":{\"healthy\":$2,\"events_routed\":$3,\"upload\":$4}",
+        i > 0 ? "," : "",
+        StringUtil::jsonEscape(shards_[i].name),
+        shards_[i].target->isHealthy() ? "true" : "false",
+        shards_[i].events_routed->load(),
+        shard_stats);
+  }
+
+  *stats += "}}";
+}
+
+} // namespace plugins_eventql
+} // namespace evcollect
@@ -0,0 +1,110 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <evcollect/util/return_code.h>
+#include "eventql_target.h"
+#include "hash_ring.h"
+
+namespace evcollect {
+namespace plugin_eventql {
+
+/**
+ * Spreads events over several EventQL nodes with a consistent hash ring.
+ * Each shard is a separate EventQLTarget with its own queue, retries and
+ * circuit breaker. Events are hashed on the event name or on the value of a
+ * top level field of the event (falling back to the event name if the field
+ * is missing).
+ *
+ * While the circuit breaker of a shard is open, its events go to the next
+ * healthy shard on the ring. Thanks to the virtual nodes, the traffic of a
+ * failed shard is spread over all other shards instead of doubling the load
+ * on a single neighbor. Events that were already queued on the failed shard
+ * stay there and are retried. When the cooldown of the breaker expires, the
+ * shard gets its events back and the first batch is sent as the probe; if
+ * that fails, the breaker opens again. If no shard is healthy, events go to
+ * their owner
+ */
+class ShardedTarget {
+public:
+
+  ShardedTarget();
+
+  void addShard(const std::string& name, std::unique_ptr<EventQLTarget> shard);
+  void setShardKey(const std::string& field);
+  void setVirtualNodes(size_t num_vnodes);
+
+  ReturnCode emitEvent(
+    const std::string& event_name,
+    const std::string& event_data);
+
+  ReturnCode startUploadThreads();
+  void stopUploadThreads();
+
+  /**
+   * Write the metrics of all shards as a JSON object to stats. May be called
+   * from any thread
+   */
+  void getStats(std::string* stats) const;
+
+  /**
+   * Returns the index of the shard for an event, skipping unhealthy shards.
+   * failover is set to true if the owner of the event was skipped
+   */
+  size_t selectShard(
+      const std::string& event_name,
+      const std::string& event_data,
+      bool* failover = nullptr) const;
+
+protected:
+
+  struct Shard {
+    std::string name;
+    std::unique_ptr<EventQLTarget> target;
+    std::unique_ptr<std::atomic<uint64_t>> events_routed;
+  };
+
+  std::vector<Shard> shards_;
+  std::string shard_key_;
+  size_t num_vnodes_;
+  std::unique_ptr<HashRing> ring_;
+  std::atomic<uint64_t> failovers_;
+};
+
+/**
+ * Find the value of a top level field in a JSON object. String values are
+ * returned as they appear between the quotes (escapes are not resolved),
+ * other values as their JSON text. Returns false if the field does not exist
+ */
+bool findJSONField(
+    const std::string& json,
+    const std::string& field,
+    const char** value,
+    size_t* value_len);
+
+} // namespace plugins_eventql
+} // namespace evcollect
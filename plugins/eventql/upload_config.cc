@@ -0,0 +1,386 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <evcollect/util/time.h>
+#include <evcollect/util/return_code.h>
+#include "upload_config.h"
+
+namespace evcollect {
+namespace plugin_eventql {
+
+bool configureUploadTarget(
+    evcollect_ctx_t* ctx,
+    const evcollect_plugin_cfg_t* cfg,
+    EventQLTarget* target,
+    const std::string& spool_subdir /* = "" */) {
+  const char* host_selection_opt;
+  if (evcollect_plugin_getcfg(cfg, "host_selection", &host_selection_opt)) {
+    auto rc = target->setHostSelection(host_selection_opt);
+    if (!rc.isSuccess()) {
+      evcollect_seterror(ctx, rc.getMessage().c_str());
+      return false;
+    }
+  }
+
+  const char* max_inflight_opt;
+  if (evcollect_plugin_getcfg(cfg, "max_inflight", &max_inflight_opt)) {
+    uint64_t max_inflight;
+    try {
+      max_inflight = std::stoull(max_inflight_opt);
+    } catch (...) {
+      evcollect_seterror(ctx, "invalid value for max_inflight");
+      return false;
+    }
+
+    if (max_inflight == 0) {
+      evcollect_seterror(ctx, "max_inflight must be greater than zero");
+      return false;
+    }
+
+    target->setMaxInflight(max_inflight);
+  }
+
+  std::string username;
+  const char* username_opt;
+  if (evcollect_plugin_getcfg(cfg, "username", &username_opt)) {
+    username = std::string(username_opt);
+  }
+
+  std::string password;
+  const char* password_opt;
+  if (evcollect_plugin_getcfg(cfg, "password", &password_opt)) {
+    password = std::string(password_opt);
+  }
+
+  if (!username.empty() || !password.empty()) {
+    target->setCredentials(username, password);
+  }
+
+  const char* auth_token_opt;
+  if (evcollect_plugin_getcfg(cfg, "auth_token", &auth_token_opt)) {
+    target->setAuthToken(std::string(auth_token_opt));
+  }
+
+  const char* http_timeout_opt;
+  if (evcollect_plugin_getcfg(cfg, "http_timeout", &http_timeout_opt)) {
+    uint64_t http_timeout;
+    try {
+      http_timeout = std::stoull(http_timeout_opt);
+    } catch (...) {
+      evcollect_seterror(ctx, "invalid value for http_timeout");
+      return false;
+    }
+
+    target->setHTTPTimeout(http_timeout);
+  }
+
+  const char* queue_maxlen_opt;
+  if (evcollect_plugin_getcfg(cfg, "queue_maxlen", &queue_maxlen_opt)) {
+    uint64_t queue_maxlen;
+    try {
+      queue_maxlen = std::stoull(queue_maxlen_opt);
+    } catch (...) {
+      evcollect_seterror(ctx, "invalid value for queue_maxlen");
+      return false;
+    }
+
+    target->setMaxQueueLength(queue_maxlen);
+  }
+
+  const char* batch_maxlen_opt;
+  if (evcollect_plugin_getcfg(cfg, "batch_maxlen", &batch_maxlen_opt)) {
+    uint64_t batch_maxlen;
+    try {
+      batch_maxlen = std::stoull(batch_maxlen_opt);
+    } catch (...) {
+      evcollect_seterror(ctx, "invalid value for batch_maxlen");
+      return false;
+    }
+
+    if (batch_maxlen == 0) {
+      evcollect_seterror(ctx, "batch_maxlen must be greater than zero");
+      return false;
+    }
+
+    target->setBatchMaxEvents(batch_maxlen);
+  }
+
+  const char* batch_maxbytes_opt;
+  if (evcollect_plugin_getcfg(cfg, "batch_maxbytes", &batch_maxbytes_opt)) {
+    uint64_t batch_maxbytes;
+    try {
+      batch_maxbytes = std::stoull(batch_maxbytes_opt);
+    } catch (...) {
+      evcollect_seterror(ctx, "invalid value for batch_maxbytes");
+      return false;
+    }
+
+    target->setBatchMaxBytes(batch_maxbytes);
+  }
+
+  const char* batch_linger_opt;
+  if (evcollect_plugin_getcfg(cfg, "batch_linger_ms", &batch_linger_opt)) {
+    uint64_t batch_linger;
+    try {
+      batch_linger = std::stoull(batch_linger_opt);
+    } catch (...) {
+      evcollect_seterror(ctx, "invalid value for batch_linger_ms");
+      return false;
+    }
+
+    target->setBatchLinger(batch_linger * kMicrosPerMilli);
+  }
+
+  const char* retry_max_attempts_opt;
+  if (evcollect_plugin_getcfg(
+          cfg,
+          "retry_max_attempts",
+          &retry_max_attempts_opt)) {
+    uint64_t retry_max_attempts;
+    try {
+      retry_max_attempts = std::stoull(retry_max_attempts_opt);
+    } catch (...) {
+      evcollect_seterror(ctx, "invalid value for retry_max_attempts");
+      return false;
+    }
+
+    target->setRetryMaxAttempts(retry_max_attempts);
+  }
+
+  const char* retry_queue_maxlen_opt;
+  if (evcollect_plugin_getcfg(
+          cfg,
+          "retry_queue_maxlen",
+          &retry_queue_maxlen_opt)) {
+    uint64_t retry_queue_maxlen;
+    try {
+      retry_queue_maxlen = std::stoull(retry_queue_maxlen_opt);
+    } catch (...) {
+      evcollect_seterror(ctx, "invalid value for retry_queue_maxlen");
+      return false;
+    }
+
+    target->setRetryQueueLength(retry_queue_maxlen);
+  }
+
+  {
+    uint64_t backoff = EventQLTarget::kDefaultRetryBackoffMicros;
+    uint64_t backoff_max = EventQLTarget::kDefaultRetryBackoffMaxMicros;
+
+    const char* backoff_opt;
+    if (evcollect_plugin_getcfg(cfg, "retry_backoff_ms", &backoff_opt)) {
+      try {
+        backoff = std::stoull(backoff_opt) * kMicrosPerMilli;
+      } catch (...) {
+        evcollect_seterror(ctx, "invalid value for retry_backoff_ms");
+        return false;
+      }
+    }
+
+    const char* backoff_max_opt;
+    if (evcollect_plugin_getcfg(
+            cfg,
+            "retry_backoff_max_ms",
+            &backoff_max_opt)) {
+      try {
+        backoff_max = std::stoull(backoff_max_opt) * kMicrosPerMilli;
+      } catch (...) {
+        evcollect_seterror(ctx, "invalid value for retry_backoff_max_ms");
+        return false;
+      }
+    }
+
+    target->setRetryBackoff(backoff, backoff_max);
+  }
+
+  {
+    uint64_t threshold = EventQLTarget::kDefaultCircuitBreakerThreshold;
+    uint64_t cooldown = EventQLTarget::kDefaultCircuitBreakerCooldownMicros;
+
+    const char* threshold_opt;
+    if (evcollect_plugin_getcfg(
+            cfg,
+            "circuit_breaker_threshold",
+            &threshold_opt)) {
+      try {
+        threshold = std::stoull(threshold_opt);
+      } catch (...) {
+        evcollect_seterror(ctx, "invalid value for circuit_breaker_threshold");
+        return false;
+      }
+    }
+
+    const char* cooldown_opt;
+    if (evcollect_plugin_getcfg(
+            cfg,
+            "circuit_breaker_cooldown_ms",
+            &cooldown_opt)) {
+      try {
+        cooldown = std::stoull(cooldown_opt) * kMicrosPerMilli;
+      } catch (...) {
+        evcollect_seterror(
+            ctx,
+            "invalid value for circuit_breaker_cooldown_ms");
+        return false;
+      }
+    }
+
+    target->setCircuitBreaker(threshold, cooldown);
+  }
+
+  const char* adaptive_opt;
+  if (evcollect_plugin_getcfg(cfg, "adaptive_batching", &adaptive_opt)) {
+    std::string adaptive(adaptive_opt);
+    if (adaptive != "on" && adaptive != "off") {
+      evcollect_seterror(
+          ctx,
+          "invalid value for adaptive_batching -- must be 'on' or 'off'");
+      return false;
+    }
+
+    uint64_t latency_target = 0;
+    const char* latency_target_opt;
+    if (evcollect_plugin_getcfg(
+            cfg,
+            "latency_target_ms",
+            &latency_target_opt)) {
+      try {
+        latency_target = std::stoull(latency_target_opt) * kMicrosPerMilli;
+      } catch (...) {
+        evcollect_seterror(ctx, "invalid value for latency_target_ms");
+        return false;
+      }
+    }
+
+    target->setAdaptiveBatching(adaptive == "on", latency_target);
+  }
+
+  const char* compression_opt;
+  if (evcollect_plugin_getcfg(cfg, "compression", &compression_opt)) {
+    int compression_level = -1; // Z_DEFAULT_COMPRESSION
+    const char* compression_level_opt;
+    if (evcollect_plugin_getcfg(
+            cfg,
+            "compression_level",
+            &compression_level_opt)) {
+      try {
+        compression_level = std::stoi(compression_level_opt);
+      } catch (...) {
+        evcollect_seterror(ctx, "invalid value for compression_level");
+        return false;
+      }
+    }
+
+    auto rc = target->setCompression(compression_opt, compression_level);
+    if (!rc.isSuccess()) {
+      evcollect_seterror(ctx, rc.getMessage().c_str());
+      return false;
+    }
+  }
+
+  const char* spool_dir_opt;
+  if (evcollect_plugin_getcfg(cfg, "spool_dir", &spool_dir_opt)) {
+    uint64_t segment_size = UploadSpool::kDefaultSegmentSize;
+    const char* segment_size_opt;
+    if (evcollect_plugin_getcfg(
+            cfg,
+            "spool_segment_size",
+            &segment_size_opt)) {
+      try {
+        segment_size = std::stoull(segment_size_opt);
+      } catch (...) {
+        evcollect_seterror(ctx, "invalid value for spool_segment_size");
+        return false;
+      }
+    }
+
+    uint64_t sync_interval = UploadSpool::kDefaultSyncIntervalMicros;
+    const char* sync_interval_opt;
+    if (evcollect_plugin_getcfg(
+            cfg,
+            "spool_sync_interval_ms",
+            &sync_interval_opt)) {
+      try {
+        sync_interval = std::stoull(sync_interval_opt) * kMicrosPerMilli;
+      } catch (...) {
+        evcollect_seterror(ctx, "invalid value for spool_sync_interval_ms");
+        return false;
+      }
+    }
+
+    /* every shard needs its own spool */
+    std::string spool_dir(spool_dir_opt);
+    if (!spool_subdir.empty()) {
+      if (mkdir(spool_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        evcollect_seterror(ctx, "can't create spool_dir");
+        return false;
+      }
+
+      spool_dir += "/" + spool_subdir;
+    }
+
+    auto rc = target->setSpool(spool_dir, segment_size, sync_interval);
+    if (!rc.isSuccess()) {
+      evcollect_seterror(ctx, rc.getMessage().c_str());
+      return false;
+    }
+  }
+
+  for (int i = 0; ; ++i) {
+    std::vector<std::string> route;
+    for (int j = 0; ; ++j) {
+      const char* arg;
+      if (evcollect_plugin_getcfgv(cfg, "route", i, j, &arg)) {
+        route.emplace_back(arg);
+      } else {
+        break;
+      }
+    }
+
+    if (route.empty()) {
+      break;
+    }
+
+    if (route.size() != 2) {
+      evcollect_seterror(
+          ctx,
+          "invalid number of arguments to route. " \
+          "format is: route <event> <target>");
+      return false;
+    }
+
+    auto rc = target->addRoute(route[0], route[1]);
+    if (!rc.isSuccess()) {
+      evcollect_seterror(ctx, rc.getMessage().c_str());
+      return false;
+    }
+  }
+
+  return true;
+}
+
+} // namespace plugins_eventql
+} // namespace evcollect
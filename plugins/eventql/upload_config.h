@@ -0,0 +1,46 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <string>
+#include <evcollect/evcollect.h>
+#include "eventql_target.h"
+
+namespace evcollect {
+namespace plugin_eventql {
+
+/**
+ * Apply the options shared by all plugins that upload through an
+ * EventQLTarget (batching, retries, compression, spooling, credentials and
+ * routes) from cfg to target. If spool_subdir is given, the target spools
+ * into that subdirectory of spool_dir. Returns false and sets the error on
+ * ctx if an option is invalid
+ */
+bool configureUploadTarget(
+    evcollect_ctx_t* ctx,
+    const evcollect_plugin_cfg_t* cfg,
+    EventQLTarget* target,
+    const std::string& spool_subdir = "");
+
+} // namespace plugins_eventql
+} // namespace evcollect
@@ -0,0 +1,146 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <evcollect/util/stringutil.h>
+#include "upload_metrics.h"
+
+namespace evcollect {
+namespace plugin_eventql {
+
+namespace {
+
+std::atomic<size_t> next_shard(0);
+
+/* shards are assigned round-robin to threads on first use, so with up to
+   kNumShards threads each thread writes to its own shard */
+size_t getThreadShardIndex() {
+  static thread_local size_t shard_idx =
+      next_shard.fetch_add(1, std::memory_order_relaxed) %
+      UploadMetrics::kNumShards;
+
+  return shard_idx;
+}
+
+void histogramToJSON(const LogHistogram& histogram, std::string* json) {
+  auto count = histogram.getCount();
+  *json += StringUtil::format(
+      "{\"count\":$0,\"mean\":$1,\"p50\":$2,\"p90\":$3,\"p99\":$4,\"max\":$5}",
+      count,
+      count ? histogram.getSum() / count : 0,
+      histogram.getPercentile(50),
+      histogram.getPercentile(90),
+      histogram.getPercentile(99),
+      histogram.getMax());
+}
+
+}
+
+UploadMetrics::UploadMetrics() : shards_(new Shard[kNumShards]) {
+  for (size_t i = 0; i < kNumShards; ++i) {
+    for (auto& c : shards_[i].counters) {
+      c.store(0, std::memory_order_relaxed);
+    }
+  }
+}
+
+UploadMetrics::Shard* UploadMetrics::getShard() {
+  return &shards_[getThreadShardIndex()];
+}
+
+void UploadMetrics::increment(Counter counter, uint64_t value /* = 1 */) {
+  getShard()->counters[counter].fetch_add(value, std::memory_order_relaxed);
+}
+
+void UploadMetrics::record(Histogram histogram, uint64_t value) {
+  getShard()->histograms[histogram].record(value);
+}
+
+uint64_t UploadMetrics::getCounter(Counter counter) const {
+  uint64_t value = 0;
+  for (size_t i = 0; i < kNumShards; ++i) {
+    value += shards_[i].counters[counter].load(std::memory_order_relaxed);
+  }
+
+  return value;
+}
+
+void UploadMetrics::getHistogram(
+    Histogram histogram,
+    LogHistogram* merged) const {
+  for (size_t i = 0; i < kNumShards; ++i) {
+    shards_[i].histograms[histogram].mergeInto(merged);
+  }
+}
+
+void UploadMetrics::recordError(const std::string& error_code) {
+  if (error_code == "EINVAL") {
+    increment(ERRORS_EINVAL);
+  } else if (error_code == "EACCESS") {
+    increment(ERRORS_EACCESS);
+  } else {
+    increment(ERRORS_EIO);
+  }
+}
+
+void UploadMetrics::toJSON(size_t queue_depth, std::string* json) const {
+  *json += StringUtil::format(
+      "{\"queue_depth\":$0,\"enqueued\":$1,\"enqueue_blocked\":$2," \
+      "\"spooled\":$3,\"requests\":$4,\"events_sent\":$5,\"retries\":$6," \
+      "\"bytes_uncompressed\":$7,\"bytes_compressed\":$8," \
+      "\"compress_cpu_us\":$9",
+      queue_depth,
+      getCounter(ENQUEUED),
+      getCounter(ENQUEUE_BLOCKED),
+      getCounter(SPOOLED),
+      getCounter(REQUESTS),
+      getCounter(EVENTS_SENT),
+      getCounter(RETRIES),
+      getCounter(BYTES_UNCOMPRESSED),
+      getCounter(BYTES_COMPRESSED),
+      getCounter(COMPRESS_CPU));
+
+  *json += StringUtil::format(
+      ",\"errors\":{\"EINVAL\":$0,\"EACCESS\":$1,\"EIO\":$2}",
+      getCounter(ERRORS_EINVAL),
+      getCounter(ERRORS_EACCESS),
+      getCounter(ERRORS_EIO));
+
+  const std::pair<Histogram, const char*> histograms[] = {
+    { ENQUEUE_WAIT, "enqueue_wait_us" },
+    { REQUEST_LATENCY, "request_latency_us" },
+    { EVENTS_PER_REQUEST, "events_per_request" }
+  };
+
+  for (const auto& h : histograms) {
+    LogHistogram merged;
+    getHistogram(h.first, &merged);
+    *json += StringUtil::format(",\"$0\":", h.second);
+    histogramToJSON(merged, json);
+  }
+
+  *json += "}";
+}
+
+} // namespace plugins_eventql
+} // namespace evcollect
+
@@ -0,0 +1,100 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <atomic>
+#include <memory>
+#include <string>
+#include <evcollect/util/histogram.h>
+
+namespace evcollect {
+namespace plugin_eventql {
+
+/**
+ * Counters and histograms for a single eventql target. Each thread updates
+ * its own shard with relaxed atomic adds, so recording a metric never takes
+ * a lock and never bounces a cache line between the producer threads and
+ * the upload thread. Readers sum up all shards.
+ */
+class UploadMetrics {
+public:
+
+  enum Counter {
+    ENQUEUED,
+    ENQUEUE_BLOCKED,
+    SPOOLED,
+    REQUESTS,
+    EVENTS_SENT,
+    BYTES_UNCOMPRESSED,
+    BYTES_COMPRESSED,
+    COMPRESS_CPU,
+    RETRIES,
+    ERRORS_EINVAL,
+    ERRORS_EACCESS,
+    ERRORS_EIO,
+    kNumCounters
+  };
+
+  enum Histogram {
+    ENQUEUE_WAIT,
+    REQUEST_LATENCY,
+    EVENTS_PER_REQUEST,
+    kNumHistograms
+  };
+
+  static const size_t kNumShards = 8;
+
+  UploadMetrics();
+
+  void increment(Counter counter, uint64_t value = 1);
+  void record(Histogram histogram, uint64_t value);
+
+  uint64_t getCounter(Counter counter) const;
+  void getHistogram(Histogram histogram, LogHistogram* merged) const;
+
+  /**
+   * Count a failed request under its error class (EINVAL, EACCESS or EIO)
+   */
+  void recordError(const std::string& error_code);
+
+  /**
+   * Write all metrics as a JSON object
+   */
+  void toJSON(size_t queue_depth, std::string* json) const;
+
+protected:
+
+  struct Shard {
+    std::atomic<uint64_t> counters[kNumCounters];
+    LogHistogram histograms[kNumHistograms];
+    char padding[64];
+  };
+
+  Shard* getShard();
+
+  std::unique_ptr<Shard[]> shards_;
+};
+
+} // namespace plugins_eventql
+} // namespace evcollect
+
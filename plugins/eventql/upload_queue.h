@@ -0,0 +1,100 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <atomic>
+#include <memory>
+#include <stdint.h>
+
+namespace evcollect {
+namespace plugin_eventql {
+
+/**
+ * A bounded multi-producer, single-consumer ring buffer of move-only values.
+ *
+ * Producers claim a slot with a CAS on the tail and publish the value by
+ * bumping the slot's sequence number, so pushes never take a lock and never
+ * copy. The consumer owns the head and can drain a whole batch of values in
+ * one call (based on D. Vyukov's bounded MPMC queue).
+ *
+ * The capacity is rounded up to a power of two. push() and size() may be
+ * called from any thread, all other methods only from the consumer thread
+ */
+template <typename T>
+class UploadQueue {
+public:
+
+  UploadQueue(size_t capacity);
+
+  UploadQueue(const UploadQueue& other) = delete;
+  UploadQueue& operator=(const UploadQueue& other) = delete;
+
+  /**
+   * Move value into the queue. Returns false (and leaves value untouched) if
+   * the queue is full
+   */
+  bool push(T&& value);
+
+  /**
+   * Move the next value out of the queue. Returns false if the queue is empty
+   */
+  bool pop(T* value);
+
+  /**
+   * Move up to max_values values out of the queue and pass each of them to
+   * fn. Stops after the first value for which fn returns false. Returns the
+   * number of values dequeued
+   */
+  template <typename F>
+  size_t popBatch(size_t max_values, F fn);
+
+  /**
+   * Returns the approximate number of values in the queue
+   */
+  size_t size() const;
+
+  bool empty() const;
+
+  size_t capacity() const;
+
+protected:
+
+  struct Slot {
+    std::atomic<size_t> seq;
+    T value;
+  };
+
+  static size_t roundCapacity(size_t capacity);
+
+  const size_t mask_;
+  std::unique_ptr<Slot[]> slots_;
+  char pad0_[64];
+  std::atomic<size_t> tail_;
+  char pad1_[64];
+  std::atomic<size_t> head_;
+};
+
+} // namespace plugins_eventql
+} // namespace evcollect
+
+#include "upload_queue_impl.h"
@@ -0,0 +1,167 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+/**
+ * Contention benchmark for the upload queue: N producer threads push small
+ * events into the queue while a single consumer drains it in batches, as the
+ * upload thread does. The lock-free ring is compared to a mutex-protected
+ * deque with one notify per push and pop (the previous implementation).
+ *
+ *   $ make upload_queue_bench && ./upload_queue_bench [events_per_producer]
+ */
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <evcollect/util/time.h>
+#include "upload_queue.h"
+
+using namespace evcollect::plugin_eventql;
+
+struct Event {
+  std::string database;
+  std::string table;
+  std::string data;
+};
+
+static const size_t kQueueLength = 8192;
+static const size_t kBatchSize = 1024;
+
+static Event makeEvent() {
+  Event ev;
+  ev.database = "mydb";
+  ev.table = "mytable";
+  ev.data = "{\"value\":123}";
+  return ev;
+}
+
+static uint64_t benchRing(size_t num_producers, size_t num_events) {
+  UploadQueue<Event> queue(kQueueLength);
+  std::vector<Event> batch;
+  batch.reserve(kBatchSize);
+
+  auto t0 = MonotonicClock::now();
+  std::vector<std::thread> producers;
+  for (size_t p = 0; p < num_producers; ++p) {
+    producers.emplace_back([&queue, num_events] () {
+      for (size_t i = 0; i < num_events; ++i) {
+        auto ev = makeEvent();
+        while (!queue.push(std::move(ev))) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+
+  size_t total = num_producers * num_events;
+  for (size_t n = 0; n < total; ) {
+    auto popped = queue.popBatch(kBatchSize, [&batch] (Event&& ev) {
+      batch.emplace_back(std::move(ev));
+      return true;
+    });
+
+    if (popped == 0) {
+      std::this_thread::yield();
+    }
+
+    n += popped;
+    batch.clear();
+  }
+
+  for (auto& t : producers) {
+    t.join();
+  }
+
+  return MonotonicClock::now() - t0;
+}
+
+static uint64_t benchMutex(size_t num_producers, size_t num_events) {
+  std::deque<Event> queue;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<Event> batch;
+  batch.reserve(kBatchSize);
+
+  auto t0 = MonotonicClock::now();
+  std::vector<std::thread> producers;
+  for (size_t p = 0; p < num_producers; ++p) {
+    producers.emplace_back([&queue, &mutex, &cv, num_events] () {
+      for (size_t i = 0; i < num_events; ++i) {
+        auto ev = makeEvent();
+        std::unique_lock<std::mutex> lk(mutex);
+        while (queue.size() >= kQueueLength) {
+          cv.wait(lk);
+        }
+
+        queue.emplace_back(std::move(ev));
+        cv.notify_all();
+      }
+    });
+  }
+
+  size_t total = num_producers * num_events;
+  for (size_t n = 0; n < total; ) {
+    std::unique_lock<std::mutex> lk(mutex);
+    while (queue.empty()) {
+      cv.wait(lk);
+    }
+
+    while (!queue.empty() && batch.size() < kBatchSize) {
+      batch.emplace_back(std::move(queue.front()));
+      queue.pop_front();
+      cv.notify_all();
+      ++n;
+    }
+
+    lk.unlock();
+    batch.clear();
+  }
+
+  for (auto& t : producers) {
+    t.join();
+  }
+
+  return MonotonicClock::now() - t0;
+}
+
+int main(int argc, const char** argv) {
+  size_t num_events = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+
+  printf("producers    ring Mevents/s    mutex Mevents/s\n");
+  for (size_t num_producers : { 1, 2, 4, 8 }) {
+    double total = num_producers * num_events;
+    auto ring = benchRing(num_producers, num_events);
+    auto mutex = benchMutex(num_producers, num_events);
+    printf(
+        "%9zu    %15.2f    %15.2f\n",
+        num_producers,
+        total / ring,
+        total / mutex);
+  }
+
+  return 0;
+}
@@ -0,0 +1,135 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+
+namespace evcollect {
+namespace plugin_eventql {
+
+template <typename T>
+size_t UploadQueue<T>::roundCapacity(size_t capacity) {
+  size_t rounded = 2;
+  while (rounded < capacity) {
+    rounded <<= 1;
+  }
+
+  return rounded;
+}
+
+template <typename T>
+UploadQueue<T>::UploadQueue(
+    size_t capacity) :
+    mask_(roundCapacity(capacity) - 1),
+    slots_(new Slot[mask_ + 1]),
+    tail_(0),
+    head_(0) {
+  for (size_t i = 0; i <= mask_; ++i) {
+    slots_[i].seq.store(i, std::memory_order_relaxed);
+  }
+}
+
+template <typename T>
+bool UploadQueue<T>::push(T&& value) {
+  auto pos = tail_.load(std::memory_order_relaxed);
+  Slot* slot;
+  while (true) {
+    slot = &slots_[pos & mask_];
+    auto seq = slot->seq.load(std::memory_order_acquire);
+    auto diff = intptr_t(seq) - intptr_t(pos);
+    if (diff == 0) {
+      if (tail_.compare_exchange_weak(
+              pos,
+              pos + 1,
+              std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = tail_.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->value = std::move(value);
+  slot->seq.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+template <typename T>
+bool UploadQueue<T>::pop(T* value) {
+  auto pos = head_.load(std::memory_order_relaxed);
+  auto& slot = slots_[pos & mask_];
+  if (slot.seq.load(std::memory_order_acquire) != pos + 1) {
+    return false;
+  }
+
+  *value = std::move(slot.value);
+  slot.seq.store(pos + mask_ + 1, std::memory_order_release);
+  head_.store(pos + 1, std::memory_order_relaxed);
+  return true;
+}
+
+template <typename T>
+template <typename F>
+size_t UploadQueue<T>::popBatch(size_t max_values, F fn) {
+  auto pos = head_.load(std::memory_order_relaxed);
+  size_t n = 0;
+  while (n < max_values) {
+    auto& slot = slots_[(pos + n) & mask_];
+    if (slot.seq.load(std::memory_order_acquire) != pos + n + 1) {
+      break;
+    }
+
+    bool more = fn(std::move(slot.value));
+    slot.seq.store(pos + n + mask_ + 1, std::memory_order_release);
+    ++n;
+
+    if (!more) {
+      break;
+    }
+  }
+
+  head_.store(pos + n, std::memory_order_relaxed);
+  return n;
+}
+
+template <typename T>
+size_t UploadQueue<T>::size() const {
+  auto head = head_.load(std::memory_order_relaxed);
+  auto tail = tail_.load(std::memory_order_relaxed);
+  return tail > head ? tail - head : 0;
+}
+
+template <typename T>
+bool UploadQueue<T>::empty() const {
+  auto pos = head_.load(std::memory_order_relaxed);
+  return slots_[pos & mask_].seq.load(std::memory_order_acquire) != pos + 1;
+}
+
+template <typename T>
+size_t UploadQueue<T>::capacity() const {
+  return mask_ + 1;
+}
+
+} // namespace plugins_eventql
+} // namespace evcollect
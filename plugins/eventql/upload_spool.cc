@@ -0,0 +1,640 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <evcollect/evcollect.h>
+#include <evcollect/util/stringutil.h>
+#include "upload_spool.h"
+
+namespace evcollect {
+namespace plugin_eventql {
+
+namespace {
+
+const char kSegmentMagic[] = "EVQLSP01";
+
+uint32_t crc32(const char* data, size_t size) {
+  static uint32_t table[256];
+  static std::once_flag table_init;
+  std::call_once(table_init, [] () {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      }
+      table[i] = c;
+    }
+  });
+
+  uint32_t crc = 0xffffffff;
+  for (size_t i = 0; i < size; ++i) {
+    crc = table[(crc ^ (uint8_t) data[i]) & 0xff] ^ (crc >> 8);
+  }
+
+  return crc ^ 0xffffffff;
+}
+
+bool writeAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    auto rc = ::write(fd, data, size);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return false;
+    }
+
+    data += rc;
+    size -= rc;
+  }
+
+  return true;
+}
+
+}
+
+UploadSpool::UploadSpool(
+    const std::string& spool_dir) :
+    name_("upload"),
+    spool_dir_(spool_dir),
+    segment_size_(kDefaultSegmentSize),
+    sync_interval_(kDefaultSyncIntervalMicros),
+    empty_(true),
+    lock_fd_(-1),
+    cursor_fd_(-1),
+    next_cursor_(1),
+    write_fd_(-1),
+    write_seq_(0),
+    write_offset_(0),
+    write_dirty_(false),
+    last_sync_(0),
+    read_offset_(0),
+    read_fd_(-1),
+    read_map_(nullptr),
+    read_map_size_(0) {}
+
+UploadSpool::~UploadSpool() {
+  sync(true);
+  unmapReadSegment();
+
+  if (write_fd_ >= 0) {
+    close(write_fd_);
+  }
+
+  if (cursor_fd_ >= 0) {
+    close(cursor_fd_);
+  }
+
+  if (lock_fd_ >= 0) {
+    flock(lock_fd_, LOCK_UN);
+    close(lock_fd_);
+  }
+}
+
+void UploadSpool::setName(const std::string& name) {
+  name_ = name;
+}
+
+void UploadSpool::setSegmentSize(uint64_t bytes) {
+  segment_size_ = bytes;
+}
+
+void UploadSpool::setSyncInterval(uint64_t usecs) {
+  sync_interval_ = usecs;
+}
+
+std::string UploadSpool::getSegmentPath(uint64_t seq) const {
+  return StringUtil::format("$0/$1.spool", spool_dir_, seq);
+}
+
+ReturnCode UploadSpool::open() {
+  std::unique_lock<std::mutex> lk(mutex_);
+
+  if (mkdir(spool_dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+    return ReturnCode::error(
+        "EIO",
+        "mkdir('%s') failed: %s",
+        spool_dir_.c_str(),
+        strerror(errno));
+  }
+
+  auto lock_path = spool_dir_ + "/lock";
+  lock_fd_ = ::open(lock_path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (lock_fd_ < 0) {
+    return ReturnCode::error(
+        "EIO",
+        "open('%s') failed: %s",
+        lock_path.c_str(),
+        strerror(errno));
+  }
+
+  if (flock(lock_fd_, LOCK_EX | LOCK_NB) != 0) {
+    return ReturnCode::error(
+        "EIO",
+        "spool directory '%s' is locked by another process or output",
+        spool_dir_.c_str());
+  }
+
+  /* the cursor file stores <seq:u64><offset:u64> of the next record to read */
+  uint64_t cursor[2] = { 0, 0 };
+  auto cursor_path = spool_dir_ + "/cursor";
+  cursor_fd_ = ::open(cursor_path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (cursor_fd_ < 0) {
+    return ReturnCode::error(
+        "EIO",
+        "open('%s') failed: %s",
+        cursor_path.c_str(),
+        strerror(errno));
+  }
+
+  if (pread(cursor_fd_, cursor, sizeof(cursor), 0) != sizeof(cursor)) {
+    cursor[0] = 0;
+    cursor[1] = 0;
+  }
+
+  std::vector<uint64_t> seqs;
+  auto dir = opendir(spool_dir_.c_str());
+  if (!dir) {
+    return ReturnCode::error(
+        "EIO",
+        "opendir('%s') failed: %s",
+        spool_dir_.c_str(),
+        strerror(errno));
+  }
+
+  for (struct dirent* de; (de = readdir(dir)) != nullptr; ) {
+    std::string name(de->d_name);
+    if (!StringUtil::endsWith(name, ".spool")) {
+      continue;
+    }
+
+    auto seq_str = name.substr(0, name.size() - 6);
+    if (!StringUtil::isDigitString(seq_str)) {
+      continue;
+    }
+
+    seqs.emplace_back(std::stoull(seq_str));
+  }
+
+  closedir(dir);
+  std::sort(seqs.begin(), seqs.end());
+
+  /* segments before the cursor have been fully replayed already */
+  write_seq_ = cursor[0];
+  for (auto seq : seqs) {
+    write_seq_ = std::max(write_seq_, seq);
+    if (seq < cursor[0]) {
+      unlink(getSegmentPath(seq).c_str());
+      continue;
+    }
+
+    Segment segment;
+    segment.seq = seq;
+    segment.path = getSegmentPath(seq);
+    segments_.emplace_back(segment);
+  }
+
+  if (!segments_.empty() && segments_.front().seq == cursor[0]) {
+    read_offset_ = cursor[1];
+  } else {
+    read_offset_ = 0;
+  }
+
+  /* all existing segments are sealed, appends go to a new segment */
+  uint64_t pending_bytes = 0;
+  for (const auto& segment : segments_) {
+    struct stat st;
+    if (stat(segment.path.c_str(), &st) == 0) {
+      pending_bytes += st.st_size;
+    }
+  }
+
+  if (!segments_.empty()) {
+    pending_bytes -= std::min(pending_bytes, read_offset_);
+  }
+
+  empty_ = pending_bytes <= kSegmentHeaderSize * segments_.size();
+  last_sync_ = MonotonicClock::now();
+
+  if (!empty_) {
+    auto msg = StringUtil::format(
+        "$0 spool: replaying $1 bytes in $2 segments from $3",
+        name_,
+        pending_bytes,
+        segments_.size(),
+        spool_dir_);
+
+    evcollect_log(EVCOLLECT_LOG_INFO, msg.c_str());
+  }
+
+  return ReturnCode::success();
+}
+
+ReturnCode UploadSpool::openWriteSegment() {
+  Segment segment;
+  segment.seq = ++write_seq_;
+  segment.path = getSegmentPath(segment.seq);
+
+  write_fd_ = ::open(
+      segment.path.c_str(),
+      O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+      0644);
+
+  if (write_fd_ < 0) {
+    return ReturnCode::error(
+        "EIO",
+        "open('%s') failed: %s",
+        segment.path.c_str(),
+        strerror(errno));
+  }
+
+  write_buf_.assign(kSegmentMagic, kSegmentHeaderSize);
+  write_offset_ = kSegmentHeaderSize;
+  segments_.emplace_back(segment);
+  return ReturnCode::success();
+}
+
+ReturnCode UploadSpool::closeWriteSegment() {
+  auto rc = flushWriteBuffer();
+  if (write_dirty_ && fdatasync(write_fd_) != 0) {
+    rc = ReturnCode::error("EIO", "fdatasync() failed: %s", strerror(errno));
+  }
+
+  close(write_fd_);
+  write_fd_ = -1;
+  write_dirty_ = false;
+  return rc;
+}
+
+ReturnCode UploadSpool::flushWriteBuffer() {
+  if (write_buf_.empty()) {
+    return ReturnCode::success();
+  }
+
+  if (!writeAll(write_fd_, write_buf_.data(), write_buf_.size())) {
+    return ReturnCode::error(
+        "EIO",
+        "write('%s') failed: %s",
+        segments_.back().path.c_str(),
+        strerror(errno));
+  }
+
+  write_buf_.clear();
+  return ReturnCode::success();
+}
+
+ReturnCode UploadSpool::append(
+    const char* data,
+    size_t size,
+    bool* was_empty) {
+  if (size > kMaxRecordSize) {
+    return ReturnCode::error("EINVAL", "record too large for spool");
+  }
+
+  std::unique_lock<std::mutex> lk(mutex_);
+
+  if (write_fd_ < 0) {
+    auto rc = openWriteSegment();
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  uint32_t hdr[2];
+  hdr[0] = size;
+  hdr[1] = crc32(data, size);
+  write_buf_.append((const char*) hdr, sizeof(hdr));
+  write_buf_.append(data, size);
+  write_offset_ += kRecordHeaderSize + size;
+  write_dirty_ = true;
+
+  auto rc = ReturnCode::success();
+  if (write_buf_.size() >= kWriteBufferSize) {
+    rc = flushWriteBuffer();
+  }
+
+  if (rc.isSuccess() && write_offset_ >= segment_size_) {
+    rc = closeWriteSegment();
+  }
+
+  bool empty = empty_.exchange(false);
+  if (was_empty) {
+    *was_empty = empty;
+  }
+
+  return rc;
+}
+
+ReturnCode UploadSpool::sync(bool force) {
+  std::unique_lock<std::mutex> lk(mutex_);
+
+  if (!write_dirty_ || write_fd_ < 0) {
+    return ReturnCode::success();
+  }
+
+  auto now = MonotonicClock::now();
+  if (!force && now - last_sync_ < sync_interval_) {
+    return ReturnCode::success();
+  }
+
+  auto rc = flushWriteBuffer();
+  if (!rc.isSuccess()) {
+    return rc;
+  }
+
+  write_dirty_ = false;
+  last_sync_ = now;
+
+  /* fsync without holding the lock so that appends are not blocked */
+  int fd = dup(write_fd_);
+  lk.unlock();
+
+  if (fd < 0) {
+    return ReturnCode::error("EIO", "dup() failed: %s", strerror(errno));
+  }
+
+  rc = ReturnCode::success();
+  if (fdatasync(fd) != 0) {
+    rc = ReturnCode::error("EIO", "fdatasync() failed: %s", strerror(errno));
+  }
+
+  close(fd);
+  return rc;
+}
+
+bool UploadSpool::empty() const {
+  return empty_;
+}
+
+bool UploadSpool::mapReadSegment() {
+  const auto& segment = segments_.front();
+
+  if (read_fd_ < 0) {
+    read_fd_ = ::open(segment.path.c_str(), O_RDONLY);
+    if (read_fd_ < 0) {
+      return false;
+    }
+  }
+
+  struct stat st;
+  if (fstat(read_fd_, &st) != 0) {
+    return false;
+  }
+
+  /* the segment that is currently being written to may have grown */
+  if (read_map_ && read_map_size_ == (uint64_t) st.st_size) {
+    return true;
+  }
+
+  if (read_map_) {
+    munmap((void*) read_map_, read_map_size_);
+    read_map_ = nullptr;
+    read_map_size_ = 0;
+  }
+
+  if (st.st_size == 0) {
+    return true;
+  }
+
+  auto map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, read_fd_, 0);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  read_map_ = (const char*) map;
+  read_map_size_ = st.st_size;
+  return true;
+}
+
+void UploadSpool::unmapReadSegment() {
+  if (read_map_) {
+    munmap((void*) read_map_, read_map_size_);
+  }
+
+  if (read_fd_ >= 0) {
+    close(read_fd_);
+  }
+
+  read_fd_ = -1;
+  read_map_ = nullptr;
+  read_map_size_ = 0;
+}
+
+/**
+ * Move the front segment to the read segments. It is deleted once all records
+ * read from it are committed
+ */
+void UploadSpool::dropReadSegment() {
+  unmapReadSegment();
+  read_segments_.emplace_back(segments_.front());
+  segments_.pop_front();
+  read_offset_ = 0;
+}
+
+/**
+ * Delete the read segments that no uncommitted record was read from and
+ * persist the replay position
+ */
+void UploadSpool::releaseSegments() {
+  while (!read_segments_.empty() &&
+         (pending_reads_.empty() ||
+          read_segments_.front().seq < pending_reads_.front().begin_seq)) {
+    unlink(read_segments_.front().path.c_str());
+    read_segments_.pop_front();
+  }
+
+  writeCursor();
+}
+
+/**
+ * The replay position is the start of the oldest read that is not fully
+ * committed yet, or the read position if all reads are committed
+ */
+void UploadSpool::writeCursor() {
+  uint64_t cursor[2];
+  if (!pending_reads_.empty()) {
+    cursor[0] = pending_reads_.front().begin_seq;
+    cursor[1] = pending_reads_.front().begin_offset;
+  } else {
+    cursor[0] = segments_.empty() ? write_seq_ + 1 : segments_.front().seq;
+    cursor[1] = read_offset_;
+  }
+
+  if (pwrite(cursor_fd_, cursor, sizeof(cursor), 0) != sizeof(cursor)) {
+    auto msg = StringUtil::format("$0 spool: writing cursor failed", name_);
+    evcollect_log(EVCOLLECT_LOG_WARNING, msg.c_str());
+  }
+}
+
+size_t UploadSpool::read(
+    size_t max_records,
+    size_t max_bytes,
+    ReadCallback fn,
+    Cursor* cursor) {
+  std::unique_lock<std::mutex> lk(mutex_);
+
+  *cursor = 0;
+  if (write_fd_ >= 0 && !flushWriteBuffer().isSuccess()) {
+    return 0;
+  }
+
+  PendingRead pending;
+  pending.begin_seq = segments_.empty() ? 0 : segments_.front().seq;
+  pending.begin_offset = read_offset_;
+
+  size_t nrecords = 0;
+  size_t nbytes = 0;
+  while (!segments_.empty() && nrecords < max_records && nbytes < max_bytes) {
+    bool is_active = write_fd_ >= 0 && segments_.size() == 1;
+
+    if (!mapReadSegment()) {
+      auto msg = StringUtil::format(
+          "$0 spool: can't read segment $1, skipping",
+          name_,
+          segments_.front().path);
+
+      evcollect_log(EVCOLLECT_LOG_ERROR, msg.c_str());
+      if (is_active) {
+        closeWriteSegment();
+      }
+
+      dropReadSegment();
+      continue;
+    }
+
+    bool corrupt = false;
+    if (read_map_size_ < kSegmentHeaderSize ||
+        memcmp(read_map_, kSegmentMagic, kSegmentHeaderSize) != 0) {
+      corrupt = !is_active;
+    }
+
+    uint64_t pos = std::max(read_offset_, (uint64_t) kSegmentHeaderSize);
+    while (!corrupt &&
+           pos + kRecordHeaderSize <= read_map_size_ &&
+           nrecords < max_records &&
+           nbytes < max_bytes) {
+      uint32_t hdr[2];
+      memcpy(hdr, read_map_ + pos, sizeof(hdr));
+      if (pos + kRecordHeaderSize + hdr[0] > read_map_size_) {
+        break;
+      }
+
+      auto data = read_map_ + pos + kRecordHeaderSize;
+      if (crc32(data, hdr[0]) != hdr[1]) {
+        corrupt = true;
+        break;
+      }
+
+      fn(data, hdr[0]);
+      pos += kRecordHeaderSize + hdr[0];
+      nbytes += hdr[0];
+      ++nrecords;
+    }
+
+    read_offset_ = pos;
+
+    if (corrupt) {
+      auto msg = StringUtil::format(
+          "$0 spool: corrupt record in $1 at offset $2, skipping " \
+          "rest of segment",
+          name_,
+          segments_.front().path,
+          pos);
+
+      evcollect_log(EVCOLLECT_LOG_ERROR, msg.c_str());
+    }
+
+    /* caught up with the writer: discard the segment so that it can be
+       deleted. the next append opens a new one */
+    if (is_active) {
+      if (pos >= write_offset_ || corrupt) {
+        closeWriteSegment();
+        dropReadSegment();
+      }
+
+      break;
+    }
+
+    /* a sealed segment is done once we reach its end (or a torn record at
+       its tail) without hitting the read limits */
+    bool at_end =
+        corrupt ||
+        pos + kRecordHeaderSize > read_map_size_ ||
+        pos + kRecordHeaderSize + ((const uint32_t*) (read_map_ + pos))[0] >
+            read_map_size_;
+
+    if (!at_end) {
+      break;
+    }
+
+    dropReadSegment();
+  }
+
+  empty_ = segments_.empty();
+
+  if (nrecords > 0) {
+    pending.cursor = next_cursor_++;
+    pending.outstanding = nrecords;
+    pending_reads_.emplace_back(pending);
+    *cursor = pending.cursor;
+  } else if (pending_reads_.empty()) {
+    releaseSegments();
+  }
+
+  return nrecords;
+}
+
+void UploadSpool::commit(Cursor cursor, size_t nrecords) {
+  std::unique_lock<std::mutex> lk(mutex_);
+
+  for (auto& pending : pending_reads_) {
+    if (pending.cursor == cursor) {
+      pending.outstanding -= std::min(pending.outstanding, nrecords);
+      break;
+    }
+  }
+
+  if (pending_reads_.empty() || pending_reads_.front().outstanding > 0) {
+    return;
+  }
+
+  while (!pending_reads_.empty() && pending_reads_.front().outstanding == 0) {
+    pending_reads_.pop_front();
+  }
+
+  releaseSegments();
+}
+
+} // namespace plugins_eventql
+} // namespace evcollect
@@ -0,0 +1,176 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <evcollect/util/time.h>
+#include <evcollect/util/return_code.h>
+
+namespace evcollect {
+namespace plugin_eventql {
+
+/**
+ * A segmented, append-only on-disk queue of opaque records. Records are
+ * appended to the newest segment and replayed (via mmap) from the oldest one.
+ *
+ * Records returned by read() stay in the spool until they are committed with
+ * commit(). The replay position that is persisted in the cursor file only
+ * moves past a record once it and all records before it are committed, and
+ * segments are only deleted once all of their records are committed. So a
+ * restarted process replays every record that was not committed, some of
+ * them possibly for a second time.
+ *
+ * Each record is framed as <len:u32><crc32:u32><payload>. Appends are buffered
+ * in memory and fsynced in groups (at most once per sync interval) by calling
+ * sync() periodically. A torn or corrupt record at the tail of a segment (e.g.
+ * after a crash) ends the replay of that segment.
+ *
+ * All methods are thread safe
+ */
+class UploadSpool {
+public:
+
+  static const uint64_t kDefaultSegmentSize = 64 * 1024 * 1024;
+  static const uint64_t kDefaultSyncIntervalMicros = 100 * kMicrosPerMilli;
+  static const size_t kWriteBufferSize = 64 * 1024;
+  static const size_t kMaxRecordSize = 256 * 1024 * 1024;
+
+  using ReadCallback = std::function<void (const char* data, size_t size)>;
+
+  /**
+   * Identifies the records returned by a single call to read(). 0 means no
+   * records
+   */
+  using Cursor = uint64_t;
+
+  UploadSpool(const std::string& spool_dir);
+  ~UploadSpool();
+
+  UploadSpool(const UploadSpool& other) = delete;
+  UploadSpool& operator=(const UploadSpool& other) = delete;
+
+  /**
+   * Name of the owning output, used as the prefix of log messages
+   */
+  void setName(const std::string& name);
+  void setSegmentSize(uint64_t bytes);
+  void setSyncInterval(uint64_t usecs);
+
+  /**
+   * Lock the spool directory and pick up existing segments
+   */
+  ReturnCode open();
+
+  /**
+   * Append a record. Returns true in *was_empty if the spool was empty before
+   * the record was appended
+   */
+  ReturnCode append(const char* data, size_t size, bool* was_empty = nullptr);
+
+  /**
+   * Read up to max_records records (or max_bytes payload bytes, but at least
+   * one record) and call fn for each of them. Returns the number of records
+   * read. The records must be committed with the cursor returned in *cursor
+   */
+  size_t read(
+      size_t max_records,
+      size_t max_bytes,
+      ReadCallback fn,
+      Cursor* cursor);
+
+  /**
+   * Mark nrecords of the records returned by the read() call that returned
+   * cursor as done (i.e. delivered or dropped for good). Persists the new
+   * replay position and deletes segments once all records up to them are
+   * committed
+   */
+  void commit(Cursor cursor, size_t nrecords);
+
+  /**
+   * Write out buffered records and fsync the current segment if there are
+   * unsynced records and the sync interval has passed (or force is true)
+   */
+  ReturnCode sync(bool force = false);
+
+  /**
+   * Returns true if there are no records to replay
+   */
+  bool empty() const;
+
+protected:
+
+  struct Segment {
+    uint64_t seq;
+    std::string path;
+  };
+
+  struct PendingRead {
+    Cursor cursor;
+    uint64_t begin_seq;
+    uint64_t begin_offset;
+    size_t outstanding;
+  };
+
+  static const size_t kSegmentHeaderSize = 8;
+  static const size_t kRecordHeaderSize = 8;
+
+  std::string getSegmentPath(uint64_t seq) const;
+  ReturnCode openWriteSegment();
+  ReturnCode closeWriteSegment();
+  ReturnCode flushWriteBuffer();
+  bool mapReadSegment();
+  void unmapReadSegment();
+  void dropReadSegment();
+  void releaseSegments();
+  void writeCursor();
+
+  std::string name_;
+  std::string spool_dir_;
+  uint64_t segment_size_;
+  uint64_t sync_interval_;
+  mutable std::mutex mutex_;
+  std::atomic<bool> empty_;
+  int lock_fd_;
+  int cursor_fd_;
+  std::deque<Segment> segments_;
+  std::deque<Segment> read_segments_;
+  std::deque<PendingRead> pending_reads_;
+  Cursor next_cursor_;
+  int write_fd_;
+  uint64_t write_seq_;
+  uint64_t write_offset_;
+  std::string write_buf_;
+  bool write_dirty_;
+  uint64_t last_sync_;
+  uint64_t read_offset_;
+  int read_fd_;
+  const char* read_map_;
+  uint64_t read_map_size_;
+};
+
+} // namespace plugins_eventql
+} // namespace evcollect
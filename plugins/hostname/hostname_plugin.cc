@@ -21,33 +21,29 @@
  * commercial activities involving this program without disclosing the source
  * code of your own applications
  */
-#include <netdb.h>
-#include <unistd.h>
-#include <string.h>
-#include <util/stringutil.h>
+#include <evcollect/util/stringutil.h>
 #include <evcollect/evcollect.h>
 
 namespace evcollect {
 namespace plugin_hostname {
 
+/**
+ * Emits the hostname and the FQDN of this host, as cached by the daemon
+ */
 int getEvent(
     evcollect_ctx_t* ctx,
-    void* userdata,
+    void* /* userdata */,
     evcollect_event_t* ev) {
-  std::string hostname;
-  std::string hostname_fqdn;
-
-  hostname.resize(1024);
-  if (gethostname(&hostname[0], hostname.size()) == -1) {
-    evcollect_seterror(ctx, "gethostname() failed");
+  char hostname[1024];
+  char hostname_fqdn[1024];
+  if (!evcollect_host_getname(
+          ctx,
+          hostname,
+          sizeof(hostname),
+          hostname_fqdn,
+          sizeof(hostname_fqdn))) {
+    evcollect_seterror(ctx, "no host metadata available");
     return false;
-  } else {
-    hostname.resize(strlen(hostname.data()));
-  }
-
-  struct hostent* h = gethostbyname(hostname.c_str());
-  if (h) {
-    hostname_fqdn = std::string(h->h_name);
   }
 
   auto evdata = StringUtil::format(
@@ -75,4 +71,3 @@ EVCOLLECT_PLUGIN_INIT(hostname) {
 
   return true;
 }
-
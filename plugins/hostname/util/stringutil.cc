@@ -1 +0,0 @@
-../../../src/evcollect/util/stringutil.cc
\ No newline at end of file
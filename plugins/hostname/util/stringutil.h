@@ -1 +0,0 @@
-../../../src/evcollect/util/stringutil.h
\ No newline at end of file
@@ -1 +0,0 @@
-../../../src/evcollect/util/stringutil_impl.h
\ No newline at end of file
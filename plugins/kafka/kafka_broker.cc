@@ -0,0 +1,312 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <evcollect/util/time.h>
+#include "kafka_broker.h"
+#include "kafka_protocol.h"
+
+namespace evcollect {
+namespace plugin_kafka {
+
+/* guard against allocating huge buffers for a corrupt size prefix */
+static const size_t kMaxResponseSize = 64 * 1024 * 1024;
+
+KafkaBrokerConnection::KafkaBrokerConnection(
+    const std::string& host,
+    uint16_t port) :
+    host_(host),
+    port_(port),
+    fd_(-1) {}
+
+KafkaBrokerConnection::~KafkaBrokerConnection() {
+  close();
+}
+
+ReturnCode KafkaBrokerConnection::connect(uint64_t deadline) {
+  close();
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo* addrs = nullptr;
+  auto port = std::to_string(port_);
+  int gai_rc = getaddrinfo(host_.c_str(), port.c_str(), &hints, &addrs);
+  if (gai_rc != 0) {
+    return ReturnCode::error(
+        "EIO",
+        "getaddrinfo(%s) failed: %s",
+        host_.c_str(),
+        gai_strerror(gai_rc));
+  }
+
+  auto rc = ReturnCode::error("EIO", "no addresses for %s", host_.c_str());
+  for (auto addr = addrs; addr; addr = addr->ai_next) {
+    fd_ = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd_ < 0) {
+      rc = ReturnCode::error("EIO", "socket() failed: %s", strerror(errno));
+      continue;
+    }
+
+    fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+    fcntl(fd_, F_SETFD, FD_CLOEXEC);
+    int one = 1;
+    setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (::connect(fd_, addr->ai_addr, addr->ai_addrlen) == 0) {
+      rc = ReturnCode::success();
+      break;
+    }
+
+    if (errno == EINPROGRESS) {
+      rc = waitFor(POLLOUT, deadline);
+      if (rc.isSuccess()) {
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &errlen);
+        if (err == 0) {
+          break;
+        }
+
+        rc = ReturnCode::error(
+            "EIO",
+            "connect() to %s:%i failed: %s",
+            host_.c_str(),
+            port_,
+            strerror(err));
+      }
+    } else {
+      rc = ReturnCode::error(
+          "EIO",
+          "connect() to %s:%i failed: %s",
+          host_.c_str(),
+          port_,
+          strerror(errno));
+    }
+
+    ::close(fd_);
+    fd_ = -1;
+  }
+
+  freeaddrinfo(addrs);
+  return rc;
+}
+
+void KafkaBrokerConnection::close() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool KafkaBrokerConnection::isConnected() const {
+  return fd_ >= 0;
+}
+
+ReturnCode KafkaBrokerConnection::sendRequest(
+    const std::string& request,
+    uint64_t deadline) {
+  if (fd_ < 0) {
+    auto rc = connect(deadline);
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  size_t pos = 0;
+  while (pos < request.size()) {
+    auto n = ::send(
+        fd_,
+        request.data() + pos,
+        request.size() - pos,
+        MSG_NOSIGNAL);
+
+    if (n > 0) {
+      pos += n;
+      continue;
+    }
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      auto rc = waitFor(POLLOUT, deadline);
+      if (!rc.isSuccess()) {
+        close();
+        return rc;
+      }
+
+      continue;
+    }
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    auto rc = ReturnCode::error(
+        "EIO",
+        "send() to %s:%i failed: %s",
+        host_.c_str(),
+        port_,
+        strerror(errno));
+
+    close();
+    return rc;
+  }
+
+  return ReturnCode::success();
+}
+
+ReturnCode KafkaBrokerConnection::readResponse(
+    int32_t correlation_id,
+    std::string* response,
+    uint64_t deadline) {
+  if (fd_ < 0) {
+    return ReturnCode::error("EIO", "not connected");
+  }
+
+  char header[8];
+  auto rc = readFully(header, sizeof(header), deadline);
+  if (!rc.isSuccess()) {
+    close();
+    return rc;
+  }
+
+  int32_t size;
+  int32_t response_correlation_id;
+  KafkaReader reader(header, sizeof(header));
+  reader.readInt32(&size);
+  reader.readInt32(&response_correlation_id);
+
+  if (size < 4 || size_t(size) > kMaxResponseSize) {
+    close();
+    return ReturnCode::error("EIO", "invalid response size: %i", size);
+  }
+
+  if (response_correlation_id != correlation_id) {
+    close();
+    return ReturnCode::error(
+        "EIO",
+        "correlation id mismatch: expected %i, got %i",
+        correlation_id,
+        response_correlation_id);
+  }
+
+  response->resize(size - 4);
+  rc = readFully(&(*response)[0], response->size(), deadline);
+  if (!rc.isSuccess()) {
+    close();
+    return rc;
+  }
+
+  return ReturnCode::success();
+}
+
+ReturnCode KafkaBrokerConnection::readFully(
+    char* data,
+    size_t size,
+    uint64_t deadline) {
+  size_t pos = 0;
+  while (pos < size) {
+    auto n = ::recv(fd_, data + pos, size - pos, 0);
+    if (n > 0) {
+      pos += n;
+      continue;
+    }
+
+    if (n == 0) {
+      return ReturnCode::error(
+          "EIO",
+          "connection to %s:%i closed by broker",
+          host_.c_str(),
+          port_);
+    }
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      auto rc = waitFor(POLLIN, deadline);
+      if (!rc.isSuccess()) {
+        return rc;
+      }
+
+      continue;
+    }
+
+    if (errno != EINTR) {
+      return ReturnCode::error(
+          "EIO",
+          "recv() from %s:%i failed: %s",
+          host_.c_str(),
+          port_,
+          strerror(errno));
+    }
+  }
+
+  return ReturnCode::success();
+}
+
+ReturnCode KafkaBrokerConnection::waitFor(short events, uint64_t deadline) {
+  for (;;) {
+    auto now = MonotonicClock::now();
+    if (now >= deadline) {
+      return ReturnCode::error(
+          "EIO",
+          "timeout while talking to %s:%i",
+          host_.c_str(),
+          port_);
+    }
+
+    struct pollfd p;
+    p.fd = fd_;
+    p.events = events;
+    p.revents = 0;
+
+    int timeout_ms = (deadline - now + kMicrosPerMilli - 1) / kMicrosPerMilli;
+    int rc = poll(&p, 1, timeout_ms);
+    if (rc > 0) {
+      return ReturnCode::success();
+    }
+
+    if (rc < 0 && errno != EINTR) {
+      return ReturnCode::error("EIO", "poll() failed: %s", strerror(errno));
+    }
+  }
+}
+
+const std::string& KafkaBrokerConnection::getHost() const {
+  return host_;
+}
+
+uint16_t KafkaBrokerConnection::getPort() const {
+  return port_;
+}
+
+} // namespace plugins_kafka
+} // namespace evcollect
+
@@ -0,0 +1,80 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <evcollect/util/return_code.h>
+
+namespace evcollect {
+namespace plugin_kafka {
+
+/**
+ * A blocking connection to a single broker. Requests on a connection are
+ * answered in order, so the caller may send several requests before reading
+ * the responses. All calls take an absolute deadline (MonotonicClock)
+ */
+class KafkaBrokerConnection {
+public:
+
+  KafkaBrokerConnection(const std::string& host, uint16_t port);
+  ~KafkaBrokerConnection();
+
+  KafkaBrokerConnection(const KafkaBrokerConnection& other) = delete;
+  KafkaBrokerConnection& operator=(const KafkaBrokerConnection& o) = delete;
+
+  ReturnCode connect(uint64_t deadline);
+  void close();
+  bool isConnected() const;
+
+  /**
+   * Send a fully encoded request (including the size prefix). Connects
+   * first if the connection is not yet established
+   */
+  ReturnCode sendRequest(const std::string& request, uint64_t deadline);
+
+  /**
+   * Read the next response and check that it matches correlation_id. The
+   * returned response starts right after the correlation id
+   */
+  ReturnCode readResponse(
+      int32_t correlation_id,
+      std::string* response,
+      uint64_t deadline);
+
+  const std::string& getHost() const;
+  uint16_t getPort() const;
+
+protected:
+
+  ReturnCode waitFor(short events, uint64_t deadline);
+  ReturnCode readFully(char* data, size_t size, uint64_t deadline);
+
+  std::string host_;
+  uint16_t port_;
+  int fd_;
+};
+
+} // namespace plugins_kafka
+} // namespace evcollect
+
@@ -0,0 +1,313 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <string.h>
+#include <evcollect/evcollect.h>
+#include <evcollect/util/time.h>
+#include <evcollect/util/return_code.h>
+#include <evcollect/util/stringutil.h>
+#include "kafka_target.h"
+
+namespace evcollect {
+namespace plugin_kafka {
+
+static bool getUInt64Option(
+    evcollect_ctx_t* ctx,
+    const evcollect_plugin_cfg_t* cfg,
+    const char* key,
+    uint64_t* value) {
+  const char* opt;
+  if (!evcollect_plugin_getcfg(cfg, key, &opt)) {
+    return true;
+  }
+
+  try {
+    *value = std::stoull(opt);
+  } catch (...) {
+    auto msg = StringUtil::format("invalid value for $0", key);
+    evcollect_seterror(ctx, msg.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+int pluginAttach(
+    evcollect_ctx_t* ctx,
+    const evcollect_plugin_cfg_t* cfg,
+    void** userdata) {
+  uint16_t port = KafkaTarget::kDefaultPort;
+  const char* port_opt;
+  if (evcollect_plugin_getcfg(cfg, "port", &port_opt)) {
+    try {
+      port = std::stoul(port_opt);
+    } catch (...) {
+      evcollect_seterror(ctx, "invalid port");
+      return false;
+    }
+  }
+
+  std::unique_ptr<KafkaTarget> target(new KafkaTarget());
+
+  /* bootstrap brokers may be given multiple times, each as host or
+     host:port */
+  int nhosts = 0;
+  for (auto key : { "host", "hostname" }) {
+    for (int i = 0; ; ++i) {
+      const char* hostname_opt;
+      if (!evcollect_plugin_getcfgv(cfg, key, i, 0, &hostname_opt)) {
+        break;
+      }
+
+      std::string hostname(hostname_opt);
+      uint16_t host_port = port;
+      auto port_pos = hostname.find(":");
+      if (port_pos != std::string::npos) {
+        try {
+          host_port = std::stoul(hostname.substr(port_pos + 1));
+        } catch (...) {
+          evcollect_seterror(ctx, "invalid port");
+          return false;
+        }
+
+        hostname = hostname.substr(0, port_pos);
+      }
+
+      target->addBroker(hostname, host_port);
+      ++nhosts;
+    }
+  }
+
+  if (nhosts == 0) {
+    target->addBroker("localhost", port);
+  }
+
+  const char* client_id_opt;
+  if (evcollect_plugin_getcfg(cfg, "client_id", &client_id_opt)) {
+    target->setClientID(client_id_opt);
+  }
+
+  const char* partition_key_opt;
+  if (evcollect_plugin_getcfg(cfg, "partition_key", &partition_key_opt)) {
+    target->setPartitionKey(partition_key_opt);
+  }
+
+  const char* acks_opt;
+  if (evcollect_plugin_getcfg(cfg, "acks", &acks_opt)) {
+    auto rc = target->setAcks(acks_opt);
+    if (!rc.isSuccess()) {
+      evcollect_seterror(ctx, rc.getMessage().c_str());
+      return false;
+    }
+  }
+
+  uint64_t request_timeout =
+      KafkaTarget::kDefaultRequestTimeoutMicros / kMicrosPerMilli;
+  if (!getUInt64Option(ctx, cfg, "request_timeout_ms", &request_timeout)) {
+    return false;
+  }
+
+  target->setRequestTimeout(request_timeout * kMicrosPerMilli);
+
+  uint64_t queue_maxlen = KafkaTarget::kDefaultMaxQueueLength;
+  if (!getUInt64Option(ctx, cfg, "queue_maxlen", &queue_maxlen)) {
+    return false;
+  }
+
+  target->setMaxQueueLength(queue_maxlen);
+
+  uint64_t batch_maxlen = KafkaTarget::kDefaultBatchMaxEvents;
+  if (!getUInt64Option(ctx, cfg, "batch_maxlen", &batch_maxlen)) {
+    return false;
+  }
+
+  if (batch_maxlen == 0) {
+    evcollect_seterror(ctx, "batch_maxlen must be greater than zero");
+    return false;
+  }
+
+  target->setBatchMaxEvents(batch_maxlen);
+
+  uint64_t batch_maxbytes = KafkaTarget::kDefaultBatchMaxBytes;
+  if (!getUInt64Option(ctx, cfg, "batch_maxbytes", &batch_maxbytes)) {
+    return false;
+  }
+
+  target->setBatchMaxBytes(batch_maxbytes);
+
+  uint64_t batch_linger =
+      KafkaTarget::kDefaultBatchLingerMicros / kMicrosPerMilli;
+  if (!getUInt64Option(ctx, cfg, "batch_linger_ms", &batch_linger)) {
+    return false;
+  }
+
+  target->setBatchLinger(batch_linger * kMicrosPerMilli);
+
+  uint64_t retry_max_attempts = KafkaTarget::kDefaultRetryMaxAttempts;
+  if (!getUInt64Option(
+          ctx,
+          cfg,
+          "retry_max_attempts",
+          &retry_max_attempts)) {
+    return false;
+  }
+
+  target->setRetryMaxAttempts(retry_max_attempts);
+
+  uint64_t retry_backoff =
+      KafkaTarget::kDefaultRetryBackoffMicros / kMicrosPerMilli;
+  if (!getUInt64Option(ctx, cfg, "retry_backoff_ms", &retry_backoff)) {
+    return false;
+  }
+
+  target->setRetryBackoff(retry_backoff * kMicrosPerMilli);
+
+  const char* compression_opt;
+  if (evcollect_plugin_getcfg(cfg, "compression", &compression_opt)) {
+    int compression_level = -1; // Z_DEFAULT_COMPRESSION
+    const char* compression_level_opt;
+    if (evcollect_plugin_getcfg(
+            cfg,
+            "compression_level",
+            &compression_level_opt)) {
+      try {
+        compression_level = std::stoi(compression_level_opt);
+      } catch (...) {
+        evcollect_seterror(ctx, "invalid value for compression_level");
+        return false;
+      }
+    }
+
+    auto rc = target->setCompression(compression_opt, compression_level);
+    if (!rc.isSuccess()) {
+      evcollect_seterror(ctx, rc.getMessage().c_str());
+      return false;
+    }
+  }
+
+  for (int i = 0; ; ++i) {
+    std::vector<std::string> route;
+    for (int j = 0; ; ++j) {
+      const char* arg;
+      if (evcollect_plugin_getcfgv(cfg, "route", i, j, &arg)) {
+        route.emplace_back(arg);
+      } else {
+        break;
+      }
+    }
+
+    if (route.empty()) {
+      break;
+    }
+
+    if (route.size() != 2) {
+      evcollect_seterror(
+          ctx,
+          "invalid number of arguments to route. " \
+          "format is: route <event> <topic>");
+      return false;
+    }
+
+    auto rc = target->addRoute(route[0], route[1]);
+    if (!rc.isSuccess()) {
+      evcollect_seterror(ctx, rc.getMessage().c_str());
+      return false;
+    }
+  }
+
+  auto rc = target->startUploadThread();
+  if (!rc.isSuccess()) {
+    evcollect_seterror(ctx, rc.getMessage().c_str());
+    return false;
+  }
+
+  *userdata = target.release();
+  return true;
+}
+
+int pluginDetach(evcollect_ctx_t* ctx, void* userdata) {
+  auto target = static_cast<KafkaTarget*>(userdata);
+  target->stopUploadThread();
+  delete target;
+  return true;
+}
+
+int pluginEmitEvent(
+    evcollect_ctx_t* ctx,
+    void* userdata,
+    const evcollect_event_t* event) {
+  auto target = static_cast<KafkaTarget*>(userdata);
+
+  const char* ev_name;
+  size_t ev_name_len;
+  evcollect_event_getname(event, &ev_name, &ev_name_len);
+
+  const char* ev_data;
+  size_t ev_data_len;
+  evcollect_event_getdata(event, &ev_data, &ev_data_len);
+
+  auto rc = target->emitEvent(
+      std::string(ev_name, ev_name_len),
+      std::string(ev_data, ev_data_len));
+
+  if (rc.isSuccess()) {
+    return 1;
+  } else {
+    evcollect_seterror(ctx, rc.getMessage().c_str());
+    return 0;
+  }
+}
+
+int pluginGetStats(
+    evcollect_ctx_t* ctx,
+    void* userdata,
+    evcollect_event_t* stats) {
+  auto target = static_cast<KafkaTarget*>(userdata);
+
+  std::string json;
+  target->getStats(&json);
+  evcollect_event_setdata(stats, json.data(), json.size());
+  return 1;
+}
+
+} // namespace plugins_kafka
+} // namespace evcollect
+
+EVCOLLECT_PLUGIN_INIT(kafka) {
+  evcollect_output_plugin_register(
+      ctx,
+      "kafka",
+      &evcollect::plugin_kafka::pluginEmitEvent,
+      &evcollect::plugin_kafka::pluginAttach,
+      &evcollect::plugin_kafka::pluginDetach,
+      NULL,
+      NULL);
+
+  evcollect_output_plugin_register_stats(
+      ctx,
+      "kafka",
+      &evcollect::plugin_kafka::pluginGetStats);
+
+  return true;
+}
+
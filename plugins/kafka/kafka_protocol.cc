@@ -0,0 +1,695 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <string.h>
+#include "kafka_protocol.h"
+
+namespace evcollect {
+namespace plugin_kafka {
+
+bool isRetriableKafkaError(int16_t error) {
+  switch (error) {
+    case 2:  /* CORRUPT_MESSAGE */
+    case kKafkaErrorUnknownTopicOrPartition:
+    case kKafkaErrorLeaderNotAvailable:
+    case kKafkaErrorNotLeaderForPartition:
+    case kKafkaErrorRequestTimedOut:
+    case 8:  /* BROKER_NOT_AVAILABLE */
+    case 13: /* NETWORK_EXCEPTION */
+    case 19: /* NOT_ENOUGH_REPLICAS */
+    case 20: /* NOT_ENOUGH_REPLICAS_AFTER_APPEND */
+    case 56: /* KAFKA_STORAGE_ERROR */
+    case 74: /* FENCED_LEADER_EPOCH */
+    case 75: /* UNKNOWN_LEADER_EPOCH */
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool isMetadataKafkaError(int16_t error) {
+  switch (error) {
+    case kKafkaErrorUnknownTopicOrPartition:
+    case kKafkaErrorLeaderNotAvailable:
+    case kKafkaErrorNotLeaderForPartition:
+    case 8:  /* BROKER_NOT_AVAILABLE */
+    case 56: /* KAFKA_STORAGE_ERROR */
+    case 74: /* FENCED_LEADER_EPOCH */
+    case 75: /* UNKNOWN_LEADER_EPOCH */
+      return true;
+    default:
+      return false;
+  }
+}
+
+ReturnCode getKafkaError(int16_t error) {
+  switch (error) {
+    case kKafkaErrorNone:
+      return ReturnCode::success();
+    case kKafkaErrorUnknownTopicOrPartition:
+      return ReturnCode::error("EIO", "kafka error: unknown topic or partition");
+    case kKafkaErrorLeaderNotAvailable:
+      return ReturnCode::error("EIO", "kafka error: leader not available");
+    case kKafkaErrorNotLeaderForPartition:
+      return ReturnCode::error("EIO", "kafka error: not leader for partition");
+    case kKafkaErrorRequestTimedOut:
+      return ReturnCode::error("EIO", "kafka error: request timed out");
+    case kKafkaErrorMessageTooLarge:
+      return ReturnCode::error("EINVAL", "kafka error: message too large");
+    case kKafkaErrorTopicAuthorizationFailed:
+      return ReturnCode::error(
+          "EACCESS",
+          "kafka error: topic authorization failed");
+    default:
+      return ReturnCode::error(
+          isRetriableKafkaError(error) ? "EIO" : "EINVAL",
+          "kafka error: %i",
+          error);
+  }
+}
+
+KafkaWriter::KafkaWriter(std::string* buf) : buf_(buf) {}
+
+void KafkaWriter::putInt8(int8_t value) {
+  buf_->push_back((char) value);
+}
+
+void KafkaWriter::putInt16(int16_t value) {
+  uint16_t v = value;
+  char b[2] = { char(v >> 8), char(v) };
+  buf_->append(b, sizeof(b));
+}
+
+void KafkaWriter::putInt32(int32_t value) {
+  uint32_t v = value;
+  char b[4] = { char(v >> 24), char(v >> 16), char(v >> 8), char(v) };
+  buf_->append(b, sizeof(b));
+}
+
+void KafkaWriter::putInt64(int64_t value) {
+  uint64_t v = value;
+  putInt32(int32_t(v >> 32));
+  putInt32(int32_t(v));
+}
+
+void KafkaWriter::putVarint(int64_t value) {
+  uint64_t v = (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+  while (v >= 0x80) {
+    buf_->push_back(char((v & 0x7f) | 0x80));
+    v >>= 7;
+  }
+
+  buf_->push_back(char(v));
+}
+
+void KafkaWriter::putString(const std::string& value) {
+  putInt16(value.size());
+  buf_->append(value);
+}
+
+void KafkaWriter::putNullString() {
+  putInt16(-1);
+}
+
+void KafkaWriter::putBytes(const std::string& value) {
+  putInt32(value.size());
+  buf_->append(value);
+}
+
+void KafkaWriter::patchInt32(size_t pos, int32_t value) {
+  uint32_t v = value;
+  (*buf_)[pos] = char(v >> 24);
+  (*buf_)[pos + 1] = char(v >> 16);
+  (*buf_)[pos + 2] = char(v >> 8);
+  (*buf_)[pos + 3] = char(v);
+}
+
+size_t KafkaWriter::size() const {
+  return buf_->size();
+}
+
+KafkaReader::KafkaReader(
+    const char* data,
+    size_t size) :
+    data_(data),
+    size_(size),
+    pos_(0) {}
+
+bool KafkaReader::readInt8(int8_t* value) {
+  if (remaining() < 1) {
+    return false;
+  }
+
+  *value = (int8_t) data_[pos_++];
+  return true;
+}
+
+bool KafkaReader::readInt16(int16_t* value) {
+  if (remaining() < 2) {
+    return false;
+  }
+
+  auto b = (const unsigned char*) data_ + pos_;
+  *value = int16_t((uint16_t(b[0]) << 8) | b[1]);
+  pos_ += 2;
+  return true;
+}
+
+bool KafkaReader::readInt32(int32_t* value) {
+  if (remaining() < 4) {
+    return false;
+  }
+
+  auto b = (const unsigned char*) data_ + pos_;
+  *value = int32_t(
+      (uint32_t(b[0]) << 24) |
+      (uint32_t(b[1]) << 16) |
+      (uint32_t(b[2]) << 8) |
+      uint32_t(b[3]));
+
+  pos_ += 4;
+  return true;
+}
+
+bool KafkaReader::readInt64(int64_t* value) {
+  int32_t hi;
+  int32_t lo;
+  if (!readInt32(&hi) || !readInt32(&lo)) {
+    return false;
+  }
+
+  *value = int64_t((uint64_t(uint32_t(hi)) << 32) | uint32_t(lo));
+  return true;
+}
+
+bool KafkaReader::readVarint(int64_t* value) {
+  uint64_t v = 0;
+  for (size_t shift = 0; shift < 64; shift += 7) {
+    if (remaining() < 1) {
+      return false;
+    }
+
+    uint8_t b = data_[pos_++];
+    v |= uint64_t(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) {
+      *value = int64_t(v >> 1) ^ -int64_t(v & 1);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool KafkaReader::readString(std::string* value) {
+  int16_t len;
+  if (!readInt16(&len)) {
+    return false;
+  }
+
+  if (len < 0) {
+    value->clear();
+    return true;
+  }
+
+  return readRaw(len, value);
+}
+
+bool KafkaReader::readBytes(std::string* value) {
+  int32_t len;
+  if (!readInt32(&len)) {
+    return false;
+  }
+
+  if (len < 0) {
+    value->clear();
+    return true;
+  }
+
+  return readRaw(len, value);
+}
+
+bool KafkaReader::readRaw(size_t size, std::string* value) {
+  if (remaining() < size) {
+    return false;
+  }
+
+  value->assign(data_ + pos_, size);
+  pos_ += size;
+  return true;
+}
+
+bool KafkaReader::skip(size_t size) {
+  if (remaining() < size) {
+    return false;
+  }
+
+  pos_ += size;
+  return true;
+}
+
+size_t KafkaReader::remaining() const {
+  return size_ - pos_;
+}
+
+void encodeKafkaRecords(
+    const std::vector<KafkaRecord>& records,
+    int64_t base_timestamp,
+    std::string* out) {
+  std::string record;
+  KafkaWriter writer(out);
+  KafkaWriter record_writer(&record);
+  for (size_t i = 0; i < records.size(); ++i) {
+    const auto& r = records[i];
+    record.clear();
+    record_writer.putInt8(0); // attributes
+    record_writer.putVarint(r.timestamp - base_timestamp);
+    record_writer.putVarint(i);
+    if (r.has_key) {
+      record_writer.putVarint(r.key.size());
+      record.append(r.key);
+    } else {
+      record_writer.putVarint(-1);
+    }
+
+    record_writer.putVarint(r.value.size());
+    record.append(r.value);
+    record_writer.putVarint(0); // headers
+
+    writer.putVarint(record.size());
+    out->append(record);
+  }
+}
+
+/**
+ * Record batch layout (v2):
+ *
+ *   baseOffset: int64
+ *   batchLength: int32
+ *   partitionLeaderEpoch: int32
+ *   magic: int8 (= 2)
+ *   crc: uint32 (CRC-32C of everything after this field)
+ *   attributes: int16
+ *   lastOffsetDelta: int32
+ *   firstTimestamp: int64
+ *   maxTimestamp: int64
+ *   producerId: int64
+ *   producerEpoch: int16
+ *   baseSequence: int32
+ *   records: int32 count + records
+ */
+static const size_t kRecordBatchLengthOffset = 8;
+static const size_t kRecordBatchCRCOffset = 17;
+static const size_t kRecordBatchHeaderSize = 61;
+
+void encodeKafkaRecordBatch(
+    const std::string& records,
+    size_t num_records,
+    int64_t first_timestamp,
+    int64_t max_timestamp,
+    int16_t compression,
+    std::string* out) {
+  out->clear();
+  out->reserve(kRecordBatchHeaderSize + records.size());
+
+  KafkaWriter writer(out);
+  writer.putInt64(0);
+  writer.putInt32(0); // patched below
+  writer.putInt32(-1);
+  writer.putInt8(2);
+  writer.putInt32(0); // patched below
+  writer.putInt16(compression);
+  writer.putInt32(num_records > 0 ? num_records - 1 : 0);
+  writer.putInt64(first_timestamp);
+  writer.putInt64(max_timestamp);
+  writer.putInt64(-1);
+  writer.putInt16(-1);
+  writer.putInt32(-1);
+  writer.putInt32(num_records);
+  out->append(records);
+
+  writer.patchInt32(
+      kRecordBatchLengthOffset,
+      out->size() - kRecordBatchLengthOffset - 4);
+
+  auto crc_begin = kRecordBatchCRCOffset + 4;
+  writer.patchInt32(
+      kRecordBatchCRCOffset,
+      crc32c(0, out->data() + crc_begin, out->size() - crc_begin));
+}
+
+ReturnCode decodeKafkaRecordBatch(
+    const std::string& batch,
+    size_t* num_records,
+    int16_t* compression,
+    std::string* records) {
+  if (batch.size() < kRecordBatchHeaderSize) {
+    return ReturnCode::error("EINVAL", "record batch too short");
+  }
+
+  KafkaReader reader(batch.data(), batch.size());
+  int32_t batch_len;
+  int8_t magic;
+  int32_t crc;
+  int32_t count;
+  reader.skip(8);
+  reader.readInt32(&batch_len);
+  reader.skip(4);
+  reader.readInt8(&magic);
+  reader.readInt32(&crc);
+  reader.readInt16(compression);
+  reader.skip(4 + 8 + 8 + 8 + 2 + 4);
+  reader.readInt32(&count);
+
+  if (magic != 2) {
+    return ReturnCode::error("EINVAL", "unsupported record batch magic");
+  }
+
+  if (batch_len < 0 ||
+      size_t(batch_len) != batch.size() - kRecordBatchLengthOffset - 4) {
+    return ReturnCode::error("EINVAL", "invalid record batch length");
+  }
+
+  auto crc_begin = kRecordBatchCRCOffset + 4;
+  if (uint32_t(crc) !=
+      crc32c(0, batch.data() + crc_begin, batch.size() - crc_begin)) {
+    return ReturnCode::error("EINVAL", "record batch checksum mismatch");
+  }
+
+  *num_records = count;
+  *compression &= 0x7;
+  reader.readRaw(reader.remaining(), records);
+  return ReturnCode::success();
+}
+
+ReturnCode decodeKafkaRecords(
+    const std::string& records,
+    size_t num_records,
+    int64_t base_timestamp,
+    std::vector<KafkaRecord>* out) {
+  KafkaReader reader(records.data(), records.size());
+  for (size_t i = 0; i < num_records; ++i) {
+    int64_t len;
+    int8_t attributes;
+    int64_t timestamp_delta;
+    int64_t offset_delta;
+    int64_t key_len;
+    int64_t value_len;
+    int64_t num_headers;
+    KafkaRecord r;
+    if (!reader.readVarint(&len) ||
+        !reader.readInt8(&attributes) ||
+        !reader.readVarint(&timestamp_delta) ||
+        !reader.readVarint(&offset_delta) ||
+        !reader.readVarint(&key_len) ||
+        (key_len >= 0 && !reader.readRaw(key_len, &r.key)) ||
+        !reader.readVarint(&value_len) ||
+        (value_len >= 0 && !reader.readRaw(value_len, &r.value)) ||
+        !reader.readVarint(&num_headers) ||
+        num_headers != 0) {
+      return ReturnCode::error("EINVAL", "invalid record");
+    }
+
+    r.has_key = key_len >= 0;
+    r.timestamp = base_timestamp + timestamp_delta;
+    out->emplace_back(std::move(r));
+  }
+
+  return ReturnCode::success();
+}
+
+void encodeKafkaRequestHeader(
+    int16_t api_key,
+    int16_t api_version,
+    int32_t correlation_id,
+    const std::string& client_id,
+    std::string* out) {
+  out->clear();
+  KafkaWriter writer(out);
+  writer.putInt32(0); // size, set by finishKafkaMessage
+  writer.putInt16(api_key);
+  writer.putInt16(api_version);
+  writer.putInt32(correlation_id);
+  writer.putString(client_id);
+}
+
+void finishKafkaMessage(std::string* out) {
+  KafkaWriter writer(out);
+  writer.patchInt32(0, out->size() - 4);
+}
+
+void encodeKafkaMetadataRequest(
+    int32_t correlation_id,
+    const std::string& client_id,
+    const std::vector<std::string>& topics,
+    std::string* out) {
+  encodeKafkaRequestHeader(
+      kKafkaAPIKeyMetadata,
+      kKafkaMetadataVersion,
+      correlation_id,
+      client_id,
+      out);
+
+  KafkaWriter writer(out);
+  writer.putInt32(topics.size());
+  for (const auto& topic : topics) {
+    writer.putString(topic);
+  }
+
+  writer.putInt8(1); // allow_auto_topic_creation
+  finishKafkaMessage(out);
+}
+
+ReturnCode decodeKafkaMetadataResponse(
+    const std::string& response,
+    KafkaMetadata* metadata) {
+  KafkaReader reader(response.data(), response.size());
+  auto invalid = ReturnCode::error("EINVAL", "invalid metadata response");
+
+  int32_t throttle_time;
+  int32_t num_brokers;
+  if (!reader.readInt32(&throttle_time) ||
+      !reader.readInt32(&num_brokers)) {
+    return invalid;
+  }
+
+  for (int32_t i = 0; i < num_brokers; ++i) {
+    KafkaBrokerMetadata broker;
+    std::string rack;
+    if (!reader.readInt32(&broker.node_id) ||
+        !reader.readString(&broker.host) ||
+        !reader.readInt32(&broker.port) ||
+        !reader.readString(&rack)) {
+      return invalid;
+    }
+
+    metadata->brokers.emplace_back(std::move(broker));
+  }
+
+  std::string cluster_id;
+  int32_t controller_id;
+  int32_t num_topics;
+  if (!reader.readString(&cluster_id) ||
+      !reader.readInt32(&controller_id) ||
+      !reader.readInt32(&num_topics)) {
+    return invalid;
+  }
+
+  for (int32_t i = 0; i < num_topics; ++i) {
+    KafkaTopicMetadata topic;
+    int8_t is_internal;
+    int32_t num_partitions;
+    if (!reader.readInt16(&topic.error) ||
+        !reader.readString(&topic.topic) ||
+        !reader.readInt8(&is_internal) ||
+        !reader.readInt32(&num_partitions)) {
+      return invalid;
+    }
+
+    for (int32_t j = 0; j < num_partitions; ++j) {
+      KafkaPartitionMetadata partition;
+      int32_t num_replicas;
+      int32_t num_isr;
+      if (!reader.readInt16(&partition.error) ||
+          !reader.readInt32(&partition.partition) ||
+          !reader.readInt32(&partition.leader) ||
+          !reader.readInt32(&num_replicas) ||
+          num_replicas < 0 ||
+          !reader.skip(num_replicas * 4) ||
+          !reader.readInt32(&num_isr) ||
+          num_isr < 0 ||
+          !reader.skip(num_isr * 4)) {
+        return invalid;
+      }
+
+      topic.partitions.emplace_back(partition);
+    }
+
+    metadata->topics.emplace_back(std::move(topic));
+  }
+
+  return ReturnCode::success();
+}
+
+void encodeKafkaProduceRequest(
+    int32_t correlation_id,
+    const std::string& client_id,
+    int16_t acks,
+    int32_t timeout_ms,
+    const std::vector<KafkaProduceTopic>& topics,
+    std::string* out) {
+  encodeKafkaRequestHeader(
+      kKafkaAPIKeyProduce,
+      kKafkaProduceVersion,
+      correlation_id,
+      client_id,
+      out);
+
+  KafkaWriter writer(out);
+  writer.putNullString(); // transactional_id
+  writer.putInt16(acks);
+  writer.putInt32(timeout_ms);
+  writer.putInt32(topics.size());
+  for (const auto& topic : topics) {
+    writer.putString(topic.topic);
+    writer.putInt32(topic.partitions.size());
+    for (const auto& partition : topic.partitions) {
+      writer.putInt32(partition.partition);
+      writer.putBytes(partition.record_batch);
+    }
+  }
+
+  finishKafkaMessage(out);
+}
+
+ReturnCode decodeKafkaProduceResponse(
+    const std::string& response,
+    std::vector<KafkaProduceResult>* results) {
+  KafkaReader reader(response.data(), response.size());
+  auto invalid = ReturnCode::error("EINVAL", "invalid produce response");
+
+  int32_t num_topics;
+  if (!reader.readInt32(&num_topics)) {
+    return invalid;
+  }
+
+  for (int32_t i = 0; i < num_topics; ++i) {
+    std::string topic;
+    int32_t num_partitions;
+    if (!reader.readString(&topic) || !reader.readInt32(&num_partitions)) {
+      return invalid;
+    }
+
+    for (int32_t j = 0; j < num_partitions; ++j) {
+      KafkaProduceResult result;
+      int64_t log_append_time;
+      result.topic = topic;
+      if (!reader.readInt32(&result.partition) ||
+          !reader.readInt16(&result.error) ||
+          !reader.readInt64(&result.base_offset) ||
+          !reader.readInt64(&log_append_time)) {
+        return invalid;
+      }
+
+      results->emplace_back(std::move(result));
+    }
+  }
+
+  return ReturnCode::success();
+}
+
+namespace {
+
+struct CRC32CTable {
+  uint32_t table[256];
+
+  CRC32CTable() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int j = 0; j < 8; ++j) {
+        crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+      }
+
+      table[i] = crc;
+    }
+  }
+};
+
+const CRC32CTable crc32c_table;
+
+}
+
+uint32_t crc32c(uint32_t crc, const char* data, size_t size) {
+  auto p = (const unsigned char*) data;
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i) {
+    crc = crc32c_table.table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  }
+
+  return ~crc;
+}
+
+int32_t murmur2(const char* data, size_t size) {
+  const uint32_t seed = 0x9747b28c;
+  const uint32_t m = 0x5bd1e995;
+  const int r = 24;
+
+  auto p = (const unsigned char*) data;
+  uint32_t h = seed ^ uint32_t(size);
+
+  size_t nblocks = size / 4;
+  for (size_t i = 0; i < nblocks; ++i) {
+    uint32_t k =
+        uint32_t(p[i * 4]) |
+        (uint32_t(p[i * 4 + 1]) << 8) |
+        (uint32_t(p[i * 4 + 2]) << 16) |
+        (uint32_t(p[i * 4 + 3]) << 24);
+
+    k *= m;
+    k ^= k >> r;
+    k *= m;
+    h *= m;
+    h ^= k;
+  }
+
+  auto tail = p + nblocks * 4;
+  switch (size % 4) {
+    case 3:
+      h ^= uint32_t(tail[2]) << 16;
+      /* fallthrough */
+    case 2:
+      h ^= uint32_t(tail[1]) << 8;
+      /* fallthrough */
+    case 1:
+      h ^= uint32_t(tail[0]);
+      h *= m;
+  }
+
+  h ^= h >> 13;
+  h *= m;
+  h ^= h >> 15;
+  return int32_t(h);
+}
+
+} // namespace plugins_kafka
+} // namespace evcollect
+
@@ -0,0 +1,275 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <evcollect/util/return_code.h>
+
+namespace evcollect {
+namespace plugin_kafka {
+
+/**
+ * Encoder and decoder for the subset of the Kafka wire protocol the producer
+ * needs: Metadata (v4) and Produce (v3) requests with v2 record batches. All
+ * integers are big-endian. See https://kafka.apache.org/protocol
+ */
+static const int16_t kKafkaAPIKeyProduce = 0;
+static const int16_t kKafkaAPIKeyMetadata = 3;
+static const int16_t kKafkaProduceVersion = 3;
+static const int16_t kKafkaMetadataVersion = 4;
+
+static const int16_t kKafkaCompressionNone = 0;
+static const int16_t kKafkaCompressionGzip = 1;
+
+/**
+ * Error codes returned by the broker (only the ones we handle explicitly)
+ */
+static const int16_t kKafkaErrorNone = 0;
+static const int16_t kKafkaErrorUnknownTopicOrPartition = 3;
+static const int16_t kKafkaErrorLeaderNotAvailable = 5;
+static const int16_t kKafkaErrorNotLeaderForPartition = 6;
+static const int16_t kKafkaErrorRequestTimedOut = 7;
+static const int16_t kKafkaErrorMessageTooLarge = 10;
+static const int16_t kKafkaErrorTopicAuthorizationFailed = 29;
+
+/**
+ * Returns true if the request may succeed when it is retried
+ */
+bool isRetriableKafkaError(int16_t error);
+
+/**
+ * Returns true if the error means that our partition metadata is stale
+ */
+bool isMetadataKafkaError(int16_t error);
+
+/**
+ * Converts a broker error code into a ReturnCode with one of the EINVAL,
+ * EACCESS or EIO classes
+ */
+ReturnCode getKafkaError(int16_t error);
+
+class KafkaWriter {
+public:
+
+  KafkaWriter(std::string* buf);
+
+  void putInt8(int8_t value);
+  void putInt16(int16_t value);
+  void putInt32(int32_t value);
+  void putInt64(int64_t value);
+
+  /**
+   * Zig-zag encoded variable length integer as used in v2 record batches
+   */
+  void putVarint(int64_t value);
+
+  void putString(const std::string& value);
+  void putNullString();
+  void putBytes(const std::string& value);
+
+  /**
+   * Overwrite the int32 at pos (e.g. a length prefix)
+   */
+  void patchInt32(size_t pos, int32_t value);
+
+  size_t size() const;
+
+protected:
+  std::string* buf_;
+};
+
+class KafkaReader {
+public:
+
+  KafkaReader(const char* data, size_t size);
+
+  bool readInt8(int8_t* value);
+  bool readInt16(int16_t* value);
+  bool readInt32(int32_t* value);
+  bool readInt64(int64_t* value);
+  bool readVarint(int64_t* value);
+
+  /**
+   * Read an int16 length prefixed string. Null strings are read as empty
+   */
+  bool readString(std::string* value);
+
+  /**
+   * Read an int32 length prefixed byte array
+   */
+  bool readBytes(std::string* value);
+
+  bool readRaw(size_t size, std::string* value);
+  bool skip(size_t size);
+  size_t remaining() const;
+
+protected:
+  const char* data_;
+  size_t size_;
+  size_t pos_;
+};
+
+struct KafkaRecord {
+  bool has_key;
+  std::string key;
+  std::string value;
+  int64_t timestamp;
+};
+
+/**
+ * Encode the records section of a v2 record batch. The timestamp and offset
+ * of each record is stored as a delta to base_timestamp and the first record
+ */
+void encodeKafkaRecords(
+    const std::vector<KafkaRecord>& records,
+    int64_t base_timestamp,
+    std::string* out);
+
+/**
+ * Wrap a (possibly compressed) records section into a v2 record batch
+ * including the CRC-32C checksum
+ */
+void encodeKafkaRecordBatch(
+    const std::string& records,
+    size_t num_records,
+    int64_t first_timestamp,
+    int64_t max_timestamp,
+    int16_t compression,
+    std::string* out);
+
+/**
+ * Decode a v2 record batch. The records section is returned as is (i.e.
+ * still compressed if compression is not kKafkaCompressionNone)
+ */
+ReturnCode decodeKafkaRecordBatch(
+    const std::string& batch,
+    size_t* num_records,
+    int16_t* compression,
+    std::string* records);
+
+/**
+ * Decode num_records records from an uncompressed records section
+ */
+ReturnCode decodeKafkaRecords(
+    const std::string& records,
+    size_t num_records,
+    int64_t base_timestamp,
+    std::vector<KafkaRecord>* out);
+
+void encodeKafkaRequestHeader(
+    int16_t api_key,
+    int16_t api_version,
+    int32_t correlation_id,
+    const std::string& client_id,
+    std::string* out);
+
+/**
+ * Set the int32 size prefix of a request or response in out
+ */
+void finishKafkaMessage(std::string* out);
+
+void encodeKafkaMetadataRequest(
+    int32_t correlation_id,
+    const std::string& client_id,
+    const std::vector<std::string>& topics,
+    std::string* out);
+
+struct KafkaBrokerMetadata {
+  int32_t node_id;
+  std::string host;
+  int32_t port;
+};
+
+struct KafkaPartitionMetadata {
+  int16_t error;
+  int32_t partition;
+  int32_t leader;
+};
+
+struct KafkaTopicMetadata {
+  int16_t error;
+  std::string topic;
+  std::vector<KafkaPartitionMetadata> partitions;
+};
+
+struct KafkaMetadata {
+  std::vector<KafkaBrokerMetadata> brokers;
+  std::vector<KafkaTopicMetadata> topics;
+};
+
+/**
+ * Decode a metadata response (without the size and correlation id)
+ */
+ReturnCode decodeKafkaMetadataResponse(
+    const std::string& response,
+    KafkaMetadata* metadata);
+
+struct KafkaProducePartition {
+  int32_t partition;
+  std::string record_batch;
+};
+
+struct KafkaProduceTopic {
+  std::string topic;
+  std::vector<KafkaProducePartition> partitions;
+};
+
+void encodeKafkaProduceRequest(
+    int32_t correlation_id,
+    const std::string& client_id,
+    int16_t acks,
+    int32_t timeout_ms,
+    const std::vector<KafkaProduceTopic>& topics,
+    std::string* out);
+
+struct KafkaProduceResult {
+  std::string topic;
+  int32_t partition;
+  int16_t error;
+  int64_t base_offset;
+};
+
+/**
+ * Decode a produce response (without the size and correlation id)
+ */
+ReturnCode decodeKafkaProduceResponse(
+    const std::string& response,
+    std::vector<KafkaProduceResult>* results);
+
+/**
+ * CRC-32C (Castagnoli) as used for the record batch checksum
+ */
+uint32_t crc32c(uint32_t crc, const char* data, size_t size);
+
+/**
+ * The murmur2 hash used by the Java client's default partitioner, so that
+ * keyed events land on the same partition as with other Kafka producers
+ */
+int32_t murmur2(const char* data, size_t size);
+
+} // namespace plugins_kafka
+} // namespace evcollect
+
@@ -0,0 +1,1064 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <algorithm>
+#include <fnmatch.h>
+#include <string.h>
+#include <unistd.h>
+#include <evcollect/util/stringutil.h>
+#include "kafka_target.h"
+
+namespace evcollect {
+namespace plugin_kafka {
+
+namespace {
+
+/**
+ * Extract the value of a top-level field from a JSON object. String values
+ * are unescaped (except for \u sequences which are kept as is), all other
+ * values are returned verbatim. Returns false if the field does not exist
+ * or the document is not a JSON object
+ */
+class JSONFieldExtractor {
+public:
+
+  JSONFieldExtractor(const std::string& json) : json_(json), pos_(0) {}
+
+  bool extract(const std::string& field, std::string* value) {
+    skipWhitespace();
+    if (!consume('{')) {
+      return false;
+    }
+
+    for (;;) {
+      skipWhitespace();
+      std::string key;
+      if (!readString(&key)) {
+        return false;
+      }
+
+      skipWhitespace();
+      if (!consume(':')) {
+        return false;
+      }
+
+      skipWhitespace();
+      if (key == field) {
+        if (pos_ < json_.size() && json_[pos_] == '"') {
+          return readString(value);
+        }
+
+        auto begin = pos_;
+        if (!skipValue()) {
+          return false;
+        }
+
+        *value = json_.substr(begin, pos_ - begin);
+        return true;
+      }
+
+      if (!skipValue()) {
+        return false;
+      }
+
+      skipWhitespace();
+      if (!consume(',')) {
+        return false;
+      }
+    }
+  }
+
+protected:
+
+  void skipWhitespace() {
+    while (pos_ < json_.size() && isspace((unsigned char) json_[pos_])) {
+      ++pos_;
+    }
+  }
+
+  bool consume(char c) {
+    if (pos_ < json_.size() && json_[pos_] == c) {
+      ++pos_;
+      return true;
+    }
+
+    return false;
+  }
+
+  bool readString(std::string* str) {
+    if (!consume('"')) {
+      return false;
+    }
+
+    str->clear();
+    while (pos_ < json_.size()) {
+      char c = json_[pos_++];
+      if (c == '"') {
+        return true;
+      }
+
+      if (c != '\\') {
+        str->push_back(c);
+        continue;
+      }
+
+      if (pos_ >= json_.size()) {
+        return false;
+      }
+
+      c = json_[pos_++];
+      switch (c) {
+        case 'b': str->push_back('\b'); break;
+        case 'f': str->push_back('\f'); break;
+        case 'n': str->push_back('\n'); break;
+        case 'r': str->push_back('\r'); break;
+        case 't': str->push_back('\t'); break;
+        case 'u': str->append("\\u"); break;
+        default: str->push_back(c); break;
+      }
+    }
+
+    return false;
+  }
+
+  bool skipValue() {
+    if (pos_ >= json_.size()) {
+      return false;
+    }
+
+    if (json_[pos_] == '"') {
+      std::string tmp;
+      return readString(&tmp);
+    }
+
+    size_t depth = 0;
+    while (pos_ < json_.size()) {
+      char c = json_[pos_];
+      if (c == '"') {
+        std::string tmp;
+        if (!readString(&tmp)) {
+          return false;
+        }
+
+        continue;
+      }
+
+      if (c == '{' || c == '[') {
+        ++depth;
+      } else if (c == '}' || c == ']') {
+        if (depth == 0) {
+          return true;
+        }
+
+        --depth;
+      } else if (c == ',' && depth == 0) {
+        return true;
+      }
+
+      ++pos_;
+    }
+
+    return depth == 0;
+  }
+
+  const std::string& json_;
+  size_t pos_;
+};
+
+void expandTemplate(const std::string& event_name, std::string* str) {
+  size_t pos = 0;
+  while ((pos = str->find("%E", pos)) != std::string::npos) {
+    str->replace(pos, 2, event_name);
+    pos += event_name.size();
+  }
+}
+
+}
+
+KafkaTarget::KafkaTarget() :
+    client_id_("evcollect"),
+    acks_(kDefaultAcks),
+    request_timeout_(kDefaultRequestTimeoutMicros),
+    max_queue_length_(kDefaultMaxQueueLength),
+    batch_max_events_(kDefaultBatchMaxEvents),
+    batch_max_bytes_(kDefaultBatchMaxBytes),
+    batch_linger_(kDefaultBatchLingerMicros),
+    retry_max_attempts_(kDefaultRetryMaxAttempts),
+    retry_backoff_(kDefaultRetryBackoffMicros),
+    need_metadata_(true),
+    metadata_retry_at_(0),
+    metadata_expires_(0),
+    next_correlation_id_(1),
+    thread_running_(false),
+    thread_shutdown_(false) {
+  stats_.events_enqueued = 0;
+  stats_.events_sent = 0;
+  stats_.events_dropped = 0;
+  stats_.batches_sent = 0;
+  stats_.batches_failed = 0;
+  stats_.bytes_sent = 0;
+  stats_.bytes_uncompressed = 0;
+  stats_.buffered_events = 0;
+}
+
+KafkaTarget::~KafkaTarget() {
+  stopUploadThread();
+}
+
+void KafkaTarget::addBroker(const std::string& hostname, uint16_t port) {
+  bootstrap_.emplace_back(new KafkaBrokerConnection(hostname, port));
+}
+
+ReturnCode KafkaTarget::addRoute(
+    const std::string& event_name_match,
+    const std::string& topic) {
+  std::string topic_chars = topic;
+  expandTemplate("", &topic_chars);
+  if (topic.empty() ||
+      topic_chars.find_first_not_of(
+          "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789._-")
+          != std::string::npos) {
+    return ReturnCode::error(
+        "EINVAL",
+        "invalid topic '%s' -- may only contain [a-zA-Z0-9._-] and %%E",
+        topic.c_str());
+  }
+
+  Route r;
+  r.event_name_match = event_name_match;
+  r.topic = topic;
+  r.topic_is_template = topic.find("%E") != std::string::npos;
+  routes_.emplace_back(r);
+  return ReturnCode::success();
+}
+
+void KafkaTarget::setPartitionKey(const std::string& field) {
+  partition_key_ = field;
+}
+
+ReturnCode KafkaTarget::setAcks(const std::string& acks) {
+  if (acks == "0") {
+    acks_ = 0;
+    return ReturnCode::success();
+  }
+
+  if (acks == "1") {
+    acks_ = 1;
+    return ReturnCode::success();
+  }
+
+  if (acks == "all" || acks == "-1") {
+    acks_ = -1;
+    return ReturnCode::success();
+  }
+
+  return ReturnCode::error(
+      "EINVAL",
+      "invalid acks: '%s' -- must be '0', '1' or 'all'",
+      acks.c_str());
+}
+
+ReturnCode KafkaTarget::setCompression(
+    const std::string& compression,
+    int level) {
+  if (compression == "none") {
+#ifdef HAVE_ZLIB
+    gzip_.reset(nullptr);
+#endif
+    return ReturnCode::success();
+  }
+
+  if (compression == "gzip") {
+#ifdef HAVE_ZLIB
+    if (level < -1 || level > 9) {
+      return ReturnCode::error(
+          "EINVAL",
+          "invalid compression level: %i -- must be 0-9",
+          level);
+    }
+
+    gzip_.reset(new GzipCompressor(level));
+    return ReturnCode::success();
+#else
+    return ReturnCode::error(
+        "EINVAL",
+        "gzip compression is not supported (compiled without zlib)");
+#endif
+  }
+
+  return ReturnCode::error(
+      "EINVAL",
+      "invalid compression: '%s' -- must be 'gzip' or 'none'",
+      compression.c_str());
+}
+
+void KafkaTarget::setClientID(const std::string& client_id) {
+  client_id_ = client_id;
+}
+
+void KafkaTarget::setRequestTimeout(uint64_t usecs) {
+  request_timeout_ = usecs;
+}
+
+void KafkaTarget::setMaxQueueLength(size_t queue_len) {
+  max_queue_length_ = queue_len;
+}
+
+void KafkaTarget::setBatchMaxEvents(size_t max_events) {
+  batch_max_events_ = max_events;
+}
+
+void KafkaTarget::setBatchMaxBytes(size_t max_bytes) {
+  batch_max_bytes_ = max_bytes;
+}
+
+void KafkaTarget::setBatchLinger(uint64_t usecs) {
+  batch_linger_ = usecs;
+}
+
+void KafkaTarget::setRetryMaxAttempts(size_t max_attempts) {
+  retry_max_attempts_ = max_attempts;
+}
+
+void KafkaTarget::setRetryBackoff(uint64_t usecs) {
+  retry_backoff_ = usecs;
+}
+
+ReturnCode KafkaTarget::emitEvent(
+    const std::string& event_name,
+    const std::string& event_data) {
+  KafkaRecord record;
+  record.has_key = false;
+  record.value = event_data;
+  record.timestamp = WallClock::unixMillis();
+  if (!partition_key_.empty()) {
+    JSONFieldExtractor extractor(event_data);
+    record.has_key = extractor.extract(partition_key_, &record.key);
+  }
+
+  for (const auto& route : routes_) {
+    if (route.event_name_match != event_name &&
+        fnmatch(
+            route.event_name_match.c_str(),
+            event_name.c_str(),
+            0) != 0) {
+      continue;
+    }
+
+    QueuedRecord r;
+    r.topic = route.topic;
+    r.record = record;
+    if (route.topic_is_template) {
+      expandTemplate(event_name, &r.topic);
+    }
+
+    std::unique_lock<std::mutex> lk(mutex_);
+    while (queue_.size() >= max_queue_length_) {
+      if (thread_shutdown_) {
+        return ReturnCode::error("EIO", "kafka upload thread stopped");
+      }
+
+      queue_space_cv_.wait(lk);
+    }
+
+    queue_.emplace_back(std::move(r));
+    ++stats_.events_enqueued;
+    lk.unlock();
+    cv_.notify_one();
+  }
+
+  return ReturnCode::success();
+}
+
+ReturnCode KafkaTarget::startUploadThread() {
+  if (thread_running_) {
+    return ReturnCode::error("RTERROR", "upload thread is already running");
+  }
+
+  if (bootstrap_.empty()) {
+    return ReturnCode::error("EINVAL", "no hosts configured");
+  }
+
+  thread_running_ = true;
+  thread_shutdown_ = false;
+  thread_ = std::thread(&KafkaTarget::runUploadThread, this);
+  return ReturnCode::success();
+}
+
+void KafkaTarget::stopUploadThread() {
+  if (!thread_running_) {
+    return;
+  }
+
+  {
+    std::unique_lock<std::mutex> lk(mutex_);
+    thread_shutdown_ = true;
+  }
+
+  cv_.notify_all();
+  queue_space_cv_.notify_all();
+  thread_.join();
+  thread_running_ = false;
+}
+
+void KafkaTarget::getStats(std::string* stats) const {
+  size_t queue_depth;
+  {
+    std::unique_lock<std::mutex> lk(mutex_);
+    queue_depth = queue_.size();
+  }
+
+  *stats += StringUtil::format(
+      "{\"queue_depth\":$0,\"buffered\":$1,\"enqueued\":$2," \
+      "\"events_sent\":$3,\"events_dropped\":$4,\"batches_sent\":$5," \
+      "\"batches_failed\":$6,\"bytes_sent\":$7,\"bytes_uncompressed\":$8}",
+      queue_depth,
+      stats_.buffered_events.load(),
+      stats_.events_enqueued.load(),
+      stats_.events_sent.load(),
+      stats_.events_dropped.load(),
+      stats_.batches_sent.load(),
+      stats_.batches_failed.load(),
+      stats_.bytes_sent.load(),
+      stats_.bytes_uncompressed.load());
+}
+
+/**
+ * The upload thread moves records from the queue into per-partition
+ * batches and sends all ready batches (full, lingered long enough or due
+ * for a retry) with one produce request per leader broker. Records are only
+ * taken from the queue while fewer than max_queue_length records are
+ * buffered in batches, so a slow or unavailable cluster blocks the
+ * producers instead of growing the buffers without bound
+ */
+void KafkaTarget::runUploadThread() {
+  std::vector<QueuedRecord> records;
+  for (;;) {
+    bool shutdown;
+    {
+      std::unique_lock<std::mutex> lk(mutex_);
+      for (;;) {
+        shutdown = thread_shutdown_;
+        if (shutdown) {
+          break;
+        }
+
+        bool can_drain =
+            unassigned_.empty() &&
+            stats_.buffered_events < max_queue_length_;
+
+        if (can_drain && !queue_.empty()) {
+          break;
+        }
+
+        auto now = MonotonicClock::now();
+        auto deadline = getNextDeadline(now);
+        if (deadline <= now) {
+          break;
+        }
+
+        cv_.wait_for(lk, std::chrono::microseconds(deadline - now));
+      }
+
+      if (shutdown ||
+          (unassigned_.empty() &&
+           stats_.buffered_events < max_queue_length_)) {
+        while (!queue_.empty()) {
+          records.emplace_back(std::move(queue_.front()));
+          queue_.pop_front();
+        }
+
+        queue_space_cv_.notify_all();
+      }
+    }
+
+    auto now = MonotonicClock::now();
+    for (auto& r : records) {
+      assignRecord(std::move(r), now);
+    }
+
+    records.clear();
+
+    if ((need_metadata_ && now >= metadata_retry_at_) ||
+        now >= metadata_expires_) {
+      refreshMetadata(now);
+
+      std::vector<QueuedRecord> retry;
+      retry.swap(unassigned_);
+      for (auto& r : retry) {
+        assignRecord(std::move(r), now);
+      }
+    }
+
+    sendBatches(now, false);
+
+    if (shutdown) {
+      break;
+    }
+  }
+
+  /* flush everything that is still buffered. we give up once the request
+     timeout has passed or all batches ran out of retries */
+  auto deadline = MonotonicClock::now() + request_timeout_;
+  while (stats_.buffered_events > 0 || !unassigned_.empty()) {
+    auto now = MonotonicClock::now();
+    if (now >= deadline) {
+      break;
+    }
+
+    if (need_metadata_) {
+      refreshMetadata(now);
+    }
+
+    std::vector<QueuedRecord> retry;
+    retry.swap(unassigned_);
+    for (auto& r : retry) {
+      assignRecord(std::move(r), now);
+    }
+
+    if (sendBatches(now, true) == 0) {
+      usleep(std::min(retry_backoff_, deadline - now));
+    }
+  }
+
+  size_t dropped = unassigned_.size();
+  unassigned_.clear();
+  for (const auto& p : partitions_) {
+    for (const auto& b : p.second) {
+      dropped += b.records.size();
+    }
+  }
+
+  partitions_.clear();
+  if (dropped > 0) {
+    dropRecords(dropped, "shutting down");
+  }
+
+  stats_.buffered_events = 0;
+}
+
+uint64_t KafkaTarget::getNextDeadline(uint64_t now) const {
+  uint64_t deadline = std::min(now + request_timeout_, metadata_expires_);
+  if (need_metadata_ || !unassigned_.empty()) {
+    deadline = std::min(deadline, std::max(metadata_retry_at_, now + 1));
+  }
+
+  for (const auto& p : partitions_) {
+    if (p.second.empty() || getLeader(p.first) < 0) {
+      continue;
+    }
+
+    const auto& batch = p.second.front();
+    if (batch.attempt > 0) {
+      deadline = std::min(deadline, batch.retry_at);
+    } else {
+      deadline = std::min(deadline, batch.created + batch_linger_);
+    }
+  }
+
+  return deadline;
+}
+
+void KafkaTarget::assignRecord(QueuedRecord&& record, uint64_t now) {
+  auto topic = topics_.find(record.topic);
+  if (topic == topics_.end() || topic->second.leaders.empty()) {
+    need_metadata_ = true;
+    unassigned_.emplace_back(std::move(record));
+    return;
+  }
+
+  auto& state = topic->second;
+  auto num_partitions = state.leaders.size();
+
+  int32_t partition;
+  if (record.record.has_key) {
+    auto hash = murmur2(record.record.key.data(), record.record.key.size());
+    partition = (hash & 0x7fffffff) % num_partitions;
+  } else {
+    /* keyless records stick to one partition until its batch is full or
+       sent, so that they are sent in large batches */
+    partition = state.sticky_partition % num_partitions;
+    auto queue = partitions_.find(TopicPartition(record.topic, partition));
+    if (queue == partitions_.end() ||
+        queue->second.empty() ||
+        !canAppend(queue->second.back(), record.record)) {
+      state.sticky_partition = (state.sticky_partition + 1) % num_partitions;
+      partition = state.sticky_partition;
+    }
+  }
+
+  ++stats_.buffered_events;
+  appendRecord(
+      TopicPartition(std::move(record.topic), partition),
+      std::move(record.record),
+      now);
+}
+
+void KafkaTarget::appendRecord(
+    const TopicPartition& tp,
+    KafkaRecord&& record,
+    uint64_t now) {
+  auto& queue = partitions_[tp];
+  if (queue.empty() || !canAppend(queue.back(), record)) {
+    ProduceBatch batch;
+    batch.size_bytes = 0;
+    batch.created = now;
+    batch.attempt = 0;
+    batch.retry_at = 0;
+    queue.emplace_back(std::move(batch));
+  }
+
+  auto& batch = queue.back();
+  batch.size_bytes += record.key.size() + record.value.size();
+  batch.records.emplace_back(std::move(record));
+}
+
+bool KafkaTarget::canAppend(
+    const ProduceBatch& batch,
+    const KafkaRecord& record) const {
+  if (batch.attempt > 0 || batch.records.size() >= batch_max_events_) {
+    return false;
+  }
+
+  auto size = record.key.size() + record.value.size();
+  return batch.records.empty() || batch.size_bytes + size <= batch_max_bytes_;
+}
+
+bool KafkaTarget::isReady(const PartitionQueue& queue, uint64_t now) const {
+  const auto& batch = queue.front();
+  if (batch.attempt > 0) {
+    return now >= batch.retry_at;
+  }
+
+  return
+      queue.size() > 1 ||
+      batch.records.size() >= batch_max_events_ ||
+      batch.size_bytes >= batch_max_bytes_ ||
+      now >= batch.created + batch_linger_;
+}
+
+void KafkaTarget::refreshMetadata(uint64_t now) {
+  std::vector<std::string> topics;
+  for (const auto& t : topics_) {
+    topics.emplace_back(t.first);
+  }
+
+  for (const auto& r : unassigned_) {
+    if (std::find(topics.begin(), topics.end(), r.topic) == topics.end()) {
+      topics.emplace_back(r.topic);
+    }
+  }
+
+  if (topics.empty()) {
+    need_metadata_ = false;
+    metadata_expires_ = now + kMetadataMaxAgeMicros;
+    return;
+  }
+
+  metadata_retry_at_ = now + retry_backoff_;
+
+  /* ask any broker we know, starting with the ones from the last metadata
+     response and falling back to the bootstrap brokers */
+  std::vector<KafkaBrokerConnection*> candidates;
+  for (const auto& b : brokers_) {
+    candidates.emplace_back(b.second.get());
+  }
+
+  for (const auto& b : bootstrap_) {
+    candidates.emplace_back(b.get());
+  }
+
+  KafkaMetadata metadata;
+  auto rc = ReturnCode::error("EIO", "no brokers");
+  for (auto conn : candidates) {
+    metadata = KafkaMetadata();
+    auto correlation_id = next_correlation_id_++;
+    std::string req;
+    encodeKafkaMetadataRequest(correlation_id, client_id_, topics, &req);
+
+    auto deadline = MonotonicClock::now() + request_timeout_;
+    std::string res;
+    rc = conn->sendRequest(req, deadline);
+    if (rc.isSuccess()) {
+      rc = conn->readResponse(correlation_id, &res, deadline);
+    }
+
+    if (rc.isSuccess()) {
+      rc = decodeKafkaMetadataResponse(res, &metadata);
+    }
+
+    if (rc.isSuccess()) {
+      break;
+    }
+
+    conn->close();
+    auto msg = StringUtil::format(
+        "kafka metadata request to $0:$1 failed: $2",
+        conn->getHost(),
+        conn->getPort(),
+        rc.getMessage());
+
+    evcollect_log(EVCOLLECT_LOG_DEBUG, msg.c_str());
+  }
+
+  if (!rc.isSuccess()) {
+    auto msg = StringUtil::format(
+        "error while fetching kafka metadata: $0",
+        rc.getMessage());
+
+    evcollect_log(EVCOLLECT_LOG_WARNING, msg.c_str());
+    return;
+  }
+
+  for (const auto& b : metadata.brokers) {
+    auto& conn = brokers_[b.node_id];
+    if (!conn || conn->getHost() != b.host || conn->getPort() != b.port) {
+      conn.reset(new KafkaBrokerConnection(b.host, b.port));
+    }
+  }
+
+  need_metadata_ = false;
+  metadata_expires_ = now + kMetadataMaxAgeMicros;
+  for (const auto& t : metadata.topics) {
+    if (t.error != kKafkaErrorNone && !isRetriableKafkaError(t.error)) {
+      size_t dropped = 0;
+      auto iter = unassigned_.begin();
+      while (iter != unassigned_.end()) {
+        if (iter->topic == t.topic) {
+          iter = unassigned_.erase(iter);
+          ++dropped;
+        } else {
+          ++iter;
+        }
+      }
+
+      auto err = getKafkaError(t.error);
+      dropRecords(
+          dropped,
+          StringUtil::format("topic $0: $1", t.topic, err.getMessage()));
+      continue;
+    }
+
+    if (t.error != kKafkaErrorNone || t.partitions.empty()) {
+      need_metadata_ = true;
+      continue;
+    }
+
+    auto& state = topics_[t.topic];
+    bool new_topic = state.leaders.empty();
+    state.leaders.clear();
+    for (const auto& p : t.partitions) {
+      if (p.partition < 0) {
+        continue;
+      }
+
+      if (state.leaders.size() <= size_t(p.partition)) {
+        state.leaders.resize(p.partition + 1, -1);
+      }
+
+      state.leaders[p.partition] = p.leader;
+      if (p.leader < 0) {
+        need_metadata_ = true;
+      }
+    }
+
+    if (new_topic) {
+      state.sticky_partition = next_correlation_id_ % state.leaders.size();
+    }
+  }
+}
+
+/**
+ * Send the first batch of each ready partition, with one produce request
+ * per leader. All requests are sent before any response is read so that
+ * the brokers work on them in parallel. Returns the number of batches sent
+ */
+size_t KafkaTarget::sendBatches(uint64_t now, bool flush) {
+  std::map<int32_t, std::vector<TopicPartition>> by_leader;
+  for (const auto& p : partitions_) {
+    if (p.second.empty() || (!flush && !isReady(p.second, now))) {
+      continue;
+    }
+
+    auto leader = getLeader(p.first);
+    if (leader < 0 || !getBroker(leader)) {
+      need_metadata_ = true;
+      continue;
+    }
+
+    by_leader[leader].emplace_back(p.first);
+  }
+
+  struct ProduceRequest {
+    KafkaBrokerConnection* conn;
+    int32_t correlation_id;
+    std::vector<TopicPartition> partitions;
+    std::vector<size_t> sizes;
+    ReturnCode rc;
+  };
+
+  std::vector<ProduceRequest> requests;
+  auto deadline = MonotonicClock::now() + request_timeout_;
+  for (auto& l : by_leader) {
+    ProduceRequest req = {
+      getBroker(l.first),
+      next_correlation_id_++,
+      std::move(l.second),
+      {},
+      ReturnCode::success()
+    };
+
+    std::vector<KafkaProduceTopic> topics;
+    for (const auto& tp : req.partitions) {
+      if (topics.empty() || topics.back().topic != tp.first) {
+        topics.emplace_back();
+        topics.back().topic = tp.first;
+      }
+
+      KafkaProducePartition partition;
+      partition.partition = tp.second;
+      encodeBatch(partitions_[tp].front(), &partition.record_batch);
+      req.sizes.emplace_back(partition.record_batch.size());
+      topics.back().partitions.emplace_back(std::move(partition));
+    }
+
+    std::string buf;
+    encodeKafkaProduceRequest(
+        req.correlation_id,
+        client_id_,
+        acks_,
+        request_timeout_ / kMicrosPerMilli,
+        topics,
+        &buf);
+
+    req.rc = req.conn->sendRequest(buf, deadline);
+    requests.emplace_back(std::move(req));
+  }
+
+  size_t num_batches = 0;
+  for (auto& req : requests) {
+    num_batches += req.partitions.size();
+
+    std::vector<KafkaProduceResult> results;
+    if (req.rc.isSuccess() && acks_ != 0) {
+      std::string res;
+      req.rc = req.conn->readResponse(req.correlation_id, &res, deadline);
+      if (req.rc.isSuccess()) {
+        req.rc = decodeKafkaProduceResponse(res, &results);
+      }
+    }
+
+    if (!req.rc.isSuccess()) {
+      req.conn->close();
+      for (const auto& tp : req.partitions) {
+        failBatch(tp, req.rc, true, now);
+      }
+
+      continue;
+    }
+
+    for (size_t i = 0; i < req.partitions.size(); ++i) {
+      const auto& tp = req.partitions[i];
+      if (acks_ == 0) {
+        completeBatch(tp, req.sizes[i]);
+        continue;
+      }
+
+      auto result = std::find_if(
+          results.begin(),
+          results.end(),
+          [&tp] (const KafkaProduceResult& r) {
+            return r.topic == tp.first && r.partition == tp.second;
+          });
+
+      if (result == results.end()) {
+        failBatch(
+            tp,
+            ReturnCode::error("EIO", "partition missing in response"),
+            false,
+            now);
+      } else if (result->error == kKafkaErrorNone) {
+        completeBatch(tp, req.sizes[i]);
+      } else {
+        failBatch(
+            tp,
+            getKafkaError(result->error),
+            isMetadataKafkaError(result->error),
+            now);
+      }
+    }
+  }
+
+  for (auto iter = partitions_.begin(); iter != partitions_.end(); ) {
+    if (iter->second.empty()) {
+      iter = partitions_.erase(iter);
+    } else {
+      ++iter;
+    }
+  }
+
+  return num_batches;
+}
+
+void KafkaTarget::encodeBatch(
+    const ProduceBatch& batch,
+    std::string* record_batch) {
+  int64_t first_timestamp = batch.records.front().timestamp;
+  int64_t max_timestamp = first_timestamp;
+  for (const auto& r : batch.records) {
+    max_timestamp = std::max(max_timestamp, r.timestamp);
+  }
+
+  std::string records;
+  encodeKafkaRecords(batch.records, first_timestamp, &records);
+
+  int16_t compression = kKafkaCompressionNone;
+#ifdef HAVE_ZLIB
+  if (gzip_) {
+    std::string compressed;
+    auto rc = gzip_->compress(records, &compressed);
+    if (rc.isSuccess()) {
+      records.swap(compressed);
+      compression = kKafkaCompressionGzip;
+    } else {
+      auto msg = StringUtil::format(
+          "gzip compression failed, sending uncompressed batch: $0",
+          rc.getMessage());
+
+      evcollect_log(EVCOLLECT_LOG_WARNING, msg.c_str());
+    }
+  }
+#endif
+
+  encodeKafkaRecordBatch(
+      records,
+      batch.records.size(),
+      first_timestamp,
+      max_timestamp,
+      compression,
+      record_batch);
+}
+
+void KafkaTarget::completeBatch(const TopicPartition& tp, size_t bytes) {
+  auto& queue = partitions_[tp];
+  auto num_records = queue.front().records.size();
+  stats_.bytes_uncompressed += queue.front().size_bytes;
+
+  auto msg = StringUtil::format(
+      "kafka batch upload: topic=$0 partition=$1 events=$2 bytes=$3",
+      tp.first,
+      tp.second,
+      num_records,
+      bytes);
+
+  evcollect_log(EVCOLLECT_LOG_DEBUG, msg.c_str());
+
+  stats_.events_sent += num_records;
+  stats_.bytes_sent += bytes;
+  ++stats_.batches_sent;
+  stats_.buffered_events -= num_records;
+  queue.pop_front();
+}
+
+void KafkaTarget::failBatch(
+    const TopicPartition& tp,
+    const ReturnCode& rc,
+    bool refresh_metadata,
+    uint64_t now) {
+  ++stats_.batches_failed;
+  if (refresh_metadata) {
+    need_metadata_ = true;
+    metadata_retry_at_ = 0;
+  }
+
+  auto& queue = partitions_[tp];
+  auto& batch = queue.front();
+  ++batch.attempt;
+
+  if (rc.getCode() != "EIO" || batch.attempt > retry_max_attempts_) {
+    auto num_records = batch.records.size();
+    stats_.buffered_events -= num_records;
+    queue.pop_front();
+    dropRecords(
+        num_records,
+        StringUtil::format(
+            "topic $0 partition $1: $2",
+            tp.first,
+            tp.second,
+            rc.getMessage()));
+    return;
+  }
+
+  auto backoff = retry_backoff_ << std::min(batch.attempt - 1, size_t(16));
+  auto max_backoff = kMaxRetryBackoffMicros;
+  backoff = std::min(backoff, max_backoff);
+  batch.retry_at = now + backoff;
+
+  auto msg = StringUtil::format(
+      "error while uploading batch of $0 events to kafka topic $1 partition " \
+      "$2, retrying in $3ms: $4",
+      batch.records.size(),
+      tp.first,
+      tp.second,
+      backoff / kMicrosPerMilli,
+      rc.getMessage());
+
+  evcollect_log(EVCOLLECT_LOG_WARNING, msg.c_str());
+}
+
+void KafkaTarget::dropRecords(size_t num_records, const std::string& reason) {
+  if (num_records == 0) {
+    return;
+  }
+
+  stats_.events_dropped += num_records;
+  auto msg = StringUtil::format(
+      "dropping $0 events for kafka: $1",
+      num_records,
+      reason);
+
+  evcollect_log(EVCOLLECT_LOG_ERROR, msg.c_str());
+}
+
+int32_t KafkaTarget::getLeader(const TopicPartition& tp) const {
+  auto topic = topics_.find(tp.first);
+  if (topic == topics_.end() ||
+      size_t(tp.second) >= topic->second.leaders.size()) {
+    return -1;
+  }
+
+  return topic->second.leaders[tp.second];
+}
+
+KafkaBrokerConnection* KafkaTarget::getBroker(int32_t node_id) {
+  auto broker = brokers_.find(node_id);
+  if (broker == brokers_.end()) {
+    return nullptr;
+  } else {
+    return broker->second.get();
+  }
+}
+
+} // namespace plugins_kafka
+} // namespace evcollect
+
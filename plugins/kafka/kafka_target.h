@@ -0,0 +1,212 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <evcollect/evcollect.h>
+#include <evcollect/util/gzip.h>
+#include <evcollect/util/time.h>
+#include <evcollect/util/return_code.h>
+#include "kafka_broker.h"
+#include "kafka_protocol.h"
+
+namespace evcollect {
+namespace plugin_kafka {
+
+class KafkaTarget {
+public:
+
+  static const uint16_t kDefaultPort = 9092;
+  static const uint64_t kDefaultRequestTimeoutMicros = 30 * kMicrosPerSecond;
+  static const size_t kDefaultMaxQueueLength = 8192;
+  static const size_t kDefaultBatchMaxEvents = 1024;
+  static const size_t kDefaultBatchMaxBytes = 512 * 1024;
+  static const uint64_t kDefaultBatchLingerMicros = 100 * kMicrosPerMilli;
+  static const int16_t kDefaultAcks = 1;
+  static const size_t kDefaultRetryMaxAttempts = 8;
+  static const uint64_t kDefaultRetryBackoffMicros = 100 * kMicrosPerMilli;
+  static const uint64_t kMaxRetryBackoffMicros = 10 * kMicrosPerSecond;
+  static const uint64_t kMetadataMaxAgeMicros = 5 * kMicrosPerMinute;
+
+  KafkaTarget();
+  ~KafkaTarget();
+
+  /**
+   * Add a bootstrap broker. The actual partition leaders are discovered
+   * through a metadata request to any of the bootstrap brokers
+   */
+  void addBroker(const std::string& hostname, uint16_t port);
+
+  /**
+   * Route events matching event_name_match (an exact event name or a glob
+   * pattern) to topic, where "%E" in topic is replaced by the event name
+   */
+  ReturnCode addRoute(
+      const std::string& event_name_match,
+      const std::string& topic);
+
+  /**
+   * Use the value of the top-level field in each event's JSON body as the
+   * message key. Keyed events are partitioned by murmur2(key) like the Java
+   * client does, so all events with the same key end up in one partition.
+   * Events without the field are spread across partitions in batches
+   */
+  void setPartitionKey(const std::string& field);
+
+  /**
+   * acks is "0" (don't wait for the broker), "1" (wait for the leader) or
+   * "all"/"-1" (wait for all in-sync replicas)
+   */
+  ReturnCode setAcks(const std::string& acks);
+  ReturnCode setCompression(const std::string& compression, int level);
+  void setClientID(const std::string& client_id);
+  void setRequestTimeout(uint64_t usecs);
+  void setMaxQueueLength(size_t queue_len);
+  void setBatchMaxEvents(size_t max_events);
+  void setBatchMaxBytes(size_t max_bytes);
+  void setBatchLinger(uint64_t usecs);
+  void setRetryMaxAttempts(size_t max_attempts);
+  void setRetryBackoff(uint64_t usecs);
+
+  ReturnCode emitEvent(
+    const std::string& event_name,
+    const std::string& event_data);
+
+  ReturnCode startUploadThread();
+  void stopUploadThread();
+
+  /**
+   * Write the counters of this target as a JSON object to stats. May be
+   * called from any thread
+   */
+  void getStats(std::string* stats) const;
+
+protected:
+
+  struct Route {
+    std::string event_name_match;
+    std::string topic;
+    bool topic_is_template;
+  };
+
+  struct QueuedRecord {
+    std::string topic;
+    KafkaRecord record;
+  };
+
+  /**
+   * Records for a single partition that are sent as one record batch. A
+   * batch that failed is retried as is and never receives new records, so
+   * the order of records in a partition is preserved
+   */
+  struct ProduceBatch {
+    std::vector<KafkaRecord> records;
+    size_t size_bytes;
+    uint64_t created;
+    size_t attempt;
+    uint64_t retry_at;
+  };
+
+  using TopicPartition = std::pair<std::string, int32_t>;
+  using PartitionQueue = std::deque<ProduceBatch>;
+
+  struct TopicState {
+    std::vector<int32_t> leaders;
+    size_t sticky_partition;
+  };
+
+  struct KafkaStats {
+    std::atomic<uint64_t> events_enqueued;
+    std::atomic<uint64_t> events_sent;
+    std::atomic<uint64_t> events_dropped;
+    std::atomic<uint64_t> batches_sent;
+    std::atomic<uint64_t> batches_failed;
+    std::atomic<uint64_t> bytes_sent;
+    std::atomic<uint64_t> bytes_uncompressed;
+    std::atomic<uint64_t> buffered_events;
+  };
+
+  void runUploadThread();
+  uint64_t getNextDeadline(uint64_t now) const;
+  void assignRecord(QueuedRecord&& record, uint64_t now);
+  void appendRecord(
+      const TopicPartition& tp,
+      KafkaRecord&& record,
+      uint64_t now);
+  bool canAppend(const ProduceBatch& batch, const KafkaRecord& record) const;
+  bool isReady(const PartitionQueue& queue, uint64_t now) const;
+  void refreshMetadata(uint64_t now);
+  size_t sendBatches(uint64_t now, bool flush);
+  void encodeBatch(const ProduceBatch& batch, std::string* record_batch);
+  void completeBatch(const TopicPartition& tp, size_t bytes);
+  void failBatch(
+      const TopicPartition& tp,
+      const ReturnCode& rc,
+      bool refresh_metadata,
+      uint64_t now);
+  void dropRecords(size_t num_records, const std::string& reason);
+  int32_t getLeader(const TopicPartition& tp) const;
+  KafkaBrokerConnection* getBroker(int32_t node_id);
+
+  std::vector<std::unique_ptr<KafkaBrokerConnection>> bootstrap_;
+  std::map<int32_t, std::unique_ptr<KafkaBrokerConnection>> brokers_;
+  std::map<std::string, TopicState> topics_;
+  std::map<TopicPartition, PartitionQueue> partitions_;
+  std::vector<QueuedRecord> unassigned_;
+  std::vector<Route> routes_;
+  std::string partition_key_;
+  std::string client_id_;
+  int16_t acks_;
+  uint64_t request_timeout_;
+  size_t max_queue_length_;
+  size_t batch_max_events_;
+  size_t batch_max_bytes_;
+  uint64_t batch_linger_;
+  size_t retry_max_attempts_;
+  uint64_t retry_backoff_;
+  bool need_metadata_;
+  uint64_t metadata_retry_at_;
+  uint64_t metadata_expires_;
+  int32_t next_correlation_id_;
+  std::deque<QueuedRecord> queue_;
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable queue_space_cv_;
+  std::thread thread_;
+  bool thread_running_;
+  bool thread_shutdown_;
+  KafkaStats stats_;
+#ifdef HAVE_ZLIB
+  std::unique_ptr<GzipCompressor> gzip_;
+#endif
+};
+
+} // namespace plugins_kafka
+} // namespace evcollect
+
@@ -0,0 +1,586 @@
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <evcollect/evcollect.h>
+#include <evcollect/util/testing.h>
+#include <evcollect/util/time.h>
+#include "kafka_protocol.h"
+#include "kafka_target.h"
+
+using namespace evcollect::plugin_kafka;
+
+/* the plugin usually resolves this symbol from the evcollectd binary */
+void evcollect_log(evcollect_loglevel level, const char* msg) {}
+
+static bool gunzip(const std::string& in, std::string* out) {
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  if (inflateInit2(&z, 15 + 32) != Z_OK) {
+    return false;
+  }
+
+  z.next_in = (Bytef*) in.data();
+  z.avail_in = in.size();
+
+  char chunk[4096];
+  int rc;
+  do {
+    z.next_out = (Bytef*) chunk;
+    z.avail_out = sizeof(chunk);
+    rc = inflate(&z, Z_NO_FLUSH);
+    out->append(chunk, sizeof(chunk) - z.avail_out);
+  } while (rc == Z_OK);
+
+  inflateEnd(&z);
+  return rc == Z_STREAM_END;
+}
+
+/**
+ * A single-node Kafka cluster that speaks just enough of the protocol for
+ * the producer: Metadata v4 and Produce v3. Every topic is auto-created
+ * with num_partitions partitions. The handler returns the error code for
+ * each partition in a produce request; records are only stored on success
+ */
+class MockKafkaBroker {
+public:
+
+  using HandlerFn = std::function<int16_t (size_t request_idx)>;
+
+  struct StoredRecord {
+    bool has_key;
+    std::string key;
+    std::string value;
+  };
+
+  MockKafkaBroker(
+      int32_t num_partitions,
+      HandlerFn handler = [] (size_t) { return kKafkaErrorNone; }) :
+      num_partitions_(num_partitions),
+      handler_(handler),
+      num_produce_requests_(0),
+      num_metadata_requests_(0),
+      num_records_(0),
+      num_gzip_batches_(0) {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    bind(listen_fd_, (struct sockaddr*) &addr, sizeof(addr));
+    listen(listen_fd_, 16);
+
+    socklen_t addr_len = sizeof(addr);
+    getsockname(listen_fd_, (struct sockaddr*) &addr, &addr_len);
+    port_ = ntohs(addr.sin_port);
+
+    thread_ = std::thread([this] () {
+      int fd;
+      while ((fd = accept(listen_fd_, NULL, NULL)) >= 0) {
+        std::unique_lock<std::mutex> lk(mutex_);
+        conns_.emplace_back(fd);
+        conn_threads_.emplace_back(&MockKafkaBroker::serve, this, fd);
+      }
+    });
+  }
+
+  ~MockKafkaBroker() {
+    shutdown(listen_fd_, SHUT_RDWR);
+    close(listen_fd_);
+    thread_.join();
+
+    for (auto fd : conns_) {
+      shutdown(fd, SHUT_RDWR);
+    }
+
+    for (auto& t : conn_threads_) {
+      t.join();
+    }
+
+    for (auto fd : conns_) {
+      close(fd);
+    }
+  }
+
+  uint16_t getPort() const {
+    return port_;
+  }
+
+  size_t getNumProduceRequests() const {
+    return num_produce_requests_;
+  }
+
+  size_t getNumMetadataRequests() const {
+    return num_metadata_requests_;
+  }
+
+  size_t getNumRecords() const {
+    return num_records_;
+  }
+
+  size_t getNumGzipBatches() const {
+    return num_gzip_batches_;
+  }
+
+  std::map<std::pair<std::string, int32_t>, std::vector<StoredRecord>>
+      getRecords() {
+    std::unique_lock<std::mutex> lk(mutex_);
+    return records_;
+  }
+
+  /**
+   * Wait until fn returns true, returns false after timeout microseconds
+   */
+  bool waitFor(std::function<bool ()> fn, uint64_t timeout) {
+    auto deadline = MonotonicClock::now() + timeout;
+    while (!fn()) {
+      if (MonotonicClock::now() > deadline) {
+        return false;
+      }
+
+      usleep(1000);
+    }
+
+    return true;
+  }
+
+protected:
+
+  bool readFully(int fd, char* data, size_t size) {
+    while (size > 0) {
+      auto n = read(fd, data, size);
+      if (n <= 0) {
+        return false;
+      }
+
+      data += n;
+      size -= n;
+    }
+
+    return true;
+  }
+
+  void serve(int fd) {
+    for (;;) {
+      char size_buf[4];
+      if (!readFully(fd, size_buf, sizeof(size_buf))) {
+        return;
+      }
+
+      int32_t size;
+      KafkaReader(size_buf, sizeof(size_buf)).readInt32(&size);
+      std::string req(size, 0);
+      if (!readFully(fd, &req[0], size)) {
+        return;
+      }
+
+      KafkaReader reader(req.data(), req.size());
+      int16_t api_key;
+      int16_t api_version;
+      int32_t correlation_id;
+      std::string client_id;
+      reader.readInt16(&api_key);
+      reader.readInt16(&api_version);
+      reader.readInt32(&correlation_id);
+      reader.readString(&client_id);
+
+      std::string res;
+      KafkaWriter writer(&res);
+      writer.putInt32(0);
+      writer.putInt32(correlation_id);
+
+      bool respond = true;
+      switch (api_key) {
+        case kKafkaAPIKeyMetadata:
+          handleMetadata(&reader, &writer);
+          break;
+        case kKafkaAPIKeyProduce:
+          respond = handleProduce(&reader, &writer);
+          break;
+        default:
+          return;
+      }
+
+      if (!respond) {
+        continue;
+      }
+
+      finishKafkaMessage(&res);
+      if (write(fd, res.data(), res.size()) != (ssize_t) res.size()) {
+        return;
+      }
+    }
+  }
+
+  void handleMetadata(KafkaReader* reader, KafkaWriter* writer) {
+    ++num_metadata_requests_;
+
+    int32_t num_topics;
+    reader->readInt32(&num_topics);
+
+    writer->putInt32(0); // throttle_time_ms
+    writer->putInt32(1); // brokers
+    writer->putInt32(1);
+    writer->putString("127.0.0.1");
+    writer->putInt32(port_);
+    writer->putNullString();
+    writer->putNullString(); // cluster_id
+    writer->putInt32(1); // controller_id
+    writer->putInt32(num_topics);
+    for (int32_t i = 0; i < num_topics; ++i) {
+      std::string topic;
+      reader->readString(&topic);
+      writer->putInt16(kKafkaErrorNone);
+      writer->putString(topic);
+      writer->putInt8(0);
+      writer->putInt32(num_partitions_);
+      for (int32_t p = 0; p < num_partitions_; ++p) {
+        writer->putInt16(kKafkaErrorNone);
+        writer->putInt32(p);
+        writer->putInt32(1); // leader
+        writer->putInt32(1); // replicas
+        writer->putInt32(1);
+        writer->putInt32(1); // isr
+        writer->putInt32(1);
+      }
+    }
+  }
+
+  bool handleProduce(KafkaReader* reader, KafkaWriter* writer) {
+    auto error = handler_(num_produce_requests_++);
+
+    std::string transactional_id;
+    int16_t acks;
+    int32_t timeout;
+    int32_t num_topics;
+    reader->readString(&transactional_id);
+    reader->readInt16(&acks);
+    reader->readInt32(&timeout);
+    reader->readInt32(&num_topics);
+
+    writer->putInt32(num_topics);
+    for (int32_t i = 0; i < num_topics; ++i) {
+      std::string topic;
+      int32_t num_partitions;
+      reader->readString(&topic);
+      reader->readInt32(&num_partitions);
+      writer->putString(topic);
+      writer->putInt32(num_partitions);
+
+      for (int32_t j = 0; j < num_partitions; ++j) {
+        int32_t partition;
+        std::string batch;
+        reader->readInt32(&partition);
+        reader->readBytes(&batch);
+
+        auto partition_error = error;
+        if (partition_error == kKafkaErrorNone &&
+            !storeBatch(topic, partition, batch)) {
+          partition_error = 2; // CORRUPT_MESSAGE
+        }
+
+        writer->putInt32(partition);
+        writer->putInt16(partition_error);
+        writer->putInt64(0);
+        writer->putInt64(-1);
+      }
+    }
+
+    writer->putInt32(0); // throttle_time_ms
+    return acks != 0;
+  }
+
+  bool storeBatch(
+      const std::string& topic,
+      int32_t partition,
+      const std::string& batch) {
+    size_t num_records;
+    int16_t compression;
+    std::string records;
+    if (!decodeKafkaRecordBatch(
+            batch,
+            &num_records,
+            &compression,
+            &records).isSuccess()) {
+      return false;
+    }
+
+    if (compression == kKafkaCompressionGzip) {
+      std::string decompressed;
+      if (!gunzip(records, &decompressed)) {
+        return false;
+      }
+
+      records.swap(decompressed);
+      ++num_gzip_batches_;
+    } else if (compression != kKafkaCompressionNone) {
+      return false;
+    }
+
+    std::vector<KafkaRecord> decoded;
+    if (!decodeKafkaRecords(records, num_records, 0, &decoded).isSuccess()) {
+      return false;
+    }
+
+    std::unique_lock<std::mutex> lk(mutex_);
+    auto& stored = records_[std::make_pair(topic, partition)];
+    for (const auto& r : decoded) {
+      stored.emplace_back(StoredRecord { r.has_key, r.key, r.value });
+    }
+
+    num_records_ += decoded.size();
+    return true;
+  }
+
+  int32_t num_partitions_;
+  HandlerFn handler_;
+  int listen_fd_;
+  uint16_t port_;
+  std::atomic<size_t> num_produce_requests_;
+  std::atomic<size_t> num_metadata_requests_;
+  std::atomic<size_t> num_records_;
+  std::atomic<size_t> num_gzip_batches_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::vector<int> conns_;
+  std::vector<std::thread> conn_threads_;
+  std::map<std::pair<std::string, int32_t>, std::vector<StoredRecord>> records_;
+};
+
+static void configureTarget(KafkaTarget* target, uint16_t port) {
+  target->addBroker("127.0.0.1", port);
+  target->setBatchMaxEvents(10);
+  target->setBatchLinger(kMicrosPerMilli);
+  target->setRetryBackoff(10 * kMicrosPerMilli);
+}
+
+TEST(KafkaProtocol, checksums) {
+  std::string check = "123456789";
+  EXPECT_EQ(crc32c(0, check.data(), check.size()), 0xe3069283);
+
+  /* test vectors from the Java client */
+  EXPECT_EQ(murmur2("21", 2), -973932308);
+  EXPECT_EQ(murmur2("foobar", 6), -790332482);
+  EXPECT_EQ(murmur2("a-little-bit-long-string", 24), -985981536);
+}
+
+TEST(KafkaProtocol, record_batch) {
+  std::vector<KafkaRecord> records;
+  for (int i = 0; i < 3; ++i) {
+    KafkaRecord r;
+    r.has_key = i > 0;
+    r.key = StringUtil::format("key$0", i);
+    r.value = StringUtil::format("{\"n\":$0}", i);
+    r.timestamp = 1000 + i;
+    records.emplace_back(r);
+  }
+
+  std::string encoded;
+  encodeKafkaRecords(records, 1000, &encoded);
+  std::string batch;
+  encodeKafkaRecordBatch(encoded, 3, 1000, 1002, 0, &batch);
+
+  size_t num_records;
+  int16_t compression;
+  std::string decoded_records;
+  ASSERT_TRUE(decodeKafkaRecordBatch(
+      batch,
+      &num_records,
+      &compression,
+      &decoded_records).isSuccess());
+  EXPECT_EQ(num_records, 3);
+  EXPECT_EQ(compression, 0);
+
+  std::vector<KafkaRecord> decoded;
+  ASSERT_TRUE(decodeKafkaRecords(
+      decoded_records,
+      num_records,
+      1000,
+      &decoded).isSuccess());
+  ASSERT_EQ(decoded.size(), 3);
+  EXPECT_EQ(decoded[0].has_key, false);
+  EXPECT_EQ(decoded[2].key, "key2");
+  EXPECT_EQ(decoded[2].value, "{\"n\":2}");
+  EXPECT_EQ(decoded[2].timestamp, 1002);
+
+  batch[batch.size() - 1] ^= 1;
+  EXPECT_FALSE(decodeKafkaRecordBatch(
+      batch,
+      &num_records,
+      &compression,
+      &decoded_records).isSuccess());
+}
+
+TEST(KafkaTarget, produces_batches) {
+  MockKafkaBroker broker(4);
+
+  KafkaTarget target;
+  configureTarget(&target, broker.getPort());
+  ASSERT_TRUE(target.addRoute("test.*", "%E").isSuccess());
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  for (size_t i = 0; i < 100; ++i) {
+    ASSERT_TRUE(target.emitEvent("test.a", "{}").isSuccess());
+    ASSERT_TRUE(target.emitEvent("other", "{}").isSuccess());
+  }
+
+  EXPECT_TRUE(broker.waitFor([&broker] () {
+    return broker.getNumRecords() == 100;
+  }, 5 * kMicrosPerSecond));
+
+  target.stopUploadThread();
+  EXPECT_EQ(broker.getNumRecords(), 100);
+  EXPECT_TRUE(broker.getNumProduceRequests() < 100);
+
+  for (const auto& p : broker.getRecords()) {
+    EXPECT_EQ(p.first.first, "test.a");
+  }
+}
+
+TEST(KafkaTarget, key_partitioning) {
+  MockKafkaBroker broker(4);
+
+  KafkaTarget target;
+  configureTarget(&target, broker.getPort());
+  target.setPartitionKey("user");
+  ASSERT_TRUE(target.addRoute("test", "events").isSuccess());
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  for (size_t i = 0; i < 100; ++i) {
+    auto ev = StringUtil::format(
+        "{\"n\": $0, \"nested\": {\"user\": 1}, \"user\": \"u$1\"}",
+        i,
+        i % 5);
+
+    ASSERT_TRUE(target.emitEvent("test", ev).isSuccess());
+  }
+
+  EXPECT_TRUE(broker.waitFor([&broker] () {
+    return broker.getNumRecords() == 100;
+  }, 5 * kMicrosPerSecond));
+
+  target.stopUploadThread();
+
+  size_t num_records = 0;
+  for (const auto& p : broker.getRecords()) {
+    int last_n = -1;
+    for (const auto& r : p.second) {
+      ASSERT_TRUE(r.has_key);
+      auto hash = murmur2(r.key.data(), r.key.size());
+      EXPECT_EQ((hash & 0x7fffffff) % 4, p.first.second);
+
+      /* records for one key stay in order */
+      auto n = std::stoi(r.value.substr(6));
+      EXPECT_TRUE(n > last_n);
+      last_n = n;
+      ++num_records;
+    }
+  }
+
+  EXPECT_EQ(num_records, 100);
+}
+
+TEST(KafkaTarget, gzip_compression) {
+  MockKafkaBroker broker(1);
+
+  KafkaTarget target;
+  configureTarget(&target, broker.getPort());
+  ASSERT_TRUE(target.setCompression("gzip", 6).isSuccess());
+  ASSERT_TRUE(target.addRoute("test", "events").isSuccess());
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  for (size_t i = 0; i < 20; ++i) {
+    ASSERT_TRUE(target.emitEvent("test", "{\"value\":123}").isSuccess());
+  }
+
+  EXPECT_TRUE(broker.waitFor([&broker] () {
+    return broker.getNumRecords() == 20;
+  }, 5 * kMicrosPerSecond));
+
+  target.stopUploadThread();
+  EXPECT_TRUE(broker.getNumGzipBatches() > 0);
+  EXPECT_EQ(broker.getNumGzipBatches(), broker.getNumProduceRequests());
+
+  auto records = broker.getRecords();
+  ASSERT_EQ(records.size(), 1);
+  for (const auto& r : records.begin()->second) {
+    EXPECT_EQ(r.value, "{\"value\":123}");
+  }
+}
+
+TEST(KafkaTarget, retries_on_leader_change) {
+  MockKafkaBroker broker(2, [] (size_t idx) {
+    return idx < 2 ? kKafkaErrorNotLeaderForPartition : kKafkaErrorNone;
+  });
+
+  KafkaTarget target;
+  configureTarget(&target, broker.getPort());
+  ASSERT_TRUE(target.addRoute("test", "events").isSuccess());
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  for (size_t i = 0; i < 10; ++i) {
+    ASSERT_TRUE(target.emitEvent("test", "{}").isSuccess());
+  }
+
+  EXPECT_TRUE(broker.waitFor([&broker] () {
+    return broker.getNumRecords() == 10;
+  }, 5 * kMicrosPerSecond));
+
+  target.stopUploadThread();
+  EXPECT_EQ(broker.getNumRecords(), 10);
+  EXPECT_TRUE(broker.getNumMetadataRequests() >= 2);
+}
+
+TEST(KafkaTarget, drops_on_fatal_error) {
+  MockKafkaBroker broker(1, [] (size_t idx) {
+    return kKafkaErrorMessageTooLarge;
+  });
+
+  KafkaTarget target;
+  configureTarget(&target, broker.getPort());
+  ASSERT_TRUE(target.addRoute("test", "events").isSuccess());
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  for (size_t i = 0; i < 10; ++i) {
+    ASSERT_TRUE(target.emitEvent("test", "{}").isSuccess());
+  }
+
+  usleep(200 * kMicrosPerMilli);
+  target.stopUploadThread();
+  EXPECT_EQ(broker.getNumRecords(), 0);
+
+  std::string stats;
+  target.getStats(&stats);
+  EXPECT_TRUE(stats.find("\"events_dropped\":10,") != std::string::npos);
+}
+
+TEST(KafkaTarget, acks_zero) {
+  MockKafkaBroker broker(2);
+
+  KafkaTarget target;
+  configureTarget(&target, broker.getPort());
+  ASSERT_TRUE(target.setAcks("0").isSuccess());
+  ASSERT_TRUE(target.addRoute("test", "events").isSuccess());
+  ASSERT_TRUE(target.startUploadThread().isSuccess());
+
+  for (size_t i = 0; i < 50; ++i) {
+    ASSERT_TRUE(target.emitEvent("test", "{}").isSuccess());
+  }
+
+  EXPECT_TRUE(broker.waitFor([&broker] () {
+    return broker.getNumRecords() == 50;
+  }, 5 * kMicrosPerSecond));
+
+  target.stopUploadThread();
+  EXPECT_EQ(broker.getNumRecords(), 50);
+}
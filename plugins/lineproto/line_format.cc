@@ -0,0 +1,558 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <algorithm>
+#include <ctype.h>
+#include <fnmatch.h>
+#include <string.h>
+#include <evcollect/util/stringutil.h>
+#include <evcollect/util/time.h>
+#include "line_format.h"
+
+namespace evcollect {
+namespace plugin_lineproto {
+
+ReturnCode parseLineFormat(const std::string& str, LineFormat* format) {
+  if (str == "statsd") {
+    *format = LineFormat::STATSD;
+    return ReturnCode::success();
+  }
+
+  if (str == "graphite") {
+    *format = LineFormat::GRAPHITE;
+    return ReturnCode::success();
+  }
+
+  if (str == "influx") {
+    *format = LineFormat::INFLUX;
+    return ReturnCode::success();
+  }
+
+  return ReturnCode::error(
+      "EINVAL",
+      "invalid format: '%s' -- must be 'statsd', 'graphite' or 'influx'",
+      str.c_str());
+}
+
+namespace {
+
+class JSONFlattener {
+public:
+
+  JSONFlattener(
+      const std::string& json,
+      std::vector<JSONField>* fields) :
+      json_(json),
+      fields_(fields),
+      pos_(0) {}
+
+  bool flatten() {
+    skipWhitespace();
+    if (!readObject("")) {
+      return false;
+    }
+
+    skipWhitespace();
+    return pos_ == json_.size();
+  }
+
+protected:
+
+  void skipWhitespace() {
+    while (pos_ < json_.size() && isspace((unsigned char) json_[pos_])) {
+      ++pos_;
+    }
+  }
+
+  bool consume(char c) {
+    if (pos_ < json_.size() && json_[pos_] == c) {
+      ++pos_;
+      return true;
+    }
+
+    return false;
+  }
+
+  bool consume(const char* literal) {
+    auto len = strlen(literal);
+    if (json_.compare(pos_, len, literal) != 0) {
+      return false;
+    }
+
+    pos_ += len;
+    return true;
+  }
+
+  bool readObject(const std::string& prefix) {
+    if (!consume('{')) {
+      return false;
+    }
+
+    skipWhitespace();
+    if (consume('}')) {
+      return true;
+    }
+
+    for (;;) {
+      skipWhitespace();
+      std::string key;
+      if (!readString(&key)) {
+        return false;
+      }
+
+      skipWhitespace();
+      if (!consume(':')) {
+        return false;
+      }
+
+      skipWhitespace();
+      if (!readValue(prefix.empty() ? key : prefix + "." + key)) {
+        return false;
+      }
+
+      skipWhitespace();
+      if (consume('}')) {
+        return true;
+      }
+
+      if (!consume(',')) {
+        return false;
+      }
+    }
+  }
+
+  bool readArray() {
+    if (!consume('[')) {
+      return false;
+    }
+
+    skipWhitespace();
+    if (consume(']')) {
+      return true;
+    }
+
+    /* arrays are skipped, but their elements are validated */
+    auto fields_size = fields_->size();
+    for (;;) {
+      skipWhitespace();
+      if (!readValue("")) {
+        return false;
+      }
+
+      skipWhitespace();
+      if (consume(']')) {
+        fields_->resize(fields_size);
+        return true;
+      }
+
+      if (!consume(',')) {
+        return false;
+      }
+    }
+  }
+
+  bool readValue(const std::string& path) {
+    if (pos_ >= json_.size()) {
+      return false;
+    }
+
+    switch (json_[pos_]) {
+      case '{':
+        return readObject(path);
+      case '[':
+        return readArray();
+      case '"': {
+        JSONField field;
+        field.path = path;
+        field.is_number = false;
+        if (!readString(&field.value)) {
+          return false;
+        }
+
+        fields_->emplace_back(std::move(field));
+        return true;
+      }
+      case 't':
+        fields_->emplace_back(JSONField { path, "1", true });
+        return consume("true");
+      case 'f':
+        fields_->emplace_back(JSONField { path, "0", true });
+        return consume("false");
+      case 'n':
+        return consume("null");
+      default:
+        return readNumber(path);
+    }
+  }
+
+  bool readNumber(const std::string& path) {
+    auto begin = pos_;
+    consume('-');
+    if (pos_ >= json_.size() || !isdigit((unsigned char) json_[pos_])) {
+      return false;
+    }
+
+    while (pos_ < json_.size()) {
+      auto c = json_[pos_];
+      if (!isdigit((unsigned char) c) &&
+          c != '.' && c != 'e' && c != 'E' && c != '+' && c != '-') {
+        break;
+      }
+
+      ++pos_;
+    }
+
+    fields_->emplace_back(
+        JSONField { path, json_.substr(begin, pos_ - begin), true });
+
+    return true;
+  }
+
+  bool readString(std::string* str) {
+    if (!consume('"')) {
+      return false;
+    }
+
+    str->clear();
+    while (pos_ < json_.size()) {
+      char c = json_[pos_++];
+      if (c == '"') {
+        return true;
+      }
+
+      if (c != '\\') {
+        str->push_back(c);
+        continue;
+      }
+
+      if (pos_ >= json_.size()) {
+        return false;
+      }
+
+      c = json_[pos_++];
+      switch (c) {
+        case 'n': str->push_back('\n'); break;
+        case 't': str->push_back('\t'); break;
+        case 'r': str->push_back('\r'); break;
+        case 'b': str->push_back('\b'); break;
+        case 'f': str->push_back('\f'); break;
+        case 'u':
+          /* non-ascii escapes are kept as they are */
+          str->append("\\u");
+          break;
+        default: str->push_back(c); break;
+      }
+    }
+
+    return false;
+  }
+
+  const std::string& json_;
+  std::vector<JSONField>* fields_;
+  size_t pos_;
+};
+
+void expandTemplate(
+    const std::string& event_name,
+    const std::string& field_path,
+    std::string* str) {
+  size_t pos = 0;
+  while ((pos = str->find('%', pos)) != std::string::npos) {
+    if (str->compare(pos, 2, "%E") == 0) {
+      str->replace(pos, 2, event_name);
+      pos += event_name.size();
+    } else if (str->compare(pos, 2, "%F") == 0) {
+      str->replace(pos, 2, field_path);
+      pos += field_path.size();
+    } else {
+      ++pos;
+    }
+  }
+}
+
+/**
+ * Replace the characters that delimit the parts of a line in the given
+ * format with '_'
+ */
+std::string sanitize(const std::string& str, const char* reserved) {
+  auto out = str;
+  for (auto& c : out) {
+    if (strchr(reserved, c) || c == '\n' || c == '\r') {
+      c = '_';
+    }
+  }
+
+  return out;
+}
+
+/**
+ * Influx line protocol escapes delimiters with a backslash instead
+ */
+void appendInfluxEscaped(
+    const std::string& str,
+    const char* reserved,
+    std::string* out) {
+  for (auto c : str) {
+    if (c == '\n' || c == '\r') {
+      out->push_back(' ');
+      continue;
+    }
+
+    if (strchr(reserved, c)) {
+      out->push_back('\\');
+    }
+
+    out->push_back(c);
+  }
+}
+
+} // namespace
+
+bool flattenJSON(const std::string& json, std::vector<JSONField>* fields) {
+  return JSONFlattener(json, fields).flatten();
+}
+
+const char LineFormatter::kDefaultStatsdType[] = "g";
+const char LineFormatter::kDefaultMeasurement[] = "%E";
+
+LineFormatter::LineFormatter(
+    LineFormat format) :
+    format_(format),
+    measurement_(kDefaultMeasurement) {
+  default_mapping_.event_name_match = "*";
+  default_mapping_.field_match = "*";
+  default_mapping_.name = format == LineFormat::INFLUX ? "%F" : "%E.%F";
+  default_mapping_.statsd_type = kDefaultStatsdType;
+}
+
+LineFormat LineFormatter::getFormat() const {
+  return format_;
+}
+
+ReturnCode LineFormatter::addMapping(
+    const std::string& event_name_match,
+    const std::string& field_match,
+    const std::string& name,
+    const std::string& statsd_type) {
+  static const std::vector<std::string> statsd_types = {
+    "g", "c", "ms", "h", "s"
+  };
+
+  if (std::find(statsd_types.begin(), statsd_types.end(), statsd_type) ==
+      statsd_types.end()) {
+    return ReturnCode::error(
+        "EINVAL",
+        "invalid statsd metric type: '%s' -- must be g, c, ms, h or s",
+        statsd_type.c_str());
+  }
+
+  Mapping m;
+  m.event_name_match = event_name_match;
+  m.field_match = field_match;
+  m.name = name.empty() ? default_mapping_.name : name;
+  m.statsd_type = statsd_type;
+  mappings_.emplace_back(m);
+  return ReturnCode::success();
+}
+
+void LineFormatter::addTag(const std::string& key, const std::string& field) {
+  tags_.emplace_back(key, field);
+}
+
+void LineFormatter::setMeasurement(const std::string& measurement) {
+  measurement_ = measurement;
+}
+
+const LineFormatter::Mapping* LineFormatter::findMapping(
+    const std::string& event_name,
+    const std::string& field_path) const {
+  if (mappings_.empty()) {
+    return &default_mapping_;
+  }
+
+  for (const auto& m : mappings_) {
+    if (fnmatch(m.event_name_match.c_str(), event_name.c_str(), 0) == 0 &&
+        fnmatch(m.field_match.c_str(), field_path.c_str(), 0) == 0) {
+      return &m;
+    }
+  }
+
+  return nullptr;
+}
+
+bool LineFormatter::formatEvent(
+    const std::string& event_name,
+    uint64_t time,
+    const std::string& event_data,
+    std::vector<std::string>* lines) const {
+  std::vector<JSONField> fields;
+  if (!flattenJSON(event_data, &fields)) {
+    return false;
+  }
+
+  std::vector<std::pair<std::string, std::string>> tags;
+  for (const auto& t : tags_) {
+    for (const auto& f : fields) {
+      if (f.path == t.second && !f.value.empty()) {
+        tags.emplace_back(t.first, f.value);
+        break;
+      }
+    }
+  }
+
+  std::vector<Metric> metrics;
+  for (const auto& f : fields) {
+    if (!f.is_number) {
+      continue;
+    }
+
+    bool is_tag = false;
+    for (const auto& t : tags_) {
+      is_tag |= f.path == t.second;
+    }
+
+    if (is_tag) {
+      continue;
+    }
+
+    auto mapping = findMapping(event_name, f.path);
+    if (!mapping) {
+      continue;
+    }
+
+    Metric m;
+    m.name = mapping->name;
+    m.field = &f;
+    m.mapping = mapping;
+    expandTemplate(event_name, f.path, &m.name);
+    metrics.emplace_back(std::move(m));
+  }
+
+  if (metrics.empty()) {
+    return true;
+  }
+
+  switch (format_) {
+    case LineFormat::STATSD:
+      formatStatsd(metrics, tags, lines);
+      break;
+    case LineFormat::GRAPHITE:
+      formatGraphite(time, metrics, tags, lines);
+      break;
+    case LineFormat::INFLUX:
+      formatInflux(event_name, time, metrics, tags, lines);
+      break;
+  }
+
+  return true;
+}
+
+/**
+ * <name>:<value>|<type>[|#<key>:<value>,...]
+ */
+void LineFormatter::formatStatsd(
+    const std::vector<Metric>& metrics,
+    const std::vector<std::pair<std::string, std::string>>& tags,
+    std::vector<std::string>* lines) const {
+  std::string tag_suffix;
+  for (const auto& t : tags) {
+    tag_suffix += tag_suffix.empty() ? "|#" : ",";
+    tag_suffix += sanitize(t.first, ":|@#, ");
+    tag_suffix += ":";
+    tag_suffix += sanitize(t.second, "|@#, ");
+  }
+
+  for (const auto& m : metrics) {
+    std::string line = sanitize(m.name, ":|@# ");
+    line += ":";
+    line += m.field->value;
+    line += "|";
+    line += m.mapping->statsd_type;
+    line += tag_suffix;
+    lines->emplace_back(std::move(line));
+  }
+}
+
+/**
+ * <name>[;<key>=<value>...] <value> <unix seconds>
+ */
+void LineFormatter::formatGraphite(
+    uint64_t time,
+    const std::vector<Metric>& metrics,
+    const std::vector<std::pair<std::string, std::string>>& tags,
+    std::vector<std::string>* lines) const {
+  std::string tag_suffix;
+  for (const auto& t : tags) {
+    tag_suffix += ";";
+    tag_suffix += sanitize(t.first, " ;!^=");
+    tag_suffix += "=";
+    tag_suffix += sanitize(t.second, " ;~");
+  }
+
+  auto timestamp = std::to_string(time / kMicrosPerSecond);
+  for (const auto& m : metrics) {
+    std::string line = sanitize(m.name, " ;");
+    line += tag_suffix;
+    line += " ";
+    line += m.field->value;
+    line += " ";
+    line += timestamp;
+    lines->emplace_back(std::move(line));
+  }
+}
+
+/**
+ * <measurement>[,<key>=<value>...] <field>=<value>[,...] <unix nanoseconds>
+ */
+void LineFormatter::formatInflux(
+    const std::string& event_name,
+    uint64_t time,
+    const std::vector<Metric>& metrics,
+    const std::vector<std::pair<std::string, std::string>>& tags,
+    std::vector<std::string>* lines) const {
+  auto measurement = measurement_;
+  expandTemplate(event_name, "", &measurement);
+
+  std::string line;
+  appendInfluxEscaped(measurement, ", ", &line);
+  for (const auto& t : tags) {
+    line += ",";
+    appendInfluxEscaped(t.first, ",= ", &line);
+    line += "=";
+    appendInfluxEscaped(t.second, ",= ", &line);
+  }
+
+  for (size_t i = 0; i < metrics.size(); ++i) {
+    line += i == 0 ? " " : ",";
+    appendInfluxEscaped(metrics[i].name, ",= ", &line);
+    line += "=";
+    line += metrics[i].field->value;
+  }
+
+  line += " ";
+  line += std::to_string(time * 1000);
+  lines->emplace_back(std::move(line));
+}
+
+} // namespace plugins_lineproto
+} // namespace evcollect
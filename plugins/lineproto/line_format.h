@@ -0,0 +1,147 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <string>
+#include <vector>
+#include <evcollect/util/return_code.h>
+
+namespace evcollect {
+namespace plugin_lineproto {
+
+enum class LineFormat { STATSD, GRAPHITE, INFLUX };
+
+ReturnCode parseLineFormat(const std::string& str, LineFormat* format);
+
+/**
+ * A scalar field of an event. Nested objects are flattened and their keys
+ * joined with '.', so {"cpu": {"user": 1}} yields the field cpu.user. Numbers
+ * are kept as they appear in the JSON, booleans are converted to 1 and 0
+ */
+struct JSONField {
+  std::string path;
+  std::string value;
+  bool is_number;
+};
+
+/**
+ * Collect all scalar fields of a JSON object. Arrays and nulls are skipped.
+ * Returns false if the input is not a valid JSON object
+ */
+bool flattenJSON(const std::string& json, std::vector<JSONField>* fields);
+
+/**
+ * Turns events into statsd, Graphite plaintext or Influx line protocol lines.
+ * Each metric mapping selects numeric fields by event name and field path
+ * (both may be globs) and names the resulting metric, where %E is replaced
+ * by the event name and %F by the field path. If no mapping was added, every
+ * numeric field is sent as a gauge named %E.%F (or %F for Influx, where the
+ * name is the field key within the measurement)
+ */
+class LineFormatter {
+public:
+
+  static const char kDefaultStatsdType[];
+  static const char kDefaultMeasurement[];
+
+  LineFormatter(LineFormat format);
+
+  LineFormat getFormat() const;
+
+  /**
+   * statsd_type is one of g, c, ms, h or s and only used for statsd
+   */
+  ReturnCode addMapping(
+      const std::string& event_name_match,
+      const std::string& field_match,
+      const std::string& name,
+      const std::string& statsd_type);
+
+  /**
+   * Attach the value of field as a tag called key. Uses the DogStatsD tag
+   * extension for statsd and the Graphite 1.1 tag syntax for Graphite.
+   * Fields used as tags are not sent as metrics
+   */
+  void addTag(const std::string& key, const std::string& field);
+
+  /**
+   * The Influx measurement name, %E is replaced by the event name
+   */
+  void setMeasurement(const std::string& measurement);
+
+  /**
+   * Append one line per metric (or one line per event for Influx) to lines.
+   * Returns false if the event is not a JSON object
+   */
+  bool formatEvent(
+      const std::string& event_name,
+      uint64_t time,
+      const std::string& event_data,
+      std::vector<std::string>* lines) const;
+
+protected:
+
+  struct Mapping {
+    std::string event_name_match;
+    std::string field_match;
+    std::string name;
+    std::string statsd_type;
+  };
+
+  struct Metric {
+    std::string name;
+    const JSONField* field;
+    const Mapping* mapping;
+  };
+
+  const Mapping* findMapping(
+      const std::string& event_name,
+      const std::string& field_path) const;
+
+  void formatStatsd(
+      const std::vector<Metric>& metrics,
+      const std::vector<std::pair<std::string, std::string>>& tags,
+      std::vector<std::string>* lines) const;
+
+  void formatGraphite(
+      uint64_t time,
+      const std::vector<Metric>& metrics,
+      const std::vector<std::pair<std::string, std::string>>& tags,
+      std::vector<std::string>* lines) const;
+
+  void formatInflux(
+      const std::string& event_name,
+      uint64_t time,
+      const std::vector<Metric>& metrics,
+      const std::vector<std::pair<std::string, std::string>>& tags,
+      std::vector<std::string>* lines) const;
+
+  LineFormat format_;
+  std::vector<Mapping> mappings_;
+  Mapping default_mapping_;
+  std::vector<std::pair<std::string, std::string>> tags_;
+  std::string measurement_;
+};
+
+} // namespace plugins_lineproto
+} // namespace evcollect
@@ -0,0 +1,592 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <evcollect/util/logging.h>
+#include <evcollect/util/stringutil.h>
+#include "line_target.h"
+
+namespace evcollect {
+namespace plugin_lineproto {
+
+/* sendmmsg sends at most UIO_MAXIOV (1024) messages per call, but there is
+   little to gain from batches larger than this */
+static const size_t kMaxDatagramsPerCall = 64;
+
+size_t sendDatagrams(
+    int fd,
+    const std::string* packets,
+    size_t n,
+    uint64_t* num_calls) {
+  struct mmsghdr msgs[kMaxDatagramsPerCall];
+  struct iovec iovs[kMaxDatagramsPerCall];
+
+  size_t sent = 0;
+  bool retried = false;
+  while (sent < n) {
+    auto cnt = std::min(n - sent, kMaxDatagramsPerCall);
+    memset(msgs, 0, sizeof(msgs[0]) * cnt);
+    for (size_t i = 0; i < cnt; ++i) {
+      iovs[i].iov_base = (void*) packets[sent + i].data();
+      iovs[i].iov_len = packets[sent + i].size();
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int rc = sendmmsg(fd, msgs, cnt, 0);
+    if (num_calls) {
+      ++*num_calls;
+    }
+
+    if (rc < 0) {
+      /* a connected UDP socket reports an ICMP port unreachable for an
+         earlier datagram on the next send, which did not send anything */
+      if (errno == EINTR || (errno == ECONNREFUSED && !retried)) {
+        retried = true;
+        continue;
+      }
+
+      break;
+    }
+
+    sent += rc;
+  }
+
+  return sent;
+}
+
+uint16_t LineProtocolTarget::getDefaultPort(
+    LineFormat format,
+    Transport transport) {
+  switch (format) {
+    case LineFormat::STATSD:
+      return 8125;
+    case LineFormat::GRAPHITE:
+      return 2003;
+    case LineFormat::INFLUX:
+      return transport == Transport::UDP ? 8089 : 8094;
+  }
+
+  return 0;
+}
+
+ReturnCode LineProtocolTarget::parseTransport(
+    const std::string& str,
+    Transport* transport) {
+  if (str == "udp") {
+    *transport = Transport::UDP;
+    return ReturnCode::success();
+  }
+
+  if (str == "tcp") {
+    *transport = Transport::TCP;
+    return ReturnCode::success();
+  }
+
+  return ReturnCode::error(
+      "EINVAL",
+      "invalid transport: '%s' -- must be 'udp' or 'tcp'",
+      str.c_str());
+}
+
+LineProtocolTarget::LineProtocolTarget(
+    std::unique_ptr<LineFormatter> formatter,
+    Transport transport,
+    const std::string& host,
+    uint16_t port) :
+    formatter_(std::move(formatter)),
+    transport_(transport),
+    host_(host),
+    port_(port),
+    packet_size_(transport == Transport::UDP ? kDefaultMTU : kTCPPacketSize),
+    flush_interval_(kDefaultFlushIntervalMicros),
+    max_buffer_size_(kDefaultMaxBufferSize),
+    timeout_(kDefaultTimeoutMicros),
+    fd_(-1),
+    reconnect_at_(0),
+    reconnect_backoff_(kReconnectBackoffMicros),
+    buffered_(0),
+    next_flush_(0),
+    thread_running_(false),
+    thread_shutdown_(false),
+    lines_enqueued_(0),
+    lines_dropped_(0),
+    packets_sent_(0),
+    packets_dropped_(0),
+    send_calls_(0),
+    bytes_sent_(0),
+    connects_(0),
+    invalid_events_(0) {}
+
+LineProtocolTarget::~LineProtocolTarget() {
+  stopSenderThread();
+}
+
+void LineProtocolTarget::setMTU(size_t mtu) {
+  if (transport_ == Transport::UDP) {
+    packet_size_ = std::max(mtu, size_t(1));
+  }
+}
+
+void LineProtocolTarget::setFlushInterval(uint64_t usecs) {
+  flush_interval_ = usecs;
+}
+
+void LineProtocolTarget::setMaxBufferSize(size_t bytes) {
+  max_buffer_size_ = bytes;
+}
+
+void LineProtocolTarget::setTimeout(uint64_t usecs) {
+  timeout_ = usecs;
+}
+
+/**
+ * Format the event and pack its lines into the packet queue. The last packet
+ * in the queue is the one that is being filled, all others are complete and
+ * are sent right away. Lines are dropped instead of blocking the caller when
+ * the buffer is full
+ */
+ReturnCode LineProtocolTarget::emitEvent(
+    const std::string& event_name,
+    uint64_t time,
+    const std::string& event_data) {
+  std::vector<std::string> lines;
+  if (!formatter_->formatEvent(event_name, time, event_data, &lines)) {
+    ++invalid_events_;
+    return ReturnCode::error(
+        "EINVAL",
+        "event '%s' is not a JSON object",
+        event_name.c_str());
+  }
+
+  if (lines.empty()) {
+    return ReturnCode::success();
+  }
+
+  std::unique_lock<std::mutex> lk(mutex_);
+  if (thread_shutdown_) {
+    return ReturnCode::error("EIO", "line protocol sender thread stopped");
+  }
+
+  /* the sender thread sleeps until the first line is queued */
+  bool was_empty = packets_.empty();
+  if (was_empty) {
+    next_flush_ = MonotonicClock::now() + flush_interval_;
+  }
+
+  for (const auto& line : lines) {
+    auto size = line.size() + 1;
+    if (buffered_ + size > max_buffer_size_) {
+      ++lines_dropped_;
+      continue;
+    }
+
+    if (packets_.empty() ||
+        (!packets_.back().empty() &&
+         packets_.back().size() + size > packet_size_)) {
+      if (free_packets_.empty()) {
+        packets_.emplace_back();
+        packets_.back().reserve(packet_size_);
+      } else {
+        packets_.emplace_back(std::move(free_packets_.back()));
+        free_packets_.pop_back();
+      }
+    }
+
+    packets_.back().append(line);
+    packets_.back().push_back('\n');
+    buffered_ += size;
+    ++lines_enqueued_;
+  }
+
+  if (was_empty || packets_.size() > 1) {
+    lk.unlock();
+    cv_.notify_one();
+  }
+
+  return ReturnCode::success();
+}
+
+ReturnCode LineProtocolTarget::startSenderThread() {
+  std::unique_lock<std::mutex> lk(mutex_);
+  if (thread_running_) {
+    return ReturnCode::success();
+  }
+
+  thread_running_ = true;
+  thread_shutdown_ = false;
+  thread_ = std::thread(&LineProtocolTarget::runSenderThread, this);
+  return ReturnCode::success();
+}
+
+/**
+ * Stops accepting events and sends everything that is still buffered. If
+ * the server can not be reached, the remaining lines are dropped
+ */
+void LineProtocolTarget::stopSenderThread() {
+  {
+    std::unique_lock<std::mutex> lk(mutex_);
+    if (!thread_running_) {
+      return;
+    }
+
+    thread_shutdown_ = true;
+  }
+
+  cv_.notify_all();
+  thread_.join();
+  thread_running_ = false;
+}
+
+void LineProtocolTarget::runSenderThread() {
+  std::unique_lock<std::mutex> lk(mutex_);
+  for (;;) {
+    auto now = MonotonicClock::now();
+    bool flush = thread_shutdown_ || now >= next_flush_;
+    size_t ready = packets_.size();
+    if (!flush && ready > 0) {
+      --ready;
+    }
+
+    /* wait for the reconnect backoff to expire (but don't wait at all when
+       shutting down) */
+    bool reconnect_wait =
+        fd_ < 0 &&
+        now < reconnect_at_ &&
+        !thread_shutdown_;
+
+    if (ready == 0 || reconnect_wait) {
+      if (thread_shutdown_) {
+        break;
+      }
+
+      if (packets_.empty()) {
+        cv_.wait(lk);
+      } else {
+        auto deadline = std::max(next_flush_, reconnect_at_);
+        cv_.wait_for(lk, std::chrono::microseconds(deadline - now));
+      }
+
+      continue;
+    }
+
+    std::vector<std::string> batch;
+    batch.reserve(ready);
+    for (size_t i = 0; i < ready; ++i) {
+      batch.emplace_back(std::move(packets_.front()));
+      packets_.pop_front();
+    }
+
+    bool shutdown = thread_shutdown_;
+    lk.unlock();
+
+    size_t consumed = 0;
+    if (fd_ < 0) {
+      auto rc = connect();
+      if (!rc.isSuccess()) {
+        logWarning(
+            "line protocol: connecting to $0:$1 failed: $2",
+            host_,
+            port_,
+            rc.getMessage());
+      }
+    }
+
+    if (fd_ >= 0) {
+      switch (transport_) {
+        case Transport::UDP: {
+          uint64_t calls = 0;
+          consumed = sendDatagrams(fd_, batch.data(), batch.size(), &calls);
+          send_calls_ += calls;
+          packets_sent_ += consumed;
+          for (size_t i = 0; i < consumed; ++i) {
+            bytes_sent_ += batch[i].size();
+          }
+
+          /* datagrams that could not be sent are not retried */
+          for (size_t i = consumed; i < batch.size(); ++i) {
+            ++packets_dropped_;
+            lines_dropped_ += std::count(
+                batch[i].begin(),
+                batch[i].end(),
+                '\n');
+          }
+
+          consumed = batch.size();
+          break;
+        }
+        case Transport::TCP:
+          consumed = sendStream(&batch);
+          break;
+      }
+    }
+
+    lk.lock();
+
+    /* requeue the packets that were not sent, unless we are shutting down */
+    size_t bytes_done = 0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (i >= consumed && !shutdown) {
+        continue;
+      }
+
+      bytes_done += batch[i].size();
+      if (i >= consumed) {
+        ++packets_dropped_;
+        lines_dropped_ += std::count(batch[i].begin(), batch[i].end(), '\n');
+      }
+    }
+
+    for (size_t i = batch.size(); i > consumed && !shutdown; --i) {
+      packets_.emplace_front(std::move(batch[i - 1]));
+    }
+
+    buffered_ -= bytes_done;
+    for (size_t i = 0; i < std::min(consumed, batch.size()); ++i) {
+      if (free_packets_.size() < max_buffer_size_ / packet_size_) {
+        batch[i].clear();
+        free_packets_.emplace_back(std::move(batch[i]));
+      }
+    }
+
+    if (flush) {
+      next_flush_ = MonotonicClock::now() + flush_interval_;
+    }
+  }
+
+  disconnect();
+}
+
+ReturnCode LineProtocolTarget::connect() {
+  disconnect();
+
+  auto now = MonotonicClock::now();
+  reconnect_at_ = now + reconnect_backoff_;
+  reconnect_backoff_ = std::min(
+      reconnect_backoff_ * 2,
+      uint64_t(kMaxReconnectBackoffMicros));
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype =
+      transport_ == Transport::UDP ? SOCK_DGRAM : SOCK_STREAM;
+
+  struct addrinfo* addrs = nullptr;
+  auto port = std::to_string(port_);
+  int gai_rc = getaddrinfo(host_.c_str(), port.c_str(), &hints, &addrs);
+  if (gai_rc != 0) {
+    return ReturnCode::error(
+        "EIO",
+        "getaddrinfo(%s) failed: %s",
+        host_.c_str(),
+        gai_strerror(gai_rc));
+  }
+
+  auto rc = ReturnCode::error("EIO", "no addresses for %s", host_.c_str());
+  for (auto addr = addrs; addr; addr = addr->ai_next) {
+    fd_ = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd_ < 0) {
+      rc = ReturnCode::error("EIO", "socket() failed: %s", strerror(errno));
+      continue;
+    }
+
+    fcntl(fd_, F_SETFD, FD_CLOEXEC);
+
+    /* UDP sockets stay blocking, a full send buffer only stalls the
+       sender thread for a moment */
+    if (transport_ == Transport::TCP) {
+      fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+      int one = 1;
+      setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    if (::connect(fd_, addr->ai_addr, addr->ai_addrlen) == 0) {
+      rc = ReturnCode::success();
+      break;
+    }
+
+    if (errno == EINPROGRESS) {
+      if (waitWritable(now + timeout_)) {
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+        getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &errlen);
+        if (err == 0) {
+          rc = ReturnCode::success();
+          break;
+        }
+
+        rc = ReturnCode::error("EIO", "connect() failed: %s", strerror(err));
+      } else {
+        rc = ReturnCode::error("EIO", "connect() timed out");
+      }
+    } else {
+      rc = ReturnCode::error("EIO", "connect() failed: %s", strerror(errno));
+    }
+
+    close(fd_);
+    fd_ = -1;
+  }
+
+  freeaddrinfo(addrs);
+
+  if (rc.isSuccess()) {
+    reconnect_backoff_ = kReconnectBackoffMicros;
+    ++connects_;
+  }
+
+  return rc;
+}
+
+void LineProtocolTarget::disconnect() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+/**
+ * Write the packets to the TCP connection with as few syscalls as possible.
+ * Returns the number of packets that were consumed. On error, the connection
+ * is closed and a partially written packet is dropped (and counted as
+ * consumed), so that the next connection starts at a line boundary
+ */
+size_t LineProtocolTarget::sendStream(std::vector<std::string>* packets) {
+  std::vector<struct iovec> iov;
+  iov.reserve(packets->size());
+  for (auto& p : *packets) {
+    struct iovec v;
+    v.iov_base = &p[0];
+    v.iov_len = p.size();
+    iov.emplace_back(v);
+  }
+
+  auto deadline = MonotonicClock::now() + timeout_;
+  size_t idx = 0;
+  size_t offset = 0;
+  while (idx < iov.size()) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov[idx];
+    msg.msg_iovlen = std::min(iov.size() - idx, size_t(IOV_MAX));
+
+    auto rc = sendmsg(fd_, &msg, MSG_NOSIGNAL);
+    ++send_calls_;
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      if (errno == EAGAIN && waitWritable(deadline)) {
+        continue;
+      }
+
+      logWarning(
+          "line protocol: send to $0:$1 failed: $2",
+          host_,
+          port_,
+          errno == EAGAIN ? "timeout" : strerror(errno));
+
+      disconnect();
+      break;
+    }
+
+    bytes_sent_ += rc;
+    size_t written = rc;
+    while (idx < iov.size() && written >= iov[idx].iov_len) {
+      written -= iov[idx].iov_len;
+      offset = 0;
+      ++packets_sent_;
+      ++idx;
+    }
+
+    if (written > 0) {
+      iov[idx].iov_base = (char*) iov[idx].iov_base + written;
+      iov[idx].iov_len -= written;
+      offset += written;
+    }
+  }
+
+  if (idx < iov.size() && offset > 0) {
+    ++packets_dropped_;
+    lines_dropped_ += std::count(
+        (*packets)[idx].begin() + offset,
+        (*packets)[idx].end(),
+        '\n');
+
+    return idx + 1;
+  }
+
+  return idx;
+}
+
+bool LineProtocolTarget::waitWritable(uint64_t deadline) {
+  for (;;) {
+    auto now = MonotonicClock::now();
+    if (now >= deadline) {
+      return false;
+    }
+
+    struct pollfd p;
+    p.fd = fd_;
+    p.events = POLLOUT;
+    p.revents = 0;
+
+    int timeout_ms = (deadline - now + kMicrosPerMilli - 1) / kMicrosPerMilli;
+    int rc = poll(&p, 1, timeout_ms);
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+
+    return rc > 0;
+  }
+}
+
+void LineProtocolTarget::getStats(std::string* stats) const {
+  *stats = StringUtil::format(
+      "{\"lines_enqueued\":$0,\"lines_dropped\":$1,\"packets_sent\":$2,"
+      "\"packets_dropped\":$3,\"send_calls\":$4,\"bytes_sent\":$5,"
+      "\"connects\":$6,\"invalid_events\":$7}",
+      lines_enqueued_.load(),
+      lines_dropped_.load(),
+      packets_sent_.load(),
+      packets_dropped_.load(),
+      send_calls_.load(),
+      bytes_sent_.load(),
+      connects_.load(),
+      invalid_events_.load());
+}
+
+} // namespace plugins_lineproto
+} // namespace evcollect
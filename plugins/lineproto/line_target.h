@@ -0,0 +1,151 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <evcollect/util/time.h>
+#include <evcollect/util/return_code.h>
+#include "line_format.h"
+
+namespace evcollect {
+namespace plugin_lineproto {
+
+/**
+ * Send n datagrams on a connected UDP socket with as few sendmmsg calls as
+ * possible. Returns the number of datagrams that were sent and adds the
+ * number of syscalls to num_calls
+ */
+size_t sendDatagrams(
+    int fd,
+    const std::string* packets,
+    size_t n,
+    uint64_t* num_calls);
+
+class LineProtocolTarget {
+public:
+
+  enum class Transport { UDP, TCP };
+
+  static const size_t kDefaultMTU = 1432;
+  static const size_t kTCPPacketSize = 64 * 1024;
+  static const size_t kDefaultMaxBufferSize = 4 * 1024 * 1024;
+  static const uint64_t kDefaultFlushIntervalMicros = 100 * kMicrosPerMilli;
+  static const uint64_t kDefaultTimeoutMicros = 5 * kMicrosPerSecond;
+  static const uint64_t kReconnectBackoffMicros = 100 * kMicrosPerMilli;
+  static const uint64_t kMaxReconnectBackoffMicros = 10 * kMicrosPerSecond;
+
+  static uint16_t getDefaultPort(LineFormat format, Transport transport);
+
+  LineProtocolTarget(
+      std::unique_ptr<LineFormatter> formatter,
+      Transport transport,
+      const std::string& host,
+      uint16_t port);
+
+  ~LineProtocolTarget();
+
+  static ReturnCode parseTransport(const std::string& str, Transport* transport);
+
+  /**
+   * The maximum payload of a UDP datagram. Lines are packed into datagrams
+   * of at most this size, a single line that is longer is sent on its own
+   */
+  void setMTU(size_t mtu);
+
+  /**
+   * Send partially filled packets after this interval. Full packets are
+   * sent immediately
+   */
+  void setFlushInterval(uint64_t usecs);
+
+  /**
+   * Lines are dropped while more than this many bytes are waiting to be
+   * sent (e.g. while the TCP connection is down)
+   */
+  void setMaxBufferSize(size_t bytes);
+
+  void setTimeout(uint64_t usecs);
+
+  ReturnCode emitEvent(
+      const std::string& event_name,
+      uint64_t time,
+      const std::string& event_data);
+
+  ReturnCode startSenderThread();
+  void stopSenderThread();
+
+  /**
+   * Write the counters of this target as a JSON object to stats. May be
+   * called from any thread
+   */
+  void getStats(std::string* stats) const;
+
+protected:
+
+  void runSenderThread();
+  ReturnCode connect();
+  void disconnect();
+  size_t sendStream(std::vector<std::string>* packets);
+  bool waitWritable(uint64_t deadline);
+
+  std::unique_ptr<LineFormatter> formatter_;
+  Transport transport_;
+  std::string host_;
+  uint16_t port_;
+  size_t packet_size_;
+  uint64_t flush_interval_;
+  size_t max_buffer_size_;
+  uint64_t timeout_;
+  int fd_;
+  uint64_t reconnect_at_;
+  uint64_t reconnect_backoff_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<std::string> packets_;
+  std::vector<std::string> free_packets_;
+  size_t buffered_;
+  uint64_t next_flush_;
+  bool thread_running_;
+  bool thread_shutdown_;
+  std::thread thread_;
+
+  std::atomic<uint64_t> lines_enqueued_;
+  std::atomic<uint64_t> lines_dropped_;
+  std::atomic<uint64_t> packets_sent_;
+  std::atomic<uint64_t> packets_dropped_;
+  std::atomic<uint64_t> send_calls_;
+  std::atomic<uint64_t> bytes_sent_;
+  std::atomic<uint64_t> connects_;
+  std::atomic<uint64_t> invalid_events_;
+};
+
+} // namespace plugins_lineproto
+} // namespace evcollect
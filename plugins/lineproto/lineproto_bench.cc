@@ -0,0 +1,133 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+/**
+ * UDP send benchmark: statsd lines are sent to a loopback socket either one
+ * line per datagram (what most statsd clients do), packed into MTU sized
+ * datagrams with one send per datagram, or packed and sent in batches with
+ * sendmmsg (what the lineproto output does).
+ *
+ *   $ make lineproto_bench && ./lineproto_bench [num_lines]
+ */
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <evcollect/util/time.h>
+#include "line_target.h"
+
+using namespace evcollect::plugin_lineproto;
+
+static const size_t kMTU = LineProtocolTarget::kDefaultMTU;
+
+static int connectLoopback() {
+  int sink = socket(AF_INET, SOCK_DGRAM, 0);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  bind(sink, (struct sockaddr*) &addr, sizeof(addr));
+
+  socklen_t addr_len = sizeof(addr);
+  getsockname(sink, (struct sockaddr*) &addr, &addr_len);
+
+  /* the sink is never read, so the kernel drops datagrams once its receive
+     buffer is full. this only measures the cost on the sending side */
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  connect(fd, (struct sockaddr*) &addr, sizeof(addr));
+  return fd;
+}
+
+static std::vector<std::string> makePackets(
+    const std::vector<std::string>& lines,
+    size_t packet_size) {
+  std::vector<std::string> packets;
+  for (const auto& line : lines) {
+    if (packets.empty() ||
+        packets.back().size() + line.size() + 1 > packet_size) {
+      packets.emplace_back();
+    }
+
+    packets.back() += line;
+    packets.back() += "\n";
+  }
+
+  return packets;
+}
+
+static uint64_t benchSend(int fd, const std::vector<std::string>& packets) {
+  auto t0 = MonotonicClock::now();
+  for (const auto& p : packets) {
+    send(fd, p.data(), p.size(), 0);
+  }
+
+  return MonotonicClock::now() - t0;
+}
+
+static uint64_t benchSendmmsg(
+    int fd,
+    const std::vector<std::string>& packets) {
+  auto t0 = MonotonicClock::now();
+  uint64_t num_calls = 0;
+  sendDatagrams(fd, packets.data(), packets.size(), &num_calls);
+  return MonotonicClock::now() - t0;
+}
+
+int main(int argc, const char** argv) {
+  size_t num_lines = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+
+  std::vector<std::string> lines;
+  for (size_t i = 0; i < num_lines; ++i) {
+    char line[64];
+    snprintf(line, sizeof(line), "sys.stats.cpu%zu.user:%zu|g", i % 64, i);
+    lines.emplace_back(line);
+  }
+
+  auto unpacked = makePackets(lines, 1);
+  auto packed = makePackets(lines, kMTU);
+  int fd = connectLoopback();
+
+  printf("mode                  packets    Mpackets/s    Mlines/s\n");
+
+  auto print = [num_lines] (const char* mode, size_t n, uint64_t t) {
+    printf(
+        "%-18s %10zu %13.2f %11.2f\n",
+        mode,
+        n,
+        double(n) / t,
+        double(num_lines) / t);
+  };
+
+  print("line per datagram", unpacked.size(), benchSend(fd, unpacked));
+  print("packed, send", packed.size(), benchSend(fd, packed));
+  print("packed, sendmmsg", packed.size(), benchSendmmsg(fd, packed));
+
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,283 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <string.h>
+#include <evcollect/evcollect.h>
+#include <evcollect/util/time.h>
+#include <evcollect/util/return_code.h>
+#include <evcollect/util/stringutil.h>
+#include "line_format.h"
+#include "line_target.h"
+
+namespace evcollect {
+namespace plugin_lineproto {
+
+static bool getUInt64Option(
+    evcollect_ctx_t* ctx,
+    const evcollect_plugin_cfg_t* cfg,
+    const char* key,
+    uint64_t* value) {
+  const char* opt;
+  if (!evcollect_plugin_getcfg(cfg, key, &opt)) {
+    return true;
+  }
+
+  try {
+    *value = std::stoull(opt);
+  } catch (...) {
+    auto msg = StringUtil::format("invalid value for $0", key);
+    evcollect_seterror(ctx, msg.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+static std::vector<std::string> getOptionArgs(
+    const evcollect_plugin_cfg_t* cfg,
+    const char* key,
+    int i) {
+  std::vector<std::string> args;
+  for (int j = 0; ; ++j) {
+    const char* arg;
+    if (!evcollect_plugin_getcfgv(cfg, key, i, j, &arg)) {
+      break;
+    }
+
+    args.emplace_back(arg);
+  }
+
+  return args;
+}
+
+int pluginAttach(
+    evcollect_ctx_t* ctx,
+    const evcollect_plugin_cfg_t* cfg,
+    void** userdata) {
+  LineFormat format = LineFormat::STATSD;
+  const char* format_opt;
+  if (evcollect_plugin_getcfg(cfg, "format", &format_opt)) {
+    auto rc = parseLineFormat(format_opt, &format);
+    if (!rc.isSuccess()) {
+      evcollect_seterror(ctx, rc.getMessage().c_str());
+      return false;
+    }
+  }
+
+  /* graphite's plaintext listener is usually TCP only */
+  auto transport = format == LineFormat::GRAPHITE ?
+      LineProtocolTarget::Transport::TCP :
+      LineProtocolTarget::Transport::UDP;
+
+  const char* transport_opt;
+  if (evcollect_plugin_getcfg(cfg, "transport", &transport_opt)) {
+    auto rc = LineProtocolTarget::parseTransport(transport_opt, &transport);
+    if (!rc.isSuccess()) {
+      evcollect_seterror(ctx, rc.getMessage().c_str());
+      return false;
+    }
+  }
+
+  std::string hostname = "localhost";
+  const char* hostname_opt;
+  if (evcollect_plugin_getcfg(cfg, "host", &hostname_opt) ||
+      evcollect_plugin_getcfg(cfg, "hostname", &hostname_opt)) {
+    hostname = hostname_opt;
+  }
+
+  uint16_t port = LineProtocolTarget::getDefaultPort(format, transport);
+  const char* port_opt;
+  if (evcollect_plugin_getcfg(cfg, "port", &port_opt)) {
+    try {
+      port = std::stoul(port_opt);
+    } catch (...) {
+      evcollect_seterror(ctx, "invalid port");
+      return false;
+    }
+  }
+
+  std::unique_ptr<LineFormatter> formatter(new LineFormatter(format));
+
+  /* metric <event> <field> [<name> [<statsd type>]] */
+  for (int i = 0; ; ++i) {
+    auto args = getOptionArgs(cfg, "metric", i);
+    if (args.empty()) {
+      break;
+    }
+
+    if (args.size() < 2 || args.size() > 4) {
+      evcollect_seterror(
+          ctx,
+          "invalid number of arguments to metric. " \
+          "format is: metric <event> <field> [<name> [<type>]]");
+      return false;
+    }
+
+    auto rc = formatter->addMapping(
+        args[0],
+        args[1],
+        args.size() > 2 ? args[2] : "",
+        args.size() > 3 ? args[3] : LineFormatter::kDefaultStatsdType);
+
+    if (!rc.isSuccess()) {
+      evcollect_seterror(ctx, rc.getMessage().c_str());
+      return false;
+    }
+  }
+
+  /* tag <key> <field> */
+  for (int i = 0; ; ++i) {
+    auto args = getOptionArgs(cfg, "tag", i);
+    if (args.empty()) {
+      break;
+    }
+
+    if (args.size() != 2) {
+      evcollect_seterror(
+          ctx,
+          "invalid number of arguments to tag. " \
+          "format is: tag <key> <field>");
+      return false;
+    }
+
+    formatter->addTag(args[0], args[1]);
+  }
+
+  const char* measurement_opt;
+  if (evcollect_plugin_getcfg(cfg, "measurement", &measurement_opt)) {
+    formatter->setMeasurement(measurement_opt);
+  }
+
+  std::unique_ptr<LineProtocolTarget> target(
+      new LineProtocolTarget(
+          std::move(formatter),
+          transport,
+          hostname,
+          port));
+
+  uint64_t mtu = LineProtocolTarget::kDefaultMTU;
+  if (!getUInt64Option(ctx, cfg, "mtu", &mtu)) {
+    return false;
+  }
+
+  target->setMTU(mtu);
+
+  uint64_t flush_interval =
+      LineProtocolTarget::kDefaultFlushIntervalMicros / kMicrosPerMilli;
+  if (!getUInt64Option(ctx, cfg, "flush_interval_ms", &flush_interval)) {
+    return false;
+  }
+
+  target->setFlushInterval(flush_interval * kMicrosPerMilli);
+
+  uint64_t buffer_maxbytes = LineProtocolTarget::kDefaultMaxBufferSize;
+  if (!getUInt64Option(ctx, cfg, "buffer_maxbytes", &buffer_maxbytes)) {
+    return false;
+  }
+
+  target->setMaxBufferSize(buffer_maxbytes);
+
+  uint64_t timeout =
+      LineProtocolTarget::kDefaultTimeoutMicros / kMicrosPerMilli;
+  if (!getUInt64Option(ctx, cfg, "timeout_ms", &timeout)) {
+    return false;
+  }
+
+  target->setTimeout(timeout * kMicrosPerMilli);
+
+  auto rc = target->startSenderThread();
+  if (!rc.isSuccess()) {
+    evcollect_seterror(ctx, rc.getMessage().c_str());
+    return false;
+  }
+
+  *userdata = target.release();
+  return true;
+}
+
+int pluginDetach(evcollect_ctx_t* ctx, void* userdata) {
+  auto target = static_cast<LineProtocolTarget*>(userdata);
+  target->stopSenderThread();
+  delete target;
+  return true;
+}
+
+int pluginEmitEvent(
+    evcollect_ctx_t* ctx,
+    void* userdata,
+    const evcollect_event_t* event) {
+  auto target = static_cast<LineProtocolTarget*>(userdata);
+
+  const char* ev_name;
+  size_t ev_name_len;
+  evcollect_event_getname(event, &ev_name, &ev_name_len);
+
+  const char* ev_data;
+  size_t ev_data_len;
+  evcollect_event_getdata(event, &ev_data, &ev_data_len);
+
+  auto rc = target->emitEvent(
+      std::string(ev_name, ev_name_len),
+      evcollect_event_gettime(event),
+      std::string(ev_data, ev_data_len));
+
+  if (rc.isSuccess()) {
+    return 1;
+  } else {
+    evcollect_seterror(ctx, rc.getMessage().c_str());
+    return 0;
+  }
+}
+
+int pluginGetStats(
+    evcollect_ctx_t* ctx,
+    void* userdata,
+    evcollect_event_t* stats) {
+  auto target = static_cast<LineProtocolTarget*>(userdata);
+
+  std::string json;
+  target->getStats(&json);
+  evcollect_event_setdata(stats, json.data(), json.size());
+  return 1;
+}
+
+} // namespace plugins_lineproto
+} // namespace evcollect
+
+EVCOLLECT_PLUGIN_INIT(lineproto) {
+  evcollect_output_plugin_register(
+      ctx,
+      "lineproto",
+      &evcollect::plugin_lineproto::pluginEmitEvent,
+      &evcollect::plugin_lineproto::pluginAttach,
+      &evcollect::plugin_lineproto::pluginDetach,
+      NULL,
+      NULL);
+
+  evcollect_output_plugin_register_stats(
+      ctx,
+      "lineproto",
+      &evcollect::plugin_lineproto::pluginGetStats);
+
+  return true;
+}
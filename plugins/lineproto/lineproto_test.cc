@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <evcollect/evcollect.h>
+#include <evcollect/util/testing.h>
+#include <evcollect/util/time.h>
+#include "line_format.h"
+#include "line_target.h"
+
+using namespace evcollect::plugin_lineproto;
+
+/* the plugin usually resolves this symbol from the evcollectd binary */
+void evcollect_log(evcollect_loglevel level, const char* msg) {}
+
+static const uint64_t kTestTime = 1480000000 * kMicrosPerSecond;
+
+static int bindLoopback(int type, uint16_t* port) {
+  int fd = socket(AF_INET, type, 0);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  bind(fd, (struct sockaddr*) &addr, sizeof(addr));
+
+  socklen_t addr_len = sizeof(addr);
+  getsockname(fd, (struct sockaddr*) &addr, &addr_len);
+  *port = ntohs(addr.sin_port);
+
+  struct timeval tv;
+  tv.tv_sec = 5;
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  return fd;
+}
+
+static size_t countLines(const std::string& data) {
+  return std::count(data.begin(), data.end(), '\n');
+}
+
+TEST(LineFormat, flatten) {
+  std::vector<JSONField> fields;
+  ASSERT_TRUE(flattenJSON(
+      R"({ "a": 1, "b": { "c": -2.5e3, "d": "x\"y" }, "e": [1, {"f": 2}],
+          "g": true, "h": null })",
+      &fields));
+
+  ASSERT_EQ(fields.size(), 4);
+  EXPECT_EQ(fields[0].path, "a");
+  EXPECT_EQ(fields[0].value, "1");
+  EXPECT_EQ(fields[1].path, "b.c");
+  EXPECT_EQ(fields[1].value, "-2.5e3");
+  EXPECT_EQ(fields[2].path, "b.d");
+  EXPECT_EQ(fields[2].value, "x\"y");
+  EXPECT_FALSE(fields[2].is_number);
+  EXPECT_EQ(fields[3].path, "g");
+  EXPECT_EQ(fields[3].value, "1");
+
+  fields.clear();
+  EXPECT_FALSE(flattenJSON("[1, 2]", &fields));
+  EXPECT_FALSE(flattenJSON("{\"a\": 1", &fields));
+  EXPECT_FALSE(flattenJSON("{\"a\": 1} x", &fields));
+}
+
+TEST(LineFormat, statsd) {
+  LineFormatter formatter(LineFormat::STATSD);
+  ASSERT_TRUE(formatter.addMapping("sys.*", "cpu.*", "", "g").isSuccess());
+  ASSERT_TRUE(formatter.addMapping("sys.*", "reqs", "%E.rps", "c").isSuccess());
+  EXPECT_FALSE(formatter.addMapping("*", "*", "", "x").isSuccess());
+  formatter.addTag("host", "hostname");
+
+  std::vector<std::string> lines;
+  ASSERT_TRUE(formatter.formatEvent(
+      "sys.stats",
+      kTestTime,
+      R"({"hostname": "web 1", "cpu": {"user": 12.5}, "reqs": 3, "x": 1})",
+      &lines));
+
+  ASSERT_EQ(lines.size(), 2);
+  EXPECT_EQ(lines[0], "sys.stats.cpu.user:12.5|g|#host:web_1");
+  EXPECT_EQ(lines[1], "sys.stats.rps:3|c|#host:web_1");
+}
+
+TEST(LineFormat, graphite) {
+  LineFormatter formatter(LineFormat::GRAPHITE);
+  formatter.addTag("host", "hostname");
+
+  std::vector<std::string> lines;
+  ASSERT_TRUE(formatter.formatEvent(
+      "sys",
+      kTestTime,
+      R"({"hostname": "web1", "load": {"1m": 0.5, "5m": 0.25}})",
+      &lines));
+
+  ASSERT_EQ(lines.size(), 2);
+  EXPECT_EQ(lines[0], "sys.load.1m;host=web1 0.5 1480000000");
+  EXPECT_EQ(lines[1], "sys.load.5m;host=web1 0.25 1480000000");
+}
+
+TEST(LineFormat, influx) {
+  LineFormatter formatter(LineFormat::INFLUX);
+  formatter.setMeasurement("evcollect,%E");
+  formatter.addTag("host name", "hostname");
+
+  std::vector<std::string> lines;
+  ASSERT_TRUE(formatter.formatEvent(
+      "sys",
+      kTestTime,
+      R"({"hostname": "a=b", "load": {"1m": 0.5}, "mem used": 7})",
+      &lines));
+
+  ASSERT_EQ(lines.size(), 1);
+  EXPECT_EQ(
+      lines[0],
+      "evcollect\\,sys,host\\ name=a\\=b load.1m=0.5,mem\\ used=7 "
+      "1480000000000000000");
+
+  lines.clear();
+  ASSERT_TRUE(formatter.formatEvent("sys", kTestTime, "{}", &lines));
+  EXPECT_EQ(lines.size(), 0);
+}
+
+TEST(LineProtocolTarget, udp_packing) {
+  uint16_t port;
+  int fd = bindLoopback(SOCK_DGRAM, &port);
+
+  std::unique_ptr<LineFormatter> formatter(
+      new LineFormatter(LineFormat::STATSD));
+
+  LineProtocolTarget target(
+      std::move(formatter),
+      LineProtocolTarget::Transport::UDP,
+      "127.0.0.1",
+      port);
+
+  target.setMTU(200);
+  ASSERT_TRUE(target.startSenderThread().isSuccess());
+
+  for (size_t i = 0; i < 100; ++i) {
+    auto ev = StringUtil::format("{\"a\": $0, \"b\": $0, \"c\": $0}", i);
+    ASSERT_TRUE(target.emitEvent("test", kTestTime, ev).isSuccess());
+  }
+
+  size_t num_lines = 0;
+  size_t num_datagrams = 0;
+  while (num_lines < 300) {
+    char buf[65536];
+    auto n = recv(fd, buf, sizeof(buf), 0);
+    ASSERT_TRUE(n > 0);
+
+    std::string datagram(buf, n);
+    EXPECT_TRUE(datagram.size() <= 200);
+    EXPECT_TRUE(datagram[datagram.size() - 1] == '\n');
+    num_lines += countLines(datagram);
+    ++num_datagrams;
+  }
+
+  EXPECT_EQ(num_lines, 300);
+  EXPECT_TRUE(num_datagrams <= 300 * 16 / 200 + 2);
+
+  target.stopSenderThread();
+  close(fd);
+
+  std::string stats;
+  target.getStats(&stats);
+  EXPECT_TRUE(stats.find("\"lines_dropped\":0,") != std::string::npos);
+}
+
+TEST(LineProtocolTarget, tcp_reconnect) {
+  uint16_t port;
+  int fd = bindLoopback(SOCK_STREAM, &port);
+
+  std::unique_ptr<LineFormatter> formatter(
+      new LineFormatter(LineFormat::GRAPHITE));
+
+  LineProtocolTarget target(
+      std::move(formatter),
+      LineProtocolTarget::Transport::TCP,
+      "127.0.0.1",
+      port);
+
+  target.setFlushInterval(10 * kMicrosPerMilli);
+  ASSERT_TRUE(target.startSenderThread().isSuccess());
+
+  /* the port is bound but not listening yet, so connects are refused and
+     the lines stay buffered */
+  for (size_t i = 0; i < 100; ++i) {
+    auto ev = StringUtil::format("{\"value\": $0}", i);
+    ASSERT_TRUE(target.emitEvent("test", kTestTime, ev).isSuccess());
+  }
+
+  usleep(150 * kMicrosPerMilli);
+  listen(fd, 1);
+  int conn = accept(fd, NULL, NULL);
+  ASSERT_TRUE(conn >= 0);
+
+  struct timeval tv;
+  tv.tv_sec = 5;
+  tv.tv_usec = 0;
+  setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  std::string data;
+  while (countLines(data) < 100) {
+    char buf[4096];
+    auto n = recv(conn, buf, sizeof(buf), 0);
+    ASSERT_TRUE(n > 0);
+    data.append(buf, n);
+  }
+
+  target.stopSenderThread();
+  close(conn);
+  close(fd);
+
+  auto lines = StringUtil::split(data, "\n");
+  EXPECT_EQ(lines[0], "test.value 0 1480000000");
+  EXPECT_EQ(lines[99], "test.value 99 1480000000");
+
+  std::string stats;
+  target.getStats(&stats);
+  EXPECT_TRUE(stats.find("\"connects\":1,") != std::string::npos);
+}
@@ -0,0 +1,159 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <string.h>
+#include <evcollect/evcollect.h>
+#include <evcollect/util/return_code.h>
+#include <evcollect/util/stringutil.h>
+#include "localstream_target.h"
+
+namespace evcollect {
+namespace plugin_localstream {
+
+int pluginAttach(
+    evcollect_ctx_t* ctx,
+    const evcollect_plugin_cfg_t* cfg,
+    void** userdata) {
+  auto framing = LocalStreamTarget::Framing::NDJSON;
+  const char* framing_opt;
+  if (evcollect_plugin_getcfg(cfg, "framing", &framing_opt)) {
+    auto rc = LocalStreamTarget::parseFraming(framing_opt, &framing);
+    if (!rc.isSuccess()) {
+      evcollect_seterror(ctx, rc.getMessage().c_str());
+      return false;
+    }
+  }
+
+  std::unique_ptr<LocalStreamTarget> target(new LocalStreamTarget(framing));
+
+  const char* listen_opt;
+  const char* fifo_opt;
+  bool has_listen = evcollect_plugin_getcfg(cfg, "listen", &listen_opt);
+  bool has_fifo = evcollect_plugin_getcfg(cfg, "fifo", &fifo_opt);
+  if (!has_listen && !has_fifo) {
+    evcollect_seterror(ctx, "localstream: missing 'listen' or 'fifo' option");
+    return false;
+  }
+
+  if (has_listen) {
+    auto rc = target->listenSocket(listen_opt);
+    if (!rc.isSuccess()) {
+      evcollect_seterror(ctx, rc.getMessage().c_str());
+      return false;
+    }
+  }
+
+  if (has_fifo) {
+    auto rc = target->openFIFO(fifo_opt);
+    if (!rc.isSuccess()) {
+      evcollect_seterror(ctx, rc.getMessage().c_str());
+      return false;
+    }
+  }
+
+  const char* buffer_maxbytes_opt;
+  if (evcollect_plugin_getcfg(cfg, "buffer_maxbytes", &buffer_maxbytes_opt)) {
+    try {
+      target->setMaxBufferSize(std::stoull(buffer_maxbytes_opt));
+    } catch (...) {
+      evcollect_seterror(ctx, "invalid value for buffer_maxbytes");
+      return false;
+    }
+  }
+
+  auto rc = target->startWriterThread();
+  if (!rc.isSuccess()) {
+    evcollect_seterror(ctx, rc.getMessage().c_str());
+    return false;
+  }
+
+  *userdata = target.release();
+  return true;
+}
+
+int pluginDetach(evcollect_ctx_t* ctx, void* userdata) {
+  auto target = static_cast<LocalStreamTarget*>(userdata);
+  target->stopWriterThread();
+  delete target;
+  return true;
+}
+
+int pluginEmitEvent(
+    evcollect_ctx_t* ctx,
+    void* userdata,
+    const evcollect_event_t* event) {
+  auto target = static_cast<LocalStreamTarget*>(userdata);
+
+  const char* ev_name;
+  size_t ev_name_len;
+  evcollect_event_getname(event, &ev_name, &ev_name_len);
+
+  const char* ev_data;
+  size_t ev_data_len;
+  evcollect_event_getdata(event, &ev_data, &ev_data_len);
+
+  auto rc = target->emitEvent(
+      std::string(ev_name, ev_name_len),
+      evcollect_event_gettime(event),
+      std::string(ev_data, ev_data_len));
+
+  if (rc.isSuccess()) {
+    return 1;
+  } else {
+    evcollect_seterror(ctx, rc.getMessage().c_str());
+    return 0;
+  }
+}
+
+int pluginGetStats(
+    evcollect_ctx_t* ctx,
+    void* userdata,
+    evcollect_event_t* stats) {
+  auto target = static_cast<LocalStreamTarget*>(userdata);
+
+  std::string json;
+  target->getStats(&json);
+  evcollect_event_setdata(stats, json.data(), json.size());
+  return 1;
+}
+
+} // namespace plugins_localstream
+} // namespace evcollect
+
+EVCOLLECT_PLUGIN_INIT(localstream) {
+  evcollect_output_plugin_register(
+      ctx,
+      "localstream",
+      &evcollect::plugin_localstream::pluginEmitEvent,
+      &evcollect::plugin_localstream::pluginAttach,
+      &evcollect::plugin_localstream::pluginDetach,
+      NULL,
+      NULL);
+
+  evcollect_output_plugin_register_stats(
+      ctx,
+      "localstream",
+      &evcollect::plugin_localstream::pluginGetStats);
+
+  return true;
+}
@@ -0,0 +1,619 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <evcollect/util/logging.h>
+#include <evcollect/util/stringutil.h>
+#include "localstream_target.h"
+
+namespace evcollect {
+namespace plugin_localstream {
+
+ReturnCode LocalStreamTarget::parseFraming(
+    const std::string& str,
+    Framing* framing) {
+  if (str == "ndjson") {
+    *framing = Framing::NDJSON;
+    return ReturnCode::success();
+  }
+
+  if (str == "length_prefixed") {
+    *framing = Framing::LENGTH_PREFIXED;
+    return ReturnCode::success();
+  }
+
+  return ReturnCode::error(
+      "EINVAL",
+      "invalid framing: '%s' -- must be 'ndjson' or 'length_prefixed'",
+      str.c_str());
+}
+
+LocalStreamTarget::LocalStreamTarget(
+    Framing framing) :
+    framing_(framing),
+    max_buffer_size_(kDefaultMaxBufferSize),
+    listen_fd_(-1),
+    next_seq_(0),
+    sealed_bytes_(0),
+    sealed_frames_(0),
+    fifo_retry_at_(0),
+    writer_idle_(false),
+    thread_running_(false),
+    thread_shutdown_(false),
+    num_subscribers_(0),
+    subscribers_total_(0),
+    frames_enqueued_(0),
+    frames_dropped_(0),
+    bytes_written_(0),
+    write_calls_(0) {
+  wakeup_pipe_[0] = -1;
+  wakeup_pipe_[1] = -1;
+}
+
+LocalStreamTarget::~LocalStreamTarget() {
+  stopWriterThread();
+
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    unlink(socket_path_.c_str());
+  }
+
+  for (auto fd : wakeup_pipe_) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+ReturnCode LocalStreamTarget::listenSocket(const std::string& path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    return ReturnCode::error(
+        "EINVAL",
+        "socket path too long: '%s'",
+        path.c_str());
+  }
+
+  memcpy(addr.sun_path, path.data(), path.size());
+
+  /* only replace stale sockets, never regular files */
+  struct stat st;
+  if (lstat(path.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      return ReturnCode::error(
+          "EINVAL",
+          "'%s' exists and is not a socket",
+          path.c_str());
+    }
+
+    unlink(path.c_str());
+  }
+
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd_ < 0) {
+    return ReturnCode::error("EIO", "socket() failed: %s", strerror(errno));
+  }
+
+  if (bind(listen_fd_, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+      listen(listen_fd_, 16) < 0) {
+    auto rc = ReturnCode::error(
+        "EIO",
+        "listening on '%s' failed: %s",
+        path.c_str(),
+        strerror(errno));
+
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return rc;
+  }
+
+  socket_path_ = path;
+  return ReturnCode::success();
+}
+
+ReturnCode LocalStreamTarget::openFIFO(const std::string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) == 0) {
+    if (!S_ISFIFO(st.st_mode)) {
+      return ReturnCode::error(
+          "EINVAL",
+          "'%s' exists and is not a fifo",
+          path.c_str());
+    }
+  } else if (mkfifo(path.c_str(), 0600) < 0) {
+    return ReturnCode::error(
+        "EIO",
+        "mkfifo('%s') failed: %s",
+        path.c_str(),
+        strerror(errno));
+  }
+
+  fifo_path_ = path;
+  return ReturnCode::success();
+}
+
+void LocalStreamTarget::setMaxBufferSize(size_t bytes) {
+  max_buffer_size_ = bytes;
+}
+
+ReturnCode LocalStreamTarget::emitEvent(
+    const std::string& event_name,
+    uint64_t time,
+    const std::string& event_data) {
+  if (num_subscribers_ == 0) {
+    return ReturnCode::success();
+  }
+
+  std::unique_lock<std::mutex> lk(mutex_);
+  if (thread_shutdown_) {
+    return ReturnCode::error("EIO", "localstream writer thread stopped");
+  }
+
+  if (!open_chunk_) {
+    open_chunk_ = std::make_shared<Chunk>();
+  }
+
+  auto& data = open_chunk_->data;
+  auto begin = data.size();
+  if (framing_ == Framing::LENGTH_PREFIXED) {
+    data.append(4, '\0');
+  }
+
+  data += "{\"event\":\"";
+  data += StringUtil::jsonEscape(event_name);
+  data += "\",\"time\":";
+  data += std::to_string(time);
+  data += ",\"data\":";
+  if (event_data.empty()) {
+    data += "null";
+  } else {
+    auto data_begin = data.size();
+    data += event_data;
+
+    /* JSON only allows raw newlines as whitespace */
+    if (framing_ == Framing::NDJSON) {
+      std::replace(data.begin() + data_begin, data.end(), '\n', ' ');
+    }
+  }
+
+  data += "}";
+
+  if (framing_ == Framing::LENGTH_PREFIXED) {
+    uint32_t len = data.size() - begin - 4;
+    data[begin + 0] = len >> 24;
+    data[begin + 1] = len >> 16;
+    data[begin + 2] = len >> 8;
+    data[begin + 3] = len;
+  } else {
+    data += "\n";
+  }
+
+  open_chunk_->frame_ends.emplace_back(data.size());
+  ++frames_enqueued_;
+
+  bool wake = writer_idle_;
+  writer_idle_ = false;
+  lk.unlock();
+
+  if (wake) {
+    wakeup();
+  }
+
+  return ReturnCode::success();
+}
+
+void LocalStreamTarget::wakeup() {
+  char byte = 0;
+  if (write(wakeup_pipe_[1], &byte, 1) < 0) {
+    /* the pipe is full, so the writer thread will wake up anyway */
+  }
+}
+
+ReturnCode LocalStreamTarget::startWriterThread() {
+  std::unique_lock<std::mutex> lk(mutex_);
+  if (thread_running_) {
+    return ReturnCode::success();
+  }
+
+  if (wakeup_pipe_[0] < 0 && pipe2(wakeup_pipe_, O_NONBLOCK | O_CLOEXEC) < 0) {
+    return ReturnCode::error("EIO", "pipe() failed: %s", strerror(errno));
+  }
+
+  thread_running_ = true;
+  thread_shutdown_ = false;
+  thread_ = std::thread(&LocalStreamTarget::runWriterThread, this);
+  return ReturnCode::success();
+}
+
+/**
+ * Makes one last attempt to write everything that is buffered without
+ * waiting for slow readers and then disconnects all subscribers
+ */
+void LocalStreamTarget::stopWriterThread() {
+  {
+    std::unique_lock<std::mutex> lk(mutex_);
+    if (!thread_running_) {
+      return;
+    }
+
+    thread_shutdown_ = true;
+  }
+
+  wakeup();
+  thread_.join();
+  thread_running_ = false;
+}
+
+void LocalStreamTarget::runWriterThread() {
+  bool accept_ready = listen_fd_ >= 0;
+  std::vector<struct pollfd> pollfds;
+  for (;;) {
+    bool shutdown;
+    {
+      std::unique_lock<std::mutex> lk(mutex_);
+      if (open_chunk_ && !open_chunk_->data.empty()) {
+        open_chunk_->seq = next_seq_++;
+        open_chunk_->byte_begin = sealed_bytes_;
+        open_chunk_->frame_begin = sealed_frames_;
+        sealed_bytes_ += open_chunk_->data.size();
+        sealed_frames_ += open_chunk_->frame_ends.size();
+        chunks_.emplace_back(std::move(open_chunk_));
+        open_chunk_.reset();
+      }
+
+      shutdown = thread_shutdown_;
+    }
+
+    if (accept_ready) {
+      acceptSubscribers();
+    }
+
+    if (!fifo_path_.empty() && MonotonicClock::now() >= fifo_retry_at_) {
+      tryOpenFIFO();
+    }
+
+    for (auto& sub : subscribers_) {
+      if (sub.fd >= 0 && !writeSubscriber(&sub)) {
+        closeSubscriber(&sub);
+      }
+    }
+
+    subscribers_.erase(
+        std::remove_if(
+            subscribers_.begin(),
+            subscribers_.end(),
+            [] (const Subscriber& sub) { return sub.fd < 0; }),
+        subscribers_.end());
+
+    num_subscribers_ = subscribers_.size();
+
+    /* free the chunks that all subscribers have written */
+    auto min_seq = next_seq_;
+    for (const auto& sub : subscribers_) {
+      min_seq = std::min(min_seq, sub.seq);
+    }
+
+    while (!chunks_.empty() && chunks_.front()->seq < min_seq) {
+      chunks_.pop_front();
+    }
+
+    if (shutdown) {
+      break;
+    }
+
+    pollfds.clear();
+    pollfds.push_back({ wakeup_pipe_[0], POLLIN, 0 });
+    if (listen_fd_ >= 0) {
+      pollfds.push_back({ listen_fd_, POLLIN, 0 });
+    }
+
+    bool fifo_open = false;
+    for (const auto& sub : subscribers_) {
+      fifo_open |= sub.is_fifo;
+      short events = sub.is_fifo ? 0 : POLLIN;
+      if (sub.seq < next_seq_ || !sub.partial.empty()) {
+        events |= POLLOUT;
+      }
+
+      pollfds.push_back({ sub.fd, events, 0 });
+    }
+
+    int timeout_ms = -1;
+    if (!fifo_path_.empty() && !fifo_open) {
+      timeout_ms = kFIFORetryIntervalMicros / kMicrosPerMilli;
+    }
+
+    {
+      std::unique_lock<std::mutex> lk(mutex_);
+      if (thread_shutdown_ || (open_chunk_ && !open_chunk_->data.empty())) {
+        continue;
+      }
+
+      writer_idle_ = true;
+    }
+
+    poll(pollfds.data(), pollfds.size(), timeout_ms);
+
+    {
+      std::unique_lock<std::mutex> lk(mutex_);
+      writer_idle_ = false;
+    }
+
+    if (pollfds[0].revents & POLLIN) {
+      char buf[64];
+      while (read(wakeup_pipe_[0], buf, sizeof(buf)) > 0);
+    }
+
+    size_t idx = 1;
+    accept_ready = false;
+    if (listen_fd_ >= 0) {
+      accept_ready = pollfds[idx++].revents & POLLIN;
+    }
+
+    /* subscribers never send anything, so readable means closed */
+    for (auto& sub : subscribers_) {
+      auto revents = pollfds[idx++].revents;
+      if (revents & POLLIN) {
+        char buf[256];
+        auto n = read(sub.fd, buf, sizeof(buf));
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+          closeSubscriber(&sub);
+          continue;
+        }
+      }
+
+      if ((revents & (POLLERR | POLLHUP)) && !(revents & POLLIN)) {
+        closeSubscriber(&sub);
+      }
+    }
+  }
+
+  for (auto& sub : subscribers_) {
+    closeSubscriber(&sub);
+  }
+
+  subscribers_.clear();
+  chunks_.clear();
+  num_subscribers_ = 0;
+}
+
+void LocalStreamTarget::acceptSubscribers() {
+  for (;;) {
+    int fd = accept4(listen_fd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EINTR) {
+        logWarning("localstream: accept() failed: $0", strerror(errno));
+      }
+
+      return;
+    }
+
+    Subscriber sub;
+    sub.fd = fd;
+    sub.is_fifo = false;
+    sub.seq = next_seq_;
+    sub.offset = 0;
+    subscribers_.emplace_back(std::move(sub));
+    ++subscribers_total_;
+  }
+}
+
+/**
+ * Opening the write end of a fifo in non-blocking mode fails with ENXIO
+ * until there is a reader, so this is retried periodically
+ */
+void LocalStreamTarget::tryOpenFIFO() {
+  for (const auto& sub : subscribers_) {
+    if (sub.is_fifo) {
+      return;
+    }
+  }
+
+  fifo_retry_at_ = MonotonicClock::now() + kFIFORetryIntervalMicros;
+
+  int fd = open(fifo_path_.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno != ENXIO) {
+      logWarning(
+          "localstream: open('$0') failed: $1",
+          fifo_path_,
+          strerror(errno));
+    }
+
+    return;
+  }
+
+  Subscriber sub;
+  sub.fd = fd;
+  sub.is_fifo = true;
+  sub.seq = next_seq_;
+  sub.offset = 0;
+  subscribers_.emplace_back(std::move(sub));
+  ++subscribers_total_;
+}
+
+size_t LocalStreamTarget::getChunkIndex(uint64_t seq) const {
+  if (chunks_.empty()) {
+    return 0;
+  }
+
+  return seq - chunks_.front()->seq;
+}
+
+/**
+ * If the subscriber is more than max_buffer_size bytes behind, move it to
+ * the first chunk that starts within the last max_buffer_size bytes. A frame
+ * that was partially written is completed first
+ */
+void LocalStreamTarget::skipChunks(Subscriber* sub) {
+  if (sub->seq >= next_seq_) {
+    return;
+  }
+
+  auto idx = getChunkIndex(sub->seq);
+  auto position = chunks_[idx]->byte_begin + sub->offset;
+  if (sealed_bytes_ - position <= max_buffer_size_) {
+    return;
+  }
+
+  auto frames = chunks_[idx]->frame_begin;
+  if (sub->offset > 0) {
+    const auto& chunk = *chunks_[idx];
+    auto frame_end = std::upper_bound(
+        chunk.frame_ends.begin(),
+        chunk.frame_ends.end(),
+        sub->offset);
+
+    sub->partial.assign(chunk.data, sub->offset, *frame_end - sub->offset);
+    frames += (frame_end - chunk.frame_ends.begin()) + 1;
+    sub->offset = 0;
+    ++sub->seq;
+    ++idx;
+  }
+
+  auto target = sealed_bytes_ - max_buffer_size_;
+  auto next = std::lower_bound(
+      chunks_.begin() + idx,
+      chunks_.end(),
+      target,
+      [] (const std::shared_ptr<const Chunk>& c, uint64_t pos) {
+        return c->byte_begin < pos;
+      });
+
+  if (next == chunks_.end()) {
+    frames_dropped_ += sealed_frames_ - frames;
+    sub->seq = next_seq_;
+  } else {
+    frames_dropped_ += (*next)->frame_begin - frames;
+    sub->seq = (*next)->seq;
+  }
+}
+
+/**
+ * Write everything the subscriber has not received yet with a single writev
+ * call and skip ahead if it is still too far behind afterwards. Returns false
+ * if the subscriber should be disconnected
+ */
+bool LocalStreamTarget::writeSubscriber(Subscriber* sub) {
+  struct iovec iov[IOV_MAX];
+  size_t iovcnt = 0;
+  if (!sub->partial.empty()) {
+    iov[iovcnt].iov_base = &sub->partial[0];
+    iov[iovcnt].iov_len = sub->partial.size();
+    ++iovcnt;
+  }
+
+  for (auto idx = getChunkIndex(sub->seq);
+      idx < chunks_.size() && iovcnt < IOV_MAX;
+      ++idx) {
+    const auto& chunk = *chunks_[idx];
+    auto offset = chunk.seq == sub->seq ? sub->offset : 0;
+    iov[iovcnt].iov_base = (void*) (chunk.data.data() + offset);
+    iov[iovcnt].iov_len = chunk.data.size() - offset;
+    ++iovcnt;
+  }
+
+  if (iovcnt == 0) {
+    return true;
+  }
+
+  ssize_t rc;
+  if (sub->is_fifo) {
+    rc = writev(sub->fd, iov, iovcnt);
+  } else {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    rc = sendmsg(sub->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  }
+
+  ++write_calls_;
+  if (rc < 0) {
+    if (errno != EAGAIN && errno != EINTR) {
+      return false;
+    }
+
+    skipChunks(sub);
+    return true;
+  }
+
+  bytes_written_ += rc;
+  size_t written = rc;
+  if (!sub->partial.empty()) {
+    auto n = std::min(written, sub->partial.size());
+    sub->partial.erase(0, n);
+    written -= n;
+  }
+
+  while (written > 0) {
+    const auto& chunk = *chunks_[getChunkIndex(sub->seq)];
+    auto remaining = chunk.data.size() - sub->offset;
+    if (written < remaining) {
+      sub->offset += written;
+      break;
+    }
+
+    written -= remaining;
+    sub->offset = 0;
+    ++sub->seq;
+  }
+
+  skipChunks(sub);
+  return true;
+}
+
+void LocalStreamTarget::closeSubscriber(Subscriber* sub) {
+  if (sub->fd >= 0) {
+    close(sub->fd);
+    sub->fd = -1;
+  }
+}
+
+void LocalStreamTarget::getStats(std::string* stats) const {
+  *stats = StringUtil::format(
+      "{\"subscribers\":$0,\"subscribers_total\":$1,\"frames_enqueued\":$2,"
+      "\"frames_dropped\":$3,\"bytes_written\":$4,\"write_calls\":$5}",
+      num_subscribers_.load(),
+      subscribers_total_.load(),
+      frames_enqueued_.load(),
+      frames_dropped_.load(),
+      bytes_written_.load(),
+      write_calls_.load());
+}
+
+} // namespace plugins_localstream
+} // namespace evcollect
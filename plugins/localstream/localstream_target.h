@@ -0,0 +1,166 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <evcollect/util/time.h>
+#include <evcollect/util/return_code.h>
+
+namespace evcollect {
+namespace plugin_localstream {
+
+/**
+ * Streams events to local consumers, either to every client connected to a
+ * Unix domain socket or to a named pipe. Each event is framed as
+ *
+ *   {"event":"<name>","time":<unix micros>,"data":<event>}
+ *
+ * followed by a newline (NDJSON) or preceded by its length as a 32 bit big
+ * endian integer (length prefixed).
+ *
+ * Events are appended to a shared buffer that is handed to a writer thread
+ * in immutable chunks. Each subscriber has its own position in the chunk
+ * list, so all subscribers share one copy of the data and every writev call
+ * sends everything a subscriber has not received yet. A subscriber that
+ * falls more than max_buffer_size bytes behind skips whole chunks, which
+ * keeps the frames intact, and the skipped frames are counted as dropped.
+ * Events that are emitted while there are no subscribers are not buffered
+ */
+class LocalStreamTarget {
+public:
+
+  enum class Framing { NDJSON, LENGTH_PREFIXED };
+
+  static const size_t kDefaultMaxBufferSize = 8 * 1024 * 1024;
+  static const uint64_t kFIFORetryIntervalMicros = 100 * kMicrosPerMilli;
+
+  static ReturnCode parseFraming(const std::string& str, Framing* framing);
+
+  LocalStreamTarget(Framing framing);
+  ~LocalStreamTarget();
+
+  /**
+   * Listen on a Unix domain socket. Every connected client receives all
+   * events from the time it connected. An existing socket file at path is
+   * replaced
+   */
+  ReturnCode listenSocket(const std::string& path);
+
+  /**
+   * Write to a named pipe, which is created if it does not exist. Events are
+   * only written while a reader has the pipe open
+   */
+  ReturnCode openFIFO(const std::string& path);
+
+  void setMaxBufferSize(size_t bytes);
+
+  ReturnCode emitEvent(
+      const std::string& event_name,
+      uint64_t time,
+      const std::string& event_data);
+
+  ReturnCode startWriterThread();
+  void stopWriterThread();
+
+  /**
+   * Write the counters of this target as a JSON object to stats. May be
+   * called from any thread
+   */
+  void getStats(std::string* stats) const;
+
+protected:
+
+  /**
+   * Chunks are immutable once they were handed to the writer thread.
+   * byte_begin and frame_begin are the number of bytes and frames in all
+   * chunks before this one
+   */
+  struct Chunk {
+    std::string data;
+    std::vector<size_t> frame_ends;
+    uint64_t seq;
+    uint64_t byte_begin;
+    uint64_t frame_begin;
+  };
+
+  /**
+   * The position of a subscriber is the sequence number of the next chunk
+   * to write and the number of bytes of that chunk that were already written.
+   * partial holds the rest of a frame that must be completed before the
+   * subscriber can skip ahead
+   */
+  struct Subscriber {
+    int fd;
+    bool is_fifo;
+    uint64_t seq;
+    size_t offset;
+    std::string partial;
+  };
+
+  void runWriterThread();
+  void acceptSubscribers();
+  void tryOpenFIFO();
+  bool writeSubscriber(Subscriber* sub);
+  void skipChunks(Subscriber* sub);
+  size_t getChunkIndex(uint64_t seq) const;
+  void closeSubscriber(Subscriber* sub);
+  void wakeup();
+
+  Framing framing_;
+  size_t max_buffer_size_;
+  std::string socket_path_;
+  std::string fifo_path_;
+  int listen_fd_;
+  int wakeup_pipe_[2];
+
+  /* owned by the writer thread */
+  std::deque<std::shared_ptr<const Chunk>> chunks_;
+  std::vector<Subscriber> subscribers_;
+  uint64_t next_seq_;
+  uint64_t sealed_bytes_;
+  uint64_t sealed_frames_;
+  uint64_t fifo_retry_at_;
+
+  std::mutex mutex_;
+  std::shared_ptr<Chunk> open_chunk_;
+  bool writer_idle_;
+  bool thread_running_;
+  bool thread_shutdown_;
+  std::thread thread_;
+
+  std::atomic<size_t> num_subscribers_;
+  std::atomic<uint64_t> subscribers_total_;
+  std::atomic<uint64_t> frames_enqueued_;
+  std::atomic<uint64_t> frames_dropped_;
+  std::atomic<uint64_t> bytes_written_;
+  std::atomic<uint64_t> write_calls_;
+};
+
+} // namespace plugins_localstream
+} // namespace evcollect
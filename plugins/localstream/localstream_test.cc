@@ -0,0 +1,225 @@
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <evcollect/evcollect.h>
+#include <evcollect/util/testing.h>
+#include <evcollect/util/time.h>
+#include "localstream_target.h"
+
+using namespace evcollect::plugin_localstream;
+
+/* the plugin usually resolves this symbol from the evcollectd binary */
+void evcollect_log(evcollect_loglevel level, const char* msg) {}
+
+static const uint64_t kTestTime = 1480000000 * kMicrosPerSecond;
+
+static std::string makeTempPath(const std::string& name) {
+  char dir[] = "/tmp/evcollect_localstream_XXXXXX";
+  mkdtemp(dir);
+  return std::string(dir) + "/" + name;
+}
+
+static int connectSocket(const std::string& path) {
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path.data(), path.size());
+  connect(fd, (struct sockaddr*) &addr, sizeof(addr));
+
+  struct timeval tv;
+  tv.tv_sec = 5;
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  return fd;
+}
+
+static bool waitFor(std::function<bool ()> cond) {
+  for (int i = 0; i < 5000; ++i) {
+    if (cond()) {
+      return true;
+    }
+
+    usleep(1000);
+  }
+
+  return false;
+}
+
+static std::string readUntil(int fd, size_t num_bytes) {
+  std::string data;
+  char buf[65536];
+  while (data.size() < num_bytes) {
+    auto n = read(fd, buf, sizeof(buf));
+    if (n <= 0) {
+      break;
+    }
+
+    data.append(buf, n);
+  }
+
+  return data;
+}
+
+static std::string getStat(LocalStreamTarget* target, const std::string& key) {
+  std::string stats;
+  target->getStats(&stats);
+  auto begin = stats.find("\"" + key + "\":") + key.size() + 3;
+  auto end = stats.find_first_of(",}", begin);
+  return stats.substr(begin, end - begin);
+}
+
+TEST(LocalStream, ndjson_socket) {
+  signal(SIGPIPE, SIG_IGN);
+
+  auto path = makeTempPath("events.sock");
+  LocalStreamTarget target(LocalStreamTarget::Framing::NDJSON);
+  EXPECT_TRUE(target.listenSocket(path).isSuccess());
+  EXPECT_TRUE(target.startWriterThread().isSuccess());
+
+  /* no subscribers, so this is discarded */
+  EXPECT_TRUE(target.emitEvent("sys.cpu", kTestTime, "{}").isSuccess());
+
+  int fd = connectSocket(path);
+  EXPECT_TRUE(waitFor([&target] {
+    return getStat(&target, "subscribers") == "1";
+  }));
+
+  auto rc = target.emitEvent("sys.cpu", kTestTime, "{\"a\":\n1}");
+  EXPECT_TRUE(rc.isSuccess());
+  EXPECT_TRUE(target.emitEvent("sys.mem", kTestTime + 1, "").isSuccess());
+
+  std::string expected =
+      "{\"event\":\"sys.cpu\",\"time\":1480000000000000,\"data\":{\"a\": 1}}\n"
+      "{\"event\":\"sys.mem\",\"time\":1480000000000001,\"data\":null}\n";
+
+  EXPECT_EQ(readUntil(fd, expected.size()), expected);
+  EXPECT_EQ(getStat(&target, "frames_enqueued"), "2");
+  EXPECT_EQ(getStat(&target, "frames_dropped"), "0");
+
+  close(fd);
+  EXPECT_TRUE(waitFor([&target] {
+    target.emitEvent("sys.cpu", kTestTime, "{}");
+    return getStat(&target, "subscribers") == "0";
+  }));
+
+  target.stopWriterThread();
+}
+
+/**
+ * The slow subscriber never reads, so it must fall behind and drop frames
+ * while the fast subscriber still receives every frame intact
+ */
+TEST(LocalStream, slow_subscriber) {
+  signal(SIGPIPE, SIG_IGN);
+
+  auto path = makeTempPath("events.sock");
+  LocalStreamTarget target(LocalStreamTarget::Framing::LENGTH_PREFIXED);
+  target.setMaxBufferSize(64 * 1024);
+  EXPECT_TRUE(target.listenSocket(path).isSuccess());
+  EXPECT_TRUE(target.startWriterThread().isSuccess());
+
+  int slow_fd = connectSocket(path);
+  int fast_fd = connectSocket(path);
+  EXPECT_TRUE(waitFor([&target] {
+    return getStat(&target, "subscribers") == "2";
+  }));
+
+  static const size_t kNumEvents = 20000;
+  std::string payload = "{\"pad\":\"" + std::string(200, 'x') + "\"}";
+
+  std::atomic<size_t> frames_read(0);
+  bool frames_valid = true;
+  std::thread reader([fast_fd, &frames_read, &frames_valid, &payload] {
+    std::string buf;
+    char tmp[65536];
+    while (frames_read < kNumEvents) {
+      auto n = read(fast_fd, tmp, sizeof(tmp));
+      if (n <= 0) {
+        break;
+      }
+
+      buf.append(tmp, n);
+      size_t pos = 0;
+      while (buf.size() - pos >= 4) {
+        uint32_t len =
+            (uint32_t((unsigned char) buf[pos + 0]) << 24) |
+            (uint32_t((unsigned char) buf[pos + 1]) << 16) |
+            (uint32_t((unsigned char) buf[pos + 2]) << 8) |
+            (uint32_t((unsigned char) buf[pos + 3]));
+        if (buf.size() - pos - 4 < len) {
+          break;
+        }
+
+        auto frame = buf.substr(pos + 4, len);
+        auto expected_suffix = ",\"data\":" + payload + "}";
+        if (frame.compare(
+                frame.size() - expected_suffix.size(),
+                std::string::npos,
+                expected_suffix) != 0) {
+          frames_valid = false;
+        }
+
+        pos += 4 + len;
+        ++frames_read;
+      }
+
+      buf.erase(0, pos);
+    }
+  });
+
+  for (size_t i = 0; i < kNumEvents; ++i) {
+    /* don't let the fast subscriber fall behind, too */
+    if (i % 100 == 0) {
+      waitFor([&frames_read, i] { return frames_read + 200 >= i; });
+    }
+
+    EXPECT_TRUE(target.emitEvent("test", kTestTime, payload).isSuccess());
+  }
+
+  reader.join();
+  EXPECT_EQ(frames_read.load(), kNumEvents);
+  EXPECT_TRUE(frames_valid);
+
+  auto dropped = std::stoull(getStat(&target, "frames_dropped"));
+  EXPECT_TRUE(dropped > 0);
+  EXPECT_TRUE(dropped < kNumEvents);
+
+  target.stopWriterThread();
+  close(slow_fd);
+  close(fast_fd);
+}
+
+TEST(LocalStream, fifo) {
+  signal(SIGPIPE, SIG_IGN);
+
+  auto path = makeTempPath("events.fifo");
+  LocalStreamTarget target(LocalStreamTarget::Framing::NDJSON);
+  EXPECT_TRUE(target.openFIFO(path).isSuccess());
+  EXPECT_TRUE(target.startWriterThread().isSuccess());
+
+  int fd = open(path.c_str(), O_RDONLY | O_NONBLOCK);
+  EXPECT_TRUE(fd >= 0);
+  EXPECT_TRUE(waitFor([&target] {
+    return getStat(&target, "subscribers") == "1";
+  }));
+
+  fcntl(fd, F_SETFL, 0);
+  EXPECT_TRUE(target.emitEvent("sys.cpu", kTestTime, "{}").isSuccess());
+
+  std::string expected =
+      "{\"event\":\"sys.cpu\",\"time\":1480000000000000,\"data\":{}}\n";
+  EXPECT_EQ(readUntil(fd, expected.size()), expected);
+
+  close(fd);
+  target.stopWriterThread();
+}
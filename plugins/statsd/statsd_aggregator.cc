@@ -0,0 +1,614 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <evcollect/util/stringutil.h>
+#include "statsd_aggregator.h"
+
+namespace evcollect {
+namespace plugin_statsd {
+
+namespace {
+
+/**
+ * Parses [+-]digits[.digits] without a copy; anything else (e.g. exponents)
+ * falls back to strtod
+ */
+bool parseDouble(const char* begin, const char* end, double* value) {
+  auto cur = begin;
+  bool negative = false;
+  if (cur < end && (*cur == '+' || *cur == '-')) {
+    negative = *cur == '-';
+    ++cur;
+  }
+
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int scale = 0;
+  for (; cur < end && *cur >= '0' && *cur <= '9'; ++cur, ++digits) {
+    mantissa = mantissa * 10 + (*cur - '0');
+  }
+
+  if (cur < end && *cur == '.') {
+    for (++cur; cur < end && *cur >= '0' && *cur <= '9'; ++cur, ++digits) {
+      mantissa = mantissa * 10 + (*cur - '0');
+      ++scale;
+    }
+  }
+
+  if (cur == end && digits > 0 && digits <= 18) {
+    static const double kPow10[] = {
+      1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+      1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18
+    };
+
+    *value = mantissa / kPow10[scale];
+    if (negative) {
+      *value = -*value;
+    }
+
+    return true;
+  }
+
+  char buf[64];
+  size_t len = end - begin;
+  if (len == 0 || len >= sizeof(buf)) {
+    return false;
+  }
+
+  memcpy(buf, begin, len);
+  buf[len] = 0;
+  char* parse_end;
+  *value = strtod(buf, &parse_end);
+  return parse_end == buf + len && isfinite(*value);
+}
+
+bool parseType(const char* begin, const char* end, MetricType* type) {
+  switch (end - begin) {
+    case 1:
+      switch (*begin) {
+        case 'c': *type = MetricType::COUNTER; return true;
+        case 'g': *type = MetricType::GAUGE; return true;
+        case 's': *type = MetricType::SET; return true;
+        case 'h': *type = MetricType::TIMER; return true;
+        case 'd': *type = MetricType::TIMER; return true;
+        default: return false;
+      }
+    case 2:
+      if (begin[0] == 'm' && begin[1] == 's') {
+        *type = MetricType::TIMER;
+        return true;
+      }
+      return false;
+    default:
+      return false;
+  }
+}
+
+uint64_t nextRandom(uint64_t* state) {
+  /* xorshift64 */
+  auto x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+std::string formatNumber(double value) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.15g", value);
+  return buf;
+}
+
+} // namespace
+
+bool parseStatsdLine(
+    const char* begin,
+    const char* end,
+    StatsdMetric* metric) {
+  while (end > begin && (end[-1] == '\r' || end[-1] == ' ')) {
+    --end;
+  }
+
+  auto colon = static_cast<const char*>(memchr(begin, ':', end - begin));
+  if (!colon || colon == begin) {
+    return false;
+  }
+
+  auto pipe = static_cast<const char*>(memchr(colon, '|', end - colon));
+  if (!pipe || pipe == colon + 1) {
+    return false;
+  }
+
+  auto type_end = static_cast<const char*>(
+      memchr(pipe + 1, '|', end - pipe - 1));
+  if (!type_end) {
+    type_end = end;
+  }
+
+  if (!parseType(pipe + 1, type_end, &metric->type)) {
+    return false;
+  }
+
+  metric->name = begin;
+  metric->name_len = colon - begin;
+  metric->sample_rate = 1;
+  metric->relative = false;
+  metric->value = 0;
+  metric->set_value = nullptr;
+  metric->set_value_len = 0;
+
+  for (auto cur = type_end; cur < end; ) {
+    auto field = cur + 1;
+    auto field_end = static_cast<const char*>(memchr(field, '|', end - field));
+    if (!field_end) {
+      field_end = end;
+    }
+
+    if (field < field_end && *field == '@') {
+      if (!parseDouble(field + 1, field_end, &metric->sample_rate) ||
+          metric->sample_rate <= 0 ||
+          metric->sample_rate > 1) {
+        return false;
+      }
+    }
+
+    cur = field_end;
+  }
+
+  auto value = colon + 1;
+  switch (metric->type) {
+    case MetricType::SET:
+      metric->set_value = value;
+      metric->set_value_len = pipe - value;
+      return true;
+    case MetricType::GAUGE:
+      metric->relative = *value == '+' || *value == '-';
+      /* fallthrough */
+    default:
+      return parseDouble(value, pipe, &metric->value);
+  }
+}
+
+uint64_t hashMetricName(const char* name, size_t len) {
+  /* FNV-1a */
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; ++i) {
+    h ^= (unsigned char) name[i];
+    h *= 1099511628211ULL;
+  }
+
+  return h;
+}
+
+template <typename T>
+T* MetricTable<T>::get(const char* name, size_t len, uint64_t hash) {
+  if (slots_.empty()) {
+    rehash(64);
+  }
+
+  auto idx = hash & mask_;
+  for (; slots_[idx] != 0; idx = (idx + 1) & mask_) {
+    auto& e = entries_[slots_[idx] - 1];
+    if (e.hash == hash &&
+        e.name.size() == len &&
+        memcmp(e.name.data(), name, len) == 0) {
+      e.used = true;
+      return &e.value;
+    }
+  }
+
+  entries_.emplace_back();
+  auto& e = entries_.back();
+  e.name.assign(name, len);
+  e.hash = hash;
+  e.used = true;
+  e.idle = 0;
+  slots_[idx] = entries_.size();
+
+  if (entries_.size() * 2 > slots_.size()) {
+    rehash(slots_.size() * 2);
+  }
+
+  return &entries_.back().value;
+}
+
+template <typename T>
+void MetricTable<T>::reset(uint32_t max_idle) {
+  bool evict = false;
+  for (auto& e : entries_) {
+    if (e.used) {
+      e.used = false;
+      e.idle = 0;
+      e.value.reset();
+    } else if (++e.idle > max_idle) {
+      evict = true;
+    }
+  }
+
+  if (evict) {
+    entries_.erase(
+        std::remove_if(
+            entries_.begin(),
+            entries_.end(),
+            [max_idle] (const Entry& e) { return e.idle > max_idle; }),
+        entries_.end());
+
+    rehash(slots_.size());
+  }
+}
+
+template <typename T>
+void MetricTable<T>::rehash(size_t num_slots) {
+  slots_.assign(num_slots, 0);
+  mask_ = num_slots - 1;
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    auto idx = entries_[i].hash & mask_;
+    while (slots_[idx] != 0) {
+      idx = (idx + 1) & mask_;
+    }
+
+    slots_[idx] = i + 1;
+  }
+}
+
+template class MetricTable<CounterData>;
+template class MetricTable<GaugeData>;
+template class MetricTable<SetData>;
+template class MetricTable<TimerData>;
+
+void TimerData::reset() {
+  count = 0;
+  sum = 0;
+  min = 0;
+  max = 0;
+  num_values = 0;
+  samples.clear();
+}
+
+StatsdShard::StatsdShard(
+    const std::atomic<uint64_t>* epoch,
+    size_t max_timer_samples) :
+    epoch_(epoch),
+    local_epoch_(epoch->load()),
+    acked_epoch_(local_epoch_),
+    cur_(&sets_[local_epoch_ & 1]),
+    max_timer_samples_(max_timer_samples),
+    rng_state_(0x9e3779b97f4a7c15ULL ^ (uintptr_t) this),
+    packets_(0),
+    bad_lines_(0),
+    dropped_(0) {}
+
+void StatsdShard::beginBatch() {
+  auto epoch = epoch_->load(std::memory_order_acquire);
+  if (epoch != local_epoch_) {
+    local_epoch_ = epoch;
+    cur_ = &sets_[epoch & 1];
+    acked_epoch_.store(epoch, std::memory_order_release);
+  }
+}
+
+void StatsdShard::addPacket(const char* data, size_t size) {
+  uint64_t bad_lines = 0;
+  auto end = data + size;
+  for (auto cur = data; cur < end; ) {
+    auto eol = static_cast<const char*>(memchr(cur, '\n', end - cur));
+    if (!eol) {
+      eol = end;
+    }
+
+    if (eol > cur) {
+      StatsdMetric metric;
+      if (parseStatsdLine(cur, eol, &metric)) {
+        addMetric(metric);
+      } else {
+        ++bad_lines;
+      }
+    }
+
+    cur = eol + 1;
+  }
+
+  packets_.fetch_add(1, std::memory_order_relaxed);
+  if (bad_lines > 0) {
+    bad_lines_.fetch_add(bad_lines, std::memory_order_relaxed);
+  }
+}
+
+void StatsdShard::addBadPacket() {
+  packets_.fetch_add(1, std::memory_order_relaxed);
+  bad_lines_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void StatsdShard::setDropped(uint64_t dropped) {
+  dropped_.store(dropped, std::memory_order_relaxed);
+}
+
+void StatsdShard::addMetric(const StatsdMetric& m) {
+  auto hash = hashMetricName(m.name, m.name_len);
+  switch (m.type) {
+
+    case MetricType::COUNTER: {
+      auto c = cur_->counters.get(m.name, m.name_len, hash);
+      c->value += m.value / m.sample_rate;
+      break;
+    }
+
+    case MetricType::GAUGE: {
+      auto g = cur_->gauges.get(m.name, m.name_len, hash);
+      if (m.relative) {
+        g->delta += m.value;
+      } else {
+        g->has_value = true;
+        g->value = m.value;
+        g->delta = 0;
+      }
+      break;
+    }
+
+    case MetricType::SET: {
+      auto s = cur_->sets.get(m.name, m.name_len, hash);
+      s->members.insert(hashMetricName(m.set_value, m.set_value_len));
+      break;
+    }
+
+    case MetricType::TIMER: {
+      auto t = cur_->timers.get(m.name, m.name_len, hash);
+      if (t->num_values == 0 || m.value < t->min) {
+        t->min = m.value;
+      }
+      if (t->num_values == 0 || m.value > t->max) {
+        t->max = m.value;
+      }
+
+      t->count += 1 / m.sample_rate;
+      t->sum += m.value / m.sample_rate;
+      ++t->num_values;
+
+      if (t->samples.size() < max_timer_samples_) {
+        t->samples.emplace_back(m.value);
+      } else {
+        auto j = nextRandom(&rng_state_) % t->num_values;
+        if (j < t->samples.size()) {
+          t->samples[j] = m.value;
+        }
+      }
+      break;
+    }
+
+  }
+}
+
+StatsdAggregator::StatsdAggregator(
+    size_t num_shards,
+    size_t max_timer_samples) :
+    epoch_(0),
+    percentiles_({ 50, 90, 95, 99 }),
+    packets_(0),
+    bad_lines_(0),
+    dropped_(0) {
+  for (size_t i = 0; i < num_shards; ++i) {
+    shards_.emplace_back(new StatsdShard(&epoch_, max_timer_samples));
+  }
+}
+
+StatsdShard* StatsdAggregator::getShard(size_t idx) {
+  return shards_[idx].get();
+}
+
+size_t StatsdAggregator::getNumShards() const {
+  return shards_.size();
+}
+
+void StatsdAggregator::setPercentiles(const std::vector<double>& percentiles) {
+  percentiles_ = percentiles;
+}
+
+uint64_t StatsdAggregator::startFlush() {
+  return epoch_.fetch_add(1, std::memory_order_acq_rel) + 1;
+}
+
+bool StatsdAggregator::isFlushAcked(uint64_t epoch) const {
+  for (const auto& s : shards_) {
+    if (s->acked_epoch_.load(std::memory_order_acquire) != epoch) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void StatsdAggregator::mergeShard(MetricSet* set) {
+  set->counters.forEach([this] (const std::string& name, const CounterData& c) {
+    counters_[name] += c.value;
+  });
+
+  set->gauges.forEach([this] (const std::string& name, const GaugeData& g) {
+    auto& value = gauges_[name];
+    if (g.has_value) {
+      value = g.value;
+    }
+
+    value += g.delta;
+  });
+
+  set->sets.forEach([this] (const std::string& name, const SetData& s) {
+    sets_[name].insert(s.members.begin(), s.members.end());
+  });
+
+  set->timers.forEach([this] (const std::string& name, const TimerData& t) {
+    auto iter = timers_.find(name);
+    if (iter == timers_.end()) {
+      TimerSummary summary;
+      summary.count = 0;
+      summary.sum = 0;
+      summary.min = t.min;
+      summary.max = t.max;
+      iter = timers_.emplace(name, std::move(summary)).first;
+    }
+
+    auto& summary = iter->second;
+    summary.count += t.count;
+    summary.sum += t.sum;
+    summary.min = std::min(summary.min, t.min);
+    summary.max = std::max(summary.max, t.max);
+
+    /* each sample stands for num_values / samples.size() values */
+    double weight = double(t.num_values) / t.samples.size();
+    for (auto v : t.samples) {
+      summary.samples.emplace_back(v, weight);
+    }
+  });
+
+  set->counters.reset(kMaxIdleFlushes);
+  set->gauges.reset(kMaxIdleFlushes);
+  set->sets.reset(kMaxIdleFlushes);
+  set->timers.reset(kMaxIdleFlushes);
+}
+
+void StatsdAggregator::finishFlush(uint64_t epoch, std::string* event_json) {
+  uint64_t packets = 0;
+  uint64_t bad_lines = 0;
+  uint64_t dropped = 0;
+  for (const auto& s : shards_) {
+    if (s->acked_epoch_.load(std::memory_order_acquire) == epoch) {
+      mergeShard(&s->sets_[(epoch & 1) ^ 1]);
+    }
+
+    packets += s->packets_.load(std::memory_order_relaxed);
+    bad_lines += s->bad_lines_.load(std::memory_order_relaxed);
+    dropped += s->dropped_.load(std::memory_order_relaxed);
+  }
+
+  std::vector<std::string> groups;
+
+  if (!counters_.empty()) {
+    std::string json;
+    for (const auto& c : counters_) {
+      json += json.empty() ? "{" : ",";
+      json += StringUtil::format(
+          "\"$0\":$1",
+          StringUtil::jsonEscape(c.first),
+          formatNumber(c.second));
+    }
+
+    groups.emplace_back("\"counters\":" + json + "}");
+  }
+
+  if (!gauges_.empty()) {
+    std::string json;
+    for (const auto& g : gauges_) {
+      json += json.empty() ? "{" : ",";
+      json += StringUtil::format(
+          "\"$0\":$1",
+          StringUtil::jsonEscape(g.first),
+          formatNumber(g.second));
+    }
+
+    groups.emplace_back("\"gauges\":" + json + "}");
+  }
+
+  if (!sets_.empty()) {
+    std::string json;
+    for (const auto& s : sets_) {
+      json += json.empty() ? "{" : ",";
+      json += StringUtil::format(
+          "\"$0\":$1",
+          StringUtil::jsonEscape(s.first),
+          s.second.size());
+    }
+
+    groups.emplace_back("\"sets\":" + json + "}");
+  }
+
+  if (!timers_.empty()) {
+    std::string json;
+    for (auto& t : timers_) {
+      auto& summary = t.second;
+      json += json.empty() ? "{" : ",";
+      json += StringUtil::format(
+          "\"$0\":{\"count\":$1,\"sum\":$2,\"min\":$3,\"max\":$4,\"mean\":$5",
+          StringUtil::jsonEscape(t.first),
+          formatNumber(summary.count),
+          formatNumber(summary.sum),
+          formatNumber(summary.min),
+          formatNumber(summary.max),
+          formatNumber(summary.count > 0 ? summary.sum / summary.count : 0));
+
+      std::sort(summary.samples.begin(), summary.samples.end());
+      double total_weight = 0;
+      for (const auto& s : summary.samples) {
+        total_weight += s.second;
+      }
+
+      for (auto p : percentiles_) {
+        /* nearest rank */
+        double rank = total_weight * p / 100;
+        double value = summary.max;
+        double cumulative = 0;
+        for (const auto& s : summary.samples) {
+          cumulative += s.second;
+          if (cumulative >= rank) {
+            value = s.first;
+            break;
+          }
+        }
+
+        auto name = formatNumber(p);
+        std::replace(name.begin(), name.end(), '.', '_');
+        json += StringUtil::format(",\"p$0\":$1", name, formatNumber(value));
+      }
+
+      json += "}";
+    }
+
+    groups.emplace_back("\"timers\":" + json + "}");
+  }
+
+  if (!groups.empty() || packets > packets_) {
+    groups.emplace_back(
+        StringUtil::format(
+            "\"receiver\":{\"packets\":$0,\"bad_lines\":$1,\"dropped\":$2}",
+            packets - packets_,
+            bad_lines - bad_lines_,
+            dropped - dropped_));
+
+    *event_json = "{" + StringUtil::join(groups, ",") + "}";
+  }
+
+  packets_ = packets;
+  bad_lines_ = bad_lines;
+  dropped_ = dropped;
+
+  counters_.clear();
+  sets_.clear();
+  timers_.clear();
+}
+
+} // namespace plugins_statsd
+} // namespace evcollect
+
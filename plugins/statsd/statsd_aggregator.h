@@ -0,0 +1,273 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include <stdint.h>
+#include <string.h>
+
+namespace evcollect {
+namespace plugin_statsd {
+
+enum class MetricType { COUNTER, GAUGE, SET, TIMER };
+
+/**
+ * A single parsed statsd line. name and set_value point into the packet
+ */
+struct StatsdMetric {
+  const char* name;
+  size_t name_len;
+  MetricType type;
+  double value;
+  bool relative;
+  double sample_rate;
+  const char* set_value;
+  size_t set_value_len;
+};
+
+/**
+ * Parses a line in the format <name>:<value>|<type>[|@<rate>][|#<tags>].
+ * Supported types are c, g, s, ms, h and d (the last two are treated as
+ * timers). Gauge values with an explicit sign are relative. Tags are ignored
+ */
+bool parseStatsdLine(const char* begin, const char* end, StatsdMetric* metric);
+
+uint64_t hashMetricName(const char* name, size_t len);
+
+/**
+ * Open addressing hash table that maps metric names to values. Lookups take
+ * a pointer and length, so once a name was seen, updating it does not
+ * allocate. Entries are kept across flushes and only evicted after they were
+ * idle for a number of flushes
+ */
+template <typename T>
+class MetricTable {
+public:
+
+  MetricTable() : mask_(0) {}
+
+  T* get(const char* name, size_t len, uint64_t hash);
+
+  template <typename F>
+  void forEach(F fn) const {
+    for (const auto& e : entries_) {
+      if (e.used) {
+        fn(e.name, e.value);
+      }
+    }
+  }
+
+  /**
+   * Reset the values of all entries that were used since the last call and
+   * evict those that were unused for more than max_idle calls
+   */
+  void reset(uint32_t max_idle);
+
+  size_t size() const {
+    return entries_.size();
+  }
+
+protected:
+
+  struct Entry {
+    std::string name;
+    uint64_t hash;
+    bool used;
+    uint32_t idle;
+    T value;
+  };
+
+  void rehash(size_t num_slots);
+
+  std::vector<Entry> entries_;
+  std::vector<uint32_t> slots_;
+  size_t mask_;
+};
+
+struct CounterData {
+  double value;
+
+  CounterData() : value(0) {}
+  void reset() { value = 0; }
+};
+
+struct GaugeData {
+  bool has_value;
+  double value;
+  double delta;
+
+  GaugeData() : has_value(false), value(0), delta(0) {}
+  void reset() { *this = GaugeData(); }
+};
+
+struct SetData {
+  std::unordered_set<uint64_t> members;
+
+  void reset() { members.clear(); }
+};
+
+/**
+ * count is corrected for the sample rate, num_values is the number of values
+ * that were actually received. samples is a uniform reservoir sample of at
+ * most max_timer_samples of those values
+ */
+struct TimerData {
+  double count;
+  double sum;
+  double min;
+  double max;
+  uint64_t num_values;
+  std::vector<double> samples;
+
+  TimerData() : count(0), sum(0), min(0), max(0), num_values(0) {}
+  void reset();
+};
+
+struct MetricSet {
+  MetricTable<CounterData> counters;
+  MetricTable<GaugeData> gauges;
+  MetricTable<SetData> sets;
+  MetricTable<TimerData> timers;
+};
+
+/**
+ * The part of the aggregation owned by a single receiver thread. The receiver
+ * updates its shard without any locks or atomic read-modify-write operations.
+ * Each shard has two metric sets; the aggregator flips between them by
+ * advancing a global epoch, and a receiver moves to the new set at the start
+ * of its next batch, acknowledging the epoch. The set it left is then owned
+ * by the flushing thread until the epoch is advanced again
+ */
+class StatsdShard {
+public:
+
+  StatsdShard(const std::atomic<uint64_t>* epoch, size_t max_timer_samples);
+
+  /**
+   * Must be called by the owning thread before each batch of packets
+   */
+  void beginBatch();
+
+  /**
+   * Aggregate a packet of newline separated statsd lines
+   */
+  void addPacket(const char* data, size_t size);
+
+  /**
+   * Count a packet that was truncated or otherwise unusable
+   */
+  void addBadPacket();
+
+  /**
+   * Set the number of packets the kernel dropped for this shard's socket
+   */
+  void setDropped(uint64_t dropped);
+
+protected:
+  friend class StatsdAggregator;
+
+  void addMetric(const StatsdMetric& metric);
+
+  const std::atomic<uint64_t>* epoch_;
+  uint64_t local_epoch_;
+  std::atomic<uint64_t> acked_epoch_;
+  MetricSet sets_[2];
+  MetricSet* cur_;
+  size_t max_timer_samples_;
+  uint64_t rng_state_;
+  std::atomic<uint64_t> packets_;
+  std::atomic<uint64_t> bad_lines_;
+  std::atomic<uint64_t> dropped_;
+};
+
+/**
+ * Merges the shards into one event per flush:
+ *
+ *   {"counters":{..},"gauges":{..},"sets":{..},"timers":{..},"receiver":{..}}
+ *
+ * Counters are summed up (and scaled by the sample rate), gauges keep their
+ * last value across flushes, sets report the number of unique members and
+ * timers report count, sum, min, max, mean and the configured percentiles.
+ * Percentiles are computed from the timer samples, weighted by the number of
+ * values each shard's reservoir stands for
+ */
+class StatsdAggregator {
+public:
+
+  static const size_t kDefaultTimerSamples = 1024;
+  static const uint32_t kMaxIdleFlushes = 10;
+
+  StatsdAggregator(size_t num_shards, size_t max_timer_samples);
+
+  StatsdShard* getShard(size_t idx);
+  size_t getNumShards() const;
+
+  void setPercentiles(const std::vector<double>& percentiles);
+
+  /**
+   * Advance the epoch. The shards switch to their other metric set with
+   * their next batch; returns the new epoch
+   */
+  uint64_t startFlush();
+
+  bool isFlushAcked(uint64_t epoch) const;
+
+  /**
+   * Merge the metric sets of all shards that acknowledged epoch and write
+   * the event to event_json. Shards that did not acknowledge the epoch yet
+   * are merged in a later flush. Writes nothing if there is nothing to report
+   */
+  void finishFlush(uint64_t epoch, std::string* event_json);
+
+protected:
+
+  struct TimerSummary {
+    double count;
+    double sum;
+    double min;
+    double max;
+    std::vector<std::pair<double, double>> samples;
+  };
+
+  void mergeShard(MetricSet* set);
+
+  std::atomic<uint64_t> epoch_;
+  std::vector<std::unique_ptr<StatsdShard>> shards_;
+  std::vector<double> percentiles_;
+  std::map<std::string, double> counters_;
+  std::map<std::string, double> gauges_;
+  std::map<std::string, std::unordered_set<uint64_t>> sets_;
+  std::map<std::string, TimerSummary> timers_;
+  uint64_t packets_;
+  uint64_t bad_lines_;
+  uint64_t dropped_;
+};
+
+} // namespace plugins_statsd
+} // namespace evcollect
+
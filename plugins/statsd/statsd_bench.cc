@@ -0,0 +1,166 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+/**
+ * Ingest benchmark for the statsd receiver: one sender thread per receiver
+ * thread blasts counter/timer datagrams at a local UDP server using
+ * sendmmsg() while the main thread flushes once per second, like the
+ * evcollectd loop does. Prints the received and dropped packet rates.
+ *
+ *   $ make statsd_bench && ./statsd_bench [receiver_threads] [seconds]
+ */
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <evcollect/evcollect.h>
+#include <evcollect/util/time.h>
+#include "statsd_server.h"
+
+using namespace evcollect::plugin_statsd;
+
+void evcollect_log(evcollect_loglevel level, const char* msg) {}
+
+static const size_t kBatchSize = 64;
+static const size_t kNumMetrics = 1000;
+
+static double getReceiverStat(const std::string& json, const char* key) {
+  auto pos = json.find(key);
+  if (pos == std::string::npos) {
+    return 0;
+  }
+
+  return strtod(json.c_str() + pos + strlen(key) + 1, nullptr);
+}
+
+static void runSender(
+    uint16_t port,
+    size_t idx,
+    const std::atomic<bool>* running,
+    std::atomic<uint64_t>* sent) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+    perror("connect");
+    exit(1);
+  }
+
+  std::vector<std::string> packets;
+  for (size_t i = 0; i < kBatchSize; ++i) {
+    auto metric = (idx * kBatchSize + i) % kNumMetrics;
+    char buf[256];
+    snprintf(
+        buf,
+        sizeof(buf),
+        "bench.requests.%zu:1|c\nbench.latency.%zu:%zu|ms|@0.5",
+        metric,
+        metric,
+        i);
+
+    packets.emplace_back(buf);
+  }
+
+  struct mmsghdr msgs[kBatchSize];
+  struct iovec iovecs[kBatchSize];
+  memset(msgs, 0, sizeof(msgs));
+  for (size_t i = 0; i < kBatchSize; ++i) {
+    iovecs[i].iov_base = (void*) packets[i].data();
+    iovecs[i].iov_len = packets[i].size();
+    msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  while (running->load()) {
+    auto rc = sendmmsg(fd, msgs, kBatchSize, 0);
+    if (rc > 0) {
+      *sent += rc;
+    }
+  }
+
+  close(fd);
+}
+
+int main(int argc, const char** argv) {
+  size_t num_threads = argc > 1 ? strtoull(argv[1], NULL, 10) : 1;
+  size_t num_seconds = argc > 2 ? strtoull(argv[2], NULL, 10) : 5;
+
+  StatsdServer server(StatsdServer::Transport::UDP, num_threads, 1024);
+  auto rc = server.listen("127.0.0.1", 0);
+  if (rc.isSuccess()) {
+    rc = server.start();
+  }
+
+  if (!rc.isSuccess()) {
+    fprintf(stderr, "error: %s\n", rc.getMessage().c_str());
+    return 1;
+  }
+
+  std::atomic<bool> running(true);
+  std::atomic<uint64_t> sent(0);
+  std::vector<std::thread> senders;
+  for (size_t i = 0; i < num_threads; ++i) {
+    senders.emplace_back(runSender, server.getPort(), i, &running, &sent);
+  }
+
+  printf("     sent/s    received/s     dropped/s    flush_us  bytes\n");
+  uint64_t last_sent = 0;
+  for (size_t i = 0; i < num_seconds; ++i) {
+    usleep(1000000);
+
+    std::string json;
+    auto t0 = MonotonicClock::now();
+    server.flush(&json);
+    auto t1 = MonotonicClock::now();
+
+    uint64_t cur_sent = sent.load();
+    printf(
+        "%11llu %13.0f %13.0f %11llu %6zu\n",
+        (unsigned long long) (cur_sent - last_sent),
+        getReceiverStat(json, "\"packets\""),
+        getReceiverStat(json, "\"dropped\""),
+        (unsigned long long) (t1 - t0),
+        json.size());
+
+    last_sent = cur_sent;
+  }
+
+  running = false;
+  for (auto& t : senders) {
+    t.join();
+  }
+
+  server.stop();
+  return 0;
+}
@@ -0,0 +1,187 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <string>
+#include <vector>
+#include <string.h>
+#include <evcollect/evcollect.h>
+#include <evcollect/util/return_code.h>
+#include <evcollect/util/stringutil.h>
+#include "statsd_server.h"
+
+namespace evcollect {
+namespace plugin_statsd {
+
+static bool getUInt64Option(
+    evcollect_ctx_t* ctx,
+    const evcollect_plugin_cfg_t* cfg,
+    const char* key,
+    uint64_t* value) {
+  const char* opt;
+  if (!evcollect_plugin_getcfg(cfg, key, &opt)) {
+    return true;
+  }
+
+  try {
+    *value = std::stoull(opt);
+  } catch (...) {
+    auto msg = StringUtil::format("invalid value for $0", key);
+    evcollect_seterror(ctx, msg.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+int pluginAttach(
+    evcollect_ctx_t* ctx,
+    const evcollect_plugin_cfg_t* cfg,
+    void** userdata) {
+  auto transport = StatsdServer::Transport::UDP;
+  const char* transport_opt;
+  if (evcollect_plugin_getcfg(cfg, "transport", &transport_opt)) {
+    auto rc = StatsdServer::parseTransport(transport_opt, &transport);
+    if (!rc.isSuccess()) {
+      evcollect_seterror(ctx, rc.getMessage().c_str());
+      return false;
+    }
+  }
+
+  std::string host = "127.0.0.1";
+  const char* host_opt;
+  if (evcollect_plugin_getcfg(cfg, "host", &host_opt)) {
+    host = host_opt;
+  }
+
+  uint64_t port = StatsdServer::kDefaultPort;
+  if (!getUInt64Option(ctx, cfg, "port", &port)) {
+    return false;
+  }
+
+  if (port > 0xffff) {
+    evcollect_seterror(ctx, "invalid port");
+    return false;
+  }
+
+  uint64_t threads = 1;
+  if (!getUInt64Option(ctx, cfg, "threads", &threads)) {
+    return false;
+  }
+
+  if (threads == 0) {
+    evcollect_seterror(ctx, "threads must be at least 1");
+    return false;
+  }
+
+  uint64_t timer_samples = StatsdAggregator::kDefaultTimerSamples;
+  if (!getUInt64Option(ctx, cfg, "timer_samples", &timer_samples)) {
+    return false;
+  }
+
+  if (timer_samples == 0) {
+    evcollect_seterror(ctx, "timer_samples must be at least 1");
+    return false;
+  }
+
+  std::unique_ptr<StatsdServer> server(
+      new StatsdServer(transport, threads, timer_samples));
+
+  uint64_t rcvbuf = StatsdServer::kDefaultRecvBufferSize;
+  if (!getUInt64Option(ctx, cfg, "rcvbuf", &rcvbuf)) {
+    return false;
+  }
+
+  server->setRecvBufferSize(rcvbuf);
+
+  /* percentiles <p>... */
+  std::vector<double> percentiles;
+  for (int j = 0; ; ++j) {
+    const char* arg;
+    if (!evcollect_plugin_getcfgv(cfg, "percentiles", 0, j, &arg)) {
+      break;
+    }
+
+    char* end;
+    auto p = strtod(arg, &end);
+    if (*end || !(p > 0 && p <= 100)) {
+      evcollect_seterror(ctx, "invalid percentile, must be in (0, 100]");
+      return false;
+    }
+
+    percentiles.emplace_back(p);
+  }
+
+  if (!percentiles.empty()) {
+    server->setPercentiles(percentiles);
+  }
+
+  auto rc = server->listen(host, port);
+  if (rc.isSuccess()) {
+    rc = server->start();
+  }
+
+  if (!rc.isSuccess()) {
+    evcollect_seterror(ctx, rc.getMessage().c_str());
+    return false;
+  }
+
+  *userdata = server.release();
+  return true;
+}
+
+int pluginDetach(evcollect_ctx_t* ctx, void* userdata) {
+  auto server = static_cast<StatsdServer*>(userdata);
+  server->stop();
+  delete server;
+  return true;
+}
+
+int pluginGetNextEvent(
+    evcollect_ctx_t* ctx,
+    void* userdata,
+    evcollect_event_t* ev) {
+  auto server = static_cast<StatsdServer*>(userdata);
+
+  std::string json;
+  server->flush(&json);
+  evcollect_event_setdata(ev, json.data(), json.size());
+  return true;
+}
+
+} // namespace plugins_statsd
+} // namespace evcollect
+
+EVCOLLECT_PLUGIN_INIT(statsd) {
+  evcollect_source_plugin_register(
+      ctx,
+      "statsd",
+      &evcollect::plugin_statsd::pluginGetNextEvent,
+      NULL,
+      &evcollect::plugin_statsd::pluginAttach,
+      &evcollect::plugin_statsd::pluginDetach,
+      NULL,
+      NULL);
+
+  return true;
+}
+
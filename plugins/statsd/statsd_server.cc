@@ -0,0 +1,492 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <algorithm>
+#include <functional>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <evcollect/util/logging.h>
+#include "statsd_server.h"
+
+namespace evcollect {
+namespace plugin_statsd {
+
+namespace {
+
+void drainPipe(int fd) {
+  char buf[64];
+  while (read(fd, buf, sizeof(buf)) > 0);
+}
+
+size_t getNumShards(StatsdServer::Transport transport, size_t num_threads) {
+  switch (transport) {
+    case StatsdServer::Transport::UDP: return num_threads;
+    case StatsdServer::Transport::TCP: return 1;
+    case StatsdServer::Transport::BOTH: return num_threads + 1;
+  }
+
+  return 0;
+}
+
+} // namespace
+
+ReturnCode StatsdServer::parseTransport(
+    const std::string& str,
+    Transport* transport) {
+  if (str == "udp") {
+    *transport = Transport::UDP;
+    return ReturnCode::success();
+  }
+
+  if (str == "tcp") {
+    *transport = Transport::TCP;
+    return ReturnCode::success();
+  }
+
+  if (str == "both") {
+    *transport = Transport::BOTH;
+    return ReturnCode::success();
+  }
+
+  return ReturnCode::error(
+      "EINVAL",
+      "invalid transport: '%s' -- must be 'udp', 'tcp' or 'both'",
+      str.c_str());
+}
+
+StatsdServer::StatsdServer(
+    Transport transport,
+    size_t num_udp_threads,
+    size_t max_timer_samples) :
+    transport_(transport),
+    num_udp_threads_(transport == Transport::TCP ? 0 : num_udp_threads),
+    recv_buffer_size_(kDefaultRecvBufferSize),
+    port_(0),
+    aggregator_(
+        getNumShards(transport, num_udp_threads),
+        max_timer_samples),
+    tcp_fd_(-1),
+    running_(false) {
+  for (size_t i = 0; i < aggregator_.getNumShards(); ++i) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC | O_NONBLOCK) != 0) {
+      pipefd[0] = -1;
+      pipefd[1] = -1;
+    }
+
+    wakeup_pipes_.emplace_back(pipefd[0], pipefd[1]);
+  }
+}
+
+StatsdServer::~StatsdServer() {
+  stop();
+
+  for (auto fd : udp_fds_) {
+    close(fd);
+  }
+
+  if (tcp_fd_ >= 0) {
+    close(tcp_fd_);
+  }
+
+  for (const auto& p : wakeup_pipes_) {
+    if (p.first >= 0) {
+      close(p.first);
+      close(p.second);
+    }
+  }
+}
+
+void StatsdServer::setRecvBufferSize(size_t bytes) {
+  recv_buffer_size_ = bytes;
+}
+
+void StatsdServer::setPercentiles(const std::vector<double>& percentiles) {
+  aggregator_.setPercentiles(percentiles);
+}
+
+ReturnCode StatsdServer::bindSocket(
+    int type,
+    const std::string& host,
+    uint16_t* port) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = type;
+  hints.ai_flags = AI_PASSIVE;
+
+  struct addrinfo* addrs = nullptr;
+  auto port_str = std::to_string(*port);
+  int gai_rc = getaddrinfo(
+      host.empty() ? nullptr : host.c_str(),
+      port_str.c_str(),
+      &hints,
+      &addrs);
+
+  if (gai_rc != 0) {
+    return ReturnCode::error(
+        "EIO",
+        "getaddrinfo(%s) failed: %s",
+        host.c_str(),
+        gai_strerror(gai_rc));
+  }
+
+  auto rc = ReturnCode::error("EIO", "no addresses for %s", host.c_str());
+  for (auto addr = addrs; addr; addr = addr->ai_next) {
+    int fd = socket(
+        addr->ai_family,
+        addr->ai_socktype | SOCK_CLOEXEC,
+        addr->ai_protocol);
+
+    if (fd < 0) {
+      rc = ReturnCode::error("EIO", "socket() failed: %s", strerror(errno));
+      continue;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#ifdef SO_REUSEPORT
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+#endif
+
+    if (type == SOCK_DGRAM) {
+      /* SO_RCVBUFFORCE ignores rmem_max but needs CAP_NET_ADMIN */
+      int rcvbuf = recv_buffer_size_;
+#ifdef SO_RCVBUFFORCE
+      if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf))) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+      }
+#else
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+#endif
+
+#ifdef SO_RXQ_OVFL
+      setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+#endif
+    }
+
+    if (bind(fd, addr->ai_addr, addr->ai_addrlen) != 0 ||
+        (type == SOCK_STREAM && ::listen(fd, 128) != 0)) {
+      rc = ReturnCode::error(
+          "EIO",
+          "bind(%s:%u) failed: %s",
+          host.c_str(),
+          *port,
+          strerror(errno));
+      close(fd);
+      continue;
+    }
+
+    struct sockaddr_storage local;
+    socklen_t local_len = sizeof(local);
+    getsockname(fd, (struct sockaddr*) &local, &local_len);
+    switch (local.ss_family) {
+      case AF_INET:
+        *port = ntohs(((struct sockaddr_in*) &local)->sin_port);
+        break;
+      case AF_INET6:
+        *port = ntohs(((struct sockaddr_in6*) &local)->sin6_port);
+        break;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (type == SOCK_DGRAM) {
+      udp_fds_.emplace_back(fd);
+    } else {
+      tcp_fd_ = fd;
+    }
+
+    rc = ReturnCode::success();
+    break;
+  }
+
+  freeaddrinfo(addrs);
+  return rc;
+}
+
+ReturnCode StatsdServer::listen(const std::string& host, uint16_t port) {
+  for (size_t i = 0; i < num_udp_threads_; ++i) {
+    auto rc = bindSocket(SOCK_DGRAM, host, &port);
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  if (transport_ != Transport::UDP) {
+    auto rc = bindSocket(SOCK_STREAM, host, &port);
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  port_ = port;
+  return ReturnCode::success();
+}
+
+uint16_t StatsdServer::getPort() const {
+  return port_;
+}
+
+ReturnCode StatsdServer::start() {
+  for (const auto& p : wakeup_pipes_) {
+    if (p.first < 0) {
+      return ReturnCode::error("EIO", "pipe() failed");
+    }
+  }
+
+  running_ = true;
+  for (size_t i = 0; i < num_udp_threads_; ++i) {
+    threads_.emplace_back(std::bind(&StatsdServer::runUDPReceiver, this, i));
+  }
+
+  if (tcp_fd_ >= 0) {
+    threads_.emplace_back(
+        std::bind(&StatsdServer::runTCPReceiver, this, num_udp_threads_));
+  }
+
+  return ReturnCode::success();
+}
+
+void StatsdServer::stop() {
+  if (!running_) {
+    return;
+  }
+
+  running_ = false;
+  for (const auto& p : wakeup_pipes_) {
+    write(p.second, "x", 1);
+  }
+
+  for (auto& t : threads_) {
+    t.join();
+  }
+
+  threads_.clear();
+}
+
+void StatsdServer::flush(std::string* event_json) {
+  auto epoch = aggregator_.startFlush();
+  if (running_) {
+    for (const auto& p : wakeup_pipes_) {
+      write(p.second, "x", 1);
+    }
+
+    /* busy receivers switch with their next batch, idle ones on wakeup */
+    auto deadline = MonotonicClock::now() + kFlushTimeoutMicros;
+    while (!aggregator_.isFlushAcked(epoch) &&
+           MonotonicClock::now() < deadline) {
+      usleep(10);
+    }
+  }
+
+  aggregator_.finishFlush(epoch, event_json);
+}
+
+void StatsdServer::runUDPReceiver(size_t idx) {
+  auto shard = aggregator_.getShard(idx);
+  int fd = udp_fds_[idx];
+  int wakeup_fd = wakeup_pipes_[idx].first;
+
+  std::unique_ptr<char[]> buffers(new char[kBatchSize * kMaxDatagramSize]);
+  struct mmsghdr msgs[kBatchSize];
+  struct iovec iovs[kBatchSize];
+  char control[kBatchSize][CMSG_SPACE(sizeof(uint32_t))];
+  memset(msgs, 0, sizeof(msgs));
+  for (size_t i = 0; i < kBatchSize; ++i) {
+    iovs[i].iov_base = buffers.get() + i * kMaxDatagramSize;
+    iovs[i].iov_len = kMaxDatagramSize;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  while (running_.load(std::memory_order_relaxed)) {
+    shard->beginBatch();
+
+    for (size_t i = 0; i < kBatchSize; ++i) {
+      msgs[i].msg_hdr.msg_control = control[i];
+      msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+    }
+
+    int n = recvmmsg(fd, msgs, kBatchSize, MSG_DONTWAIT, nullptr);
+    if (n > 0) {
+      for (int i = 0; i < n; ++i) {
+        if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+          shard->addBadPacket();
+        } else {
+          shard->addPacket(
+              static_cast<const char*>(iovs[i].iov_base),
+              msgs[i].msg_len);
+        }
+      }
+
+#ifdef SO_RXQ_OVFL
+      /* the kernel's drop counter for this socket */
+      auto hdr = &msgs[n - 1].msg_hdr;
+      for (auto cmsg = CMSG_FIRSTHDR(hdr);
+           cmsg;
+           cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SO_RXQ_OVFL) {
+          uint32_t dropped;
+          memcpy(&dropped, CMSG_DATA(cmsg), sizeof(dropped));
+          shard->setDropped(dropped);
+        }
+      }
+#endif
+
+      continue;
+    }
+
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+      logWarning("statsd: recvmmsg() failed: $0", strerror(errno));
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = wakeup_fd;
+    fds[1].events = POLLIN;
+    if (poll(fds, 2, -1) > 0 && (fds[1].revents & POLLIN)) {
+      drainPipe(wakeup_fd);
+    }
+  }
+}
+
+void StatsdServer::runTCPReceiver(size_t idx) {
+  auto shard = aggregator_.getShard(idx);
+  int wakeup_fd = wakeup_pipes_[idx].first;
+
+  struct Connection {
+    int fd;
+    std::string buf;
+  };
+
+  std::vector<Connection> conns;
+  std::vector<struct pollfd> fds;
+  std::unique_ptr<char[]> chunk(new char[kMaxLineSize]);
+
+  while (running_.load(std::memory_order_relaxed)) {
+    fds.resize(2 + conns.size());
+    fds[0].fd = wakeup_fd;
+    fds[1].fd = tcp_fd_;
+    for (size_t i = 0; i < conns.size(); ++i) {
+      fds[2 + i].fd = conns[i].fd;
+    }
+
+    for (auto& p : fds) {
+      p.events = POLLIN;
+      p.revents = 0;
+    }
+
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      continue;
+    }
+
+    shard->beginBatch();
+
+    if (fds[0].revents & POLLIN) {
+      drainPipe(wakeup_fd);
+    }
+
+    for (size_t i = 0; i < conns.size(); ++i) {
+      auto& conn = conns[i];
+      if (fds[2 + i].revents == 0) {
+        continue;
+      }
+
+      bool close_conn = false;
+      for (;;) {
+        auto rc = read(conn.fd, chunk.get(), kMaxLineSize);
+        if (rc > 0) {
+          conn.buf.append(chunk.get(), rc);
+          continue;
+        }
+
+        if (rc < 0 && errno == EINTR) {
+          continue;
+        }
+
+        close_conn = rc == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+        break;
+      }
+
+      /* process complete lines, and everything once the client is gone */
+      size_t end = conn.buf.size();
+      if (!close_conn) {
+        auto eol = conn.buf.rfind('\n');
+        end = eol == std::string::npos ? 0 : eol + 1;
+      }
+
+      if (end > 0) {
+        shard->addPacket(conn.buf.data(), end);
+        conn.buf.erase(0, end);
+      }
+
+      if (conn.buf.size() > kMaxLineSize) {
+        logWarning("statsd: closing TCP connection, line too long");
+        close_conn = true;
+      }
+
+      if (close_conn) {
+        close(conn.fd);
+        conn.fd = -1;
+      }
+    }
+
+    conns.erase(
+        std::remove_if(
+            conns.begin(),
+            conns.end(),
+            [] (const Connection& c) { return c.fd < 0; }),
+        conns.end());
+
+    if (fds[1].revents & POLLIN) {
+      for (;;) {
+        int fd = accept4(
+            tcp_fd_,
+            nullptr,
+            nullptr,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+          break;
+        }
+
+        conns.push_back(Connection { fd, std::string() });
+      }
+    }
+  }
+
+  for (const auto& conn : conns) {
+    close(conn.fd);
+  }
+}
+
+} // namespace plugins_statsd
+} // namespace evcollect
+
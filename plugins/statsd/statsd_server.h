@@ -0,0 +1,110 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <evcollect/util/return_code.h>
+#include <evcollect/util/time.h>
+#include "statsd_aggregator.h"
+
+namespace evcollect {
+namespace plugin_statsd {
+
+/**
+ * Receives statsd packets over UDP and/or TCP. Each UDP receiver thread has
+ * its own SO_REUSEPORT socket, so the kernel spreads the packets over the
+ * threads, and reads up to kBatchSize datagrams per recvmmsg call into
+ * preallocated buffers. Every receiver thread aggregates into its own shard
+ * of the StatsdAggregator. The TCP listener runs in a separate thread with
+ * its own shard.
+ *
+ * Receivers only block in poll() once their socket is drained, together with
+ * a wakeup pipe that flush() uses to make idle receivers switch to the next
+ * epoch
+ */
+class StatsdServer {
+public:
+
+  enum class Transport { UDP, TCP, BOTH };
+
+  static const uint16_t kDefaultPort = 8125;
+  static const size_t kDefaultRecvBufferSize = 8 * 1024 * 1024;
+  static const size_t kBatchSize = 64;
+  static const size_t kMaxDatagramSize = 8192;
+  static const size_t kMaxLineSize = 65536;
+  static const uint64_t kFlushTimeoutMicros = 100 * kMicrosPerMilli;
+
+  static ReturnCode parseTransport(const std::string& str, Transport* t);
+
+  StatsdServer(
+      Transport transport,
+      size_t num_udp_threads,
+      size_t max_timer_samples);
+
+  ~StatsdServer();
+
+  void setRecvBufferSize(size_t bytes);
+  void setPercentiles(const std::vector<double>& percentiles);
+
+  /**
+   * Bind the sockets. Port 0 picks a free port, see getPort()
+   */
+  ReturnCode listen(const std::string& host, uint16_t port);
+
+  uint16_t getPort() const;
+
+  ReturnCode start();
+  void stop();
+
+  /**
+   * Collect everything that was received since the last flush and write it
+   * as one event to event_json (see StatsdAggregator). Called from the
+   * service thread at the binding interval
+   */
+  void flush(std::string* event_json);
+
+protected:
+
+  void runUDPReceiver(size_t idx);
+  void runTCPReceiver(size_t idx);
+  ReturnCode bindSocket(int type, const std::string& host, uint16_t* port);
+
+  Transport transport_;
+  size_t num_udp_threads_;
+  size_t recv_buffer_size_;
+  uint16_t port_;
+  StatsdAggregator aggregator_;
+  std::vector<int> udp_fds_;
+  int tcp_fd_;
+  std::vector<std::pair<int, int>> wakeup_pipes_;
+  std::vector<std::thread> threads_;
+  std::atomic<bool> running_;
+};
+
+} // namespace plugins_statsd
+} // namespace evcollect
+
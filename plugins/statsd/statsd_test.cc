@@ -0,0 +1,220 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <evcollect/evcollect.h>
+#include <evcollect/util/testing.h>
+#include <evcollect/util/stringutil.h>
+#include <evcollect/util/time.h>
+#include "statsd_aggregator.h"
+#include "statsd_server.h"
+
+using namespace evcollect::plugin_statsd;
+
+/* the plugin usually resolves this symbol from the evcollectd binary */
+void evcollect_log(evcollect_loglevel level, const char* msg) {}
+
+static bool parseLine(const char* line, StatsdMetric* metric) {
+  return parseStatsdLine(line, line + strlen(line), metric);
+}
+
+static std::string flushShard(
+    StatsdAggregator* aggregator,
+    StatsdShard* shard) {
+  std::string json;
+  auto epoch = aggregator->startFlush();
+  shard->beginBatch();
+  aggregator->finishFlush(epoch, &json);
+  return json;
+}
+
+TEST(StatsdParser, lines) {
+  StatsdMetric m;
+  ASSERT_TRUE(parseLine("api.requests:1|c", &m));
+  std::string name(m.name, m.name_len);
+  EXPECT_EQ(name, "api.requests");
+  EXPECT_TRUE(m.type == MetricType::COUNTER);
+  EXPECT_EQ(m.value, 1);
+  EXPECT_EQ(m.sample_rate, 1);
+
+  ASSERT_TRUE(parseLine("api.requests:3|c|@0.1|#host:a,env:prod\r", &m));
+  EXPECT_EQ(m.value, 3);
+  EXPECT_EQ(m.sample_rate, 0.1);
+
+  ASSERT_TRUE(parseLine("queue.depth:-12.5|g", &m));
+  EXPECT_TRUE(m.type == MetricType::GAUGE);
+  EXPECT_TRUE(m.relative);
+  EXPECT_EQ(m.value, -12.5);
+
+  ASSERT_TRUE(parseLine("api.latency:320.25|ms", &m));
+  EXPECT_TRUE(m.type == MetricType::TIMER);
+  EXPECT_EQ(m.value, 320.25);
+
+  ASSERT_TRUE(parseLine("api.latency:1e3|h", &m));
+  EXPECT_EQ(m.value, 1000);
+
+  ASSERT_TRUE(parseLine("users:alice|s", &m));
+  EXPECT_TRUE(m.type == MetricType::SET);
+  std::string set_value(m.set_value, m.set_value_len);
+  EXPECT_EQ(set_value, "alice");
+
+  EXPECT_FALSE(parseLine("", &m));
+  EXPECT_FALSE(parseLine("novalue", &m));
+  EXPECT_FALSE(parseLine(":1|c", &m));
+  EXPECT_FALSE(parseLine("x:|c", &m));
+  EXPECT_FALSE(parseLine("x:1|q", &m));
+  EXPECT_FALSE(parseLine("x:abc|c", &m));
+  EXPECT_FALSE(parseLine("x:1|c|@0", &m));
+  EXPECT_FALSE(parseLine("x:1|c|@2", &m));
+}
+
+TEST(StatsdAggregator, flush) {
+  StatsdAggregator aggregator(1, StatsdAggregator::kDefaultTimerSamples);
+  auto shard = aggregator.getShard(0);
+
+  std::string packet =
+      "a.count:1|c\n"
+      "a.count:2|c|@0.5\n"
+      "gauge:10|g\n"
+      "gauge:+5|g\n"
+      "bad line\n"
+      "users:alice|s\n"
+      "users:bob|s\n"
+      "users:alice|s\n";
+
+  shard->beginBatch();
+  shard->addPacket(packet.data(), packet.size());
+
+  packet.clear();
+  for (int i = 100; i > 0; --i) {
+    packet += StringUtil::format("t:$0|ms\n", i);
+  }
+
+  shard->addPacket(packet.data(), packet.size());
+
+  EXPECT_EQ(
+      flushShard(&aggregator, shard),
+      "{\"counters\":{\"a.count\":5},\"gauges\":{\"gauge\":15},"
+      "\"sets\":{\"users\":2},"
+      "\"timers\":{\"t\":{\"count\":100,\"sum\":5050,\"min\":1,\"max\":100,"
+      "\"mean\":50.5,\"p50\":50,\"p90\":90,\"p95\":95,\"p99\":99}},"
+      "\"receiver\":{\"packets\":2,\"bad_lines\":1,\"dropped\":0}}");
+
+  /* gauges keep their value, everything else starts over */
+  packet = "gauge:-3|g";
+  shard->addPacket(packet.data(), packet.size());
+  EXPECT_EQ(
+      flushShard(&aggregator, shard),
+      "{\"gauges\":{\"gauge\":12},"
+      "\"receiver\":{\"packets\":1,\"bad_lines\":0,\"dropped\":0}}");
+}
+
+TEST(StatsdAggregator, timer_reservoir) {
+  StatsdAggregator aggregator(1, 64);
+  aggregator.setPercentiles({ 50, 99.9 });
+  auto shard = aggregator.getShard(0);
+
+  shard->beginBatch();
+  for (int i = 1; i <= 10000; ++i) {
+    auto line = StringUtil::format("t:$0|ms", i);
+    shard->addPacket(line.data(), line.size());
+  }
+
+  auto json = flushShard(&aggregator, shard);
+  EXPECT_TRUE(
+      json.find(
+          "{\"timers\":{\"t\":{\"count\":10000,\"sum\":50005000,"
+          "\"min\":1,\"max\":10000,\"mean\":5000.5,\"p50\":") == 0);
+  EXPECT_TRUE(json.find(",\"p99_9\":") != std::string::npos);
+}
+
+static double getCounter(const std::string& json, const std::string& name) {
+  auto key = "\"" + name + "\":";
+  auto pos = json.find(key);
+  if (pos == std::string::npos) {
+    return 0;
+  }
+
+  return strtod(json.c_str() + pos + key.size(), nullptr);
+}
+
+TEST(StatsdServer, udp_and_tcp) {
+  StatsdServer server(StatsdServer::Transport::BOTH, 2, 16);
+  ASSERT_TRUE(server.listen("127.0.0.1", 0).isSuccess());
+  ASSERT_TRUE(server.start().isSuccess());
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(server.getPort());
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  for (int i = 0; i < 1000; ++i) {
+    std::string packet = "test.udp:1|c\ntest.gauge:7|g";
+    sendto(
+        udp_fd,
+        packet.data(),
+        packet.size(),
+        0,
+        (struct sockaddr*) &addr,
+        sizeof(addr));
+  }
+
+  int tcp_fd = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_EQ(connect(tcp_fd, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  std::string lines;
+  for (int i = 0; i < 1000; ++i) {
+    lines += "test.tcp:2|c\n";
+  }
+
+  /* split a line across two writes */
+  write(tcp_fd, lines.data(), lines.size() - 5);
+  usleep(10000);
+  write(tcp_fd, lines.data() + lines.size() - 5, 5);
+
+  double udp = 0;
+  double tcp = 0;
+  std::string json;
+  auto deadline = MonotonicClock::now() + 5 * kMicrosPerSecond;
+  while ((udp < 1000 || tcp < 2000) && MonotonicClock::now() < deadline) {
+    usleep(10000);
+    json.clear();
+    server.flush(&json);
+    udp += getCounter(json, "test.udp");
+    tcp += getCounter(json, "test.tcp");
+  }
+
+  EXPECT_EQ(udp, 1000);
+  EXPECT_EQ(tcp, 2000);
+  EXPECT_EQ(getCounter(json, "test.gauge"), 7);
+
+  close(udp_fd);
+  close(tcp_fd);
+  server.stop();
+}
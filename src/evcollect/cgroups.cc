@@ -0,0 +1,653 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <evcollect/cgroups.h>
+#include <evcollect/util/procfs.h>
+#include <evcollect/util/time.h>
+
+namespace evcollect {
+
+void CgroupSourcePlugin::registerPlugin(PluginMap* plugin_map) {
+  plugin_map->registerSourcePlugin(
+      "linux.cgroups",
+      std::unique_ptr<SourcePlugin>(new CgroupSourcePlugin()));
+}
+
+namespace {
+
+const char* kFileNames[] = {
+  "cpu.stat",
+  "memory.current",
+  "io.stat",
+  "cpu.pressure",
+  "memory.pressure",
+  "io.pressure"
+};
+
+const char* kPressurePrefixes[] = { "psi_cpu_", "psi_memory_", "psi_io_" };
+
+const uint32_t kWatchMask =
+    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+
+/* the share of the interval (both in usec) in percent, in hundredths */
+uint64_t usecPercent(uint64_t delta, uint64_t interval) {
+  if (interval == 0) {
+    return 0;
+  }
+
+  return uint64_t(double(delta) * 10000 / interval + 0.5);
+}
+
+} // namespace
+
+CgroupSource::CgroupSource() :
+    inotify_fd_(-1),
+    max_depth_(0),
+    num_fds_(0),
+    max_fds_(kMaxFDs),
+    generation_(0),
+    num_scans_(0),
+    time_(0),
+    prev_time_(0),
+    pending_pos_(0),
+    buf_(new char[kReadBufferSize]) {
+  /* leave at least half of the fd limit to the rest of the daemon */
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+    max_fds_ = std::min(max_fds_, size_t(rl.rlim_cur / 2));
+  }
+}
+
+CgroupSource::~CgroupSource() {
+  for (auto& c : cgroups_) {
+    closeCgroup(&c.second);
+  }
+
+  if (inotify_fd_ >= 0) {
+    close(inotify_fd_);
+  }
+}
+
+void CgroupSource::setMaxDepth(size_t depth) {
+  max_depth_ = depth;
+}
+
+ReturnCode CgroupSource::open(const std::string& root, uint64_t now) {
+  root_ = root;
+
+  inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd_ < 0) {
+    return ReturnCode::error(
+        "EIO",
+        "inotify_init1() failed: %s",
+        strerror(errno));
+  }
+
+  if (!scan()) {
+    return ReturnCode::error(
+        "EIO",
+        "error while reading from %s: %s",
+        root.c_str(),
+        strerror(errno));
+  }
+
+  time_ = now;
+  for (auto c : sorted_) {
+    sampleCgroup(c);
+  }
+
+  return ReturnCode::success();
+}
+
+ReturnCode CgroupSource::getNextEvent(
+    uint64_t now,
+    std::string* event_json) {
+  if (pending_pos_ >= pending_.size()) {
+    if (checkForChanges() && !scan()) {
+      return ReturnCode::error(
+          "EIO",
+          "error while reading from %s: %s",
+          root_.c_str(),
+          strerror(errno));
+    }
+
+    pending_.clear();
+    pending_pos_ = 0;
+    prev_time_ = time_;
+    time_ = now;
+    for (auto c : sorted_) {
+      sampleCgroup(c);
+      if (c->has_prev) {
+        pending_.emplace_back(c);
+      }
+    }
+  }
+
+  if (pending_pos_ >= pending_.size()) {
+    return ReturnCode::success();
+  }
+
+  const auto& cgroup = *pending_[pending_pos_++];
+  auto len = formatEvent(cgroup, out_, sizeof(out_));
+  if (len == 0) {
+    return ReturnCode::error(
+        "EIO",
+        "stats event for cgroup %s too large",
+        cgroup.path.c_str());
+  }
+
+  event_json->append(out_, len);
+  return ReturnCode::success();
+}
+
+bool CgroupSource::hasPendingEvent() const {
+  return pending_pos_ < pending_.size();
+}
+
+size_t CgroupSource::getNumCgroups() const {
+  return cgroups_.size();
+}
+
+size_t CgroupSource::getNumScans() const {
+  return num_scans_;
+}
+
+bool CgroupSource::scan() {
+  ++generation_;
+  ++num_scans_;
+
+  int root_fd = ::open(root_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (root_fd < 0) {
+    return false;
+  }
+
+  scanDirectory(root_fd, "/", 0);
+
+  for (auto iter = cgroups_.begin(); iter != cgroups_.end(); ) {
+    if (iter->second.generation == generation_) {
+      ++iter;
+    } else {
+      closeCgroup(&iter->second);
+      iter = cgroups_.erase(iter);
+    }
+  }
+
+  sorted_.clear();
+  for (auto& c : cgroups_) {
+    sorted_.emplace_back(&c.second);
+  }
+
+  std::sort(
+      sorted_.begin(),
+      sorted_.end(),
+      [] (const Cgroup* a, const Cgroup* b) {
+        return a->path < b->path;
+      });
+
+  pending_.clear();
+  pending_pos_ = 0;
+  return true;
+}
+
+/**
+ * Adds or refreshes the cgroup at path and recurses into its children. Takes
+ * ownership of dir_fd
+ */
+bool CgroupSource::scanDirectory(
+    int dir_fd,
+    const std::string& path,
+    size_t depth) {
+  auto& cgroup = cgroups_[path];
+  if (cgroup.generation == 0) {
+    cgroup.path = path;
+    cgroup.depth = depth;
+    cgroup.dir_fd = dir_fd;
+    cgroup.wd = -1;
+    for (auto& fd : cgroup.fds) {
+      fd = -1;
+    }
+
+    ++num_fds_;
+  } else {
+    close(dir_fd);
+    dir_fd = cgroup.dir_fd;
+  }
+
+  /* controllers may have been enabled since the last scan */
+  cgroup.missing_files = 0;
+  cgroup.generation = generation_;
+
+  if (max_depth_ > 0 && depth >= max_depth_) {
+    return true;
+  }
+
+  if (cgroup.wd < 0) {
+    auto watch_path = root_ + path;
+    cgroup.wd = inotify_add_watch(inotify_fd_, watch_path.c_str(), kWatchMask);
+  }
+
+  int list_fd = dup(dir_fd);
+  if (list_fd < 0) {
+    return false;
+  }
+
+  auto dir = fdopendir(list_fd);
+  if (!dir) {
+    close(list_fd);
+    return false;
+  }
+
+  rewinddir(dir);
+  std::vector<std::string> children;
+  while (auto entry = readdir(dir)) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+
+    bool is_dir = entry->d_type == DT_DIR;
+    if (entry->d_type == DT_UNKNOWN) {
+      struct stat st;
+      is_dir =
+          fstatat(dir_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+          S_ISDIR(st.st_mode);
+    }
+
+    if (is_dir) {
+      children.emplace_back(entry->d_name);
+    }
+  }
+
+  closedir(dir);
+
+  for (const auto& child : children) {
+    int child_fd = openat(
+        dir_fd,
+        child.c_str(),
+        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    /* the cgroup may have been removed in the meantime */
+    if (child_fd < 0) {
+      continue;
+    }
+
+    auto child_path = path.size() > 1 ? path + "/" + child : "/" + child;
+    scanDirectory(child_fd, child_path, depth + 1);
+  }
+
+  return true;
+}
+
+/**
+ * Drains the inotify events and returns true if a cgroup was created or
+ * removed since the last call
+ */
+bool CgroupSource::checkForChanges() {
+  alignas(struct inotify_event) char buf[4096];
+
+  bool changed = false;
+  for (;;) {
+    auto len = read(inotify_fd_, buf, sizeof(buf));
+    if (len <= 0) {
+      break;
+    }
+
+    for (char* cur = buf; cur < buf + len; ) {
+      auto ev = reinterpret_cast<const struct inotify_event*>(cur);
+      if ((ev->mask & IN_Q_OVERFLOW) ||
+          ((ev->mask & IN_ISDIR) && (ev->mask & kWatchMask))) {
+        changed = true;
+      }
+
+      cur += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+
+  return changed;
+}
+
+void CgroupSource::closeCgroup(Cgroup* cgroup) {
+  for (auto& fd : cgroup->fds) {
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+      --num_fds_;
+    }
+  }
+
+  if (cgroup->wd >= 0) {
+    /* fails if the directory is gone, the watch was removed along with it */
+    inotify_rm_watch(inotify_fd_, cgroup->wd);
+    cgroup->wd = -1;
+  }
+
+  if (cgroup->dir_fd >= 0) {
+    close(cgroup->dir_fd);
+    cgroup->dir_fd = -1;
+    --num_fds_;
+  }
+}
+
+void CgroupSource::sampleCgroup(Cgroup* cgroup) {
+  cgroup->prev = cgroup->cur;
+  cgroup->has_prev = cgroup->prev.files != 0;
+  memset(&cgroup->cur, 0, sizeof(Sample));
+
+  auto sample = &cgroup->cur;
+  for (size_t i = 0; i < kNumFiles; ++i) {
+    if (cgroup->missing_files & (1 << i)) {
+      continue;
+    }
+
+    auto len = readCgroupFile(cgroup, i);
+    if (len < 0) {
+      if (errno == ENOENT) {
+        cgroup->missing_files |= 1 << i;
+      }
+
+      continue;
+    }
+
+    auto begin = buf_.get();
+    auto end = buf_.get() + len;
+    switch (i) {
+      case FILE_CPU_STAT:
+        parseCPUStat(begin, end, sample);
+        break;
+      case FILE_MEMORY_CURRENT:
+        ProcParser::scanUInt(begin, end, &sample->memory_current);
+        break;
+      case FILE_IO_STAT:
+        parseIOStat(begin, end, sample);
+        break;
+      default:
+        parsePressure(begin, end, i - FILE_CPU_PRESSURE, sample);
+        break;
+    }
+
+    sample->files |= 1 << i;
+  }
+}
+
+/**
+ * Reads one of the stats files of a cgroup into buf_. The file is opened
+ * relative to the cgroup directory and kept open for the next tick if there
+ * are fds left in the budget
+ */
+ssize_t CgroupSource::readCgroupFile(Cgroup* cgroup, size_t idx) {
+  auto& fd = cgroup->fds[idx];
+  if (fd < 0) {
+    fd = openat(cgroup->dir_fd, kFileNames[idx], O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return -1;
+    }
+
+    ++num_fds_;
+  }
+
+  auto len = ProcFile::readFD(fd, buf_.get(), kReadBufferSize);
+  if (len < 0 || num_fds_ > max_fds_) {
+    auto err = errno;
+    close(fd);
+    fd = -1;
+    --num_fds_;
+    errno = err;
+  }
+
+  return len;
+}
+
+void CgroupSource::parseCPUStat(
+    const char* begin,
+    const char* end,
+    Sample* sample) {
+  /* the throttling stats are only there with the cpu controller enabled */
+  for (auto cur = begin; cur < end; cur = ProcParser::nextLine(cur, end)) {
+    if (ProcParser::matchKey(cur, end, "usage_usec ", 11)) {
+      ProcParser::scanUInt(cur + 11, end, &sample->cpu[CPU_USAGE]);
+    } else if (ProcParser::matchKey(cur, end, "user_usec ", 10)) {
+      ProcParser::scanUInt(cur + 10, end, &sample->cpu[CPU_USER]);
+    } else if (ProcParser::matchKey(cur, end, "system_usec ", 12)) {
+      ProcParser::scanUInt(cur + 12, end, &sample->cpu[CPU_SYSTEM]);
+    } else if (ProcParser::matchKey(cur, end, "throttled_usec ", 15)) {
+      ProcParser::scanUInt(cur + 15, end, &sample->cpu[CPU_THROTTLED]);
+      sample->has_cpu_throttled = true;
+    }
+  }
+}
+
+void CgroupSource::parseIOStat(
+    const char* begin,
+    const char* end,
+    Sample* sample) {
+  /* 8:0 rbytes=1024 wbytes=0 rios=1 wios=0 dbytes=0 dios=0 */
+  static const struct {
+    const char* key;
+    size_t key_len;
+  } kIOKeys[] = {
+    { "rbytes=", 7 },
+    { "wbytes=", 7 },
+    { "rios=", 5 },
+    { "wios=", 5 }
+  };
+
+  for (auto line = begin; line < end; ) {
+    auto line_end = ProcParser::nextLine(line, end);
+    auto cur = ProcParser::skipField(line, line_end);
+    for (;;) {
+      cur = ProcParser::skipBlanks(cur, line_end);
+      if (cur == line_end || *cur == '\n') {
+        break;
+      }
+
+      for (size_t i = 0; i < kNumIOFields; ++i) {
+        const auto& k = kIOKeys[i];
+        if (ProcParser::matchKey(cur, line_end, k.key, k.key_len)) {
+          uint64_t value;
+          ProcParser::scanUInt(cur + k.key_len, line_end, &value);
+          sample->io[i] += value;
+          break;
+        }
+      }
+
+      cur = ProcParser::skipField(cur, line_end);
+    }
+
+    line = line_end;
+  }
+}
+
+void CgroupSource::parsePressure(
+    const char* begin,
+    const char* end,
+    size_t idx,
+    Sample* sample) {
+  /* some avg10=0.00 avg60=0.00 avg300=0.00 total=12345 */
+  for (auto line = begin; line < end; ) {
+    auto line_end = ProcParser::nextLine(line, end);
+
+    size_t kind;
+    if (ProcParser::matchKey(line, line_end, "some ", 5)) {
+      kind = 0;
+    } else if (ProcParser::matchKey(line, line_end, "full ", 5)) {
+      kind = 1;
+      sample->has_pressure_full[idx] = true;
+    } else {
+      line = line_end;
+      continue;
+    }
+
+    for (auto cur = line + 5; cur < line_end; ) {
+      cur = ProcParser::skipBlanks(cur, line_end);
+      if (ProcParser::matchKey(cur, line_end, "total=", 6)) {
+        ProcParser::scanUInt(cur + 6, line_end, &sample->pressure[idx][kind]);
+        break;
+      }
+
+      auto next = ProcParser::skipField(cur, line_end);
+      if (next == cur) {
+        break;
+      }
+
+      cur = next;
+    }
+
+    line = line_end;
+  }
+}
+
+size_t CgroupSource::formatEvent(
+    const Cgroup& cgroup,
+    char* out,
+    size_t out_size) const {
+  const auto& cur = cgroup.cur;
+  const auto& prev = cgroup.prev;
+  auto interval = time_ > prev_time_ ? time_ - prev_time_ : 0;
+  auto both = [&cur, &prev] (size_t file) {
+    return (cur.files & prev.files & (1 << file)) != 0;
+  };
+
+  EventWriter w(out, out_size);
+  w.addString("cgroup", cgroup.path.data(), cgroup.path.size());
+
+  /* percent of one cpu */
+  if (both(FILE_CPU_STAT)) {
+    auto delta = [&cur, &prev] (size_t i) {
+      return ProcParser::counterDelta(cur.cpu[i], prev.cpu[i]);
+    };
+
+    w.addFixed2("cpu_usage_percent", usecPercent(delta(CPU_USAGE), interval));
+    w.addFixed2("cpu_user_percent", usecPercent(delta(CPU_USER), interval));
+    w.addFixed2(
+        "cpu_system_percent",
+        usecPercent(delta(CPU_SYSTEM), interval));
+
+    if (cur.has_cpu_throttled && prev.has_cpu_throttled) {
+      w.addFixed2(
+          "cpu_throttled_percent",
+          usecPercent(delta(CPU_THROTTLED), interval));
+    }
+  }
+
+  if (cur.files & (1 << FILE_MEMORY_CURRENT)) {
+    w.addUInt("memory_current", cur.memory_current);
+  }
+
+  if (both(FILE_IO_STAT)) {
+    static const char* kIOFieldNames[] = {
+      "io_read_bytes_per_sec",
+      "io_write_bytes_per_sec",
+      "io_reads_per_sec",
+      "io_writes_per_sec"
+    };
+
+    for (size_t i = 0; i < kNumIOFields; ++i) {
+      w.addFixed2(
+          kIOFieldNames[i],
+          ProcParser::counterRate(cur.io[i], prev.io[i], interval));
+    }
+  }
+
+  /* share of the interval in which tasks were stalled */
+  for (size_t i = 0; i < kNumPressureFiles; ++i) {
+    if (!both(FILE_CPU_PRESSURE + i)) {
+      continue;
+    }
+
+    w.addFixed2(
+        kPressurePrefixes[i],
+        "some_percent",
+        usecPercent(
+            ProcParser::counterDelta(cur.pressure[i][0], prev.pressure[i][0]),
+            interval));
+
+    if (cur.has_pressure_full[i] && prev.has_pressure_full[i]) {
+      w.addFixed2(
+          kPressurePrefixes[i],
+          "full_percent",
+          usecPercent(
+              ProcParser::counterDelta(
+                  cur.pressure[i][1],
+                  prev.pressure[i][1]),
+              interval));
+    }
+  }
+
+  return w.finish();
+}
+
+ReturnCode CgroupSourcePlugin::pluginAttach(
+    const PropertyList& config,
+    void** userdata) {
+  std::string root = "/sys/fs/cgroup";
+  config.get("root", &root);
+
+  std::unique_ptr<CgroupSource> source(new CgroupSource());
+
+  std::string max_depth;
+  if (config.get("max_depth", &max_depth)) {
+    try {
+      source->setMaxDepth(std::stoull(max_depth));
+    } catch (...) {
+      return ReturnCode::error(
+          "EINVAL",
+          "invalid value for max_depth: '%s'",
+          max_depth.c_str());
+    }
+  }
+
+  auto rc = source->open(root, MonotonicClock::now());
+  if (!rc.isSuccess()) {
+    return rc;
+  }
+
+  *userdata = source.release();
+  return ReturnCode::success();
+}
+
+void CgroupSourcePlugin::pluginDetach(void* userdata) {
+  delete static_cast<CgroupSource*>(userdata);
+}
+
+ReturnCode CgroupSourcePlugin::pluginGetNextEvent(
+    void* userdata,
+    std::string* event_json) {
+  return static_cast<CgroupSource*>(userdata)->getNextEvent(
+      MonotonicClock::now(),
+      event_json);
+}
+
+bool CgroupSourcePlugin::pluginHasPendingEvent(void* userdata) {
+  return static_cast<CgroupSource*>(userdata)->hasPendingEvent();
+}
+
+} // namespace evcollect
+
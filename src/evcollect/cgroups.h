@@ -0,0 +1,172 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <evcollect/evcollect.h>
+#include <evcollect/plugin.h>
+
+namespace evcollect {
+
+/**
+ * Samples cpu, memory, io and pressure stall stats of every cgroup below a
+ * cgroup v2 mount (usually /sys/fs/cgroup) and emits one event per cgroup and
+ * tick.
+ *
+ * The tree is walked once when the source is opened; every cgroup directory
+ * is kept open and watched with inotify. The tree is only walked again when
+ * inotify reports a cgroup being created or removed, so a tick costs a pread()
+ * per stats file and cgroup. The stats files are opened relative to the
+ * cached directory fd and kept open as long as there are fds left in the
+ * budget. Files that don't exist (e.g. because a controller is not enabled)
+ * are only looked for again on the next walk.
+ */
+class CgroupSource {
+public:
+
+  static const size_t kMaxFDs = 8192;
+
+  CgroupSource();
+  ~CgroupSource();
+
+  CgroupSource(const CgroupSource& other) = delete;
+  CgroupSource& operator=(const CgroupSource& other) = delete;
+
+  /**
+   * Only report cgroups up to this many levels below the root; zero (the
+   * default) reports all
+   */
+  void setMaxDepth(size_t depth);
+
+  /**
+   * Walk the tree below root and take the baseline sample
+   */
+  ReturnCode open(const std::string& root, uint64_t now);
+
+  /**
+   * Takes a sample of all cgroups and returns the event of the first one; the
+   * others are returned by the following calls while hasPendingEvent() returns
+   * true
+   */
+  ReturnCode getNextEvent(uint64_t now, std::string* event_json);
+  bool hasPendingEvent() const;
+
+  size_t getNumCgroups() const;
+  size_t getNumScans() const;
+
+protected:
+
+  enum { FILE_CPU_STAT, FILE_MEMORY_CURRENT, FILE_IO_STAT, FILE_CPU_PRESSURE,
+      FILE_MEMORY_PRESSURE, FILE_IO_PRESSURE, kNumFiles };
+
+  enum { CPU_USAGE, CPU_USER, CPU_SYSTEM, CPU_THROTTLED, kNumCPUFields };
+
+  enum { IO_RBYTES, IO_WBYTES, IO_RIOS, IO_WIOS, kNumIOFields };
+
+  static const size_t kNumPressureFiles = 3;
+  static const size_t kReadBufferSize = 16384;
+  static const size_t kMaxEventSize = 2048;
+
+  struct Sample {
+    uint64_t cpu[kNumCPUFields];
+    uint64_t memory_current;
+    uint64_t io[kNumIOFields];
+    /* some and full total stall time in usec */
+    uint64_t pressure[kNumPressureFiles][2];
+    bool has_pressure_full[kNumPressureFiles];
+    bool has_cpu_throttled;
+    /* bitmask of the files that were read */
+    uint32_t files;
+  };
+
+  struct Cgroup {
+    std::string path;
+    size_t depth;
+    int dir_fd;
+    int wd;
+    int fds[kNumFiles];
+    uint32_t missing_files;
+    uint64_t generation;
+    bool has_prev;
+    Sample cur;
+    Sample prev;
+  };
+
+  bool scan();
+  bool scanDirectory(int dir_fd, const std::string& path, size_t depth);
+  bool checkForChanges();
+  void closeCgroup(Cgroup* cgroup);
+  void sampleCgroup(Cgroup* cgroup);
+  ssize_t readCgroupFile(Cgroup* cgroup, size_t idx);
+  void parseCPUStat(const char* begin, const char* end, Sample* sample);
+  void parseIOStat(const char* begin, const char* end, Sample* sample);
+  void parsePressure(
+      const char* begin,
+      const char* end,
+      size_t idx,
+      Sample* sample);
+  size_t formatEvent(const Cgroup& cgroup, char* out, size_t out_size) const;
+
+  std::string root_;
+  int inotify_fd_;
+  size_t max_depth_;
+  size_t num_fds_;
+  size_t max_fds_;
+  uint64_t generation_;
+  size_t num_scans_;
+  uint64_t time_;
+  uint64_t prev_time_;
+  std::unordered_map<std::string, Cgroup> cgroups_;
+  std::vector<Cgroup*> sorted_;
+  std::vector<const Cgroup*> pending_;
+  size_t pending_pos_;
+  std::unique_ptr<char[]> buf_;
+  char out_[kMaxEventSize];
+};
+
+class CgroupSourcePlugin : public SourcePlugin {
+public:
+
+  static void registerPlugin(PluginMap* plugin_map);
+
+  ReturnCode pluginAttach(
+      const PropertyList& config,
+      void** userdata) override;
+
+  void pluginDetach(
+      void* userdata) override;
+
+  ReturnCode pluginGetNextEvent(
+      void* userdata,
+      std::string* event_json) override;
+
+  bool pluginHasPendingEvent(
+      void* userdata) override;
+
+};
+
+} // namespace evcollect
+
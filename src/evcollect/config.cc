@@ -257,6 +257,11 @@ ConfigToken ConfigLexer::nextToken() {
     return currentToken_ = parseValue();
   }
 
+  /* negative values such as relative times, e.g. "start_at -1h" */
+  if (currentChar() == '-' && std::isdigit(peekChar())) {
+    return currentToken_ = parseValue();
+  }
+
   return currentToken_ = ConfigToken::Unknown; 
 }
 
@@ -632,6 +637,14 @@ ReturnCode ConfigParser::applyEventProperties(const PropertyList& props,
   for (const auto& prop: props.properties) {
     if (prop.first == "interval") {
       output->interval_micros = 1000000; // TODO: parseTime(prop.second[0]) FIXME not sure if that's meant like this
+    } else if (prop.first == "enrich") {
+      if (prop.second.empty() || prop.second[0] != "host") {
+        return ReturnCode::error(
+            "EINVAL",
+            "invalid value for enrich -- must be 'host'");
+      }
+
+      output->add_host_metadata = true;
     } else {
       logWarning("Ignoring unsupported property \"%s\".", prop.first);
     }
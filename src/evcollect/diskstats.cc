@@ -0,0 +1,308 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <evcollect/diskstats.h>
+#include <evcollect/util/time.h>
+
+namespace evcollect {
+
+void DiskstatsSourcePlugin::registerPlugin(PluginMap* plugin_map) {
+  plugin_map->registerSourcePlugin(
+      "linux.diskstats",
+      std::unique_ptr<SourcePlugin>(new DiskstatsSourcePlugin()));
+}
+
+namespace {
+
+/* diskstats counts in 512 byte sectors, regardless of the device */
+const uint64_t kSectorSize = 512;
+
+/* kernels before 4.18 don't have the discard fields */
+const size_t kNumBaseCounters = 11;
+
+bool hasPrefix(const char* name, size_t name_len, const char* prefix) {
+  auto len = strlen(prefix);
+  return name_len >= len && memcmp(name, prefix, len) == 0;
+}
+
+/* average time per operation in ms, in hundredths */
+uint64_t latency(uint64_t ticks, uint64_t ops) {
+  return ops > 0 ? (ticks * 100 + ops / 2) / ops : 0;
+}
+
+} // namespace
+
+DiskstatsSource::DiskstatsSource() :
+    generation_(0),
+    time_(0),
+    prev_time_(0),
+    pending_pos_(0) {}
+
+void DiskstatsSource::addDeviceFilter(const std::string& name) {
+  filter_.emplace_back(name);
+}
+
+ReturnCode DiskstatsSource::open(const std::string& proc_dir, uint64_t now) {
+  auto path = proc_dir + "/diskstats";
+  auto rc = file_.open(path, false);
+  if (!rc.isSuccess()) {
+    return rc;
+  }
+
+  if (!takeSample(now)) {
+    return ReturnCode::error(
+        "EIO",
+        "error while reading from %s: %s",
+        path.c_str(),
+        strerror(errno));
+  }
+
+  pending_.clear();
+  return ReturnCode::success();
+}
+
+ReturnCode DiskstatsSource::getNextEvent(
+    uint64_t now,
+    std::string* event_json) {
+  if (pending_pos_ >= pending_.size() && !takeSample(now)) {
+    return ReturnCode::error(
+        "EIO",
+        "error while reading disk stats: %s",
+        strerror(errno));
+  }
+
+  if (pending_pos_ >= pending_.size()) {
+    return ReturnCode::success();
+  }
+
+  auto len = formatEvent(*pending_[pending_pos_++], out_, sizeof(out_));
+  if (len == 0) {
+    return ReturnCode::error("EIO", "disk stats event too large");
+  }
+
+  event_json->append(out_, len);
+  return ReturnCode::success();
+}
+
+bool DiskstatsSource::hasPendingEvent() const {
+  return pending_pos_ < pending_.size();
+}
+
+size_t DiskstatsSource::getNumDevices() const {
+  return devices_.size();
+}
+
+bool DiskstatsSource::takeSample(uint64_t now) {
+  if (!file_.read()) {
+    return false;
+  }
+
+  ++generation_;
+  pending_.clear();
+  pending_pos_ = 0;
+  prev_time_ = time_;
+  time_ = now;
+
+  /*    8       0 sda 1234 56 78910 1112 ... */
+  auto end = file_.end();
+  for (auto line = file_.begin(); line < end; ) {
+    auto line_end = ProcParser::nextLine(line, end);
+
+    uint64_t major;
+    uint64_t minor;
+    auto cur = ProcParser::scanUInt(line, line_end, &major);
+    cur = ProcParser::scanUInt(cur, line_end, &minor);
+    auto name = ProcParser::skipBlanks(cur, line_end);
+    cur = ProcParser::skipField(name, line_end);
+    size_t name_len = cur - name;
+
+    if (name_len == 0 || !matchDevice(name, name_len)) {
+      line = line_end;
+      continue;
+    }
+
+    uint64_t values[kNumCounters];
+    size_t num_values = 0;
+    for (; num_values < kNumCounters; ++num_values) {
+      auto next = ProcParser::scanUInt(cur, line_end, &values[num_values]);
+      if (next == cur) {
+        break;
+      }
+
+      cur = next;
+    }
+
+    if (num_values < kNumBaseCounters) {
+      line = line_end;
+      continue;
+    }
+
+    auto& device = devices_[std::string(name, name_len)];
+    if (device.generation == 0) {
+      device.name.assign(name, name_len);
+      device.has_prev = false;
+    } else {
+      memcpy(device.prev, device.cur, sizeof(device.prev));
+      device.has_prev = true;
+    }
+
+    memset(device.cur, 0, sizeof(device.cur));
+    memcpy(device.cur, values, sizeof(uint64_t) * num_values);
+    device.has_discards = num_values == kNumCounters;
+    device.generation = generation_;
+    if (device.has_prev) {
+      pending_.emplace_back(&device);
+    }
+
+    line = line_end;
+  }
+
+  for (auto iter = devices_.begin(); iter != devices_.end(); ) {
+    if (iter->second.generation == generation_) {
+      ++iter;
+    } else {
+      iter = devices_.erase(iter);
+    }
+  }
+
+  return true;
+}
+
+bool DiskstatsSource::matchDevice(const char* name, size_t name_len) const {
+  if (filter_.empty()) {
+    return
+        !hasPrefix(name, name_len, "loop") &&
+        !hasPrefix(name, name_len, "ram");
+  }
+
+  for (const auto& f : filter_) {
+    if (f.size() == name_len && memcmp(f.data(), name, name_len) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+size_t DiskstatsSource::formatEvent(
+    const Device& device,
+    char* out,
+    size_t out_size) const {
+  auto interval = time_ > prev_time_ ? time_ - prev_time_ : 0;
+
+  uint64_t delta[kNumCounters];
+  for (size_t i = 0; i < kNumCounters; ++i) {
+    delta[i] = ProcParser::wrappingCounterDelta(device.cur[i], device.prev[i]);
+  }
+
+  EventWriter w(out, out_size);
+  w.addString("device", device.name.data(), device.name.size());
+  w.addFixed2("reads_per_sec", ProcParser::rate(delta[READS], interval));
+  w.addFixed2("writes_per_sec", ProcParser::rate(delta[WRITES], interval));
+  w.addFixed2(
+      "reads_merged_per_sec",
+      ProcParser::rate(delta[READS_MERGED], interval));
+  w.addFixed2(
+      "writes_merged_per_sec",
+      ProcParser::rate(delta[WRITES_MERGED], interval));
+  w.addFixed2(
+      "read_bytes_per_sec",
+      ProcParser::rate(delta[SECTORS_READ] * kSectorSize, interval));
+  w.addFixed2(
+      "write_bytes_per_sec",
+      ProcParser::rate(delta[SECTORS_WRITTEN] * kSectorSize, interval));
+  w.addFixed2("read_latency_ms", latency(delta[READ_TICKS], delta[READS]));
+  w.addFixed2("write_latency_ms", latency(delta[WRITE_TICKS], delta[WRITES]));
+  w.addUInt("in_flight", device.cur[IN_FLIGHT]);
+
+  /* io_ticks and time_in_queue are in ms, the interval in us */
+  uint64_t util = 0;
+  uint64_t queue_size = 0;
+  if (interval > 0) {
+    util = std::min(
+        delta[IO_TICKS] * 100 * 100 * 1000 / interval,
+        uint64_t(10000));
+    queue_size = delta[TIME_IN_QUEUE] * 100 * 1000 / interval;
+  }
+
+  w.addFixed2("util_percent", util);
+  w.addFixed2("avg_queue_size", queue_size);
+
+  if (device.has_discards) {
+    w.addFixed2(
+        "discards_per_sec",
+        ProcParser::rate(delta[DISCARDS], interval));
+    w.addFixed2(
+        "discard_bytes_per_sec",
+        ProcParser::rate(delta[SECTORS_DISCARDED] * kSectorSize, interval));
+  }
+
+  return w.finish();
+}
+
+ReturnCode DiskstatsSourcePlugin::pluginAttach(
+    const PropertyList& config,
+    void** userdata) {
+  std::string proc_dir = "/proc";
+  config.get("proc_dir", &proc_dir);
+
+  std::unique_ptr<DiskstatsSource> source(new DiskstatsSource());
+
+  std::vector<std::vector<std::string>> devices;
+  config.get("device", &devices);
+  for (const auto& d : devices) {
+    for (const auto& name : d) {
+      source->addDeviceFilter(name);
+    }
+  }
+
+  auto rc = source->open(proc_dir, MonotonicClock::now());
+  if (!rc.isSuccess()) {
+    return rc;
+  }
+
+  *userdata = source.release();
+  return ReturnCode::success();
+}
+
+void DiskstatsSourcePlugin::pluginDetach(void* userdata) {
+  delete static_cast<DiskstatsSource*>(userdata);
+}
+
+ReturnCode DiskstatsSourcePlugin::pluginGetNextEvent(
+    void* userdata,
+    std::string* event_json) {
+  return static_cast<DiskstatsSource*>(userdata)->getNextEvent(
+      MonotonicClock::now(),
+      event_json);
+}
+
+bool DiskstatsSourcePlugin::pluginHasPendingEvent(void* userdata) {
+  return static_cast<DiskstatsSource*>(userdata)->hasPendingEvent();
+}
+
+} // namespace evcollect
+
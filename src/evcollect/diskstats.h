@@ -0,0 +1,120 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <evcollect/evcollect.h>
+#include <evcollect/plugin.h>
+#include <evcollect/util/procfs.h>
+
+namespace evcollect {
+
+/**
+ * Reads /proc/diskstats and emits one event per block device and tick with
+ * the iops, throughput, average latencies, utilization and queue size since
+ * the previous tick. Loop and ram devices are skipped unless they are listed
+ * explicitly with addDeviceFilter
+ */
+class DiskstatsSource {
+public:
+
+  DiskstatsSource();
+
+  /**
+   * Only report the given devices
+   */
+  void addDeviceFilter(const std::string& name);
+
+  /**
+   * Open /proc/diskstats below proc_dir and take the baseline sample
+   */
+  ReturnCode open(const std::string& proc_dir, uint64_t now);
+
+  /**
+   * Takes a sample and returns the event of the first device; the other
+   * devices are returned by the following calls while hasPendingEvent()
+   * returns true
+   */
+  ReturnCode getNextEvent(uint64_t now, std::string* event_json);
+  bool hasPendingEvent() const;
+
+  size_t getNumDevices() const;
+
+protected:
+
+  enum { READS, READS_MERGED, SECTORS_READ, READ_TICKS, WRITES,
+      WRITES_MERGED, SECTORS_WRITTEN, WRITE_TICKS, IN_FLIGHT, IO_TICKS,
+      TIME_IN_QUEUE, DISCARDS, DISCARDS_MERGED, SECTORS_DISCARDED,
+      DISCARD_TICKS, kNumCounters };
+
+  static const size_t kMaxEventSize = 1024;
+
+  struct Device {
+    std::string name;
+    uint64_t generation;
+    bool has_prev;
+    bool has_discards;
+    uint64_t cur[kNumCounters];
+    uint64_t prev[kNumCounters];
+  };
+
+  bool takeSample(uint64_t now);
+  bool matchDevice(const char* name, size_t name_len) const;
+  size_t formatEvent(const Device& device, char* out, size_t out_size) const;
+
+  ProcFile file_;
+  uint64_t generation_;
+  uint64_t time_;
+  uint64_t prev_time_;
+  std::unordered_map<std::string, Device> devices_;
+  std::vector<std::string> filter_;
+  std::vector<const Device*> pending_;
+  size_t pending_pos_;
+  char out_[kMaxEventSize];
+};
+
+class DiskstatsSourcePlugin : public SourcePlugin {
+public:
+
+  static void registerPlugin(PluginMap* plugin_map);
+
+  ReturnCode pluginAttach(
+      const PropertyList& config,
+      void** userdata) override;
+
+  void pluginDetach(
+      void* userdata) override;
+
+  ReturnCode pluginGetNextEvent(
+      void* userdata,
+      std::string* event_json) override;
+
+  bool pluginHasPendingEvent(
+      void* userdata) override;
+
+};
+
+} // namespace evcollect
+
@@ -23,6 +23,7 @@
  */
 #pragma once
 #include <stdlib.h>
+#include <stdint.h>
 
 /**
  * This file contains the common public C and C++ API as well as the C plugin
@@ -88,6 +89,26 @@ void evcollect_event_setdata(
     const char* data,
     size_t size);
 
+/**
+ * Returns the time at which the event was emitted as a unix timestamp in
+ * microseconds
+ */
+uint64_t evcollect_event_gettime(const evcollect_event_t* ev);
+
+/**
+ * Copy the hostname and FQDN cached by the daemon into the given buffers as
+ * NUL-terminated strings. The FQDN is resolved in the background, so this
+ * does not block on DNS; until it is known, the hostname is returned as the
+ * FQDN. Returns false if no host metadata is available or a buffer is too
+ * small
+ */
+int evcollect_host_getname(
+    evcollect_ctx_t* ctx,
+    char* hostname,
+    size_t hostname_size,
+    char* fqdn,
+    size_t fqdn_size);
+
 typedef int (*evcollect_plugin_getnextevent_fn)(
     evcollect_ctx_t* ctx,
     void* userdata,
@@ -117,6 +138,11 @@ typedef int (*evcollect_plugin_init_fn)(
 typedef void (*evcollect_plugin_free_fn)(
     evcollect_ctx_t* ctx);
 
+typedef int (*evcollect_plugin_getstats_fn)(
+    evcollect_ctx_t* ctx,
+    void* userdata,
+    evcollect_event_t* stats);
+
 void evcollect_source_plugin_register(
     evcollect_ctx_t* ctx,
     const char* plugin_name,
@@ -136,6 +162,17 @@ void evcollect_output_plugin_register(
     evcollect_plugin_init_fn init_fn,
     evcollect_plugin_free_fn free_fn);
 
+/**
+ * Register an optional stats callback for an output plugin that was
+ * previously registered with evcollect_output_plugin_register. The callback
+ * is called with the userdata of an attached output and should store a JSON
+ * object with the output's metrics using evcollect_event_setdata
+ */
+void evcollect_output_plugin_register_stats(
+    evcollect_ctx_t* ctx,
+    const char* plugin_name,
+    evcollect_plugin_getstats_fn getstats_fn);
+
 int __evcollect_plugin_init(
     evcollect_ctx_t* ctx);
 
@@ -175,9 +212,12 @@ struct EventSourceConfig {
 };
 
 struct EventConfig {
+  EventConfig() : interval_micros(0), add_host_metadata(false) {}
   std::string event_name;
   uint64_t interval_micros;
   std::vector<EventSourceConfig> sources;
+  /* enrich host: add the cached "host" object to every event */
+  bool add_host_metadata;
 };
 
 struct TargetConfig {
@@ -26,6 +26,7 @@
 #include <signal.h>
 #include <regex>
 #include <iostream>
+#include <cstring>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/file.h>
@@ -34,6 +35,7 @@
 #include <evcollect/service.h>
 #include <evcollect/util/flagparser.h>
 #include <evcollect/util/logging.h>
+#include <evcollect/util/time.h>
 
 using namespace evcollect;
 
@@ -99,6 +101,13 @@ int main(int argc, const char** argv) {
       NULL,
       "INFO");
 
+  flags.defineFlag(
+      "stats_interval",
+      FlagParser::T_INTEGER,
+      false,
+      NULL,
+      "0");
+
   flags.defineFlag(
       "daemonize",
       FlagParser::T_SWITCH,
@@ -168,6 +177,7 @@ int main(int argc, const char** argv) {
         "   -c, --config <file>       Load config from file\n"
         "   -p, --plugin <path>       Load a plugin (.so)\n"
         "   -P, --plugin_path <dir>   Set the plugin search path\n"
+        "   --stats_interval <secs>   Log output stats every <secs> seconds\n"
         "   --daemonize               Daemonize the server\n"
         "   --pidfile <file>          Write a PID file\n"
         "   --loglevel <level>        Minimum log level (default: INFO)\n"
@@ -212,6 +222,12 @@ int main(int argc, const char** argv) {
     return 1;
   }
 
+  auto stats_interval = flags.getInt("stats_interval");
+  if (stats_interval < 0) {
+    logFatal("error: --stats_interval must be >= 0");
+    return 1;
+  }
+
   for (const auto& plugin_path : flags.getStrings("plugin")) {
     conf.load_plugins.push_back(plugin_path);
   }
@@ -219,6 +235,7 @@ int main(int argc, const char** argv) {
   /* setup service */
   auto rc = ReturnCode::success();
   service = Service::createService(conf.spool_dir, conf.plugin_dir);
+  service->setStatsInterval(stats_interval * kMicrosPerSecond);
 
   for (const auto& plugin : conf.load_plugins) {
     if (!rc.isSuccess()) {
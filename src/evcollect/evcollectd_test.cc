@@ -1,4 +1,41 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <dirent.h>
+#include <fstream>
+#include <map>
+#include <poll.h>
+#include <set>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include <evcollect/config.h>
 #include <evcollect/util/testing.h>
+#include <evcollect/util/gzip.h>
+#include <evcollect/util/histogram.h>
+#include <evcollect/util/procfs.h>
+#include <evcollect/util/time.h>
+#include <evcollect/cgroups.h>
+#include <evcollect/diskstats.h>
+#include <evcollect/host_metadata.h>
+#include <evcollect/http_scrape.h>
+#include <evcollect/logfile.h>
+#include <evcollect/logfile_output.h>
+#include <evcollect/netstats.h>
+#include <evcollect/procstats.h>
+#include <evcollect/shell.h>
+#include <evcollect/syslog_source.h>
+#include <evcollect/sysstats.h>
+
+using namespace evcollect;
 
 TEST(ConfigLexer, empty) {
   auto lexer = ConfigLexer::fromString("");
@@ -83,7 +120,1652 @@ TEST(ConfigLexer, eventDecl_example1) {
   ASSERT_EQ("LF", lexer->stringValue());
 }
 
+TEST(ConfigLexer, negative_values) {
+  auto lexer = ConfigLexer::fromString("start_at -1h\n");
+
+  ASSERT_EQ(ConfigToken::Name, lexer->currentToken());
+  ASSERT_EQ("start_at", lexer->stringValue());
+
+  lexer->nextToken();
+  ASSERT_EQ(ConfigToken::Value, lexer->currentToken());
+  ASSERT_EQ("-1h", lexer->stringValue());
+
+  lexer->nextToken();
+  ASSERT_EQ(ConfigToken::End, lexer->currentToken());
+}
+
 TEST(ConfigParser, Blurb) {
   logf("Blurbed $0", "!");
   ASSERT_EQ(2, 1 + 1);
 }
+
+TEST(LogHistogram, buckets) {
+  for (uint64_t v = 0; v < 100000; v += 7) {
+    auto idx = LogHistogram::getBucketIndex(v);
+    ASSERT_TRUE(idx < LogHistogram::kNumBuckets);
+    ASSERT_TRUE(v <= LogHistogram::getBucketUpperBound(idx));
+    ASSERT_TRUE(v * 9 / 8 >= LogHistogram::getBucketUpperBound(idx));
+  }
+
+  auto last = LogHistogram::getBucketIndex(UINT64_MAX);
+  EXPECT_EQ(LogHistogram::kNumBuckets - 1, last);
+  EXPECT_EQ(UINT64_MAX, LogHistogram::getBucketUpperBound(last));
+}
+
+TEST(LogHistogram, percentiles) {
+  LogHistogram a;
+  LogHistogram b;
+  for (uint64_t v = 1; v <= 1000; ++v) {
+    (v % 2 ? a : b).record(v);
+  }
+
+  LogHistogram merged;
+  a.mergeInto(&merged);
+  b.mergeInto(&merged);
+  EXPECT_EQ(1000, merged.getCount());
+  EXPECT_EQ(500500, merged.getSum());
+  EXPECT_EQ(1000, merged.getMax());
+  EXPECT_EQ(1000, merged.getPercentile(100));
+
+  auto p50 = merged.getPercentile(50);
+  ASSERT_TRUE(p50 >= 500 && p50 <= 500 * 9 / 8);
+  auto p99 = merged.getPercentile(99);
+  ASSERT_TRUE(p99 >= 990 && p99 <= 1000);
+}
+
+#ifdef HAVE_ZLIB
+static bool gunzip(const std::string& data, std::string* out) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit2(&zs, 15 + 16) != Z_OK) {
+    return false;
+  }
+
+  out->clear();
+  zs.next_in = (Bytef*) data.data();
+  zs.avail_in = data.size();
+
+  int rc;
+  do {
+    char buf[4096];
+    zs.next_out = (Bytef*) buf;
+    zs.avail_out = sizeof(buf);
+    rc = inflate(&zs, Z_NO_FLUSH);
+    out->append(buf, sizeof(buf) - zs.avail_out);
+  } while (rc == Z_OK);
+
+  inflateEnd(&zs);
+  return rc == Z_STREAM_END && zs.avail_in == 0;
+}
+
+TEST(GzipCompressor, roundtrip) {
+  std::string data;
+  for (size_t i = 0; i < 100000; ++i) {
+    data += StringUtil::format("{\"n\": $0, \"s\": \"$1\"}\n", i, i * i % 97);
+  }
+
+  GzipCompressor gzip;
+  std::string compressed;
+  ASSERT_TRUE(gzip.compress(data, &compressed).isSuccess());
+  EXPECT_TRUE(compressed.size() < data.size() / 4);
+
+  std::string inflated;
+  ASSERT_TRUE(gunzip(compressed, &inflated));
+  EXPECT_TRUE(inflated == data);
+
+  /* the second call on the same instance resets the stream */
+  std::string small = "hello world";
+  ASSERT_TRUE(gzip.compress(small, &compressed).isSuccess());
+  ASSERT_TRUE(gunzip(compressed, &inflated));
+  EXPECT_EQ(inflated, small);
+
+  std::string again;
+  ASSERT_TRUE(gzip.compress(small, &again).isSuccess());
+  EXPECT_TRUE(again == compressed);
+
+  /* an empty input still yields a valid gzip member */
+  ASSERT_TRUE(gzip.compress("", 0, &compressed).isSuccess());
+  EXPECT_FALSE(compressed.empty());
+  ASSERT_TRUE(gunzip(compressed, &inflated));
+  EXPECT_TRUE(inflated.empty());
+
+  for (int level : { 1, 9 }) {
+    GzipCompressor leveled(level);
+    ASSERT_TRUE(leveled.compress(data, &compressed).isSuccess());
+    ASSERT_TRUE(gunzip(compressed, &inflated));
+    EXPECT_TRUE(inflated == data);
+  }
+}
+#endif
+
+static std::string makeTempDir() {
+  char path[] = "/tmp/evcollect_test.XXXXXX";
+  return mkdtemp(path);
+}
+
+static std::vector<std::string> listDir(const std::string& path) {
+  std::vector<std::string> entries;
+  auto dir = opendir(path.c_str());
+  while (auto e = readdir(dir)) {
+    if (e->d_name[0] != '.') {
+      entries.emplace_back(e->d_name);
+    }
+  }
+
+  closedir(dir);
+  std::sort(entries.begin(), entries.end());
+  return entries;
+}
+
+static std::vector<std::string> readLines(const std::string& path) {
+  std::vector<std::string> lines;
+  std::ifstream f(path);
+  for (std::string line; std::getline(f, line); ) {
+    lines.emplace_back(line);
+  }
+
+  return lines;
+}
+
+static const char kLogTimeFormat[] = "%Y-%m-%dT%H:%M:%S";
+
+static std::string formatLogTime(uint64_t t) {
+  time_t secs = t / kMicrosPerSecond;
+  struct tm tm;
+  gmtime_r(&secs, &tm);
+
+  char buf[64];
+  strftime(buf, sizeof(buf), kLogTimeFormat, &tm);
+  return buf;
+}
+
+/**
+ * Attach a logfile source with the given start_at and return the data of up
+ * to max_lines events
+ */
+static std::vector<std::string> readLogfile(
+    const std::string& logfile,
+    const std::string& start_at,
+    size_t max_lines,
+    const std::string& time_format = kLogTimeFormat) {
+  evcollect::PluginConfig plugin_config;
+  plugin_config.spool_dir = makeTempDir();
+
+  evcollect::LogfileSourcePlugin plugin;
+  plugin.pluginInit(plugin_config);
+
+  evcollect::PropertyList config;
+  config.properties.push_back({ "logfile", { logfile } });
+  config.properties.push_back({ "time_format", { time_format } });
+  config.properties.push_back({ "start_at", { start_at } });
+
+  std::vector<std::string> lines;
+  void* userdata;
+  if (!plugin.pluginAttach(config, &userdata).isSuccess()) {
+    return lines;
+  }
+
+  static const std::string prefix = "{ \"data\": \"";
+  static const std::string suffix = "\" }";
+  while (lines.size() < max_lines) {
+    std::string event;
+    if (!plugin.pluginGetNextEvent(userdata, &event).isSuccess() ||
+        event.empty()) {
+      break;
+    }
+
+    lines.emplace_back(
+        event.substr(
+            prefix.size(),
+            event.size() - prefix.size() - suffix.size()));
+  }
+
+  plugin.pluginDetach(userdata);
+  return lines;
+}
+
+/**
+ * Lines of varying length one minute apart, the last one 30s ago, and a
+ * trailing partial line. The binary search probes land in the middle of lines
+ */
+TEST(LogfileSource, start_at_time) {
+  auto dir = makeTempDir();
+  auto logfile = dir + "/test.log";
+  auto now = WallClock::unixMicros();
+
+  std::vector<std::string> lines;
+  {
+    std::ofstream f(logfile);
+    for (size_t i = 0; i < 300; ++i) {
+      auto t = now - ((299 - i) * 60 + 30) * kMicrosPerSecond;
+      lines.emplace_back(
+          formatLogTime(t) + " line " + std::to_string(i) + " " +
+          std::string(i * 7 % 50, 'x'));
+
+      f << lines.back() << "\n";
+    }
+
+    f << formatLogTime(now) << " partial";
+  }
+
+  auto res = readLogfile(logfile, "-1h", 1000);
+  ASSERT_EQ(res.size(), 60);
+  EXPECT_EQ(res[0], lines[240]);
+  EXPECT_EQ(res[59], lines[299]);
+
+  res = readLogfile(logfile, "-10m", 1);
+  ASSERT_EQ(res.size(), 1);
+  EXPECT_EQ(res[0], lines[290]);
+
+  res = readLogfile(logfile, "-1d", 1);
+  ASSERT_EQ(res.size(), 1);
+  EXPECT_EQ(res[0], lines[0]);
+
+  /* only the partial line is newer */
+  res = readLogfile(logfile, "-1s", 1);
+  EXPECT_EQ(res.size(), 0);
+}
+
+/**
+ * nginx style timestamps in a timezone west of UTC: the offset parsed by %z
+ * must be applied
+ */
+TEST(LogfileSource, start_at_time_utc_offset) {
+  auto dir = makeTempDir();
+  auto logfile = dir + "/test.log";
+  auto now = WallClock::unixMicros();
+
+  std::vector<std::string> lines;
+  {
+    std::ofstream f(logfile);
+    for (size_t i = 0; i < 180; ++i) {
+      time_t t = now / kMicrosPerSecond - (179 - i) * 60 - 30 - 7 * 3600;
+      struct tm tm;
+      gmtime_r(&t, &tm);
+
+      char buf[64];
+      strftime(buf, sizeof(buf), "[%d/%b/%Y:%H:%M:%S -0700]", &tm);
+      lines.emplace_back(std::string(buf) + " line " + std::to_string(i));
+      f << lines.back() << "\n";
+    }
+  }
+
+  auto res = readLogfile(logfile, "-1h", 1000, "%d/%b/%Y:%H:%M:%S %z");
+  ASSERT_EQ(res.size(), 60);
+  EXPECT_EQ(res[0], lines[120]);
+  EXPECT_EQ(res[59], lines[179]);
+}
+
+/**
+ * Lines without a timestamp are skipped by the probes. Reading starts right
+ * after the last line that is older than start_at, so the lines following
+ * it are read as well
+ */
+TEST(LogfileSource, start_at_time_unparseable_lines) {
+  auto dir = makeTempDir();
+  auto logfile = dir + "/test.log";
+  auto now = WallClock::unixMicros();
+
+  std::vector<std::string> lines;
+  {
+    std::ofstream f(logfile);
+    f << "garbage at the beginning\n";
+    for (size_t i = 0; i < 300; ++i) {
+      auto t = now - ((299 - i) * 60 + 30) * kMicrosPerSecond;
+      lines.emplace_back(formatLogTime(t) + " line " + std::to_string(i));
+      f << lines.back() << "\n";
+      for (size_t j = 0; j < i % 4; ++j) {
+        f << "    at frame " << j << "\n";
+      }
+    }
+  }
+
+  /* line 239 is followed by three continuation lines */
+  auto res = readLogfile(logfile, "-1h", 4);
+  ASSERT_EQ(res.size(), 4);
+  EXPECT_EQ(res[0], "    at frame 0");
+  EXPECT_EQ(res[2], "    at frame 2");
+  EXPECT_EQ(res[3], lines[240]);
+
+  /* line 244 has no continuation lines */
+  res = readLogfile(logfile, "-55m", 1);
+  ASSERT_EQ(res.size(), 1);
+  EXPECT_EQ(res[0], lines[245]);
+
+  res = readLogfile(logfile, "-1d", 1);
+  ASSERT_EQ(res.size(), 1);
+  EXPECT_EQ(res[0], "garbage at the beginning");
+}
+
+/**
+ * Runs of lines with the same timestamp: reading starts at the first line of
+ * the run
+ */
+TEST(LogfileSource, start_at_time_identical_timestamps) {
+  auto dir = makeTempDir();
+  auto logfile = dir + "/test.log";
+  auto now = WallClock::unixMicros();
+
+  std::vector<std::string> lines;
+  {
+    std::ofstream f(logfile);
+    for (size_t i = 0; i < 400; ++i) {
+      uint64_t age;
+      if (i < 100) {
+        age = 2 * kMicrosPerHour;
+      } else if (i < 300) {
+        age = 30 * kMicrosPerMinute;
+      } else {
+        age = 10 * kMicrosPerMinute;
+      }
+
+      lines.emplace_back(
+          formatLogTime(now - age) + " line " + std::to_string(i));
+      f << lines.back() << "\n";
+    }
+  }
+
+  auto res = readLogfile(logfile, "-1h", 1000);
+  ASSERT_EQ(res.size(), 300);
+  EXPECT_EQ(res[0], lines[100]);
+
+  res = readLogfile(logfile, "-20m", 1000);
+  ASSERT_EQ(res.size(), 100);
+  EXPECT_EQ(res[0], lines[300]);
+}
+
+TEST(LogfileSource, start_at_values) {
+  evcollect::PluginConfig plugin_config;
+  plugin_config.spool_dir = makeTempDir();
+
+  evcollect::LogfileSourcePlugin plugin;
+  plugin.pluginInit(plugin_config);
+
+  std::vector<std::string> invalid = {
+    "soon",
+    "-h",
+    "-1x",
+    "-1.5h",
+    "-99999999999999999999s",
+    "-18446744073709551615d",
+  };
+
+  for (const auto& start_at : invalid) {
+    evcollect::PropertyList config;
+    config.properties.push_back({ "logfile", { "/nonexistent.log" } });
+    config.properties.push_back({ "start_at", { start_at } });
+
+    void* userdata;
+    auto rc = plugin.pluginAttach(config, &userdata);
+    EXPECT_FALSE(rc.isSuccess());
+  }
+
+  std::vector<std::string> valid = { "beginning", "end", "-30s", "-2d" };
+  for (const auto& start_at : valid) {
+    evcollect::PropertyList config;
+    config.properties.push_back({ "logfile", { "/nonexistent.log" } });
+    config.properties.push_back({ "start_at", { start_at } });
+
+    void* userdata;
+    ASSERT_TRUE(plugin.pluginAttach(config, &userdata).isSuccess());
+    plugin.pluginDetach(userdata);
+  }
+}
+
+TEST(LogfileOutput, writes_ndjson) {
+  auto dir = makeTempDir();
+
+  evcollect::PropertyList config;
+  config.properties.push_back({ "directory", { dir } });
+  config.properties.push_back({ "route", { "test.*", "%E.ndjson" } });
+  config.properties.push_back({ "flush_interval_ms", { "60000" } });
+
+  evcollect::LogfileOutputPlugin plugin;
+  void* userdata;
+  ASSERT_TRUE(plugin.pluginAttach(config, &userdata).isSuccess());
+
+  for (size_t i = 0; i < 1000; ++i) {
+    evcollect::EventData ev;
+    ev.time = i;
+    ev.event_name = i % 2 ? "test.a" : "test.b";
+    ev.event_data = StringUtil::format("{\n  \"n\": $0\n}", i);
+    ASSERT_TRUE(plugin.pluginEmitEvent(userdata, ev).isSuccess());
+
+    ev.event_name = "other";
+    ASSERT_TRUE(plugin.pluginEmitEvent(userdata, ev).isSuccess());
+  }
+
+  /* everything is still buffered */
+  std::string stats;
+  plugin.pluginGetStats(userdata, &stats);
+  EXPECT_TRUE(stats.find("\"write_calls\":0,") != std::string::npos);
+
+  plugin.pluginDetach(userdata);
+
+  auto files = listDir(dir);
+  ASSERT_EQ(files.size(), 2);
+  EXPECT_EQ(files[0], "test.a.ndjson");
+  EXPECT_EQ(files[1], "test.b.ndjson");
+
+  auto lines = readLines(dir + "/test.a.ndjson");
+  ASSERT_EQ(lines.size(), 500);
+  EXPECT_EQ(lines[0], "{   \"n\": 1 }");
+  EXPECT_EQ(lines[499], "{   \"n\": 999 }");
+}
+
+#ifdef HAVE_ZLIB
+TEST(LogfileOutput, rotation) {
+  auto dir = makeTempDir();
+
+  evcollect::PropertyList config;
+  config.properties.push_back({ "directory", { dir } });
+  config.properties.push_back({ "buffer_size", { "100" } });
+  config.properties.push_back({ "rotate_size", { "1000" } });
+  config.properties.push_back({ "compression", { "gzip" } });
+
+  evcollect::LogfileOutputPlugin plugin;
+  void* userdata;
+  ASSERT_TRUE(plugin.pluginAttach(config, &userdata).isSuccess());
+
+  for (size_t i = 0; i < 2000; ++i) {
+    evcollect::EventData ev;
+    ev.time = i;
+    ev.event_name = "test";
+    ev.event_data = StringUtil::format("{\"n\":$0}", i);
+    ASSERT_TRUE(plugin.pluginEmitEvent(userdata, ev).isSuccess());
+  }
+
+  plugin.pluginDetach(userdata);
+
+  std::set<std::string> events;
+  size_t num_segments = 0;
+  for (const auto& file : listDir(dir)) {
+    if (file == "test.ndjson") {
+      for (const auto& line : readLines(dir + "/" + file)) {
+        events.insert(line);
+      }
+
+      continue;
+    }
+
+    ASSERT_TRUE(StringUtil::endsWith(file, ".gz"));
+    ++num_segments;
+
+    std::string data;
+    auto gz = gzopen((dir + "/" + file).c_str(), "rb");
+    ASSERT_TRUE(gz != nullptr);
+    char buf[4096];
+    int n;
+    while ((n = gzread(gz, buf, sizeof(buf))) > 0) {
+      data.append(buf, n);
+    }
+
+    gzclose(gz);
+
+    for (const auto& line : StringUtil::split(data, "\n")) {
+      if (!line.empty()) {
+        events.insert(line);
+      }
+    }
+  }
+
+  EXPECT_TRUE(num_segments >= 4);
+  EXPECT_EQ(events.size(), 2000);
+  EXPECT_EQ(events.count("{\"n\":1999}"), 1);
+}
+#endif
+
+static void writeFile(const std::string& path, const std::string& data) {
+  /* truncate in place, the source keeps its fds open across samples */
+  std::ofstream f(path, std::ios::trunc);
+  f << data;
+}
+
+TEST(ProcParser, wrapping_counter_delta) {
+  static const uint64_t kWrap = uint64_t(1) << 32;
+
+  EXPECT_EQ(ProcParser::wrappingCounterDelta(1500, 1000), 500);
+  EXPECT_EQ(ProcParser::wrappingCounterDelta(704, kWrap - 296), 1000);
+
+  /* counters that were reset restart from zero, not from 2^32 */
+  EXPECT_EQ(ProcParser::wrappingCounterDelta(10, 1000), 0);
+  EXPECT_EQ(ProcParser::wrappingCounterDelta(kWrap - 1000, kWrap - 10), 0);
+  EXPECT_EQ(ProcParser::wrappingCounterDelta(10, kWrap + 1000), 0);
+}
+
+TEST(ProcFile, grows_buffer) {
+  auto dir = makeTempDir();
+  auto path = dir + "/stat";
+
+  writeFile(path, "cpu 1\n");
+  ProcFile file;
+  ASSERT_TRUE(file.open(path, false).isSuccess());
+  EXPECT_EQ(std::string(file.begin(), file.end()), "cpu 1\n");
+
+  /* much larger than the initial buffer, must not be cut off */
+  std::string data;
+  for (size_t i = 0; data.size() < 100000; ++i) {
+    data += "line " + std::to_string(i) + "\n";
+  }
+
+  writeFile(path, data);
+  ASSERT_TRUE(file.read());
+  EXPECT_EQ(std::string(file.begin(), file.end()), data);
+
+  writeFile(path, "cpu 2\n");
+  ASSERT_TRUE(file.read());
+  EXPECT_EQ(std::string(file.begin(), file.end()), "cpu 2\n");
+}
+
+TEST(SysstatsSource, deltas) {
+  auto dir = makeTempDir();
+  mkdir((dir + "/pressure").c_str(), 0755);
+
+  writeFile(
+      dir + "/stat",
+      "cpu  100 0 50 800 50 0 0 0 0 0\n"
+      "cpu0 100 0 50 800 50 0 0 0 0 0\n"
+      "intr 123 4 5 6\n"
+      "ctxt 1000\n"
+      "processes 500\n"
+      "procs_running 3\n"
+      "procs_blocked 1\n");
+  writeFile(
+      dir + "/meminfo",
+      "MemTotal:           1000 kB\n"
+      "MemFree:             200 kB\n"
+      "MemAvailable:        500 kB\n"
+      "Buffers:              10 kB\n"
+      "Cached:              100 kB\n"
+      "SwapCached:            7 kB\n"
+      "Dirty:                 1 kB\n"
+      "SwapTotal:             0 kB\n"
+      "SwapFree:              0 kB\n");
+  writeFile(dir + "/loadavg", "0.52 1.5 12.345 2/345 6789\n");
+  writeFile(
+      dir + "/vmstat",
+      "pgpgin 100\npgpgout 0\npswpin 0\npswpout 0\n"
+      "pgfault 1000\npgmajfault 1\n");
+  writeFile(
+      dir + "/pressure/cpu",
+      "some avg10=1.25 avg60=0.50 avg300=0.00 total=1\n");
+  writeFile(
+      dir + "/pressure/memory",
+      "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n"
+      "full avg10=3.00 avg60=2.10 avg300=0.00 total=0\n");
+
+  evcollect::SysstatsSource source;
+  ASSERT_TRUE(source.open(dir, 1000000).isSuccess());
+
+  writeFile(
+      dir + "/stat",
+      "cpu  300 0 150 1300 50 0 0 0 0 0\n"
+      "cpu0 300 0 150 1300 50 0 0 0 0 0\n"
+      "intr 123 4 5 6\n"
+      "ctxt 3000\n"
+      "processes 520\n"
+      "procs_running 2\n"
+      "procs_blocked 0\n");
+  writeFile(
+      dir + "/vmstat",
+      "pgpgin 300\npgpgout 0\npswpin 0\npswpout 0\n"
+      "pgfault 1001\npgmajfault 1\n");
+
+  std::string event;
+  ASSERT_TRUE(source.getNextEvent(3000000, &event).isSuccess());
+  EXPECT_EQ(
+      event,
+      "{\"cpu_user\":25.00,\"cpu_nice\":0.00,\"cpu_system\":12.50,"
+      "\"cpu_idle\":62.50,\"cpu_iowait\":0.00,\"cpu_irq\":0.00,"
+      "\"cpu_softirq\":0.00,\"cpu_steal\":0.00,"
+      "\"context_switches_per_sec\":1000.00,\"forks_per_sec\":10.00,"
+      "\"procs_running\":2,\"procs_blocked\":0,\"procs_total\":345,"
+      "\"load1\":0.52,\"load5\":1.50,\"load15\":12.34,"
+      "\"mem_total\":1024000,\"mem_free\":204800,"
+      "\"mem_available\":512000,\"mem_buffers\":10240,"
+      "\"mem_cached\":102400,\"mem_dirty\":1024,"
+      "\"swap_total\":0,\"swap_free\":0,"
+      "\"pgpgin_per_sec\":100.00,\"pgpgout_per_sec\":0.00,"
+      "\"pswpin_per_sec\":0.00,\"pswpout_per_sec\":0.00,"
+      "\"pgfault_per_sec\":0.50,\"pgmajfault_per_sec\":0.00,"
+      "\"psi_cpu_some_avg10\":1.25,\"psi_cpu_some_avg60\":0.50,"
+      "\"psi_memory_some_avg10\":0.00,\"psi_memory_some_avg60\":0.00,"
+      "\"psi_memory_full_avg10\":3.00,\"psi_memory_full_avg60\":2.10}");
+
+  evcollect::SysstatsSource missing;
+  EXPECT_FALSE(missing.open(dir + "/nonexistent", 0).isSuccess());
+}
+
+/* waits for an asynchronous source to complete its event, like the service */
+static ReturnCode pollSource(
+    evcollect::SourcePlugin* plugin,
+    void* userdata,
+    std::string* event) {
+  int fd;
+  uint64_t deadline;
+  while (event->empty() && plugin->pluginGetPollFD(userdata, &fd, &deadline)) {
+    auto now = MonotonicClock::now();
+    int timeout_ms = deadline > now ? (deadline - now) / 1000 + 1 : 0;
+    struct pollfd p = { fd, POLLIN, 0 };
+    poll(&p, fd >= 0 ? 1 : 0, timeout_ms);
+
+    auto rc = plugin->pluginGetNextEvent(userdata, event);
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  return ReturnCode::success();
+}
+
+TEST(ShellSource, spawn) {
+  evcollect::PropertyList config;
+  config.properties.push_back({ "shell", { "echo '{\"n\": '$((1 + 2))'}'" } });
+
+  evcollect::ShellSourcePlugin plugin;
+  void* userdata;
+  ASSERT_TRUE(plugin.pluginAttach(config, &userdata).isSuccess());
+
+  for (size_t i = 0; i < 2; ++i) {
+    std::string event;
+    ASSERT_TRUE(plugin.pluginGetNextEvent(userdata, &event).isSuccess());
+    EXPECT_TRUE(event.empty());
+    ASSERT_TRUE(pollSource(&plugin, userdata, &event).isSuccess());
+    EXPECT_EQ(event, "{\"n\": 3}");
+  }
+
+  plugin.pluginDetach(userdata);
+}
+
+TEST(ShellSource, errors) {
+  evcollect::ShellSourcePlugin plugin;
+  void* failing;
+  void* slow;
+  void* blocked;
+
+  {
+    evcollect::PropertyList config;
+    config.properties.push_back({ "shell", { "echo '{}'; exit 3" } });
+    ASSERT_TRUE(plugin.pluginAttach(config, &failing).isSuccess());
+  }
+
+  {
+    evcollect::PropertyList config;
+    config.properties.push_back({ "shell", { "sleep 10" } });
+    config.properties.push_back({ "timeout_ms", { "100" } });
+    config.properties.push_back({ "max_concurrent", { "2" } });
+    ASSERT_TRUE(plugin.pluginAttach(config, &slow).isSuccess());
+    ASSERT_TRUE(plugin.pluginAttach(config, &blocked).isSuccess());
+  }
+
+  /* the limit is shared, a different value would silently override it */
+  {
+    evcollect::PropertyList config;
+    config.properties.push_back({ "shell", { "true" } });
+    config.properties.push_back({ "max_concurrent", { "4" } });
+    void* conflicting;
+    auto rc = plugin.pluginAttach(config, &conflicting);
+    EXPECT_FALSE(rc.isSuccess());
+    EXPECT_TRUE(rc.getMessage().find("conflicting") != std::string::npos);
+  }
+
+  std::string event;
+  ASSERT_TRUE(plugin.pluginGetNextEvent(failing, &event).isSuccess());
+  ASSERT_TRUE(plugin.pluginGetNextEvent(slow, &event).isSuccess());
+
+  /* two scripts are running already */
+  auto rc = plugin.pluginGetNextEvent(blocked, &event);
+  EXPECT_FALSE(rc.isSuccess());
+  EXPECT_TRUE(rc.getMessage().find("too many scripts") != std::string::npos);
+
+  rc = pollSource(&plugin, failing, &event);
+  EXPECT_FALSE(rc.isSuccess());
+  EXPECT_TRUE(rc.getMessage().find("exit code 3") != std::string::npos);
+  EXPECT_TRUE(event.empty());
+
+  auto t0 = MonotonicClock::now();
+  rc = pollSource(&plugin, slow, &event);
+  EXPECT_FALSE(rc.isSuccess());
+  EXPECT_TRUE(rc.getMessage().find("timed out") != std::string::npos);
+  EXPECT_TRUE(MonotonicClock::now() - t0 < 5 * kMicrosPerSecond);
+
+  /* the slots were released */
+  ASSERT_TRUE(plugin.pluginGetNextEvent(blocked, &event).isSuccess());
+
+  plugin.pluginDetach(failing);
+  plugin.pluginDetach(slow);
+  plugin.pluginDetach(blocked);
+}
+
+TEST(ShellSource, coprocess) {
+  evcollect::PropertyList config;
+  config.properties.push_back({
+      "shell",
+      { "while read l; do n=$((n + 1)); echo \"{\\\"n\\\":$n}\"; done" } });
+  config.properties.push_back({ "mode", { "coprocess" } });
+
+  evcollect::ShellSourcePlugin plugin;
+  void* userdata;
+  ASSERT_TRUE(plugin.pluginAttach(config, &userdata).isSuccess());
+
+  for (size_t i = 1; i <= 3; ++i) {
+    std::string event;
+    ASSERT_TRUE(plugin.pluginGetNextEvent(userdata, &event).isSuccess());
+    ASSERT_TRUE(pollSource(&plugin, userdata, &event).isSuccess());
+    EXPECT_EQ(event, StringUtil::format("{\"n\":$0}", i));
+  }
+
+  plugin.pluginDetach(userdata);
+}
+
+static void writeProcess(
+    const std::string& proc_dir,
+    int pid,
+    const std::string& comm,
+    uint64_t utime,
+    uint64_t stime,
+    uint64_t start_time,
+    uint64_t ctx_switches,
+    uint64_t io_bytes) {
+  auto dir = StringUtil::format("$0/$1", proc_dir, pid);
+  mkdir(dir.c_str(), 0755);
+
+  writeFile(
+      dir + "/stat",
+      StringUtil::format(
+          "$0 ($1) S 1 $0 $0 0 -1 4194560 $2 0 $3 0 $4 $5 0 0 20 -5 4 0 $6 "
+          "12345678 10 18446744073709551615 1 1 0 0 0 0 0 4096 0 0 0 0 17 0\n",
+          pid,
+          comm,
+          utime * 10,
+          utime / 100,
+          utime,
+          stime,
+          start_time));
+  writeFile(
+      dir + "/status",
+      StringUtil::format(
+          "Name:\t$0\nState:\tS (sleeping)\nUid:\t33\t33\t33\t33\n"
+          "VmRSS:\t      40 kB\nVmSwap:\t       8 kB\n"
+          "voluntary_ctxt_switches:\t$1\n"
+          "nonvoluntary_ctxt_switches:\t$2\n",
+          comm,
+          ctx_switches,
+          ctx_switches / 10));
+  writeFile(
+      dir + "/io",
+      StringUtil::format(
+          "rchar: $0\nwchar: $1\nsyscr: 1\nsyscw: 1\nread_bytes: $0\n"
+          "write_bytes: 0\ncancelled_write_bytes: 0\n",
+          io_bytes,
+          io_bytes / 2));
+}
+
+TEST(ProcstatsSource, processes) {
+  auto dir = makeTempDir();
+  mkdir((dir + "/self").c_str(), 0755);
+  writeFile(dir + "/uptime", "1.00 1.00\n");
+  writeProcess(dir, 100, "nginx", 100, 50, 5000, 10, 0);
+  writeProcess(dir, 200, "my \"(cmd)\"", 0, 0, 6000, 0, 0);
+
+  evcollect::ProcstatsSource source;
+  ASSERT_TRUE(source.open(dir, 1000000).isSuccess());
+  EXPECT_EQ(source.getNumProcesses(), 2);
+  EXPECT_EQ(source.getNumFDs(), 6);
+
+  writeProcess(dir, 100, "nginx", 300, 150, 5000, 210, 4096);
+  writeProcess(dir, 200, "my \"(cmd)\"", 2, 0, 6000, 0, 0);
+
+  std::set<std::string> events;
+  do {
+    std::string event;
+    ASSERT_TRUE(source.getNextEvent(3000000, &event).isSuccess());
+    events.insert(event);
+  } while (source.hasPendingEvent());
+
+  /* assumes USER_HZ=100 */
+  auto rss = 10 * sysconf(_SC_PAGESIZE);
+  EXPECT_EQ(events.size(), 2);
+  EXPECT_EQ(
+      events.count(
+          StringUtil::format(
+              "{\"pid\":100,\"ppid\":1,\"command\":\"nginx\",\"state\":\"S\","
+              "\"uid\":33,\"threads\":4,\"cpu_user\":100.00,"
+              "\"cpu_system\":50.00,\"rss_bytes\":$0,\"swap_bytes\":8192,"
+              "\"minor_faults_per_sec\":1000.00,"
+              "\"major_faults_per_sec\":1.00,"
+              "\"voluntary_ctx_switches_per_sec\":100.00,"
+              "\"involuntary_ctx_switches_per_sec\":10.00,"
+              "\"rchar_per_sec\":2048.00,\"wchar_per_sec\":1024.00,"
+              "\"read_bytes_per_sec\":2048.00,\"write_bytes_per_sec\":0.00}",
+              rss)),
+      1);
+  EXPECT_EQ(
+      events.count(
+          StringUtil::format(
+              "{\"pid\":200,\"ppid\":1,\"command\":\"my \\\"(cmd)\\\"\","
+              "\"state\":\"S\",\"uid\":33,\"threads\":4,\"cpu_user\":1.00,"
+              "\"cpu_system\":0.00,\"rss_bytes\":$0,\"swap_bytes\":8192,"
+              "\"minor_faults_per_sec\":10.00,"
+              "\"major_faults_per_sec\":0.00,"
+              "\"voluntary_ctx_switches_per_sec\":0.00,"
+              "\"involuntary_ctx_switches_per_sec\":0.00,"
+              "\"rchar_per_sec\":0.00,\"wchar_per_sec\":0.00,"
+              "\"read_bytes_per_sec\":0.00,\"write_bytes_per_sec\":0.00}",
+              rss)),
+      1);
+
+  /* pid 200 exits, pid 100 is reused by a new process */
+  for (auto f : { "stat", "status", "io" }) {
+    unlink(StringUtil::format("$0/200/$1", dir, f).c_str());
+  }
+  rmdir((dir + "/200").c_str());
+  writeProcess(dir, 100, "nginx", 10, 10, 9000, 0, 0);
+
+  std::string event;
+  ASSERT_TRUE(source.getNextEvent(5000000, &event).isSuccess());
+  EXPECT_EQ(event, "");
+  EXPECT_FALSE(source.hasPendingEvent());
+  EXPECT_EQ(source.getNumProcesses(), 1);
+  EXPECT_EQ(source.getNumFDs(), 3);
+}
+
+TEST(ProcstatsSource, filter_and_limit) {
+  auto dir = makeTempDir();
+  writeProcess(dir, 100, "nginx", 0, 0, 1, 0, 0);
+  writeProcess(dir, 101, "nginx", 0, 0, 1, 0, 0);
+  writeProcess(dir, 200, "postgres", 0, 0, 1, 0, 0);
+
+  evcollect::ProcstatsSource source;
+  source.addCommandFilter("nginx");
+  source.setLimit(1);
+  ASSERT_TRUE(source.open(dir, 1000000).isSuccess());
+  EXPECT_EQ(source.getNumFDs(), 6);
+
+  writeProcess(dir, 100, "nginx", 10, 0, 1, 0, 0);
+  writeProcess(dir, 101, "nginx", 20, 0, 1, 0, 0);
+  writeProcess(dir, 200, "postgres", 50, 0, 1, 0, 0);
+
+  std::string event;
+  ASSERT_TRUE(source.getNextEvent(2000000, &event).isSuccess());
+  EXPECT_FALSE(source.hasPendingEvent());
+  EXPECT_EQ(event.find("{\"pid\":101,"), 0);
+}
+
+TEST(NetdevSource, rates) {
+  auto dir = makeTempDir();
+  mkdir((dir + "/net").c_str(), 0755);
+
+  std::string header =
+      "Inter-|   Receive                            |  Transmit\n"
+      " face |bytes    packets errs drop fifo frame compressed multicast|"
+      "bytes    packets errs drop fifo colls carrier compressed\n";
+
+  writeFile(
+      dir + "/net/dev",
+      header +
+      "    lo:  1000 10 0 0 0 0 0 0  1000 10 0 0 0 0 0 0\n"
+      "  eth0: 4294967000 100 1 0 0 0 0 0 5000 50 0 2 0 0 0 0\n"
+      " veth1: 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0 0\n");
+
+  evcollect::NetdevSource source;
+  ASSERT_TRUE(source.open(dir, 1000000).isSuccess());
+  EXPECT_EQ(source.getNumInterfaces(), 3);
+
+  /* the 32 bit rx_bytes counter of eth0 wraps around, veth1 disappears */
+  writeFile(
+      dir + "/net/dev",
+      header +
+      "    lo:  3000 30 0 0 0 0 0 0  3000 30 0 0 0 0 0 0\n"
+      "  eth0: 704 300 1 0 0 0 0 0 9000 90 0 4 0 0 0 0\n");
+
+  std::vector<std::string> events;
+  do {
+    std::string event;
+    ASSERT_TRUE(source.getNextEvent(3000000, &event).isSuccess());
+    events.emplace_back(event);
+  } while (source.hasPendingEvent());
+
+  EXPECT_EQ(source.getNumInterfaces(), 2);
+  ASSERT_EQ(events.size(), 2);
+  EXPECT_EQ(
+      events[0],
+      "{\"interface\":\"lo\",\"rx_bytes_per_sec\":1000.00,"
+      "\"rx_packets_per_sec\":10.00,\"rx_errors_per_sec\":0.00,"
+      "\"rx_dropped_per_sec\":0.00,\"tx_bytes_per_sec\":1000.00,"
+      "\"tx_packets_per_sec\":10.00,\"tx_errors_per_sec\":0.00,"
+      "\"tx_dropped_per_sec\":0.00}");
+  EXPECT_EQ(
+      events[1],
+      "{\"interface\":\"eth0\",\"rx_bytes_per_sec\":500.00,"
+      "\"rx_packets_per_sec\":100.00,\"rx_errors_per_sec\":0.00,"
+      "\"rx_dropped_per_sec\":0.00,\"tx_bytes_per_sec\":2000.00,"
+      "\"tx_packets_per_sec\":20.00,\"tx_errors_per_sec\":0.00,"
+      "\"tx_dropped_per_sec\":1.00}");
+}
+
+TEST(NetsnmpSource, rates) {
+  auto dir = makeTempDir();
+  mkdir((dir + "/net").c_str(), 0755);
+
+  writeFile(
+      dir + "/net/snmp",
+      "Ip: Forwarding DefaultTTL InReceives InDelivers OutRequests\n"
+      "Ip: 2 64 1000 1000 500\n"
+      "Tcp: RtoAlgorithm RtoMin RtoMax MaxConn ActiveOpens PassiveOpens "
+      "CurrEstab OutSegs RetransSegs\n"
+      "Tcp: 1 200 120000 -1 10 20 5 1000 10\n"
+      "Udp: InDatagrams NoPorts InErrors OutDatagrams RcvbufErrors\n"
+      "Udp: 100 0 0 100 0\n");
+
+  evcollect::NetsnmpSource source;
+  ASSERT_TRUE(source.open(dir, 1000000).isSuccess());
+
+  writeFile(
+      dir + "/net/snmp",
+      "Ip: Forwarding DefaultTTL InReceives InDelivers OutRequests\n"
+      "Ip: 2 64 3000 2000 1500\n"
+      "Tcp: RtoAlgorithm RtoMin RtoMax MaxConn ActiveOpens PassiveOpens "
+      "CurrEstab OutSegs RetransSegs\n"
+      "Tcp: 1 200 120000 -1 12 30 7 3000 40\n"
+      "Udp: InDatagrams NoPorts InErrors OutDatagrams RcvbufErrors\n"
+      "Udp: 300 2 4 100 4\n");
+
+  std::string event;
+  ASSERT_TRUE(source.getNextEvent(3000000, &event).isSuccess());
+  EXPECT_EQ(
+      event,
+      "{\"ip_in_receives_per_sec\":1000.00,"
+      "\"ip_in_delivers_per_sec\":500.00,"
+      "\"ip_out_requests_per_sec\":500.00,"
+      "\"tcp_active_opens_per_sec\":1.00,"
+      "\"tcp_passive_opens_per_sec\":5.00,"
+      "\"tcp_curr_estab\":7,"
+      "\"tcp_out_segs_per_sec\":1000.00,"
+      "\"tcp_retrans_segs_per_sec\":15.00,"
+      "\"udp_in_datagrams_per_sec\":100.00,"
+      "\"udp_out_datagrams_per_sec\":0.00,"
+      "\"udp_no_ports_per_sec\":1.00,"
+      "\"udp_in_errors_per_sec\":2.00,"
+      "\"udp_rcvbuf_errors_per_sec\":2.00,"
+      "\"tcp_retrans_percent\":1.50}");
+}
+
+TEST(DiskstatsSource, rates) {
+  auto dir = makeTempDir();
+  writeFile(
+      dir + "/diskstats",
+      "   7       0 loop0 100 0 100 10 0 0 0 0 0 10 10 0 0 0 0 0 0\n"
+      "   8       0 sda 1000 10 8000 500 2000 20 16000 4000 0 1000 4500 "
+      "0 0 0 0 0 0\n"
+      "   8       1 sda1 0 0 0 0 0 0 0 0 0 0 0\n");
+
+  evcollect::DiskstatsSource source;
+  ASSERT_TRUE(source.open(dir, 1000000).isSuccess());
+  EXPECT_EQ(source.getNumDevices(), 2);
+
+  writeFile(
+      dir + "/diskstats",
+      "   7       0 loop0 200 0 200 20 0 0 0 0 0 20 20 0 0 0 0 0 0\n"
+      "   8       0 sda 1200 10 10048 700 2400 20 20096 5200 3 2000 6500 "
+      "10 0 2048 5 0 0\n"
+      "   8       1 sda1 0 0 0 0 0 0 0 0 0 0 0\n");
+
+  std::vector<std::string> events;
+  do {
+    std::string event;
+    ASSERT_TRUE(source.getNextEvent(3000000, &event).isSuccess());
+    events.emplace_back(event);
+  } while (source.hasPendingEvent());
+
+  ASSERT_EQ(events.size(), 2);
+  EXPECT_EQ(
+      events[0],
+      "{\"device\":\"sda\",\"reads_per_sec\":100.00,"
+      "\"writes_per_sec\":200.00,\"reads_merged_per_sec\":0.00,"
+      "\"writes_merged_per_sec\":0.00,"
+      "\"read_bytes_per_sec\":524288.00,"
+      "\"write_bytes_per_sec\":1048576.00,"
+      "\"read_latency_ms\":1.00,\"write_latency_ms\":3.00,"
+      "\"in_flight\":3,\"util_percent\":50.00,"
+      "\"avg_queue_size\":1.00,\"discards_per_sec\":5.00,"
+      "\"discard_bytes_per_sec\":524288.00}");
+  EXPECT_EQ(
+      events[1],
+      "{\"device\":\"sda1\",\"reads_per_sec\":0.00,"
+      "\"writes_per_sec\":0.00,\"reads_merged_per_sec\":0.00,"
+      "\"writes_merged_per_sec\":0.00,\"read_bytes_per_sec\":0.00,"
+      "\"write_bytes_per_sec\":0.00,\"read_latency_ms\":0.00,"
+      "\"write_latency_ms\":0.00,\"in_flight\":0,"
+      "\"util_percent\":0.00,\"avg_queue_size\":0.00}");
+}
+
+static void writeCgroup(
+    const std::string& dir,
+    uint64_t usage_usec,
+    uint64_t memory,
+    uint64_t rbytes,
+    uint64_t stall_usec) {
+  writeFile(
+      dir + "/cpu.stat",
+      "usage_usec " + std::to_string(usage_usec) + "\n"
+      "user_usec " + std::to_string(usage_usec / 2) + "\n"
+      "system_usec " + std::to_string(usage_usec / 2) + "\n"
+      "nr_periods 0\nnr_throttled 0\nthrottled_usec 0\n");
+  writeFile(dir + "/memory.current", std::to_string(memory) + "\n");
+  writeFile(
+      dir + "/io.stat",
+      "8:0 rbytes=" + std::to_string(rbytes) + " wbytes=0 rios=10 wios=0 "
+      "dbytes=0 dios=0\n"
+      "8:16 rbytes=" + std::to_string(rbytes) + " wbytes=0 rios=10 wios=0 "
+      "dbytes=0 dios=0\n");
+  writeFile(
+      dir + "/memory.pressure",
+      "some avg10=0.00 avg60=0.00 avg300=0.00 total=" +
+      std::to_string(stall_usec) + "\n"
+      "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+}
+
+static std::vector<std::string> getCgroupEvents(
+    evcollect::CgroupSource* source,
+    uint64_t now) {
+  std::vector<std::string> events;
+  do {
+    std::string event;
+    EXPECT_TRUE(source->getNextEvent(now, &event).isSuccess());
+    events.emplace_back(event);
+  } while (source->hasPendingEvent());
+
+  return events;
+}
+
+TEST(CgroupSource, stats) {
+  auto dir = makeTempDir();
+  mkdir((dir + "/system.slice").c_str(), 0755);
+  writeFile(dir + "/cpu.stat", "usage_usec 1000\n");
+  writeCgroup(dir + "/system.slice", 1000000, 4096, 0, 0);
+
+  evcollect::CgroupSource source;
+  ASSERT_TRUE(source.open(dir, 1000000).isSuccess());
+  EXPECT_EQ(source.getNumCgroups(), 2);
+  EXPECT_EQ(source.getNumScans(), 1);
+
+  writeFile(dir + "/cpu.stat", "usage_usec 2001000\n");
+  writeCgroup(dir + "/system.slice", 1500000, 8192, 1048576, 100000);
+
+  auto events = getCgroupEvents(&source, 3000000);
+  ASSERT_EQ(events.size(), 2);
+  EXPECT_EQ(events[0], "{\"cgroup\":\"/\",\"cpu_usage_percent\":100.00,"
+      "\"cpu_user_percent\":0.00,\"cpu_system_percent\":0.00}");
+  EXPECT_EQ(
+      events[1],
+      "{\"cgroup\":\"/system.slice\",\"cpu_usage_percent\":25.00,"
+      "\"cpu_user_percent\":12.50,\"cpu_system_percent\":12.50,"
+      "\"cpu_throttled_percent\":0.00,\"memory_current\":8192,"
+      "\"io_read_bytes_per_sec\":1048576.00,"
+      "\"io_write_bytes_per_sec\":0.00,\"io_reads_per_sec\":0.00,"
+      "\"io_writes_per_sec\":0.00,\"psi_memory_some_percent\":5.00,"
+      "\"psi_memory_full_percent\":0.00}");
+
+  /* nothing changed in the tree, so it must not be walked again */
+  getCgroupEvents(&source, 4000000);
+  EXPECT_EQ(source.getNumScans(), 1);
+}
+
+TEST(CgroupSource, rescan_on_change) {
+  auto dir = makeTempDir();
+  mkdir((dir + "/a").c_str(), 0755);
+  writeCgroup(dir + "/a", 0, 0, 0, 0);
+
+  evcollect::CgroupSource source;
+  ASSERT_TRUE(source.open(dir, 1000000).isSuccess());
+  EXPECT_EQ(source.getNumCgroups(), 2);
+
+  mkdir((dir + "/a/b").c_str(), 0755);
+  writeCgroup(dir + "/a/b", 0, 0, 0, 0);
+
+  /* the new cgroup has no baseline yet and is only reported on the next tick */
+  auto events = getCgroupEvents(&source, 2000000);
+  EXPECT_EQ(source.getNumScans(), 2);
+  EXPECT_EQ(source.getNumCgroups(), 3);
+  EXPECT_EQ(events.size(), 1);
+
+  events = getCgroupEvents(&source, 3000000);
+  ASSERT_EQ(events.size(), 2);
+  EXPECT_EQ(events[1].find("{\"cgroup\":\"/a/b\","), 0);
+
+  for (const auto& f : { "cpu.stat", "memory.current", "io.stat",
+      "memory.pressure" }) {
+    unlink((dir + "/a/b/" + f).c_str());
+  }
+
+  rmdir((dir + "/a/b").c_str());
+  getCgroupEvents(&source, 4000000);
+  EXPECT_EQ(source.getNumScans(), 3);
+  EXPECT_EQ(source.getNumCgroups(), 2);
+}
+
+static std::string formatSyslogMessage(const std::string& str) {
+  evcollect::SyslogMessage msg;
+  auto valid = evcollect::SyslogParser::parse(
+      str.data(),
+      str.data() + str.size(),
+      &msg);
+
+  std::string out = valid ? "" : "invalid ";
+  out += std::to_string(msg.facility) + "." + std::to_string(msg.severity);
+  out += " v" + std::to_string(msg.version);
+  for (const auto& f : { msg.timestamp, msg.hostname, msg.app_name,
+      msg.procid, msg.msgid, msg.structured_data, msg.message }) {
+    out += "|" + std::string(f.data ? f.data : "", f.size);
+  }
+
+  return out;
+}
+
+TEST(SyslogParser, rfc3164) {
+  EXPECT_EQ(
+      formatSyslogMessage(
+          "<34>Oct 11 22:14:15 mymachine su: 'su root' failed\n"),
+      "4.2 v0|Oct 11 22:14:15|mymachine|su||||'su root' failed");
+  EXPECT_EQ(
+      formatSyslogMessage("<13>Feb  5 17:32:18 host sshd[1234]: hello"),
+      "1.5 v0|Feb  5 17:32:18|host|sshd|1234|||hello");
+  EXPECT_EQ(
+      formatSyslogMessage("<13>Feb  5 17:32:18 sshd[1234]: no host"),
+      "1.5 v0|Feb  5 17:32:18||sshd|1234|||no host");
+  EXPECT_EQ(
+      formatSyslogMessage(
+          "<30>2024-01-02T03:04:05.123+01:00 web1 nginx: GET /"),
+      "3.6 v0|2024-01-02T03:04:05.123+01:00|web1|nginx||||GET /");
+  EXPECT_EQ(
+      formatSyslogMessage("<191>just some text"),
+      "23.7 v0|||||||just some text");
+  EXPECT_EQ(
+      formatSyslogMessage("no pri at all"),
+      "invalid 1.5 v0|||||||no pri at all");
+  EXPECT_EQ(
+      formatSyslogMessage("<192>out of range"),
+      "invalid 1.5 v0|||||||<192>out of range");
+}
+
+TEST(SyslogParser, rfc5424) {
+  EXPECT_EQ(
+      formatSyslogMessage(
+          "<165>1 2003-10-11T22:14:15.003Z mymachine.example.com evntslog - "
+          "ID47 [exampleSDID@32473 iut=\"3\" eventSource=\"App\\]\"]"
+          "[x@1 a=\"b\"] \xef\xbb\xbf" "An application event"),
+      "20.5 v1|2003-10-11T22:14:15.003Z|mymachine.example.com|evntslog||"
+      "ID47|[exampleSDID@32473 iut=\"3\" eventSource=\"App\\]\"][x@1 a=\"b\"]"
+      "|An application event");
+  EXPECT_EQ(
+      formatSyslogMessage("<34>1 - - - - - -"),
+      "4.2 v1|||||||");
+  EXPECT_EQ(
+      formatSyslogMessage("<34>1 2003-10-11T22:14:15Z host app 42 - - msg"),
+      "4.2 v1|2003-10-11T22:14:15Z|host|app|42|||msg");
+}
+
+static std::vector<std::string> receiveSyslogEvents(
+    evcollect::SyslogSource* source,
+    size_t count) {
+  std::vector<std::string> events;
+  auto deadline = MonotonicClock::now() + 5 * kMicrosPerSecond;
+  while (events.size() < count && MonotonicClock::now() < deadline) {
+    struct pollfd p = { source->getPollFD(), POLLIN, 0 };
+    poll(&p, 1, 100);
+
+    do {
+      std::string event;
+      EXPECT_TRUE(source->getNextEvent(&event).isSuccess());
+      if (!event.empty()) {
+        events.emplace_back(event);
+      }
+    } while (source->hasPendingEvent());
+  }
+
+  return events;
+}
+
+TEST(SyslogSource, udp_and_tcp) {
+  /* the TCP socket binds the ephemeral port picked for UDP, which may be
+   * taken already */
+  std::unique_ptr<evcollect::SyslogSource> s;
+  for (int i = 0; i < 10; ++i) {
+    s.reset(
+        new evcollect::SyslogSource(evcollect::SyslogSource::Transport::BOTH));
+    if (s->listen("127.0.0.1", 0).isSuccess()) {
+      break;
+    }
+  }
+
+  auto& source = *s;
+  ASSERT_TRUE(source.getPort() > 0);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(source.getPort());
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+  std::string dgram = "<14>Oct 11 22:14:15 host app[1]: via \"udp\"";
+  sendto(
+      udp_fd,
+      dgram.data(),
+      dgram.size(),
+      0,
+      (struct sockaddr*) &addr,
+      sizeof(addr));
+  close(udp_fd);
+
+  auto events = receiveSyslogEvents(&source, 1);
+  ASSERT_EQ(events.size(), 1);
+  EXPECT_EQ(
+      events[0],
+      "{\"facility\":\"user\",\"severity\":\"info\","
+      "\"timestamp\":\"Oct 11 22:14:15\",\"hostname\":\"host\","
+      "\"app_name\":\"app\",\"procid\":\"1\","
+      "\"message\":\"via \\\"udp\\\"\",\"remote_addr\":\"127.0.0.1\"}");
+
+  /* octet counted and newline framed messages on one stream, split at
+   * arbitrary points */
+  int tcp_fd = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_EQ(connect(tcp_fd, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  std::string stream =
+      "25 <11>1 - - - - - - counted"
+      "<11>first line\n"
+      "<11>second line\r\n"
+      "\n"
+      "17 <11>1 - - - - - -"
+      "<11>no newline";
+  for (size_t i = 0; i < stream.size(); i += 7) {
+    write(tcp_fd, stream.data() + i, std::min(size_t(7), stream.size() - i));
+    usleep(1000);
+  }
+
+  close(tcp_fd);
+
+  events = receiveSyslogEvents(&source, 5);
+  ASSERT_EQ(events.size(), 5);
+  EXPECT_EQ(
+      events[0],
+      "{\"facility\":\"user\",\"severity\":\"err\","
+      "\"message\":\"counted\",\"remote_addr\":\"127.0.0.1\"}");
+  EXPECT_EQ(events[1].find("{\"facility\":\"user\",\"severity\":\"err\","
+      "\"message\":\"first line\""), 0);
+  EXPECT_EQ(events[2].find("{\"facility\":\"user\",\"severity\":\"err\","
+      "\"message\":\"second line\""), 0);
+  EXPECT_EQ(events[3].find("{\"facility\":\"user\",\"severity\":\"err\","
+      "\"message\":\"\""), 0);
+  EXPECT_EQ(events[4].find("{\"facility\":\"user\",\"severity\":\"err\","
+      "\"message\":\"no newline\""), 0);
+
+  EXPECT_EQ(source.getNumMessages(), 6);
+  EXPECT_EQ(source.getNumErrors(), 0);
+}
+
+TEST(HostMetadata, snapshot) {
+  auto dir = makeTempDir();
+  writeFile(dir + "/sys_vendor", "Amazon EC2\n");
+  writeFile(dir + "/board_asset_tag", "i-0123456789abcdef0\n");
+
+  evcollect::HostMetadata host;
+  host.setDMIDir(dir);
+  host.refresh(false);
+
+  char hostname[256];
+  ASSERT_EQ(gethostname(hostname, sizeof(hostname)), 0);
+  struct utsname u;
+  ASSERT_EQ(uname(&u), 0);
+
+  auto snapshot = host.getSnapshot();
+  auto fields = snapshot->fields;
+  EXPECT_EQ(fields.find("\"hostname\":\"" + std::string(hostname) + "\""), 0);
+  EXPECT_TRUE(
+      fields.find("\"kernel_version\":\"" + std::string(u.release) + "\"") !=
+      std::string::npos);
+  EXPECT_TRUE(
+      fields.find(
+          "\"cloud_provider\":\"aws\","
+          "\"cloud_instance_id\":\"i-0123456789abcdef0\"") !=
+      std::string::npos);
+  EXPECT_EQ(snapshot->fragment, "\"host\":{" + fields + "}");
+
+  /* the refresh thread publishes a new snapshot, the old one stays valid */
+  host.start(3600);
+  host.stop();
+  EXPECT_TRUE(host.getSnapshot() != snapshot);
+  EXPECT_EQ(snapshot->fragment, "\"host\":{" + fields + "}");
+}
+
+TEST(HostMetadata, add_to_event) {
+  std::string event = "{\"a\":1}";
+  evcollect::HostMetadata::addToEvent("\"host\":{}", &event);
+  EXPECT_EQ(event, "{\"a\":1,\"host\":{}}");
+
+  event = "{ }\n";
+  evcollect::HostMetadata::addToEvent("\"host\":{}", &event);
+  EXPECT_EQ(event, "{ \"host\":{}}\n");
+
+  event = "not json";
+  evcollect::HostMetadata::addToEvent("\"host\":{}", &event);
+  EXPECT_EQ(event, "not json");
+}
+
+static std::string parsePrometheus(
+    const std::string& text,
+    size_t chunk_size,
+    const std::vector<std::string>* filter = nullptr) {
+  evcollect::PrometheusParser parser;
+  parser.setFilter(filter);
+  parser.reset("t");
+  for (size_t i = 0; i < text.size(); i += chunk_size) {
+    auto len = std::min(chunk_size, text.size() - i);
+    parser.parse(text.data() + i, len);
+  }
+
+  parser.finish();
+
+  std::string events;
+  size_t begin = 0;
+  for (auto end : parser.getEventEnds()) {
+    events += parser.getEvents().substr(begin, end - begin) + "\n";
+    begin = end;
+  }
+
+  events += std::to_string(parser.getNumErrors());
+  return events;
+}
+
+TEST(PrometheusParser, parse) {
+  std::string text =
+      "# HELP rpc_duration_seconds RPC latency.\n"
+      "# TYPE rpc_duration_seconds histogram\n"
+      "rpc_duration_seconds_bucket{le=\"0.1\"} 3\n"
+      "rpc_duration_seconds_bucket{le=\"+Inf\",} 5\n"
+      "rpc_duration_seconds_sum 1.5e-1\n"
+      "rpc_duration_seconds_count 5\n"
+      "# TYPE up gauge\n"
+      "up 1 1700000000000\r\n"
+      "\n"
+      "process_open_fds NaN\n"
+      "broken{le=\"1\" 2\n"
+      "escapes{msg=\"a\\\"b\\\\c\\nd\"} .5\n"
+      "last 7";
+
+  std::string expected =
+      "{\"target\":\"t\",\"metric\":\"rpc_duration_seconds_bucket\","
+      "\"type\":\"histogram\",\"labels\":{\"le\":\"0.1\"},\"value\":3}\n"
+      "{\"target\":\"t\",\"metric\":\"rpc_duration_seconds_bucket\","
+      "\"type\":\"histogram\",\"labels\":{\"le\":\"+Inf\"},\"value\":5}\n"
+      "{\"target\":\"t\",\"metric\":\"rpc_duration_seconds_sum\","
+      "\"type\":\"histogram\",\"value\":1.5e-1}\n"
+      "{\"target\":\"t\",\"metric\":\"rpc_duration_seconds_count\","
+      "\"type\":\"histogram\",\"value\":5}\n"
+      "{\"target\":\"t\",\"metric\":\"up\",\"type\":\"gauge\","
+      "\"value\":1,\"timestamp_ms\":1700000000000}\n"
+      "{\"target\":\"t\",\"metric\":\"escapes\",\"type\":\"untyped\","
+      "\"labels\":{\"msg\":\"a\\\"b\\\\c\\u000ad\"},\"value\":0.5}\n"
+      "{\"target\":\"t\",\"metric\":\"last\",\"type\":\"untyped\","
+      "\"value\":7}\n"
+      "1";
+
+  /* the result must not depend on where the response is split */
+  EXPECT_EQ(parsePrometheus(text, text.size()), expected);
+  EXPECT_EQ(parsePrometheus(text, 1), expected);
+  EXPECT_EQ(parsePrometheus(text, 7), expected);
+
+  std::vector<std::string> filter = { "up", "last" };
+  EXPECT_EQ(
+      parsePrometheus(text, 5, &filter),
+      "{\"target\":\"t\",\"metric\":\"up\",\"type\":\"gauge\","
+      "\"value\":1,\"timestamp_ms\":1700000000000}\n"
+      "{\"target\":\"t\",\"metric\":\"last\",\"type\":\"untyped\","
+      "\"value\":7}\n"
+      "0");
+}
+
+/**
+ * Minimal HTTP/1.1 server with keep-alive; requests for /slow are never
+ * answered. Counts the connections that served at least one response
+ */
+class TestHTTPServer {
+public:
+
+  TestHTTPServer() : num_connections_(0), stop_(false) {
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    bind(listen_fd_, (struct sockaddr*) &addr, sizeof(addr));
+    listen(listen_fd_, 16);
+    getsockname(listen_fd_, (struct sockaddr*) &addr, &addr_len);
+    port_ = ntohs(addr.sin_port);
+    thread_ = std::thread([this] () { run(); });
+  }
+
+  ~TestHTTPServer() {
+    stop_ = true;
+    shutdown(listen_fd_, SHUT_RDWR);
+    thread_.join();
+    for (auto& t : connections_) {
+      t.join();
+    }
+
+    close(listen_fd_);
+  }
+
+  void addPage(const std::string& path, const std::string& body) {
+    pages_[path] = body;
+  }
+
+  std::string getURL(const std::string& path) const {
+    return "http://127.0.0.1:" + std::to_string(port_) + path;
+  }
+
+  size_t getNumConnections() const {
+    return num_connections_;
+  }
+
+protected:
+
+  void run() {
+    for (;;) {
+      int fd = accept(listen_fd_, NULL, NULL);
+      if (fd < 0) {
+        return;
+      }
+
+      connections_.emplace_back([this, fd] () { serve(fd); });
+    }
+  }
+
+  void serve(int fd) {
+    std::string buf;
+    bool counted = false;
+    for (;;) {
+      auto header_end = buf.find("\r\n\r\n");
+      if (header_end == std::string::npos) {
+        char chunk[4096];
+        auto n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) {
+          break;
+        }
+
+        buf.append(chunk, n);
+        continue;
+      }
+
+      auto path = buf.substr(4, buf.find(' ', 4) - 4);
+      buf.erase(0, header_end + 4);
+      if (path == "/slow") {
+        while (!stop_) {
+          usleep(10000);
+        }
+
+        break;
+      }
+
+      auto page = pages_.find(path);
+      std::string response;
+      if (page == pages_.end()) {
+        response = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+      } else {
+        response =
+            "HTTP/1.1 200 OK\r\nContent-Length: " +
+            std::to_string(page->second.size()) + "\r\n\r\n" +
+            page->second;
+      }
+
+      if (!counted) {
+        ++num_connections_;
+        counted = true;
+      }
+
+      write(fd, response.data(), response.size());
+    }
+
+    close(fd);
+  }
+
+  int listen_fd_;
+  int port_;
+  std::map<std::string, std::string> pages_;
+  std::thread thread_;
+  std::vector<std::thread> connections_;
+  std::atomic<size_t> num_connections_;
+  std::atomic<bool> stop_;
+};
+
+static void pollScrapeSource(
+    evcollect::ScrapeSource* source,
+    std::vector<std::string>* events,
+    uint64_t num_scrapes) {
+  auto deadline = MonotonicClock::now() + 5 * kMicrosPerSecond;
+  while (source->getNumScrapes() < num_scrapes &&
+         MonotonicClock::now() < deadline) {
+    int fd;
+    uint64_t timer;
+    if (!source->getPollFD(&fd, &timer)) {
+      break;
+    }
+
+    int timeout_ms = 100;
+    auto now = MonotonicClock::now();
+    if (timer > 0) {
+      timeout_ms = timer > now ? (timer - now) / kMicrosPerMilli + 1 : 0;
+      timeout_ms = timeout_ms < 100 ? timeout_ms : 100;
+    }
+
+    struct pollfd p = { fd, POLLIN, 0 };
+    poll(&p, 1, timeout_ms);
+
+    do {
+      std::string event;
+      EXPECT_TRUE(
+          source->pollEvent(MonotonicClock::now(), &event).isSuccess());
+      if (!event.empty()) {
+        events->emplace_back(event);
+      }
+    } while (source->hasPendingEvent());
+  }
+}
+
+TEST(ScrapeSource, concurrent_scrapes) {
+  TestHTTPServer server;
+  server.addPage("/metrics", "# TYPE up gauge\nup 1\nrequests_total 42\n");
+
+  evcollect::ScrapeSource source(evcollect::ScrapeSource::Format::PROMETHEUS);
+  source.addTarget(server.getURL("/metrics"));
+  source.addTarget(server.getURL("/slow"));
+  source.addTarget(server.getURL("/missing"));
+  source.setTimeout(kMicrosPerSecond);
+  ASSERT_TRUE(source.open().isSuccess());
+
+  /* the hanging target must not hold back the others */
+  auto t0 = MonotonicClock::now();
+  std::string event;
+  ASSERT_TRUE(source.getNextEvent(t0, &event).isSuccess());
+  EXPECT_TRUE(event.empty());
+
+  std::vector<std::string> events;
+  pollScrapeSource(&source, &events, 2);
+  EXPECT_TRUE(MonotonicClock::now() - t0 < kMicrosPerSecond / 2);
+  ASSERT_EQ(events.size(), 2);
+  std::string target = "{\"target\":\"" + server.getURL("/metrics") + "\"";
+  EXPECT_EQ(
+      events[0],
+      target + ",\"metric\":\"up\",\"type\":\"gauge\",\"value\":1}");
+  EXPECT_EQ(
+      events[1],
+      target + ",\"metric\":\"requests_total\",\"type\":\"untyped\","
+      "\"value\":42}");
+  EXPECT_EQ(source.getNumErrors(), 1);
+
+  /* the next tick skips the target that is still busy and reuses the
+   * connections of the others */
+  ASSERT_TRUE(source.getNextEvent(MonotonicClock::now(), &event).isSuccess());
+  EXPECT_EQ(source.getNumSkipped(), 1);
+
+  events.clear();
+  pollScrapeSource(&source, &events, 5);
+  EXPECT_EQ(events.size(), 2);
+  EXPECT_EQ(source.getNumScrapes(), 5);
+  EXPECT_EQ(source.getNumErrors(), 3);
+  EXPECT_TRUE(MonotonicClock::now() - t0 >= kMicrosPerSecond);
+  EXPECT_EQ(server.getNumConnections(), 2);
+}
+
+TEST(ScrapeSource, stub_status_and_json) {
+  TestHTTPServer server;
+  server.addPage(
+      "/stub",
+      "Active connections: 291 \n"
+      "server accepts handled requests\n"
+      " 16630948 16630948 31070465 \n"
+      "Reading: 6 Writing: 179 Waiting: 106 \n");
+  server.addPage("/json", " {\"queue\":{\"depth\":3}}\n");
+  server.addPage("/empty", "{ }");
+  server.addPage("/array", "[1]");
+  server.addPage("/truncated", "{\"queue\":{\"depth\":3}");
+  server.addPage("/invalid", "{\"a\":[1,2,],\"b\":\"x\"}");
+
+  std::string event;
+  std::vector<std::string> events;
+  evcollect::ScrapeSource stub(evcollect::ScrapeSource::Format::STUB_STATUS);
+  stub.addTarget(server.getURL("/stub"));
+  ASSERT_TRUE(stub.open().isSuccess());
+  ASSERT_TRUE(stub.getNextEvent(MonotonicClock::now(), &event).isSuccess());
+  pollScrapeSource(&stub, &events, 1);
+  ASSERT_EQ(events.size(), 1);
+  EXPECT_EQ(
+      events[0],
+      "{\"target\":\"" + server.getURL("/stub") + "\","
+      "\"active_connections\":291,\"accepts\":16630948,"
+      "\"handled\":16630948,\"requests\":31070465,"
+      "\"reading\":6,\"writing\":179,\"waiting\":106}");
+
+  events.clear();
+  evcollect::ScrapeSource json(evcollect::ScrapeSource::Format::JSON);
+  json.addTarget(server.getURL("/json"));
+  json.addTarget(server.getURL("/empty"));
+  json.addTarget(server.getURL("/array"));
+  json.addTarget(server.getURL("/truncated"));
+  json.addTarget(server.getURL("/invalid"));
+  ASSERT_TRUE(json.open().isSuccess());
+  ASSERT_TRUE(json.getNextEvent(MonotonicClock::now(), &event).isSuccess());
+  pollScrapeSource(&json, &events, 5);
+  std::sort(events.begin(), events.end());
+  ASSERT_EQ(events.size(), 2);
+  EXPECT_EQ(
+      events[0],
+      "{\"target\":\"" + server.getURL("/empty") + "\"}");
+  EXPECT_EQ(
+      events[1],
+      "{\"target\":\"" + server.getURL("/json") + "\","
+      "\"queue\":{\"depth\":3}}");
+  EXPECT_EQ(json.getNumErrors(), 3);
+}
@@ -0,0 +1,349 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <algorithm>
+#include <arpa/inet.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+#include <evcollect/host_metadata.h>
+
+namespace evcollect {
+
+namespace {
+
+void appendJSONString(std::string* out, const std::string& str) {
+  static const char kHexDigits[] = "0123456789abcdef";
+
+  out->push_back('"');
+  for (unsigned char c : str) {
+    if (c == '"' || c == '\\') {
+      out->push_back('\\');
+      out->push_back(c);
+    } else if (c < 0x20) {
+      out->append("\\u00");
+      out->push_back(kHexDigits[c >> 4]);
+      out->push_back(kHexDigits[c & 0xf]);
+    } else {
+      out->push_back(c);
+    }
+  }
+
+  out->push_back('"');
+}
+
+void appendKey(std::string* out, const char* key) {
+  if (!out->empty()) {
+    out->push_back(',');
+  }
+
+  out->push_back('"');
+  out->append(key);
+  out->append("\":");
+}
+
+void appendField(std::string* out, const char* key, const std::string& value) {
+  if (!value.empty()) {
+    appendKey(out, key);
+    appendJSONString(out, value);
+  }
+}
+
+std::string readFirstLine(const std::string& path) {
+  auto fp = fopen(path.c_str(), "re");
+  if (!fp) {
+    return std::string();
+  }
+
+  char buf[256];
+  std::string line;
+  if (fgets(buf, sizeof(buf), fp)) {
+    line = buf;
+  }
+
+  fclose(fp);
+
+  while (!line.empty() && (line.back() == '\n' || line.back() == ' ')) {
+    line.pop_back();
+  }
+
+  return line;
+}
+
+std::string getHostname() {
+  char buf[256];
+  if (gethostname(buf, sizeof(buf)) != 0) {
+    return std::string();
+  }
+
+  buf[sizeof(buf) - 1] = 0;
+  return buf;
+}
+
+/* getaddrinfo is reentrant, unlike gethostbyname, but may still block */
+std::string resolveFQDN(const std::string& hostname) {
+  if (hostname.empty()) {
+    return std::string();
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_flags = AI_CANONNAME;
+
+  struct addrinfo* addrs = nullptr;
+  if (getaddrinfo(hostname.c_str(), nullptr, &hints, &addrs) != 0) {
+    return std::string();
+  }
+
+  std::string fqdn;
+  if (addrs && addrs->ai_canonname) {
+    fqdn = addrs->ai_canonname;
+  }
+
+  freeaddrinfo(addrs);
+  return fqdn;
+}
+
+/* all addresses except loopback and IPv6 link-local ones */
+std::vector<std::string> getIPAddresses() {
+  std::vector<std::string> addrs;
+
+  struct ifaddrs* ifaddrs;
+  if (getifaddrs(&ifaddrs) != 0) {
+    return addrs;
+  }
+
+  for (auto ifa = ifaddrs; ifa; ifa = ifa->ifa_next) {
+    if (!ifa->ifa_addr || (ifa->ifa_flags & IFF_LOOPBACK)) {
+      continue;
+    }
+
+    char buf[INET6_ADDRSTRLEN];
+    const char* addr = nullptr;
+    switch (ifa->ifa_addr->sa_family) {
+      case AF_INET: {
+        auto sin = (const struct sockaddr_in*) ifa->ifa_addr;
+        addr = inet_ntop(AF_INET, &sin->sin_addr, buf, sizeof(buf));
+        break;
+      }
+      case AF_INET6: {
+        auto sin6 = (const struct sockaddr_in6*) ifa->ifa_addr;
+        if (!IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr)) {
+          addr = inet_ntop(AF_INET6, &sin6->sin6_addr, buf, sizeof(buf));
+        }
+        break;
+      }
+    }
+
+    if (addr) {
+      addrs.emplace_back(addr);
+    }
+  }
+
+  freeifaddrs(ifaddrs);
+
+  std::sort(addrs.begin(), addrs.end());
+  addrs.erase(std::unique(addrs.begin(), addrs.end()), addrs.end());
+  return addrs;
+}
+
+std::string getKernelVersion() {
+  struct utsname u;
+  if (uname(&u) != 0) {
+    return std::string();
+  }
+
+  return u.release;
+}
+
+/**
+ * The DMI ids identify the big clouds without asking their metadata
+ * services; only EC2 exposes the instance id there
+ */
+void getCloudInstance(
+    const std::string& dmi_dir,
+    std::string* provider,
+    std::string* instance_id) {
+  auto sys_vendor = readFirstLine(dmi_dir + "/sys_vendor");
+  auto product_name = readFirstLine(dmi_dir + "/product_name");
+
+  if (sys_vendor == "Amazon EC2" ||
+      readFirstLine(dmi_dir + "/bios_version").find("amazon") !=
+          std::string::npos) {
+    *provider = "aws";
+    auto asset_tag = readFirstLine(dmi_dir + "/board_asset_tag");
+    if (asset_tag.compare(0, 2, "i-") == 0) {
+      *instance_id = asset_tag;
+    }
+  } else if (product_name == "Google Compute Engine") {
+    *provider = "gcp";
+  } else if (sys_vendor == "Microsoft Corporation" &&
+      readFirstLine(dmi_dir + "/chassis_asset_tag") ==
+          "7783-7084-3265-9085-8269-3286-77") {
+    *provider = "azure";
+  }
+}
+
+} // namespace
+
+HostMetadata::HostMetadata() :
+    dmi_dir_("/sys/class/dmi/id"),
+    refresh_interval_secs_(kDefaultRefreshIntervalSeconds),
+    running_(false) {}
+
+HostMetadata::~HostMetadata() {
+  stop();
+}
+
+void HostMetadata::setDMIDir(const std::string& dir) {
+  dmi_dir_ = dir;
+}
+
+void HostMetadata::start(uint64_t refresh_interval_secs) {
+  {
+    std::unique_lock<std::mutex> lk(mutex_);
+    if (running_) {
+      return;
+    }
+
+    running_ = true;
+    refresh_interval_secs_ = refresh_interval_secs;
+  }
+
+  refresh(false);
+  thread_ = std::thread(&HostMetadata::run, this);
+}
+
+void HostMetadata::stop() {
+  {
+    std::unique_lock<std::mutex> lk(mutex_);
+    running_ = false;
+  }
+
+  cv_.notify_all();
+
+  /* may wait for a DNS lookup in progress to time out */
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void HostMetadata::run() {
+  refresh(true);
+
+  std::unique_lock<std::mutex> lk(mutex_);
+  while (running_) {
+    cv_.wait_for(
+        lk,
+        std::chrono::seconds(refresh_interval_secs_),
+        [this] { return !running_; });
+
+    if (!running_) {
+      break;
+    }
+
+    lk.unlock();
+    refresh(true);
+    lk.lock();
+  }
+}
+
+void HostMetadata::refresh(bool resolve_fqdn) {
+  auto hostname = getHostname();
+  auto fqdn = resolve_fqdn ? resolveFQDN(hostname) : std::string();
+  auto ip_addrs = getIPAddresses();
+  auto kernel_version = getKernelVersion();
+
+  std::string cloud_provider;
+  std::string cloud_instance_id;
+  getCloudInstance(dmi_dir_, &cloud_provider, &cloud_instance_id);
+
+  /* keep the last known FQDN if the lookup failed */
+  {
+    std::unique_lock<std::mutex> lk(mutex_);
+    if (fqdn.empty()) {
+      fqdn = fqdn_;
+    } else {
+      fqdn_ = fqdn;
+    }
+  }
+
+  std::shared_ptr<Snapshot> snapshot(new Snapshot());
+  snapshot->hostname = hostname;
+  snapshot->hostname_fqdn = fqdn;
+  auto fields = &snapshot->fields;
+  appendField(fields, "hostname", hostname);
+  appendField(fields, "hostname_fqdn", fqdn);
+  if (!ip_addrs.empty()) {
+    appendKey(fields, "ip_addresses");
+    fields->push_back('[');
+    for (size_t i = 0; i < ip_addrs.size(); ++i) {
+      if (i > 0) {
+        fields->push_back(',');
+      }
+
+      appendJSONString(fields, ip_addrs[i]);
+    }
+
+    fields->push_back(']');
+  }
+
+  appendField(fields, "kernel_version", kernel_version);
+  appendField(fields, "cloud_provider", cloud_provider);
+  appendField(fields, "cloud_instance_id", cloud_instance_id);
+
+  snapshot->fragment = "\"host\":{" + snapshot->fields + "}";
+
+  std::unique_lock<std::mutex> lk(mutex_);
+  snapshot_ = snapshot;
+}
+
+std::shared_ptr<const HostMetadata::Snapshot>
+    HostMetadata::getSnapshot() const {
+  std::unique_lock<std::mutex> lk(mutex_);
+  return snapshot_;
+}
+
+void HostMetadata::addToEvent(
+    const std::string& fragment,
+    std::string* event_json) {
+  auto end = event_json->find_last_of('}');
+  if (end == std::string::npos || end == 0) {
+    return;
+  }
+
+  auto last = event_json->find_last_not_of(" \t\r\n", end - 1);
+  event_json->insert(end, fragment);
+  if (last != std::string::npos && (*event_json)[last] != '{') {
+    event_json->insert(end, 1, ',');
+  }
+}
+
+} // namespace evcollect
+
@@ -0,0 +1,106 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace evcollect {
+
+/**
+ * Caches facts about the host that events can be enriched with: hostname,
+ * FQDN, IP addresses, kernel version and, on the big clouds, the provider and
+ * instance id (read from DMI, so no metadata service is queried).
+ *
+ * Everything is resolved once on start() and then refreshed by a background
+ * thread on a slow timer, so a slow DNS server never stalls the service loop.
+ * The fields are serialized into a JSON fragment on every refresh; readers
+ * only copy a shared_ptr to the current snapshot
+ */
+class HostMetadata {
+public:
+
+  static const uint64_t kDefaultRefreshIntervalSeconds = 600;
+
+  struct Snapshot {
+    std::string hostname;
+    /* empty until the first lookup succeeded */
+    std::string hostname_fqdn;
+    /* "hostname":"...","hostname_fqdn":"...",... */
+    std::string fields;
+    /* "host":{<fields>} */
+    std::string fragment;
+  };
+
+  HostMetadata();
+  ~HostMetadata();
+
+  HostMetadata(const HostMetadata& other) = delete;
+  HostMetadata& operator=(const HostMetadata& other) = delete;
+
+  /**
+   * Directory to read the DMI ids from, defaults to /sys/class/dmi/id
+   */
+  void setDMIDir(const std::string& dir);
+
+  /**
+   * Resolve everything except the FQDN synchronously, then start the refresh
+   * thread which resolves the FQDN right away and everything every
+   * refresh_interval_secs. Calling start() again is a no-op
+   */
+  void start(uint64_t refresh_interval_secs = kDefaultRefreshIntervalSeconds);
+  void stop();
+
+  /**
+   * Resolve all fields (blocking) and publish a new snapshot
+   */
+  void refresh(bool resolve_fqdn = true);
+
+  std::shared_ptr<const Snapshot> getSnapshot() const;
+
+  /**
+   * Adds the pre-serialized fragment as the last field of the JSON object in
+   * event_json
+   */
+  static void addToEvent(const std::string& fragment, std::string* event_json);
+
+protected:
+
+  void run();
+
+  std::string dmi_dir_;
+  std::string fqdn_;
+  uint64_t refresh_interval_secs_;
+  std::shared_ptr<const Snapshot> snapshot_;
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  std::thread thread_;
+  bool running_;
+};
+
+} // namespace evcollect
+
@@ -0,0 +1,1194 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <cmath>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <evcollect/http_scrape.h>
+#include <evcollect/util/logging.h>
+#include <evcollect/util/time.h>
+
+namespace evcollect {
+
+void ScrapeSourcePlugin::registerPlugin(PluginMap* plugin_map) {
+  plugin_map->registerSourcePlugin(
+      "scrape",
+      std::unique_ptr<SourcePlugin>(new ScrapeSourcePlugin()));
+}
+
+namespace {
+
+bool isDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+bool isNameChar(char c) {
+  return
+      (c >= 'a' && c <= 'z') ||
+      (c >= 'A' && c <= 'Z') ||
+      isDigit(c) ||
+      c == '_' ||
+      c == ':';
+}
+
+const char* skipBlanks(const char* cur, const char* end) {
+  while (cur < end && (*cur == ' ' || *cur == '\t')) {
+    ++cur;
+  }
+
+  return cur;
+}
+
+const char* skipToken(const char* cur, const char* end) {
+  while (cur < end && *cur != ' ' && *cur != '\t') {
+    ++cur;
+  }
+
+  return cur;
+}
+
+void appendJSONChar(std::string* out, unsigned char c) {
+  static const char kHexDigits[] = "0123456789abcdef";
+
+  if (c == '"' || c == '\\') {
+    out->push_back('\\');
+    out->push_back(c);
+  } else if (c < 0x20) {
+    out->append("\\u00");
+    out->push_back(kHexDigits[c >> 4]);
+    out->push_back(kHexDigits[c & 0xf]);
+  } else {
+    out->push_back(c);
+  }
+}
+
+void appendJSONString(std::string* out, const char* str, size_t len) {
+  out->push_back('"');
+  for (size_t i = 0; i < len; ++i) {
+    appendJSONChar(out, str[i]);
+  }
+
+  out->push_back('"');
+}
+
+/* -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)? */
+bool isJSONNumber(const char* cur, const char* end) {
+  if (cur < end && *cur == '-') {
+    ++cur;
+  }
+
+  if (cur == end || !isDigit(*cur)) {
+    return false;
+  }
+
+  if (*cur == '0') {
+    ++cur;
+  } else {
+    while (cur < end && isDigit(*cur)) {
+      ++cur;
+    }
+  }
+
+  if (cur < end && *cur == '.') {
+    ++cur;
+    if (cur == end || !isDigit(*cur)) {
+      return false;
+    }
+
+    while (cur < end && isDigit(*cur)) {
+      ++cur;
+    }
+  }
+
+  if (cur < end && (*cur == 'e' || *cur == 'E')) {
+    ++cur;
+    if (cur < end && (*cur == '+' || *cur == '-')) {
+      ++cur;
+    }
+
+    if (cur == end || !isDigit(*cur)) {
+      return false;
+    }
+
+    while (cur < end && isDigit(*cur)) {
+      ++cur;
+    }
+  }
+
+  return cur == end;
+}
+
+const size_t kMaxJSONDepth = 64;
+
+const char* skipJSONWhitespace(const char* cur, const char* end) {
+  while (cur < end &&
+         (*cur == ' ' || *cur == '\t' || *cur == '\r' || *cur == '\n')) {
+    ++cur;
+  }
+
+  return cur;
+}
+
+bool isHexDigit(char c) {
+  return isDigit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+/* returns the position after the closing quote or nullptr if invalid */
+const char* skipJSONString(const char* cur, const char* end) {
+  for (++cur; cur < end; ++cur) {
+    unsigned char c = *cur;
+    if (c == '"') {
+      return cur + 1;
+    }
+
+    if (c < 0x20) {
+      return nullptr;
+    }
+
+    if (c != '\\') {
+      continue;
+    }
+
+    if (++cur == end) {
+      return nullptr;
+    }
+
+    switch (*cur) {
+      case '"':
+      case '\\':
+      case '/':
+      case 'b':
+      case 'f':
+      case 'n':
+      case 'r':
+      case 't':
+        break;
+      case 'u':
+        if (end - cur < 5 ||
+            !isHexDigit(cur[1]) ||
+            !isHexDigit(cur[2]) ||
+            !isHexDigit(cur[3]) ||
+            !isHexDigit(cur[4])) {
+          return nullptr;
+        }
+        cur += 4;
+        break;
+      default:
+        return nullptr;
+    }
+  }
+
+  return nullptr;
+}
+
+const char* skipJSONLiteral(const char* cur, const char* end, const char* lit) {
+  auto len = strlen(lit);
+  if (size_t(end - cur) < len || memcmp(cur, lit, len) != 0) {
+    return nullptr;
+  }
+
+  return cur + len;
+}
+
+/**
+ * Returns the position after the JSON value at cur (after skipping leading
+ * whitespace) or nullptr if it is not a valid value
+ */
+const char* skipJSONValue(const char* cur, const char* end, size_t depth) {
+  cur = skipJSONWhitespace(cur, end);
+  if (cur == end || depth > kMaxJSONDepth) {
+    return nullptr;
+  }
+
+  switch (*cur) {
+
+    case '"':
+      return skipJSONString(cur, end);
+
+    case '{':
+    case '[': {
+      bool is_object = *cur == '{';
+      char close = is_object ? '}' : ']';
+      cur = skipJSONWhitespace(cur + 1, end);
+      if (cur < end && *cur == close) {
+        return cur + 1;
+      }
+
+      while (true) {
+        if (is_object) {
+          if (cur == end || *cur != '"') {
+            return nullptr;
+          }
+
+          cur = skipJSONString(cur, end);
+          if (!cur) {
+            return nullptr;
+          }
+
+          cur = skipJSONWhitespace(cur, end);
+          if (cur == end || *cur != ':') {
+            return nullptr;
+          }
+
+          ++cur;
+        }
+
+        cur = skipJSONValue(cur, end, depth + 1);
+        if (!cur) {
+          return nullptr;
+        }
+
+        cur = skipJSONWhitespace(cur, end);
+        if (cur == end) {
+          return nullptr;
+        }
+
+        if (*cur == close) {
+          return cur + 1;
+        }
+
+        if (*cur != ',') {
+          return nullptr;
+        }
+
+        cur = skipJSONWhitespace(cur + 1, end);
+      }
+    }
+
+    case 't':
+      return skipJSONLiteral(cur, end, "true");
+
+    case 'f':
+      return skipJSONLiteral(cur, end, "false");
+
+    case 'n':
+      return skipJSONLiteral(cur, end, "null");
+
+    default: {
+      auto begin = cur;
+      while (cur < end &&
+             (isDigit(*cur) ||
+              *cur == '-' ||
+              *cur == '+' ||
+              *cur == '.' ||
+              *cur == 'e' ||
+              *cur == 'E')) {
+        ++cur;
+      }
+
+      return isJSONNumber(begin, cur) ? cur : nullptr;
+    }
+
+  }
+}
+
+bool scanUIntAfter(
+    const std::string& str,
+    const char* key,
+    size_t* pos,
+    uint64_t* value) {
+  auto key_pos = str.find(key, *pos);
+  if (key_pos == std::string::npos) {
+    return false;
+  }
+
+  auto begin = str.c_str() + key_pos + strlen(key);
+  char* end;
+  *value = strtoull(begin, &end, 10);
+  if (end == begin) {
+    return false;
+  }
+
+  *pos = end - str.c_str();
+  return true;
+}
+
+} // namespace
+
+PrometheusParser::PrometheusParser() :
+    filter_(nullptr),
+    skip_line_(false),
+    num_errors_(0) {}
+
+void PrometheusParser::reset(const std::string& target) {
+  target_prefix_ = "{\"target\":";
+  appendJSONString(&target_prefix_, target.data(), target.size());
+  family_.clear();
+  family_type_.clear();
+  line_.clear();
+  skip_line_ = false;
+  events_.clear();
+  event_ends_.clear();
+  num_errors_ = 0;
+}
+
+void PrometheusParser::setFilter(const std::vector<std::string>* prefixes) {
+  filter_ = prefixes;
+}
+
+void PrometheusParser::parse(const char* data, size_t size) {
+  auto end = data + size;
+
+  /* finish the line that was cut off at the end of the last chunk */
+  if (!line_.empty() || skip_line_) {
+    auto nl = static_cast<const char*>(memchr(data, '\n', size));
+    if (!nl) {
+      if (!skip_line_) {
+        line_.append(data, size);
+      }
+
+      if (line_.size() > kMaxLineSize) {
+        ++num_errors_;
+        line_.clear();
+        skip_line_ = true;
+      }
+
+      return;
+    }
+
+    if (!skip_line_) {
+      line_.append(data, nl - data);
+      parseLine(line_.data(), line_.data() + line_.size());
+    }
+
+    line_.clear();
+    skip_line_ = false;
+    data = nl + 1;
+  }
+
+  while (data < end) {
+    auto nl = static_cast<const char*>(memchr(data, '\n', end - data));
+    if (!nl) {
+      line_.assign(data, end - data);
+      break;
+    }
+
+    parseLine(data, nl);
+    data = nl + 1;
+  }
+}
+
+void PrometheusParser::finish() {
+  if (!line_.empty() && !skip_line_) {
+    parseLine(line_.data(), line_.data() + line_.size());
+  }
+
+  line_.clear();
+  skip_line_ = false;
+}
+
+const std::string& PrometheusParser::getEvents() const {
+  return events_;
+}
+
+const std::vector<size_t>& PrometheusParser::getEventEnds() const {
+  return event_ends_;
+}
+
+size_t PrometheusParser::getNumErrors() const {
+  return num_errors_;
+}
+
+void PrometheusParser::parseLine(const char* begin, const char* end) {
+  if (end > begin && end[-1] == '\r') {
+    --end;
+  }
+
+  begin = skipBlanks(begin, end);
+  if (begin == end) {
+    return;
+  }
+
+  if (*begin == '#') {
+    parseComment(begin + 1, end);
+    return;
+  }
+
+  /* the sample is written out while it is parsed, drop what was written if
+   * it turns out to be invalid or is skipped */
+  auto events_size = events_.size();
+  auto num_events = event_ends_.size();
+  if (!parseSample(begin, end)) {
+    ++num_errors_;
+  }
+
+  if (event_ends_.size() == num_events) {
+    events_.resize(events_size);
+  }
+}
+
+/* # TYPE <family> <type>; HELP and other comments are ignored */
+void PrometheusParser::parseComment(const char* begin, const char* end) {
+  auto cur = skipBlanks(begin, end);
+  if (end - cur < 5 || memcmp(cur, "TYPE", 4) != 0 || !(cur[4] == ' ')) {
+    return;
+  }
+
+  auto name = skipBlanks(cur + 4, end);
+  auto name_end = skipToken(name, end);
+  auto type = skipBlanks(name_end, end);
+  auto type_end = skipToken(type, end);
+  family_.assign(name, name_end - name);
+  family_type_.assign(type, type_end - type);
+}
+
+/**
+ * name [{label="value",...}] value [timestamp]
+ */
+bool PrometheusParser::parseSample(const char* begin, const char* end) {
+  auto cur = begin;
+  while (cur < end && isNameChar(*cur)) {
+    ++cur;
+  }
+
+  if (cur == begin || isDigit(*begin)) {
+    return false;
+  }
+
+  auto name_len = size_t(cur - begin);
+  if (filter_ && !filter_->empty() && !matchesFilter(begin, name_len)) {
+    return true;
+  }
+
+  events_.append(target_prefix_);
+  events_.append(",\"metric\":");
+  appendJSONString(&events_, begin, name_len);
+  events_.append(",\"type\":");
+  auto type = getType(begin, name_len);
+  appendJSONString(&events_, type, strlen(type));
+
+  if (cur < end && *cur == '{') {
+    bool first = true;
+    for (++cur; ; ) {
+      cur = skipBlanks(cur, end);
+      if (cur < end && *cur == '}') {
+        ++cur;
+        break;
+      }
+
+      auto label = cur;
+      while (cur < end && isNameChar(*cur)) {
+        ++cur;
+      }
+
+      auto label_end = cur;
+      cur = skipBlanks(cur, end);
+      if (label == label_end || cur == end || *cur != '=') {
+        return false;
+      }
+
+      cur = skipBlanks(cur + 1, end);
+      if (cur == end || *cur != '"') {
+        return false;
+      }
+
+      events_.append(first ? ",\"labels\":{" : ",");
+      first = false;
+      appendJSONString(&events_, label, label_end - label);
+      events_.append(":\"");
+
+      /* label values escape \, " and newlines with a backslash */
+      for (++cur; ; ) {
+        if (cur == end) {
+          return false;
+        }
+
+        auto c = *cur++;
+        if (c == '"') {
+          break;
+        }
+
+        if (c == '\\' && cur < end) {
+          c = *cur++;
+          if (c == 'n') {
+            c = '\n';
+          } else if (c != '\\' && c != '"') {
+            appendJSONChar(&events_, '\\');
+          }
+        }
+
+        appendJSONChar(&events_, c);
+      }
+
+      events_.push_back('"');
+
+      cur = skipBlanks(cur, end);
+      if (cur < end && *cur == ',') {
+        ++cur;
+      }
+    }
+
+    if (!first) {
+      events_.push_back('}');
+    }
+  }
+
+  auto value = skipBlanks(cur, end);
+  auto value_end = skipToken(value, end);
+  if (value == value_end) {
+    return false;
+  }
+
+  events_.append(",\"value\":");
+  if (isJSONNumber(value, value_end)) {
+    events_.append(value, value_end - value);
+  } else {
+    /* NaN, +Inf, 1e3, .5, 0x10 ... */
+    char buf[64];
+    if (size_t(value_end - value) >= sizeof(buf)) {
+      return false;
+    }
+
+    memcpy(buf, value, value_end - value);
+    buf[value_end - value] = 0;
+
+    char* buf_end;
+    auto v = strtod(buf, &buf_end);
+    if (buf_end == buf || *buf_end) {
+      return false;
+    }
+
+    if (!std::isfinite(v)) {
+      return true;
+    }
+
+    snprintf(buf, sizeof(buf), "%.17g", v);
+    events_.append(buf);
+  }
+
+  auto timestamp = skipBlanks(value_end, end);
+  if (timestamp < end) {
+    auto timestamp_end = skipToken(timestamp, end);
+    auto digits = timestamp < timestamp_end && *timestamp == '-' ?
+        timestamp + 1 :
+        timestamp;
+
+    if (digits == timestamp_end) {
+      return false;
+    }
+
+    for (auto c = digits; c < timestamp_end; ++c) {
+      if (!isDigit(*c)) {
+        return false;
+      }
+    }
+
+    events_.append(",\"timestamp_ms\":");
+    events_.append(timestamp, timestamp_end - timestamp);
+  }
+
+  events_.push_back('}');
+  event_ends_.emplace_back(events_.size());
+  return true;
+}
+
+bool PrometheusParser::matchesFilter(const char* name, size_t name_len) const {
+  for (const auto& prefix : *filter_) {
+    if (name_len >= prefix.size() &&
+        memcmp(name, prefix.data(), prefix.size()) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * The type of the current family applies to its samples, including the
+ * suffixed ones of histograms and summaries
+ */
+const char* PrometheusParser::getType(
+    const char* name,
+    size_t name_len) const {
+  static const char* kSuffixes[] = {
+    "_bucket", "_sum", "_count", "_total", "_created"
+  };
+
+  if (family_.empty() ||
+      name_len < family_.size() ||
+      memcmp(name, family_.data(), family_.size()) != 0) {
+    return "untyped";
+  }
+
+  auto suffix = name + family_.size();
+  auto suffix_len = name_len - family_.size();
+  if (suffix_len == 0) {
+    return family_type_.c_str();
+  }
+
+  for (auto s : kSuffixes) {
+    if (strlen(s) == suffix_len && memcmp(suffix, s, suffix_len) == 0) {
+      return family_type_.c_str();
+    }
+  }
+
+  return "untyped";
+}
+
+ReturnCode ScrapeSource::parseFormat(const std::string& str, Format* format) {
+  if (str == "prometheus") {
+    *format = Format::PROMETHEUS;
+    return ReturnCode::success();
+  }
+
+  if (str == "stub_status") {
+    *format = Format::STUB_STATUS;
+    return ReturnCode::success();
+  }
+
+  if (str == "json") {
+    *format = Format::JSON;
+    return ReturnCode::success();
+  }
+
+  return ReturnCode::error(
+      "EINVAL",
+      "invalid format: '%s' -- must be 'prometheus', 'stub_status' or 'json'",
+      str.c_str());
+}
+
+ScrapeSource::ScrapeSource(Format format) :
+    format_(format),
+    timeout_(kDefaultTimeoutMicros),
+    multi_(nullptr),
+    epoll_fd_(-1),
+    deadline_(0),
+    num_busy_(0),
+    draining_tick_(false),
+    pending_pos_(0),
+    num_scrapes_(0),
+    num_errors_(0),
+    num_skipped_(0) {}
+
+ScrapeSource::~ScrapeSource() {
+  for (auto& target : targets_) {
+    if (!target->curl) {
+      continue;
+    }
+
+    if (target->busy) {
+      curl_multi_remove_handle(multi_, target->curl);
+    }
+
+    curl_easy_cleanup(target->curl);
+  }
+
+  if (multi_) {
+    curl_multi_cleanup(multi_);
+  }
+
+  if (epoll_fd_ >= 0) {
+    close(epoll_fd_);
+  }
+}
+
+void ScrapeSource::addTarget(const std::string& url) {
+  std::unique_ptr<Target> target(new Target());
+  target->source = this;
+  target->url = url;
+  target->target_prefix = "{\"target\":";
+  appendJSONString(&target->target_prefix, url.data(), url.size());
+  target->curl = nullptr;
+  target->busy = false;
+  target->failing = false;
+  target->skipping = false;
+  target->body_size = 0;
+  target->parser.setFilter(&filter_);
+  target->error[0] = 0;
+  targets_.emplace_back(std::move(target));
+}
+
+void ScrapeSource::addMetricFilter(const std::string& prefix) {
+  filter_.emplace_back(prefix);
+}
+
+void ScrapeSource::setTimeout(uint64_t timeout_micros) {
+  timeout_ = timeout_micros;
+}
+
+ReturnCode ScrapeSource::open() {
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd_ < 0) {
+    return ReturnCode::error(
+        "EIO",
+        "epoll_create1() failed: %s",
+        strerror(errno));
+  }
+
+  multi_ = curl_multi_init();
+  if (!multi_) {
+    return ReturnCode::error("EIO", "curl_multi_init() failed");
+  }
+
+  curl_multi_setopt(multi_, CURLMOPT_SOCKETFUNCTION, &socketCallback);
+  curl_multi_setopt(multi_, CURLMOPT_SOCKETDATA, this);
+  curl_multi_setopt(multi_, CURLMOPT_TIMERFUNCTION, &timerCallback);
+  curl_multi_setopt(multi_, CURLMOPT_TIMERDATA, this);
+
+  /* keep one idle connection per target around for the next tick */
+  curl_multi_setopt(multi_, CURLMOPT_MAXCONNECTS, long(targets_.size()));
+
+  for (auto& target : targets_) {
+    auto curl = curl_easy_init();
+    if (!curl) {
+      return ReturnCode::error("EIO", "curl_easy_init() failed");
+    }
+
+    target->curl = curl;
+    curl_easy_setopt(curl, CURLOPT_URL, target->url.c_str());
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, target.get());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &writeCallback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, target.get());
+    curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, target->error);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, long(timeout_ / 1000));
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "evcollect");
+  }
+
+  return ReturnCode::success();
+}
+
+ReturnCode ScrapeSource::getNextEvent(uint64_t now, std::string* event_json) {
+  /* the service keeps calling while there are pending events, only the first
+   * call of a tick starts the scrapes */
+  if (!draining_tick_) {
+    for (auto& target : targets_) {
+      if (!target->busy) {
+        target->skipping = false;
+        startScrape(target.get());
+        continue;
+      }
+
+      ++num_skipped_;
+      if (!target->skipping) {
+        logWarning(
+            "scrape: $0 is still busy with the last scrape, skipping it",
+            target->url);
+        target->skipping = true;
+      }
+    }
+  }
+
+  nextEvent(event_json);
+  draining_tick_ = hasPendingEvent();
+  return ReturnCode::success();
+}
+
+ReturnCode ScrapeSource::pollEvent(uint64_t now, std::string* event_json) {
+  draining_tick_ = false;
+
+  if (!hasPendingEvent()) {
+    struct epoll_event evs[64];
+    int n = epoll_wait(epoll_fd_, evs, 64, 0);
+    int running;
+    for (int i = 0; i < n; ++i) {
+      int mask = 0;
+      if (evs[i].events & EPOLLIN) {
+        mask |= CURL_CSELECT_IN;
+      }
+      if (evs[i].events & EPOLLOUT) {
+        mask |= CURL_CSELECT_OUT;
+      }
+      if (evs[i].events & (EPOLLERR | EPOLLHUP)) {
+        mask |= CURL_CSELECT_ERR;
+      }
+
+      curl_multi_socket_action(multi_, evs[i].data.fd, mask, &running);
+    }
+
+    if (deadline_ > 0 && deadline_ <= now) {
+      deadline_ = 0;
+      curl_multi_socket_action(multi_, CURL_SOCKET_TIMEOUT, 0, &running);
+    }
+
+    completeScrapes();
+  }
+
+  nextEvent(event_json);
+  return ReturnCode::success();
+}
+
+bool ScrapeSource::hasPendingEvent() const {
+  return pending_pos_ < event_ends_.size();
+}
+
+bool ScrapeSource::getPollFD(int* fd, uint64_t* deadline) const {
+  if (num_busy_ == 0) {
+    return false;
+  }
+
+  *fd = epoll_fd_;
+  *deadline = deadline_;
+  return true;
+}
+
+uint64_t ScrapeSource::getNumScrapes() const {
+  return num_scrapes_;
+}
+
+uint64_t ScrapeSource::getNumErrors() const {
+  return num_errors_;
+}
+
+uint64_t ScrapeSource::getNumSkipped() const {
+  return num_skipped_;
+}
+
+size_t ScrapeSource::writeCallback(
+    char* data,
+    size_t size,
+    size_t nmemb,
+    void* userdata) {
+  auto target = static_cast<Target*>(userdata);
+  auto len = size * nmemb;
+
+  target->body_size += len;
+  if (target->body_size > kMaxBodySize) {
+    return 0;
+  }
+
+  if (target->source->format_ == Format::PROMETHEUS) {
+    target->parser.parse(data, len);
+  } else {
+    target->body.append(data, len);
+  }
+
+  return len;
+}
+
+int ScrapeSource::socketCallback(
+    CURL* curl,
+    curl_socket_t fd,
+    int what,
+    void* userdata,
+    void* socketp) {
+  auto source = static_cast<ScrapeSource*>(userdata);
+  if (what == CURL_POLL_REMOVE) {
+    epoll_ctl(source->epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    return 0;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.data.fd = fd;
+  if (what & CURL_POLL_IN) {
+    ev.events |= EPOLLIN;
+  }
+  if (what & CURL_POLL_OUT) {
+    ev.events |= EPOLLOUT;
+  }
+
+  int op = socketp ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(source->epoll_fd_, op, fd, &ev) != 0) {
+    op = op == EPOLL_CTL_ADD ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    epoll_ctl(source->epoll_fd_, op, fd, &ev);
+  }
+
+  if (!socketp) {
+    curl_multi_assign(source->multi_, fd, source);
+  }
+
+  return 0;
+}
+
+int ScrapeSource::timerCallback(
+    CURLM* multi,
+    long timeout_ms,
+    void* userdata) {
+  auto source = static_cast<ScrapeSource*>(userdata);
+  if (timeout_ms < 0) {
+    source->deadline_ = 0;
+  } else {
+    source->deadline_ = MonotonicClock::now() + timeout_ms * kMicrosPerMilli;
+  }
+
+  return 0;
+}
+
+void ScrapeSource::startScrape(Target* target) {
+  target->body.clear();
+  target->body_size = 0;
+  target->error[0] = 0;
+  if (format_ == Format::PROMETHEUS) {
+    target->parser.reset(target->url);
+  }
+
+  auto rc = curl_multi_add_handle(multi_, target->curl);
+  if (rc != CURLM_OK) {
+    logWarning(
+        "scrape: curl_multi_add_handle() failed: $0",
+        curl_multi_strerror(rc));
+    return;
+  }
+
+  target->busy = true;
+  ++num_busy_;
+}
+
+void ScrapeSource::completeScrapes() {
+  CURLMsg* msg;
+  int msgs_left;
+  while ((msg = curl_multi_info_read(multi_, &msgs_left))) {
+    if (msg->msg != CURLMSG_DONE) {
+      continue;
+    }
+
+    auto curl = msg->easy_handle;
+    auto result = msg->data.result;
+
+    char* target;
+    curl_easy_getinfo(curl, CURLINFO_PRIVATE, &target);
+    curl_multi_remove_handle(multi_, curl);
+    completeScrape(reinterpret_cast<Target*>(target), result);
+  }
+}
+
+void ScrapeSource::completeScrape(Target* target, CURLcode result) {
+  target->busy = false;
+  --num_busy_;
+  ++num_scrapes_;
+
+  bool success = result == CURLE_OK;
+  if (success) {
+    switch (format_) {
+      case Format::PROMETHEUS:
+        target->parser.finish();
+        addEvents(
+            target->parser.getEvents(),
+            target->parser.getEventEnds());
+        break;
+      case Format::STUB_STATUS:
+        success = formatStubStatus(*target);
+        break;
+      case Format::JSON:
+        success = formatJSON(*target);
+        break;
+    }
+  }
+
+  if (!success) {
+    ++num_errors_;
+    if (!target->failing) {
+      std::string error = "invalid response";
+      if (result != CURLE_OK) {
+        error = target->error[0] ? target->error : curl_easy_strerror(result);
+      }
+
+      logWarning("scrape: $0 failed: $1", target->url, error);
+      target->failing = true;
+    }
+
+    return;
+  }
+
+  if (target->failing) {
+    logInfo("scrape: $0 is back", target->url);
+    target->failing = false;
+  }
+}
+
+/**
+ * Active connections: 291
+ * server accepts handled requests
+ *  16630948 16630948 31070465
+ * Reading: 6 Writing: 179 Waiting: 106
+ */
+bool ScrapeSource::formatStubStatus(const Target& target) {
+  uint64_t active;
+  uint64_t accepts;
+  uint64_t handled;
+  uint64_t requests;
+  uint64_t reading;
+  uint64_t writing;
+  uint64_t waiting;
+
+  size_t pos = 0;
+  if (!scanUIntAfter(target.body, "Active connections:", &pos, &active) ||
+      !scanUIntAfter(target.body, "requests", &pos, &accepts) ||
+      !scanUIntAfter(target.body, "", &pos, &handled) ||
+      !scanUIntAfter(target.body, "", &pos, &requests) ||
+      !scanUIntAfter(target.body, "Reading:", &pos, &reading) ||
+      !scanUIntAfter(target.body, "Writing:", &pos, &writing) ||
+      !scanUIntAfter(target.body, "Waiting:", &pos, &waiting)) {
+    return false;
+  }
+
+  events_.append(target.target_prefix);
+  events_.append(",\"active_connections\":" + std::to_string(active));
+  events_.append(",\"accepts\":" + std::to_string(accepts));
+  events_.append(",\"handled\":" + std::to_string(handled));
+  events_.append(",\"requests\":" + std::to_string(requests));
+  events_.append(",\"reading\":" + std::to_string(reading));
+  events_.append(",\"writing\":" + std::to_string(writing));
+  events_.append(",\"waiting\":" + std::to_string(waiting));
+  events_.push_back('}');
+  event_ends_.emplace_back(events_.size());
+  return true;
+}
+
+/* the page must be a JSON object; the target is added as its first field */
+bool ScrapeSource::formatJSON(const Target& target) {
+  const auto& body = target.body;
+  auto begin = body.find_first_not_of(" \t\r\n");
+  auto last = body.find_last_not_of(" \t\r\n");
+  if (begin == std::string::npos || body[begin] != '{' || body[last] != '}') {
+    return false;
+  }
+
+  /* the members are copied into the event as they are */
+  auto body_end = body.data() + last + 1;
+  if (skipJSONValue(body.data() + begin, body_end, 0) != body_end) {
+    return false;
+  }
+
+  auto inner = body.find_first_not_of(" \t\r\n", begin + 1);
+  events_.append(target.target_prefix);
+  if (inner != last) {
+    events_.push_back(',');
+    events_.append(body, inner, last - inner);
+  }
+
+  events_.push_back('}');
+  event_ends_.emplace_back(events_.size());
+  return true;
+}
+
+void ScrapeSource::addEvents(
+    const std::string& events,
+    const std::vector<size_t>& ends) {
+  auto base = events_.size();
+  events_.append(events);
+  for (auto end : ends) {
+    event_ends_.emplace_back(base + end);
+  }
+}
+
+void ScrapeSource::nextEvent(std::string* event_json) {
+  if (pending_pos_ < event_ends_.size()) {
+    size_t begin = pending_pos_ > 0 ? event_ends_[pending_pos_ - 1] : 0;
+    event_json->append(events_, begin, event_ends_[pending_pos_] - begin);
+    ++pending_pos_;
+  }
+
+  if (pending_pos_ >= event_ends_.size()) {
+    events_.clear();
+    event_ends_.clear();
+    pending_pos_ = 0;
+  }
+}
+
+ReturnCode ScrapeSourcePlugin::pluginAttach(
+    const PropertyList& config,
+    void** userdata) {
+  auto format = ScrapeSource::Format::PROMETHEUS;
+  std::string format_str;
+  if (config.get("format", &format_str)) {
+    auto rc = ScrapeSource::parseFormat(format_str, &format);
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  std::unique_ptr<ScrapeSource> source(new ScrapeSource(format));
+
+  std::vector<std::vector<std::string>> urls;
+  config.get("url", &urls);
+  for (const auto& u : urls) {
+    for (const auto& url : u) {
+      source->addTarget(url);
+    }
+  }
+
+  if (urls.empty()) {
+    return ReturnCode::error("EINVAL", "missing url");
+  }
+
+  std::vector<std::vector<std::string>> metrics;
+  config.get("metric", &metrics);
+  for (const auto& m : metrics) {
+    for (const auto& prefix : m) {
+      source->addMetricFilter(prefix);
+    }
+  }
+
+  std::string timeout;
+  if (config.get("timeout_ms", &timeout)) {
+    try {
+      source->setTimeout(std::stoull(timeout) * kMicrosPerMilli);
+    } catch (...) {
+      return ReturnCode::error(
+          "EINVAL",
+          "invalid value for timeout_ms: '%s'",
+          timeout.c_str());
+    }
+  }
+
+  auto rc = source->open();
+  if (!rc.isSuccess()) {
+    return rc;
+  }
+
+  *userdata = source.release();
+  return ReturnCode::success();
+}
+
+void ScrapeSourcePlugin::pluginDetach(void* userdata) {
+  delete static_cast<ScrapeSource*>(userdata);
+}
+
+ReturnCode ScrapeSourcePlugin::pluginGetNextEvent(
+    void* userdata,
+    std::string* event_json) {
+  return static_cast<ScrapeSource*>(userdata)->getNextEvent(
+      MonotonicClock::now(),
+      event_json);
+}
+
+bool ScrapeSourcePlugin::pluginHasPendingEvent(void* userdata) {
+  return static_cast<ScrapeSource*>(userdata)->hasPendingEvent();
+}
+
+bool ScrapeSourcePlugin::pluginGetPollFD(
+    void* userdata,
+    int* fd,
+    uint64_t* deadline) {
+  return static_cast<ScrapeSource*>(userdata)->getPollFD(fd, deadline);
+}
+
+ReturnCode ScrapeSourcePlugin::pluginPollEvent(
+    void* userdata,
+    std::string* event_json) {
+  return static_cast<ScrapeSource*>(userdata)->pollEvent(
+      MonotonicClock::now(),
+      event_json);
+}
+
+} // namespace evcollect
+
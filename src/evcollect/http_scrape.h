@@ -0,0 +1,236 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include <curl/curl.h>
+#include <evcollect/evcollect.h>
+#include <evcollect/plugin.h>
+
+namespace evcollect {
+
+/**
+ * Streaming parser for the Prometheus text exposition format. The body is fed
+ * in the chunks it is received in and every sample is written out as one JSON
+ * event right away:
+ *
+ *   {"target":"...","metric":"http_requests_total","type":"counter",
+ *    "labels":{"code":"200"},"value":1027,"timestamp_ms":1395066363000}
+ *
+ * Only the current line (if it spans chunks) and the TYPE of the current
+ * metric family are kept. Samples with a NaN or infinite value are skipped,
+ * as JSON can't represent them
+ */
+class PrometheusParser {
+public:
+
+  static const size_t kMaxLineSize = 65536;
+
+  PrometheusParser();
+
+  /**
+   * Start a new body; target is added to every event
+   */
+  void reset(const std::string& target);
+
+  /**
+   * Only report metric families starting with one of these prefixes
+   */
+  void setFilter(const std::vector<std::string>* prefixes);
+
+  void parse(const char* data, size_t size);
+
+  /**
+   * Parse the last line if the body didn't end with a newline
+   */
+  void finish();
+
+  /* the events are stored back to back, event_ends holds their end offsets */
+  const std::string& getEvents() const;
+  const std::vector<size_t>& getEventEnds() const;
+
+  size_t getNumErrors() const;
+
+protected:
+
+  void parseLine(const char* begin, const char* end);
+  void parseComment(const char* begin, const char* end);
+  bool parseSample(const char* begin, const char* end);
+  bool matchesFilter(const char* name, size_t name_len) const;
+  const char* getType(const char* name, size_t name_len) const;
+
+  std::string target_prefix_;
+  const std::vector<std::string>* filter_;
+  std::string family_;
+  std::string family_type_;
+  std::string line_;
+  bool skip_line_;
+  std::string events_;
+  std::vector<size_t> event_ends_;
+  size_t num_errors_;
+};
+
+/**
+ * Scrapes a list of HTTP endpoints on every tick and emits their contents as
+ * events: one event per sample for Prometheus /metrics endpoints, one event
+ * per target for nginx stub_status and JSON status pages.
+ *
+ * All transfers run concurrently on one curl multi handle that is driven by
+ * the service loop: curl's sockets are registered with an epoll instance
+ * whose fd, together with curl's timer as the deadline, is returned from
+ * getPollFD(). Every target keeps its easy handle, so connections are kept
+ * alive between ticks. A target that is still busy with the previous scrape
+ * is skipped on the next tick, so one slow endpoint doesn't hold up the
+ * others
+ */
+class ScrapeSource {
+public:
+
+  enum class Format { PROMETHEUS, STUB_STATUS, JSON };
+
+  static const uint64_t kDefaultTimeoutMicros = 10000000;
+  static const size_t kMaxBodySize = 64 * 1024 * 1024;
+
+  static ReturnCode parseFormat(const std::string& str, Format* format);
+
+  ScrapeSource(Format format);
+  ~ScrapeSource();
+
+  ScrapeSource(const ScrapeSource& other) = delete;
+  ScrapeSource& operator=(const ScrapeSource& other) = delete;
+
+  void addTarget(const std::string& url);
+  void addMetricFilter(const std::string& prefix);
+  void setTimeout(uint64_t timeout_micros);
+
+  ReturnCode open();
+
+  /**
+   * Called on every tick: starts a scrape of every target that isn't busy and
+   * returns the next event that is ready
+   */
+  ReturnCode getNextEvent(uint64_t now, std::string* event_json);
+
+  /**
+   * Called when the poll fd is readable or the deadline has passed: drives
+   * the transfers and returns the next event that is ready
+   */
+  ReturnCode pollEvent(uint64_t now, std::string* event_json);
+
+  bool hasPendingEvent() const;
+  bool getPollFD(int* fd, uint64_t* deadline) const;
+
+  uint64_t getNumScrapes() const;
+  uint64_t getNumErrors() const;
+  uint64_t getNumSkipped() const;
+
+protected:
+
+  struct Target {
+    ScrapeSource* source;
+    std::string url;
+    std::string target_prefix;
+    CURL* curl;
+    bool busy;
+    bool failing;
+    bool skipping;
+    size_t body_size;
+    std::string body;
+    PrometheusParser parser;
+    char error[CURL_ERROR_SIZE];
+  };
+
+  static size_t writeCallback(
+      char* data,
+      size_t size,
+      size_t nmemb,
+      void* userdata);
+
+  static int socketCallback(
+      CURL* curl,
+      curl_socket_t fd,
+      int what,
+      void* userdata,
+      void* socketp);
+
+  static int timerCallback(CURLM* multi, long timeout_ms, void* userdata);
+
+  void startScrape(Target* target);
+  void completeScrapes();
+  void completeScrape(Target* target, CURLcode result);
+  bool formatStubStatus(const Target& target);
+  bool formatJSON(const Target& target);
+  void addEvents(const std::string& events, const std::vector<size_t>& ends);
+  void nextEvent(std::string* event_json);
+
+  Format format_;
+  uint64_t timeout_;
+  std::vector<std::string> filter_;
+  std::vector<std::unique_ptr<Target>> targets_;
+  CURLM* multi_;
+  int epoll_fd_;
+  uint64_t deadline_;
+  size_t num_busy_;
+  bool draining_tick_;
+  std::string events_;
+  std::vector<size_t> event_ends_;
+  size_t pending_pos_;
+  uint64_t num_scrapes_;
+  uint64_t num_errors_;
+  uint64_t num_skipped_;
+};
+
+class ScrapeSourcePlugin : public SourcePlugin {
+public:
+
+  static void registerPlugin(PluginMap* plugin_map);
+
+  ReturnCode pluginAttach(
+      const PropertyList& config,
+      void** userdata) override;
+
+  void pluginDetach(
+      void* userdata) override;
+
+  ReturnCode pluginGetNextEvent(
+      void* userdata,
+      std::string* event_json) override;
+
+  bool pluginHasPendingEvent(
+      void* userdata) override;
+
+  bool pluginGetPollFD(
+      void* userdata,
+      int* fd,
+      uint64_t* deadline) override;
+
+  ReturnCode pluginPollEvent(
+      void* userdata,
+      std::string* event_json) override;
+
+};
+
+} // namespace evcollect
+
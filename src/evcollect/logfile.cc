@@ -21,7 +21,9 @@
  * commercial activities involving this program without disclosing the source
  * code of your own applications
  */
+#include <errno.h>
 #include <netdb.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <list>
 #include <sys/fcntl.h>
@@ -55,6 +57,9 @@ public:
   ~LogfileSource();
 
   ReturnCode setRegex(const std::string& regex);
+  ReturnCode setStartPosition(const std::string& start_at);
+  void setTimeField(const std::string& field);
+  void setTimeFormat(const std::string& format);
 
   bool hasNextLine();
   ReturnCode getNextLine(std::string* line);
@@ -63,7 +68,33 @@ public:
   ReturnCode readCheckpoint();
   ReturnCode writeCheckpoint();
 
+  /**
+   * Move the read position to the configured start position. This is a no-op
+   * if a checkpoint was found, i.e. it only applies on the first attach
+   */
+  ReturnCode seekStartPosition();
+
 protected:
+
+  enum class StartPosition { BEGINNING, END, TIME };
+
+  static const size_t kMaxProbeLines = 128;
+
+  ReturnCode seekTime(uint64_t min_time);
+  bool probeLine(
+      int fd,
+      uint64_t pos,
+      uint64_t file_size,
+      uint64_t* line_begin,
+      uint64_t* line_time);
+  bool readLineAt(
+      int fd,
+      uint64_t pos,
+      uint64_t file_size,
+      std::string* line,
+      uint64_t* next_line);
+  bool parseLineTime(const std::string& line, uint64_t* time);
+
   std::string filename_;
   std::string checkpoint_filename_;
   pcre* pcre_handle_;
@@ -75,6 +106,11 @@ protected:
   uint64_t checkpoint_offset_;
   uint64_t checkpoint_interval_micros_;
   uint64_t last_checkpoint_;
+  bool has_checkpoint_;
+  StartPosition start_at_;
+  uint64_t start_at_micros_;
+  std::string time_field_;
+  std::string time_format_;
   char buf_[8192];
   size_t buf_len_;
   size_t buf_pos_;
@@ -97,6 +133,11 @@ LogfileSource::LogfileSource(
     checkpoint_offset_(0),
     checkpoint_interval_micros_(10 * kMicrosPerSecond),
     last_checkpoint_(0),
+    has_checkpoint_(false),
+    start_at_(StartPosition::BEGINNING),
+    start_at_micros_(0),
+    time_field_("time"),
+    time_format_("%d/%b/%Y:%H:%M:%S %z"),
     line_buf_maxsize_(8192) {
   auto filename_hash = SHA1::compute(filename_);
   checkpoint_filename_ = spool_dir + "/log_" + filename_hash.toString();
@@ -156,6 +197,70 @@ ReturnCode LogfileSource::setRegex(const std::string& regex) {
   return ReturnCode::success();
 }
 
+ReturnCode LogfileSource::setStartPosition(const std::string& start_at) {
+  if (start_at == "beginning") {
+    start_at_ = StartPosition::BEGINNING;
+    return ReturnCode::success();
+  }
+
+  if (start_at == "end") {
+    start_at_ = StartPosition::END;
+    return ReturnCode::success();
+  }
+
+  /* relative time, e.g. -30s, -15m, -1h or -2d */
+  if (start_at.size() < 3 ||
+      start_at[0] != '-' ||
+      !StringUtil::isDigitString(
+          start_at.data() + 1,
+          start_at.data() + start_at.size() - 1)) {
+    return ReturnCode::error(
+        "EINVAL",
+        "invalid value for start_at: '%s' -- " \
+        "must be 'beginning', 'end' or a relative time like '-1h'",
+        start_at.c_str());
+  }
+
+  uint64_t unit;
+  switch (start_at[start_at.size() - 1]) {
+    case 's': unit = kMicrosPerSecond; break;
+    case 'm': unit = kMicrosPerMinute; break;
+    case 'h': unit = kMicrosPerHour; break;
+    case 'd': unit = kMicrosPerDay; break;
+    default:
+      return ReturnCode::error(
+          "EINVAL",
+          "invalid time unit in start_at: '%s' -- must be one of s, m, h, d",
+          start_at.c_str());
+  }
+
+  auto value_str = start_at.substr(1, start_at.size() - 2);
+  char* value_end = nullptr;
+  errno = 0;
+  auto value = strtoull(value_str.c_str(), &value_end, 10);
+  if (errno != 0 ||
+      value_end != value_str.c_str() + value_str.size() ||
+      value > UINT64_MAX / unit) {
+    return ReturnCode::error(
+        "EINVAL",
+        "value for start_at is out of range: '%s'",
+        start_at.c_str());
+  }
+
+  start_at_ = StartPosition::TIME;
+  start_at_micros_ = value * unit;
+
+  return ReturnCode::success();
+}
+
+void LogfileSource::setTimeField(const std::string& field) {
+  time_field_ = field;
+}
+
+void LogfileSource::setTimeFormat(const std::string& format) {
+  time_format_ = format;
+}
+
 bool LogfileSource::hasNextLine() {
   if (line_buf_.empty()) {
     readLines();
@@ -340,12 +445,224 @@ ReturnCode LogfileSource::readCheckpoint() {
     close(fd);
   }
 
+  has_checkpoint_ = inode_ != 0;
   consumed_offset_ = offset_;
   checkpoint_inode_ = inode_;
   checkpoint_offset_ = offset_;
   return ReturnCode::success();
 }
 
+ReturnCode LogfileSource::seekStartPosition() {
+  if (has_checkpoint_) {
+    return ReturnCode::success();
+  }
+
+  switch (start_at_) {
+
+    case StartPosition::BEGINNING:
+      return ReturnCode::success();
+
+    case StartPosition::END: {
+      struct stat file_st;
+      if (stat(filename_.c_str(), &file_st) < 0) {
+        return ReturnCode::success(); // file doesn't exist yet
+      }
+
+      inode_ = file_st.st_ino;
+      offset_ = file_st.st_size;
+      consumed_offset_ = offset_;
+      return ReturnCode::success();
+    }
+
+    case StartPosition::TIME: {
+      auto now = WallClock::unixMicros();
+      return seekTime(now > start_at_micros_ ? now - start_at_micros_ : 0);
+    }
+
+  }
+
+  return ReturnCode::success();
+}
+
+/**
+ * Binary search the file for the first line with a timestamp >= min_time. This
+ * assumes that the timestamps in the file are (roughly) monotonically
+ * increasing. Every probe lands somewhere inside a line, so we skip forward to
+ * the next line start and read the first line with a parseable timestamp from
+ * there. Lines without a timestamp are skipped (up to kMaxProbeLines per probe)
+ */
+ReturnCode LogfileSource::seekTime(uint64_t min_time) {
+  int fd = open(filename_.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return ReturnCode::success(); // file doesn't exist yet
+  }
+
+  struct stat file_st;
+  if (fstat(fd, &file_st) < 0) {
+    close(fd);
+    return ReturnCode::error("IOERR", "fstat('%s') failed", filename_.c_str());
+  }
+
+  uint64_t file_size = file_st.st_size;
+  uint64_t lo = 0;
+  uint64_t hi = file_size;
+  size_t nprobes = 0;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    uint64_t line_begin;
+    uint64_t line_time;
+    ++nprobes;
+    if (!probeLine(fd, mid, file_size, &line_begin, &line_time) ||
+        line_time >= min_time) {
+      hi = mid;
+    } else {
+      lo = line_begin + 1;
+    }
+  }
+
+  /* snap the result to the start of the next line */
+  uint64_t offset = 0;
+  if (lo > 0) {
+    std::string line;
+    if (!readLineAt(fd, lo - 1, file_size, &line, &offset)) {
+      offset = file_size;
+    }
+  }
+
+  close(fd);
+
+  logInfo(
+      "Starting to read '$0' at offset $1/$2 ($3 probes)",
+      filename_,
+      offset,
+      file_size,
+      nprobes);
+
+  inode_ = file_st.st_ino;
+  offset_ = offset;
+  consumed_offset_ = offset;
+  return ReturnCode::success();
+}
+
+bool LogfileSource::probeLine(
+    int fd,
+    uint64_t pos,
+    uint64_t file_size,
+    uint64_t* line_begin,
+    uint64_t* line_time) {
+  std::string line;
+  uint64_t begin = 0;
+  if (pos > 0 && !readLineAt(fd, pos - 1, file_size, &line, &begin)) {
+    return false;
+  }
+
+  for (size_t n = 0; n < kMaxProbeLines && begin < file_size; ++n) {
+    uint64_t next;
+    if (!readLineAt(fd, begin, file_size, &line, &next)) {
+      return false;
+    }
+
+    if (parseLineTime(line, line_time)) {
+      *line_begin = begin;
+      return true;
+    }
+
+    begin = next;
+  }
+
+  return false;
+}
+
+/**
+ * Read the (remainder of the) line at pos. Returns false if the line is not
+ * terminated by a newline
+ */
+bool LogfileSource::readLineAt(
+    int fd,
+    uint64_t pos,
+    uint64_t file_size,
+    std::string* line,
+    uint64_t* next_line) {
+  line->clear();
+
+  char buf[4096];
+  while (pos < file_size) {
+    auto bytes_read = pread(fd, buf, sizeof(buf), pos);
+    if (bytes_read <= 0) {
+      return false;
+    }
+
+    auto eol = (const char*) memchr(buf, '\n', bytes_read);
+    if (eol) {
+      line->append(buf, eol - buf);
+      *next_line = pos + (eol - buf) + 1;
+      return true;
+    }
+
+    line->append(buf, bytes_read);
+    pos += bytes_read;
+  }
+
+  return false;
+}
+
+bool LogfileSource::parseLineTime(const std::string& line, uint64_t* time) {
+  std::string time_str;
+
+  if (pcre_handle_) {
+    size_t field_idx = 0;
+    for (size_t i = 1; i < pcre_fields_.size(); ++i) {
+      if (pcre_fields_[i] == time_field_) {
+        field_idx = i;
+        break;
+      }
+    }
+
+    if (field_idx == 0) {
+      return false;
+    }
+
+    const size_t OV_COUNT = 3 * 36;
+    int ovector[OV_COUNT];
+
+    int pcre_rc = pcre_exec(
+        pcre_handle_,
+        0,
+        line.data(),
+        line.size(),
+        0,
+        0,
+        ovector,
+        OV_COUNT);
+
+    if (pcre_rc <= (int) field_idx || ovector[2 * field_idx] < 0) {
+      return false;
+    }
+
+    time_str = line.substr(
+        ovector[2 * field_idx],
+        ovector[2 * field_idx + 1] - ovector[2 * field_idx]);
+  } else {
+    time_str = StringUtil::beginsWith(line, "[") ? line.substr(1) : line;
+  }
+
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  if (!strptime(time_str.c_str(), time_format_.c_str(), &tm)) {
+    return false;
+  }
+
+  /* timegm normalizes tm and resets the offset parsed by %z */
+  auto gmtoff = tm.tm_gmtoff;
+  auto t = timegm(&tm) - gmtoff;
+  if (t < 0) {
+    return false;
+  }
+
+  *time = uint64_t(t) * kMicrosPerSecond;
+  return true;
+}
+
 ReturnCode LogfileSource::writeCheckpoint() {
   if (checkpoint_inode_ == inode_ && checkpoint_offset_ == consumed_offset_) {
     return ReturnCode::success();
@@ -407,6 +724,31 @@ ReturnCode LogfileSourcePlugin::pluginAttach(
     }
   }
 
+  std::string time_field;
+  if (config.get("time_field", &time_field)) {
+    logfile->setTimeField(time_field);
+  }
+
+  std::string time_format;
+  if (config.get("time_format", &time_format)) {
+    logfile->setTimeFormat(time_format);
+  }
+
+  std::string start_at;
+  if (config.get("start_at", &start_at)) {
+    auto rc = logfile->setStartPosition(start_at);
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  {
+    auto rc = logfile->seekStartPosition();
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
   *userdata = logfile.release();
   return ReturnCode::success();
 }
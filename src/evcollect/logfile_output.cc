@@ -0,0 +1,903 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#include <evcollect/util/stringutil.h>
+#include <evcollect/util/time.h>
+#include <evcollect/util/logging.h>
+#include <evcollect/logfile_output.h>
+
+namespace evcollect {
+
+void LogfileOutputPlugin::registerPlugin(PluginMap* plugin_map) {
+  plugin_map->registerOutputPlugin(
+      "logfile",
+      std::unique_ptr<OutputPlugin>(new LogfileOutputPlugin()));
+}
+
+class LogfileTarget {
+public:
+
+  static const size_t kDefaultBufferSize = 1024 * 1024;
+  static const uint64_t kDefaultFlushInterval = kMicrosPerSecond;
+  static const size_t kChunkSize = 64 * 1024;
+  static const size_t kMaxBufferedFactor = 8;
+  static const size_t kCompressBufferSize = 256 * 1024;
+
+  LogfileTarget(const std::string& directory);
+  ~LogfileTarget();
+
+  ReturnCode addRoute(
+      const std::string& event_name_match,
+      const std::string& path);
+
+  /**
+   * The writer thread flushes the buffers once they hold this many bytes.
+   * emitEvent blocks while more than kMaxBufferedFactor times this many bytes
+   * are buffered
+   */
+  void setBufferSize(size_t bytes);
+
+  /**
+   * Flush the buffers at least this often, even if they are not full
+   */
+  void setFlushInterval(uint64_t usecs);
+
+  /**
+   * Call fdatasync on every file that was written to at most once per
+   * interval. Zero (the default) leaves syncing to the kernel
+   */
+  void setFsyncInterval(uint64_t usecs);
+
+  void setRotateSize(uint64_t bytes);
+  void setRotateInterval(uint64_t usecs);
+  ReturnCode setCompression(const std::string& compression);
+
+  ReturnCode emitEvent(const EventData& evdata);
+
+  ReturnCode startWriterThread();
+  void stopWriterThread();
+
+  void getStats(std::string* stats) const;
+
+protected:
+
+  struct Route {
+    std::string event_name_match;
+    std::string path;
+    bool path_is_template;
+  };
+
+  /**
+   * chunks is protected by mutex_, all other fields are only accessed from
+   * the writer thread
+   */
+  struct OutputFile {
+    std::string path;
+    std::vector<std::string> chunks;
+    int fd;
+    uint64_t size;
+    uint64_t segment_time;
+    bool needs_sync;
+  };
+
+  using FileList = std::vector<OutputFile*>;
+
+  const FileList& resolveRoutes(const std::string& event_name);
+  void appendEvent(OutputFile* file, const std::string& data);
+
+  void runWriterThread();
+  void writeChunks(OutputFile* file, std::vector<std::string>* chunks);
+  bool openFile(OutputFile* file);
+  void closeFile(OutputFile* file);
+  void rotateFile(OutputFile* file);
+  void syncFiles(const FileList& files);
+
+  void runCompressThread();
+  void compressSegment(const std::string& path);
+
+  std::string directory_;
+  std::vector<Route> routes_;
+  size_t buffer_size_;
+  uint64_t flush_interval_;
+  uint64_t fsync_interval_;
+  uint64_t rotate_size_;
+  uint64_t rotate_interval_;
+  bool compress_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable space_cv_;
+  bool running_;
+  size_t buffered_;
+  std::map<std::string, std::unique_ptr<OutputFile>> files_;
+  std::unordered_map<std::string, FileList> route_cache_;
+  std::vector<std::string> free_chunks_;
+  uint64_t next_flush_;
+  uint64_t next_fsync_;
+  std::thread thread_;
+
+  std::mutex compress_mutex_;
+  std::condition_variable compress_cv_;
+  bool compress_running_;
+  std::deque<std::string> compress_queue_;
+  std::thread compress_thread_;
+
+  std::atomic<uint64_t> events_enqueued_;
+  std::atomic<uint64_t> bytes_written_;
+  std::atomic<uint64_t> bytes_dropped_;
+  std::atomic<uint64_t> write_calls_;
+  std::atomic<uint64_t> fsync_calls_;
+  std::atomic<uint64_t> segments_rotated_;
+  std::atomic<uint64_t> segments_compressed_;
+};
+
+LogfileTarget::LogfileTarget(
+    const std::string& directory) :
+    directory_(directory),
+    buffer_size_(kDefaultBufferSize),
+    flush_interval_(kDefaultFlushInterval),
+    fsync_interval_(0),
+    rotate_size_(0),
+    rotate_interval_(0),
+    compress_(false),
+    running_(false),
+    buffered_(0),
+    next_flush_(0),
+    next_fsync_(0),
+    compress_running_(false),
+    events_enqueued_(0),
+    bytes_written_(0),
+    bytes_dropped_(0),
+    write_calls_(0),
+    fsync_calls_(0),
+    segments_rotated_(0),
+    segments_compressed_(0) {}
+
+LogfileTarget::~LogfileTarget() {
+  stopWriterThread();
+}
+
+ReturnCode LogfileTarget::addRoute(
+    const std::string& event_name_match,
+    const std::string& path) {
+  if (path.empty() || path[path.size() - 1] == '/') {
+    return ReturnCode::error(
+        "EINVAL",
+        "invalid logfile path '%s'",
+        path.c_str());
+  }
+
+  if (path[0] != '/' && directory_.empty()) {
+    return ReturnCode::error(
+        "EINVAL",
+        "relative logfile path '%s' requires a directory",
+        path.c_str());
+  }
+
+  Route r;
+  r.event_name_match = event_name_match;
+  r.path = path[0] == '/' ? path : directory_ + "/" + path;
+  r.path_is_template = path.find("%E") != std::string::npos;
+  routes_.emplace_back(r);
+  return ReturnCode::success();
+}
+
+void LogfileTarget::setBufferSize(size_t bytes) {
+  buffer_size_ = std::max(bytes, size_t(1));
+}
+
+void LogfileTarget::setFlushInterval(uint64_t usecs) {
+  flush_interval_ = usecs;
+}
+
+void LogfileTarget::setFsyncInterval(uint64_t usecs) {
+  fsync_interval_ = usecs;
+}
+
+void LogfileTarget::setRotateSize(uint64_t bytes) {
+  rotate_size_ = bytes;
+}
+
+void LogfileTarget::setRotateInterval(uint64_t usecs) {
+  rotate_interval_ = usecs;
+}
+
+ReturnCode LogfileTarget::setCompression(const std::string& compression) {
+  if (compression == "none") {
+    compress_ = false;
+    return ReturnCode::success();
+  }
+
+#ifdef HAVE_ZLIB
+  if (compression == "gzip") {
+    compress_ = true;
+    return ReturnCode::success();
+  }
+#endif
+
+  return ReturnCode::error(
+      "EINVAL",
+      "unsupported compression: '%s'",
+      compression.c_str());
+}
+
+namespace {
+void expandTemplate(const std::string& event_name, std::string* str) {
+  /* event names must not be able to escape the target directory */
+  auto name = event_name;
+  std::replace(name.begin(), name.end(), '/', '_');
+
+  size_t pos = 0;
+  while ((pos = str->find("%E", pos)) != std::string::npos) {
+    str->replace(pos, 2, name);
+    pos += name.size();
+  }
+}
+}
+
+/**
+ * Returns the files an event is written to. Routes are matched once per event
+ * name and then served from the route cache. Must be called with mutex_ held
+ */
+const LogfileTarget::FileList& LogfileTarget::resolveRoutes(
+    const std::string& event_name) {
+  auto cached = route_cache_.find(event_name);
+  if (cached != route_cache_.end()) {
+    return cached->second;
+  }
+
+  FileList files;
+  for (const auto& r : routes_) {
+    if (fnmatch(r.event_name_match.c_str(), event_name.c_str(), 0) != 0) {
+      continue;
+    }
+
+    auto path = r.path;
+    if (r.path_is_template) {
+      expandTemplate(event_name, &path);
+    }
+
+    auto& file = files_[path];
+    if (!file) {
+      file.reset(new OutputFile());
+      file->path = path;
+      file->fd = -1;
+      file->size = 0;
+      file->segment_time = 0;
+      file->needs_sync = false;
+    }
+
+    if (std::find(files.begin(), files.end(), file.get()) == files.end()) {
+      files.emplace_back(file.get());
+    }
+  }
+
+  return route_cache_.emplace(event_name, std::move(files)).first->second;
+}
+
+ReturnCode LogfileTarget::emitEvent(const EventData& evdata) {
+  std::unique_lock<std::mutex> lk(mutex_);
+  const auto& files = resolveRoutes(evdata.event_name);
+  if (files.empty()) {
+    return ReturnCode::success();
+  }
+
+  while (running_ && buffered_ >= buffer_size_ * kMaxBufferedFactor) {
+    space_cv_.wait(lk);
+  }
+
+  if (!running_) {
+    return ReturnCode::error("EIO", "logfile output is shutting down");
+  }
+
+  for (auto file : files) {
+    appendEvent(file, evdata.event_data);
+  }
+
+  buffered_ += (evdata.event_data.size() + 1) * files.size();
+  ++events_enqueued_;
+
+  if (buffered_ >= buffer_size_) {
+    cv_.notify_one();
+  }
+
+  return ReturnCode::success();
+}
+
+/**
+ * Append one event to the file's buffer. Data is appended to fixed size
+ * chunks that are recycled after they were written, so buffering an event
+ * does not allocate in the steady state. Raw newlines in the event (which
+ * JSON only allows as whitespace) are replaced to keep one event per line
+ */
+void LogfileTarget::appendEvent(OutputFile* file, const std::string& data) {
+  auto& chunks = file->chunks;
+  if (chunks.empty() ||
+      chunks.back().size() + data.size() + 1 > kChunkSize) {
+    if (free_chunks_.empty()) {
+      chunks.emplace_back();
+      chunks.back().reserve(kChunkSize);
+    } else {
+      chunks.emplace_back(std::move(free_chunks_.back()));
+      free_chunks_.pop_back();
+    }
+  }
+
+  auto& chunk = chunks.back();
+  auto begin = chunk.size();
+  chunk.append(data);
+  std::replace(chunk.begin() + begin, chunk.end(), '\n', ' ');
+  chunk.push_back('\n');
+}
+
+ReturnCode LogfileTarget::startWriterThread() {
+  std::unique_lock<std::mutex> lk(mutex_);
+  if (running_) {
+    return ReturnCode::success();
+  }
+
+  running_ = true;
+  next_flush_ = MonotonicClock::now() + flush_interval_;
+  next_fsync_ = MonotonicClock::now() + fsync_interval_;
+  thread_ = std::thread(&LogfileTarget::runWriterThread, this);
+
+  if (compress_) {
+    std::unique_lock<std::mutex> compress_lk(compress_mutex_);
+    compress_running_ = true;
+    compress_thread_ = std::thread(&LogfileTarget::runCompressThread, this);
+  }
+
+  return ReturnCode::success();
+}
+
+/**
+ * Stops accepting events, writes out everything that is still buffered and
+ * waits until all closed segments are compressed
+ */
+void LogfileTarget::stopWriterThread() {
+  {
+    std::unique_lock<std::mutex> lk(mutex_);
+    if (!running_) {
+      return;
+    }
+
+    running_ = false;
+    cv_.notify_all();
+    space_cv_.notify_all();
+  }
+
+  thread_.join();
+
+  if (compress_thread_.joinable()) {
+    {
+      std::unique_lock<std::mutex> lk(compress_mutex_);
+      compress_running_ = false;
+      compress_cv_.notify_all();
+    }
+
+    compress_thread_.join();
+  }
+}
+
+void LogfileTarget::runWriterThread() {
+  std::unique_lock<std::mutex> lk(mutex_);
+  for (;;) {
+    auto now = MonotonicClock::now();
+    auto deadline = next_flush_;
+    if (fsync_interval_ > 0) {
+      deadline = std::min(deadline, next_fsync_);
+    }
+
+    if (running_ && buffered_ < buffer_size_ && now < deadline) {
+      cv_.wait_for(lk, std::chrono::microseconds(deadline - now));
+      continue;
+    }
+
+    bool shutdown = !running_;
+
+    std::vector<std::pair<OutputFile*, std::vector<std::string>>> pending;
+    FileList files;
+    for (auto& f : files_) {
+      files.emplace_back(f.second.get());
+      if (!f.second->chunks.empty()) {
+        pending.emplace_back(f.second.get(), std::move(f.second->chunks));
+        f.second->chunks.clear();
+      }
+    }
+
+    buffered_ = 0;
+    space_cv_.notify_all();
+    lk.unlock();
+
+    /* the file list only grows and the files are never freed while the
+       writer thread is running, so they can be accessed without the lock */
+    for (auto& p : pending) {
+      writeChunks(p.first, &p.second);
+    }
+
+    if (rotate_interval_ > 0) {
+      auto wall_now = WallClock::unixMicros();
+      for (auto file : files) {
+        if (file->fd >= 0 &&
+            file->size > 0 &&
+            wall_now >= file->segment_time + rotate_interval_) {
+          rotateFile(file);
+        }
+      }
+    }
+
+    now = MonotonicClock::now();
+    if (fsync_interval_ > 0 && now >= next_fsync_) {
+      syncFiles(files);
+      next_fsync_ = now + fsync_interval_;
+    }
+
+    lk.lock();
+    for (auto& p : pending) {
+      for (auto& chunk : p.second) {
+        if (free_chunks_.size() >= kMaxBufferedFactor * buffer_size_ /
+                kChunkSize) {
+          break;
+        }
+
+        chunk.clear();
+        free_chunks_.emplace_back(std::move(chunk));
+      }
+    }
+
+    next_flush_ = now + flush_interval_;
+
+    if (shutdown) {
+      break;
+    }
+  }
+
+  for (auto& f : files_) {
+    closeFile(f.second.get());
+  }
+}
+
+/**
+ * Write all chunks of a file with as few writev calls as possible. If the
+ * write fails, the remaining data is dropped so that a full or broken disk
+ * does not stall the daemon
+ */
+void LogfileTarget::writeChunks(
+    OutputFile* file,
+    std::vector<std::string>* chunks) {
+  uint64_t total = 0;
+  std::vector<struct iovec> iov;
+  iov.reserve(chunks->size());
+  for (auto& chunk : *chunks) {
+    struct iovec v;
+    v.iov_base = &chunk[0];
+    v.iov_len = chunk.size();
+    iov.emplace_back(v);
+    total += chunk.size();
+  }
+
+  if (file->fd >= 0 &&
+      rotate_interval_ > 0 &&
+      file->size > 0 &&
+      WallClock::unixMicros() >= file->segment_time + rotate_interval_) {
+    rotateFile(file);
+  }
+
+  if (file->fd < 0 && !openFile(file)) {
+    bytes_dropped_ += total;
+    return;
+  }
+
+  size_t idx = 0;
+  while (idx < iov.size()) {
+    auto cnt = std::min(iov.size() - idx, size_t(IOV_MAX));
+    auto rc = writev(file->fd, &iov[idx], cnt);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      logError(
+          "logfile output: writev('$0') failed: $1",
+          file->path,
+          strerror(errno));
+
+      break;
+    }
+
+    ++write_calls_;
+    bytes_written_ += rc;
+    file->size += rc;
+    total -= rc;
+    file->needs_sync = true;
+
+    size_t written = rc;
+    while (idx < iov.size() && written >= iov[idx].iov_len) {
+      written -= iov[idx].iov_len;
+      ++idx;
+    }
+
+    if (written > 0) {
+      iov[idx].iov_base = (char*) iov[idx].iov_base + written;
+      iov[idx].iov_len -= written;
+    }
+  }
+
+  bytes_dropped_ += total;
+
+  if (rotate_size_ > 0 && file->size >= rotate_size_) {
+    rotateFile(file);
+  }
+}
+
+bool LogfileTarget::openFile(OutputFile* file) {
+  file->fd = open(
+      file->path.c_str(),
+      O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+      0644);
+
+  if (file->fd < 0) {
+    logError(
+        "logfile output: open('$0') failed: $1",
+        file->path,
+        strerror(errno));
+
+    return false;
+  }
+
+  struct stat st;
+  file->size = fstat(file->fd, &st) == 0 ? st.st_size : 0;
+  file->segment_time = WallClock::unixMicros();
+  file->needs_sync = false;
+  return true;
+}
+
+void LogfileTarget::closeFile(OutputFile* file) {
+  if (file->fd < 0) {
+    return;
+  }
+
+  if (fsync_interval_ > 0 && file->needs_sync) {
+    fdatasync(file->fd);
+    ++fsync_calls_;
+  }
+
+  close(file->fd);
+  file->fd = -1;
+  file->needs_sync = false;
+}
+
+/**
+ * Close the current segment and rename it to <path>.<timestamp>. The next
+ * write re-creates the file. If compression is enabled, the closed segment
+ * is handed to the compression thread
+ */
+void LogfileTarget::rotateFile(OutputFile* file) {
+  closeFile(file);
+
+  auto segment = file->path + "." +
+      UnixTime(file->segment_time).toString("%Y%m%d-%H%M%S");
+
+  struct stat st;
+  for (size_t n = 1;
+      stat(segment.c_str(), &st) == 0 ||
+      stat((segment + ".gz").c_str(), &st) == 0;
+      ++n) {
+    segment = file->path + "." +
+        UnixTime(file->segment_time).toString("%Y%m%d-%H%M%S") + "." +
+        std::to_string(n);
+  }
+
+  file->size = 0;
+  if (rename(file->path.c_str(), segment.c_str()) < 0) {
+    logError(
+        "logfile output: rename('$0', '$1') failed: $2",
+        file->path,
+        segment,
+        strerror(errno));
+
+    return;
+  }
+
+  ++segments_rotated_;
+
+  if (compress_) {
+    std::unique_lock<std::mutex> lk(compress_mutex_);
+    compress_queue_.emplace_back(segment);
+    compress_cv_.notify_one();
+  }
+}
+
+/**
+ * Sync all files that were written to since the last sync. This is the only
+ * place where the writer thread waits for the disk, so a single fsync covers
+ * every event that was written in the interval
+ */
+void LogfileTarget::syncFiles(const FileList& files) {
+  for (auto file : files) {
+    if (file->fd < 0 || !file->needs_sync) {
+      continue;
+    }
+
+    if (fdatasync(file->fd) < 0) {
+      logWarning(
+          "logfile output: fdatasync('$0') failed: $1",
+          file->path,
+          strerror(errno));
+    }
+
+    file->needs_sync = false;
+    ++fsync_calls_;
+  }
+}
+
+void LogfileTarget::runCompressThread() {
+  std::unique_lock<std::mutex> lk(compress_mutex_);
+  for (;;) {
+    while (compress_running_ && compress_queue_.empty()) {
+      compress_cv_.wait(lk);
+    }
+
+    if (compress_queue_.empty()) {
+      return;
+    }
+
+    auto path = compress_queue_.front();
+    compress_queue_.pop_front();
+    lk.unlock();
+    compressSegment(path);
+    lk.lock();
+  }
+}
+
+/**
+ * Compress a closed segment to <segment>.gz. The output is written to a
+ * temporary file first so that a crash never leaves a truncated .gz file
+ * next to a deleted segment
+ */
+void LogfileTarget::compressSegment(const std::string& path) {
+#ifdef HAVE_ZLIB
+  auto gz_path = path + ".gz";
+  auto tmp_path = gz_path + ".tmp";
+
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    logError(
+        "logfile output: open('$0') failed: $1",
+        path,
+        strerror(errno));
+
+    return;
+  }
+
+  auto gz = gzopen(tmp_path.c_str(), "wb");
+  if (!gz) {
+    logError("logfile output: gzopen('$0') failed", tmp_path);
+    close(fd);
+    return;
+  }
+
+  gzbuffer(gz, kCompressBufferSize);
+
+  std::unique_ptr<char[]> buf(new char[kCompressBufferSize]);
+  bool success = true;
+  for (;;) {
+    auto n = read(fd, buf.get(), kCompressBufferSize);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      success = n == 0;
+      break;
+    }
+
+    if (gzwrite(gz, buf.get(), n) != n) {
+      success = false;
+      break;
+    }
+  }
+
+  close(fd);
+  if (gzclose(gz) != Z_OK) {
+    success = false;
+  }
+
+  if (!success || rename(tmp_path.c_str(), gz_path.c_str()) < 0) {
+    logError("logfile output: compressing '$0' failed", path);
+    unlink(tmp_path.c_str());
+    return;
+  }
+
+  unlink(path.c_str());
+  ++segments_compressed_;
+#endif
+}
+
+void LogfileTarget::getStats(std::string* stats) const {
+  *stats = StringUtil::format(
+      "{\"events_enqueued\":$0,\"bytes_written\":$1,\"bytes_dropped\":$2,"
+      "\"write_calls\":$3,\"fsync_calls\":$4,\"segments_rotated\":$5,"
+      "\"segments_compressed\":$6}",
+      events_enqueued_.load(),
+      bytes_written_.load(),
+      bytes_dropped_.load(),
+      write_calls_.load(),
+      fsync_calls_.load(),
+      segments_rotated_.load(),
+      segments_compressed_.load());
+}
+
+static ReturnCode getUInt64Property(
+    const PropertyList& config,
+    const std::string& key,
+    uint64_t* value) {
+  std::string opt;
+  if (!config.get(key, &opt)) {
+    return ReturnCode::success();
+  }
+
+  try {
+    *value = std::stoull(opt);
+  } catch (...) {
+    return ReturnCode::error(
+        "EINVAL",
+        "invalid value for %s: '%s'",
+        key.c_str(),
+        opt.c_str());
+  }
+
+  return ReturnCode::success();
+}
+
+ReturnCode LogfileOutputPlugin::pluginAttach(
+    const PropertyList& config,
+    void** userdata) {
+  std::string directory;
+  if (config.get("directory", &directory)) {
+    struct stat st;
+    if (stat(directory.c_str(), &st) < 0 || !S_ISDIR(st.st_mode)) {
+      return ReturnCode::error(
+          "EINVAL",
+          "logfile output directory '%s' does not exist",
+          directory.c_str());
+    }
+  }
+
+  std::unique_ptr<LogfileTarget> target(new LogfileTarget(directory));
+
+  std::vector<std::vector<std::string>> routes;
+  config.get("route", &routes);
+  for (const auto& route : routes) {
+    if (route.size() != 2) {
+      return ReturnCode::error(
+          "EINVAL",
+          "invalid value for route, format is: route <event> <file>");
+    }
+
+    auto rc = target->addRoute(route[0], route[1]);
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  if (routes.empty()) {
+    auto rc = target->addRoute("*", "%E.ndjson");
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  uint64_t buffer_size = LogfileTarget::kDefaultBufferSize;
+  uint64_t flush_interval = LogfileTarget::kDefaultFlushInterval /
+      kMicrosPerMilli;
+  uint64_t fsync_interval = 0;
+  uint64_t rotate_size = 0;
+  uint64_t rotate_interval = 0;
+
+  {
+    auto rc = getUInt64Property(config, "buffer_size", &buffer_size);
+    if (rc.isSuccess()) {
+      rc = getUInt64Property(config, "flush_interval_ms", &flush_interval);
+    }
+    if (rc.isSuccess()) {
+      rc = getUInt64Property(config, "fsync_interval_ms", &fsync_interval);
+    }
+    if (rc.isSuccess()) {
+      rc = getUInt64Property(config, "rotate_size", &rotate_size);
+    }
+    if (rc.isSuccess()) {
+      rc = getUInt64Property(config, "rotate_interval_secs", &rotate_interval);
+    }
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  target->setBufferSize(buffer_size);
+  target->setFlushInterval(flush_interval * kMicrosPerMilli);
+  target->setFsyncInterval(fsync_interval * kMicrosPerMilli);
+  target->setRotateSize(rotate_size);
+  target->setRotateInterval(rotate_interval * kMicrosPerSecond);
+
+  std::string compression;
+  if (config.get("compression", &compression)) {
+    auto rc = target->setCompression(compression);
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  {
+    auto rc = target->startWriterThread();
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  *userdata = target.release();
+  return ReturnCode::success();
+}
+
+void LogfileOutputPlugin::pluginDetach(void* userdata) {
+  auto target = static_cast<LogfileTarget*>(userdata);
+  target->stopWriterThread();
+  delete target;
+}
+
+ReturnCode LogfileOutputPlugin::pluginEmitEvent(
+    void* userdata,
+    const EventData& evdata) {
+  return static_cast<LogfileTarget*>(userdata)->emitEvent(evdata);
+}
+
+ReturnCode LogfileOutputPlugin::pluginGetStats(
+    void* userdata,
+    std::string* stats) {
+  static_cast<LogfileTarget*>(userdata)->getStats(stats);
+  return ReturnCode::success();
+}
+
+} // namespace evcollect
@@ -0,0 +1,59 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <string>
+#include <evcollect/evcollect.h>
+#include <evcollect/plugin.h>
+
+namespace evcollect {
+
+/**
+ * Appends events as newline-delimited JSON to local files. Each route maps
+ * an event name (or glob) to a file path, which may contain %E for the event
+ * name. Events are collected in large userspace buffers and written out by a
+ * background thread with writev, so there is no write syscall per event
+ */
+class LogfileOutputPlugin : public OutputPlugin {
+public:
+
+  static void registerPlugin(PluginMap* plugin_map);
+
+  ReturnCode pluginAttach(
+      const PropertyList& config,
+      void** userdata) override;
+
+  void pluginDetach(
+      void* userdata) override;
+
+  ReturnCode pluginEmitEvent(
+      void* userdata,
+      const EventData& evdata) override;
+
+  ReturnCode pluginGetStats(
+      void* userdata,
+      std::string* stats) override;
+
+};
+
+} // namespace evcollect
@@ -0,0 +1,523 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <errno.h>
+#include <string.h>
+#include <evcollect/netstats.h>
+#include <evcollect/util/time.h>
+
+namespace evcollect {
+
+void NetdevSourcePlugin::registerPlugin(PluginMap* plugin_map) {
+  plugin_map->registerSourcePlugin(
+      "linux.netdev",
+      std::unique_ptr<SourcePlugin>(new NetdevSourcePlugin()));
+}
+
+void NetsnmpSourcePlugin::registerPlugin(PluginMap* plugin_map) {
+  plugin_map->registerSourcePlugin(
+      "linux.netsnmp",
+      std::unique_ptr<SourcePlugin>(new NetsnmpSourcePlugin()));
+}
+
+namespace {
+
+/* the columns of /proc/net/dev that are reported, after the interface name */
+const size_t kNetdevColumns[] = { 0, 1, 2, 3, 8, 9, 10, 11 };
+const size_t kNumNetdevColumns = 16;
+
+const char* kNetdevFieldNames[] = {
+  "rx_bytes_per_sec",
+  "rx_packets_per_sec",
+  "rx_errors_per_sec",
+  "rx_dropped_per_sec",
+  "tx_bytes_per_sec",
+  "tx_packets_per_sec",
+  "tx_errors_per_sec",
+  "tx_dropped_per_sec"
+};
+
+struct SnmpField {
+  const char* proto;
+  const char* key;
+  const char* json_name;
+  bool gauge;
+};
+
+/* all fields except for gauges are reported as per second rates */
+const SnmpField kSnmpFields[] = {
+  { "Ip", "InReceives", "ip_in_receives_per_sec", false },
+  { "Ip", "InDelivers", "ip_in_delivers_per_sec", false },
+  { "Ip", "OutRequests", "ip_out_requests_per_sec", false },
+  { "Ip", "InDiscards", "ip_in_discards_per_sec", false },
+  { "Ip", "OutDiscards", "ip_out_discards_per_sec", false },
+  { "Tcp", "ActiveOpens", "tcp_active_opens_per_sec", false },
+  { "Tcp", "PassiveOpens", "tcp_passive_opens_per_sec", false },
+  { "Tcp", "AttemptFails", "tcp_attempt_fails_per_sec", false },
+  { "Tcp", "EstabResets", "tcp_estab_resets_per_sec", false },
+  { "Tcp", "CurrEstab", "tcp_curr_estab", true },
+  { "Tcp", "InSegs", "tcp_in_segs_per_sec", false },
+  { "Tcp", "OutSegs", "tcp_out_segs_per_sec", false },
+  { "Tcp", "RetransSegs", "tcp_retrans_segs_per_sec", false },
+  { "Tcp", "InErrs", "tcp_in_errors_per_sec", false },
+  { "Tcp", "OutRsts", "tcp_out_resets_per_sec", false },
+  { "Udp", "InDatagrams", "udp_in_datagrams_per_sec", false },
+  { "Udp", "OutDatagrams", "udp_out_datagrams_per_sec", false },
+  { "Udp", "NoPorts", "udp_no_ports_per_sec", false },
+  { "Udp", "InErrors", "udp_in_errors_per_sec", false },
+  { "Udp", "RcvbufErrors", "udp_rcvbuf_errors_per_sec", false },
+  { "Udp", "SndbufErrors", "udp_sndbuf_errors_per_sec", false }
+};
+
+const size_t kNumSnmpFields = sizeof(kSnmpFields) / sizeof(kSnmpFields[0]);
+
+/* indexes into kSnmpFields, for the retransmit ratio */
+const size_t kTcpOutSegsField = 11;
+const size_t kTcpRetransSegsField = 12;
+
+bool matchToken(
+    const char* begin,
+    const char* end,
+    const char* token) {
+  auto len = strlen(token);
+  return size_t(end - begin) == len && memcmp(begin, token, len) == 0;
+}
+
+} // namespace
+
+NetdevSource::NetdevSource() :
+    generation_(0),
+    time_(0),
+    prev_time_(0),
+    pending_pos_(0) {}
+
+void NetdevSource::addInterfaceFilter(const std::string& name) {
+  filter_.emplace_back(name);
+}
+
+ReturnCode NetdevSource::open(const std::string& proc_dir, uint64_t now) {
+  auto path = proc_dir + "/net/dev";
+  auto rc = file_.open(path, false);
+  if (!rc.isSuccess()) {
+    return rc;
+  }
+
+  if (!takeSample(now)) {
+    return ReturnCode::error(
+        "EIO",
+        "error while reading from %s: %s",
+        path.c_str(),
+        strerror(errno));
+  }
+
+  pending_.clear();
+  return ReturnCode::success();
+}
+
+ReturnCode NetdevSource::getNextEvent(
+    uint64_t now,
+    std::string* event_json) {
+  if (pending_pos_ >= pending_.size() && !takeSample(now)) {
+    return ReturnCode::error(
+        "EIO",
+        "error while reading network interface stats: %s",
+        strerror(errno));
+  }
+
+  if (pending_pos_ >= pending_.size()) {
+    return ReturnCode::success();
+  }
+
+  auto len = formatEvent(*pending_[pending_pos_++], out_, sizeof(out_));
+  if (len == 0) {
+    return ReturnCode::error("EIO", "network interface event too large");
+  }
+
+  event_json->append(out_, len);
+  return ReturnCode::success();
+}
+
+bool NetdevSource::hasPendingEvent() const {
+  return pending_pos_ < pending_.size();
+}
+
+size_t NetdevSource::getNumInterfaces() const {
+  return interfaces_.size();
+}
+
+bool NetdevSource::takeSample(uint64_t now) {
+  if (!file_.read()) {
+    return false;
+  }
+
+  ++generation_;
+  pending_.clear();
+  pending_pos_ = 0;
+  prev_time_ = time_;
+  time_ = now;
+
+  /*
+   * Inter-|   Receive                            |  Transmit
+   *  face |bytes    packets errs drop fifo ...   |bytes    packets ...
+   *   eth0: 1234 12 0 0 0 0 0 0 5678 34 0 0 0 0 0 0
+   */
+  auto end = file_.end();
+  auto line = ProcParser::nextLine(file_.begin(), end);
+  line = ProcParser::nextLine(line, end);
+  for (; line < end; line = ProcParser::nextLine(line, end)) {
+    auto line_end = ProcParser::nextLine(line, end);
+    auto name = ProcParser::skipBlanks(line, line_end);
+    auto colon = static_cast<const char*>(
+        memchr(name, ':', line_end - name));
+    if (!colon) {
+      continue;
+    }
+
+    size_t name_len = colon - name;
+    if (!matchInterface(name, name_len)) {
+      continue;
+    }
+
+    uint64_t values[kNumNetdevColumns];
+    auto cur = colon + 1;
+    for (size_t i = 0; i < kNumNetdevColumns; ++i) {
+      cur = ProcParser::scanUInt(cur, line_end, &values[i]);
+    }
+
+    auto& iface = interfaces_[std::string(name, name_len)];
+    if (iface.generation == 0) {
+      iface.name.assign(name, name_len);
+      iface.has_prev = false;
+    } else {
+      memcpy(iface.prev, iface.cur, sizeof(iface.prev));
+      iface.has_prev = true;
+    }
+
+    for (size_t i = 0; i < kNumCounters; ++i) {
+      iface.cur[i] = values[kNetdevColumns[i]];
+    }
+
+    iface.generation = generation_;
+    if (iface.has_prev) {
+      pending_.emplace_back(&iface);
+    }
+  }
+
+  for (auto iter = interfaces_.begin(); iter != interfaces_.end(); ) {
+    if (iter->second.generation == generation_) {
+      ++iter;
+    } else {
+      iter = interfaces_.erase(iter);
+    }
+  }
+
+  return true;
+}
+
+bool NetdevSource::matchInterface(const char* name, size_t name_len) const {
+  if (filter_.empty()) {
+    return true;
+  }
+
+  for (const auto& f : filter_) {
+    if (f.size() == name_len && memcmp(f.data(), name, name_len) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+size_t NetdevSource::formatEvent(
+    const Interface& iface,
+    char* out,
+    size_t out_size) const {
+  auto interval = time_ > prev_time_ ? time_ - prev_time_ : 0;
+
+  EventWriter w(out, out_size);
+  w.addString("interface", iface.name.data(), iface.name.size());
+  for (size_t i = 0; i < kNumCounters; ++i) {
+    auto delta = ProcParser::wrappingCounterDelta(iface.cur[i], iface.prev[i]);
+    w.addFixed2(kNetdevFieldNames[i], ProcParser::rate(delta, interval));
+  }
+
+  return w.finish();
+}
+
+NetsnmpSource::NetsnmpSource() :
+    num_fields_(kNumSnmpFields),
+    cur_(samples_[0]),
+    prev_(samples_[1]),
+    time_(0),
+    prev_time_(0) {
+  static_assert(
+      sizeof(kSnmpFields) / sizeof(kSnmpFields[0]) <= kMaxFields,
+      "too many snmp fields");
+
+  for (size_t i = 0; i < kMaxFields; ++i) {
+    field_line_[i] = -1;
+    field_column_[i] = -1;
+  }
+
+  memset(samples_, 0, sizeof(samples_));
+}
+
+ReturnCode NetsnmpSource::open(const std::string& proc_dir, uint64_t now) {
+  auto path = proc_dir + "/net/snmp";
+  auto rc = file_.open(path, false);
+  if (!rc.isSuccess()) {
+    return rc;
+  }
+
+  /*
+   * Tcp: RtoAlgorithm RtoMin RtoMax MaxConn ActiveOpens ...
+   * Tcp: 1 200 120000 -1 463 ...
+   */
+  auto end = file_.end();
+  int line_idx = 0;
+  for (auto line = file_.begin(); line < end; ++line_idx) {
+    auto line_end = ProcParser::nextLine(line, end);
+    auto colon = static_cast<const char*>(
+        memchr(line, ':', line_end - line));
+
+    if (line_idx % 2 == 0 && colon) {
+      auto cur = colon + 1;
+      for (int column = 0; ; ++column) {
+        cur = ProcParser::skipBlanks(cur, line_end);
+        if (cur == line_end || *cur == '\n') {
+          break;
+        }
+
+        auto token_end = ProcParser::skipField(cur, line_end);
+        for (size_t i = 0; i < num_fields_; ++i) {
+          const auto& f = kSnmpFields[i];
+          if (matchToken(line, colon, f.proto) &&
+              matchToken(cur, token_end, f.key)) {
+            field_line_[i] = line_idx + 1;
+            field_column_[i] = column;
+          }
+        }
+
+        cur = token_end;
+      }
+    }
+
+    line = line_end;
+  }
+
+  prev_time_ = now;
+  if (!takeSample(prev_)) {
+    return ReturnCode::error(
+        "EIO",
+        "error while reading from %s: %s",
+        path.c_str(),
+        strerror(errno));
+  }
+
+  return ReturnCode::success();
+}
+
+ReturnCode NetsnmpSource::getNextEvent(
+    uint64_t now,
+    std::string* event_json) {
+  if (!takeSample(cur_)) {
+    return ReturnCode::error(
+        "EIO",
+        "error while reading network protocol stats: %s",
+        strerror(errno));
+  }
+
+  auto interval = now > prev_time_ ? now - prev_time_ : 0;
+  auto len = formatEvent(interval, out_, sizeof(out_));
+  std::swap(cur_, prev_);
+  prev_time_ = now;
+
+  if (len == 0) {
+    return ReturnCode::error("EIO", "network protocol event too large");
+  }
+
+  event_json->append(out_, len);
+  return ReturnCode::success();
+}
+
+bool NetsnmpSource::takeSample(uint64_t* values) {
+  if (!file_.read()) {
+    return false;
+  }
+
+  memset(values, 0, sizeof(uint64_t) * kMaxFields);
+
+  auto end = file_.end();
+  int line_idx = 0;
+  for (auto line = file_.begin(); line < end; ++line_idx) {
+    auto line_end = ProcParser::nextLine(line, end);
+    auto colon = static_cast<const char*>(
+        memchr(line, ':', line_end - line));
+
+    if (line_idx % 2 == 0 || !colon) {
+      line = line_end;
+      continue;
+    }
+
+    /* MaxConn is -1, negative values are read as zero */
+    uint64_t columns[kMaxColumns];
+    size_t num_columns = 0;
+    for (auto cur = colon + 1; num_columns < kMaxColumns; ) {
+      cur = ProcParser::skipBlanks(cur, line_end);
+      if (cur == line_end || *cur == '\n') {
+        break;
+      }
+
+      auto next = ProcParser::scanUInt(cur, line_end, &columns[num_columns]);
+      if (next == cur) {
+        columns[num_columns] = 0;
+        next = ProcParser::skipField(cur, line_end);
+      }
+
+      ++num_columns;
+      cur = next;
+    }
+
+    for (size_t i = 0; i < num_fields_; ++i) {
+      if (field_line_[i] == line_idx && field_column_[i] < num_columns) {
+        values[i] = columns[field_column_[i]];
+      }
+    }
+
+    line = line_end;
+  }
+
+  return true;
+}
+
+size_t NetsnmpSource::formatEvent(
+    uint64_t interval,
+    char* out,
+    size_t out_size) const {
+  EventWriter w(out, out_size);
+  for (size_t i = 0; i < num_fields_; ++i) {
+    const auto& f = kSnmpFields[i];
+    if (field_line_[i] < 0) {
+      continue;
+    }
+
+    if (f.gauge) {
+      w.addUInt(f.json_name, cur_[i]);
+    } else {
+      auto delta = ProcParser::wrappingCounterDelta(cur_[i], prev_[i]);
+      w.addFixed2(f.json_name, ProcParser::rate(delta, interval));
+    }
+  }
+
+  if (field_line_[kTcpOutSegsField] >= 0 &&
+      field_line_[kTcpRetransSegsField] >= 0) {
+    auto out_segs = ProcParser::wrappingCounterDelta(
+        cur_[kTcpOutSegsField],
+        prev_[kTcpOutSegsField]);
+    auto retrans_segs = ProcParser::wrappingCounterDelta(
+        cur_[kTcpRetransSegsField],
+        prev_[kTcpRetransSegsField]);
+
+    w.addFixed2(
+        "tcp_retrans_percent",
+        out_segs > 0 ? (retrans_segs * 10000 + out_segs / 2) / out_segs : 0);
+  }
+
+  return w.finish();
+}
+
+ReturnCode NetdevSourcePlugin::pluginAttach(
+    const PropertyList& config,
+    void** userdata) {
+  std::string proc_dir = "/proc";
+  config.get("proc_dir", &proc_dir);
+
+  std::unique_ptr<NetdevSource> source(new NetdevSource());
+
+  std::vector<std::vector<std::string>> interfaces;
+  config.get("interface", &interfaces);
+  for (const auto& i : interfaces) {
+    for (const auto& name : i) {
+      source->addInterfaceFilter(name);
+    }
+  }
+
+  auto rc = source->open(proc_dir, MonotonicClock::now());
+  if (!rc.isSuccess()) {
+    return rc;
+  }
+
+  *userdata = source.release();
+  return ReturnCode::success();
+}
+
+void NetdevSourcePlugin::pluginDetach(void* userdata) {
+  delete static_cast<NetdevSource*>(userdata);
+}
+
+ReturnCode NetdevSourcePlugin::pluginGetNextEvent(
+    void* userdata,
+    std::string* event_json) {
+  return static_cast<NetdevSource*>(userdata)->getNextEvent(
+      MonotonicClock::now(),
+      event_json);
+}
+
+bool NetdevSourcePlugin::pluginHasPendingEvent(void* userdata) {
+  return static_cast<NetdevSource*>(userdata)->hasPendingEvent();
+}
+
+ReturnCode NetsnmpSourcePlugin::pluginAttach(
+    const PropertyList& config,
+    void** userdata) {
+  std::string proc_dir = "/proc";
+  config.get("proc_dir", &proc_dir);
+
+  std::unique_ptr<NetsnmpSource> source(new NetsnmpSource());
+  auto rc = source->open(proc_dir, MonotonicClock::now());
+  if (!rc.isSuccess()) {
+    return rc;
+  }
+
+  *userdata = source.release();
+  return ReturnCode::success();
+}
+
+void NetsnmpSourcePlugin::pluginDetach(void* userdata) {
+  delete static_cast<NetsnmpSource*>(userdata);
+}
+
+ReturnCode NetsnmpSourcePlugin::pluginGetNextEvent(
+    void* userdata,
+    std::string* event_json) {
+  return static_cast<NetsnmpSource*>(userdata)->getNextEvent(
+      MonotonicClock::now(),
+      event_json);
+}
+
+bool NetsnmpSourcePlugin::pluginHasPendingEvent(void* userdata) {
+  return false;
+}
+
+} // namespace evcollect
+
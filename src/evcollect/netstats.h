@@ -0,0 +1,177 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <evcollect/evcollect.h>
+#include <evcollect/plugin.h>
+#include <evcollect/util/procfs.h>
+
+namespace evcollect {
+
+/**
+ * Reads /proc/net/dev and emits one event per network interface and tick with
+ * the receive and transmit rates since the previous tick. Interfaces that
+ * disappear are dropped from the table on the next tick
+ */
+class NetdevSource {
+public:
+
+  NetdevSource();
+
+  /**
+   * Only report the given interfaces
+   */
+  void addInterfaceFilter(const std::string& name);
+
+  /**
+   * Open /proc/net/dev below proc_dir and take the baseline sample
+   */
+  ReturnCode open(const std::string& proc_dir, uint64_t now);
+
+  /**
+   * Takes a sample and returns the event of the first interface; the other
+   * interfaces are returned by the following calls while hasPendingEvent()
+   * returns true
+   */
+  ReturnCode getNextEvent(uint64_t now, std::string* event_json);
+  bool hasPendingEvent() const;
+
+  size_t getNumInterfaces() const;
+
+protected:
+
+  enum { RX_BYTES, RX_PACKETS, RX_ERRORS, RX_DROPPED, TX_BYTES, TX_PACKETS,
+      TX_ERRORS, TX_DROPPED, kNumCounters };
+
+  static const size_t kMaxEventSize = 1024;
+
+  struct Interface {
+    std::string name;
+    uint64_t generation;
+    bool has_prev;
+    uint64_t cur[kNumCounters];
+    uint64_t prev[kNumCounters];
+  };
+
+  bool takeSample(uint64_t now);
+  bool matchInterface(const char* name, size_t name_len) const;
+  size_t formatEvent(const Interface& iface, char* out, size_t out_size) const;
+
+  ProcFile file_;
+  uint64_t generation_;
+  uint64_t time_;
+  uint64_t prev_time_;
+  std::unordered_map<std::string, Interface> interfaces_;
+  std::vector<std::string> filter_;
+  std::vector<const Interface*> pending_;
+  size_t pending_pos_;
+  char out_[kMaxEventSize];
+};
+
+/**
+ * Reads the ip, tcp and udp counters from /proc/net/snmp and emits them as
+ * one event per tick with per second rates (and the number of established
+ * tcp connections and the tcp retransmit ratio)
+ */
+class NetsnmpSource {
+public:
+
+  NetsnmpSource();
+
+  /**
+   * Open /proc/net/snmp below proc_dir, look up the columns of the reported
+   * counters and take the baseline sample
+   */
+  ReturnCode open(const std::string& proc_dir, uint64_t now);
+
+  ReturnCode getNextEvent(uint64_t now, std::string* event_json);
+
+protected:
+
+  static const size_t kMaxFields = 32;
+  static const size_t kMaxColumns = 64;
+  static const size_t kMaxEventSize = 2048;
+
+  bool takeSample(uint64_t* values);
+  size_t formatEvent(uint64_t interval, char* out, size_t out_size) const;
+
+  ProcFile file_;
+  size_t num_fields_;
+  /* the line and column of each field, or -1 if the kernel doesn't have it */
+  int field_line_[kMaxFields];
+  int field_column_[kMaxFields];
+  uint64_t samples_[2][kMaxFields];
+  uint64_t* cur_;
+  uint64_t* prev_;
+  uint64_t time_;
+  uint64_t prev_time_;
+  char out_[kMaxEventSize];
+};
+
+class NetdevSourcePlugin : public SourcePlugin {
+public:
+
+  static void registerPlugin(PluginMap* plugin_map);
+
+  ReturnCode pluginAttach(
+      const PropertyList& config,
+      void** userdata) override;
+
+  void pluginDetach(
+      void* userdata) override;
+
+  ReturnCode pluginGetNextEvent(
+      void* userdata,
+      std::string* event_json) override;
+
+  bool pluginHasPendingEvent(
+      void* userdata) override;
+
+};
+
+class NetsnmpSourcePlugin : public SourcePlugin {
+public:
+
+  static void registerPlugin(PluginMap* plugin_map);
+
+  ReturnCode pluginAttach(
+      const PropertyList& config,
+      void** userdata) override;
+
+  void pluginDetach(
+      void* userdata) override;
+
+  ReturnCode pluginGetNextEvent(
+      void* userdata,
+      std::string* event_json) override;
+
+  bool pluginHasPendingEvent(
+      void* userdata) override;
+
+};
+
+} // namespace evcollect
+
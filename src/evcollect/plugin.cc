@@ -22,10 +22,12 @@
  * code of your own applications
  */
 #include <dlfcn.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <evcollect/plugin.h>
+#include <evcollect/host_metadata.h>
 #include <evcollect/service.h>
 #include <evcollect/util/logging.h>
 
@@ -46,6 +48,19 @@ ReturnCode SourcePlugin::pluginAttach(
 
 void SourcePlugin::pluginDetach(void* userdata) {}
 
+bool SourcePlugin::pluginGetPollFD(
+    void* userdata,
+    int* fd,
+    uint64_t* deadline) {
+  return false;
+}
+
+ReturnCode SourcePlugin::pluginPollEvent(
+    void* userdata,
+    std::string* event_json) {
+  return pluginGetNextEvent(userdata, event_json);
+}
+
 DynamicSourcePlugin::DynamicSourcePlugin(
     PluginContext* ctx,
     evcollect_plugin_getnextevent_fn getnextevent_fn,
@@ -137,6 +152,12 @@ ReturnCode OutputPlugin::pluginAttach(
 
 void OutputPlugin::pluginDetach(void* userdata) {}
 
+ReturnCode OutputPlugin::pluginGetStats(
+    void* userdata,
+    std::string* stats) {
+  return ReturnCode::success();
+}
+
 DynamicOutputPlugin::DynamicOutputPlugin(
     PluginContext* ctx,
     evcollect_plugin_emitevent_fn emitevent_fn,
@@ -146,6 +167,7 @@ DynamicOutputPlugin::DynamicOutputPlugin(
     evcollect_plugin_free_fn free_fn) :
     ctx_(ctx),
     emitevent_fn_(emitevent_fn),
+    getstats_fn_(nullptr),
     attach_fn_(attach_fn),
     detach_fn_(detach_fn),
     init_fn_(init_fn),
@@ -200,6 +222,30 @@ ReturnCode DynamicOutputPlugin::pluginEmitEvent(
   }
 }
 
+ReturnCode DynamicOutputPlugin::pluginGetStats(
+    void* userdata,
+    std::string* stats) {
+  if (!getstats_fn_) {
+    return ReturnCode::success();
+  }
+
+  EventData ev;
+  if (getstats_fn_(ctx_, userdata, &ev)) {
+    *stats = std::move(ev.event_data);
+    return ReturnCode::success();
+  } else {
+    return ReturnCode::error(
+        "EPLUGIN",
+        "pluginGetStats failed: %s",
+        ctx_->error.c_str());
+  }
+}
+
+void DynamicOutputPlugin::setGetStatsFn(
+    evcollect_plugin_getstats_fn getstats_fn) {
+  getstats_fn_ = getstats_fn;
+}
+
 ReturnCode loadPlugin(
     PluginContext* plugin_ctx,
     std::string plugin_name,
@@ -335,6 +381,16 @@ ReturnCode PluginMap::getOutputPlugin(
   return ReturnCode::success();
 }
 
+OutputPlugin* PluginMap::findOutputPlugin(
+    const std::string& plugin_name) const {
+  auto iter = output_plugins_.find(plugin_name);
+  if (iter == output_plugins_.end()) {
+    return nullptr;
+  } else {
+    return iter->second.plugin.get();
+  }
+}
+
 } // namespace evcollect
 
 void evcollect_log(
@@ -431,6 +487,38 @@ void evcollect_event_setdata(
   ev_->event_data = std::string(data, size);
 }
 
+uint64_t evcollect_event_gettime(const evcollect_event_t* ev) {
+  return static_cast<const evcollect::EventData*>(ev)->time;
+}
+
+int evcollect_host_getname(
+    evcollect_ctx_t* ctx,
+    char* hostname,
+    size_t hostname_size,
+    char* fqdn,
+    size_t fqdn_size) {
+  auto ctx_ = static_cast<evcollect::PluginContext*>(ctx);
+  if (!ctx_->host_metadata) {
+    return false;
+  }
+
+  ctx_->host_metadata->start();
+  auto snapshot = ctx_->host_metadata->getSnapshot();
+
+  const auto& name = snapshot->hostname;
+  const auto& name_fqdn = snapshot->hostname_fqdn.empty() ?
+      snapshot->hostname :
+      snapshot->hostname_fqdn;
+
+  if (name.size() >= hostname_size || name_fqdn.size() >= fqdn_size) {
+    return false;
+  }
+
+  memcpy(hostname, name.c_str(), name.size() + 1);
+  memcpy(fqdn, name_fqdn.c_str(), name_fqdn.size() + 1);
+  return true;
+}
+
 void evcollect_source_plugin_register(
     evcollect_ctx_t* ctx,
     const char* plugin_name,
@@ -475,3 +563,20 @@ void evcollect_output_plugin_register(
               free_fn)));
 }
 
+void evcollect_output_plugin_register_stats(
+    evcollect_ctx_t* ctx,
+    const char* plugin_name,
+    evcollect_plugin_getstats_fn getstats_fn) {
+  auto ctx_ = static_cast<evcollect::PluginContext*>(ctx);
+  auto plugin = dynamic_cast<evcollect::DynamicOutputPlugin*>(
+      ctx_->plugin_map->findOutputPlugin(plugin_name));
+
+  if (!plugin) {
+    logWarning(
+        "can't register stats for unknown output plugin: $0",
+        plugin_name);
+    return;
+  }
+
+  plugin->setGetStatsFn(getstats_fn);
+}
@@ -31,6 +31,7 @@
 
 namespace evcollect {
 class PluginMap;
+class HostMetadata;
 
 struct PluginConfig {
   std::string spool_dir;
@@ -39,6 +40,7 @@ struct PluginConfig {
 struct PluginContext {
   std::string error;
   PluginMap* plugin_map;
+  HostMetadata* host_metadata;
 };
 
 class SourcePlugin {
@@ -82,6 +84,28 @@ public:
   virtual bool pluginHasPendingEvent(
       void* userdata) = 0;
 
+  /**
+   * Sources that complete their events asynchronously (e.g. by waiting for a
+   * child process) return a file descriptor for the service to watch and/or
+   * a deadline (MonotonicClock) at which they want to be called again. The
+   * service then calls pluginGetNextEvent outside of the regular interval.
+   * Returns false if there is nothing to wait for
+   */
+  virtual bool pluginGetPollFD(
+      void* userdata,
+      int* fd,
+      uint64_t* deadline);
+
+  /**
+   * Called instead of pluginGetNextEvent when the fd returned from
+   * pluginGetPollFD is readable or the deadline has passed, for sources that
+   * need to tell these calls apart from the regular interval. Defaults to
+   * pluginGetNextEvent
+   */
+  virtual ReturnCode pluginPollEvent(
+      void* userdata,
+      std::string* event_json);
+
 };
 
 class DynamicSourcePlugin : public SourcePlugin {
@@ -148,6 +172,14 @@ public:
       void* userdata,
       const EventData& evdata) = 0;
 
+  /**
+   * Return the metrics for an attached output as a JSON object. Leaves stats
+   * empty if the plugin does not provide any metrics
+   */
+  virtual ReturnCode pluginGetStats(
+      void* userdata,
+      std::string* stats);
+
 };
 
 class DynamicOutputPlugin : public OutputPlugin {
@@ -166,10 +198,14 @@ public:
   ReturnCode pluginAttach(const PropertyList& config, void** userdata) override;
   void pluginDetach(void* userdata) override;
   ReturnCode pluginEmitEvent(void* userdata, const EventData& evdata) override;
+  ReturnCode pluginGetStats(void* userdata, std::string* stats) override;
+
+  void setGetStatsFn(evcollect_plugin_getstats_fn getstats_fn);
 
 protected:
   PluginContext* ctx_;
   evcollect_plugin_emitevent_fn emitevent_fn_;
+  evcollect_plugin_getstats_fn getstats_fn_;
   evcollect_plugin_attach_fn attach_fn_;
   evcollect_plugin_detach_fn detach_fn_;
   evcollect_plugin_init_fn init_fn_;
@@ -203,6 +239,12 @@ public:
       const std::string& plugin_name,
       OutputPlugin** plugin) const;
 
+  /**
+   * Like getOutputPlugin, but does not initialize the plugin. Returns
+   * nullptr if no such plugin was registered
+   */
+  OutputPlugin* findOutputPlugin(const std::string& plugin_name) const;
+
 protected:
 
   struct SourcePluginBinding {
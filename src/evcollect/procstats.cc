@@ -0,0 +1,589 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <evcollect/procstats.h>
+#include <evcollect/util/procfs.h>
+#include <evcollect/util/time.h>
+
+namespace evcollect {
+
+void ProcstatsSourcePlugin::registerPlugin(PluginMap* plugin_map) {
+  plugin_map->registerSourcePlugin(
+      "linux.procstats",
+      std::unique_ptr<SourcePlugin>(new ProcstatsSourcePlugin()));
+}
+
+namespace {
+
+struct ProcField {
+  const char* key;
+  size_t key_len;
+  const char* json_name;
+};
+
+/* monotonic counters from /proc/[pid]/io, reported as per second rates */
+const ProcField kIOFields[] = {
+  { "rchar:", 6, "rchar_per_sec" },
+  { "wchar:", 6, "wchar_per_sec" },
+  { "read_bytes:", 11, "read_bytes_per_sec" },
+  { "write_bytes:", 12, "write_bytes_per_sec" }
+};
+
+const size_t kNumIOFields = sizeof(kIOFields) / sizeof(kIOFields[0]);
+
+const char* kProcessFileNames[] = { "stat", "status", "io" };
+
+bool parsePid(const char* name, pid_t* pid) {
+  if (*name == 0) {
+    return false;
+  }
+
+  uint64_t v = 0;
+  for (; *name; ++name) {
+    if (*name < '0' || *name > '9') {
+      return false;
+    }
+
+    v = v * 10 + (*name - '0');
+  }
+
+  *pid = v;
+  return true;
+}
+
+} // namespace
+
+ProcstatsSource::ProcstatsSource() :
+    dir_(nullptr),
+    dir_fd_(-1),
+    num_fds_(0),
+    max_fds_(kMaxFDs),
+    generation_(0),
+    limit_(0),
+    pending_pos_(0),
+    buf_(new char[kReadBufferSize]),
+    clock_ticks_(sysconf(_SC_CLK_TCK)),
+    page_size_(sysconf(_SC_PAGESIZE)) {
+  /* leave at least half of the fd limit to the rest of the daemon */
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+    max_fds_ = std::min(max_fds_, size_t(rl.rlim_cur / 2));
+  }
+}
+
+ProcstatsSource::~ProcstatsSource() {
+  for (auto& p : processes_) {
+    closeFiles(&p.second);
+  }
+
+  if (dir_) {
+    closedir(dir_);
+  }
+}
+
+void ProcstatsSource::addCommandFilter(const std::string& command) {
+  commands_.emplace_back(command);
+}
+
+void ProcstatsSource::setLimit(size_t n) {
+  limit_ = n;
+}
+
+ReturnCode ProcstatsSource::open(const std::string& proc_dir, uint64_t now) {
+  proc_dir_ = proc_dir;
+  dir_ = opendir(proc_dir.c_str());
+  if (!dir_) {
+    return ReturnCode::error(
+        "EIO",
+        "opendir(%s) failed: %s",
+        proc_dir.c_str(),
+        strerror(errno));
+  }
+
+  dir_fd_ = dirfd(dir_);
+
+  if (!scan(now)) {
+    return ReturnCode::error(
+        "EIO",
+        "error while reading from %s: %s",
+        proc_dir.c_str(),
+        strerror(errno));
+  }
+
+  pending_.clear();
+  return ReturnCode::success();
+}
+
+ReturnCode ProcstatsSource::getNextEvent(
+    uint64_t now,
+    std::string* event_json) {
+  if (pending_pos_ >= pending_.size() && !scan(now)) {
+    return ReturnCode::error(
+        "EIO",
+        "error while reading from %s: %s",
+        proc_dir_.c_str(),
+        strerror(errno));
+  }
+
+  if (pending_pos_ >= pending_.size()) {
+    return ReturnCode::success();
+  }
+
+  const auto& process = *pending_[pending_pos_++];
+  auto len = formatEvent(process, out_, sizeof(out_));
+  if (len == 0) {
+    return ReturnCode::error(
+        "EIO",
+        "stats event for pid %d too large",
+        int(process.pid));
+  }
+
+  event_json->append(out_, len);
+  return ReturnCode::success();
+}
+
+bool ProcstatsSource::hasPendingEvent() const {
+  return pending_pos_ < pending_.size();
+}
+
+size_t ProcstatsSource::getNumProcesses() const {
+  return processes_.size();
+}
+
+size_t ProcstatsSource::getNumFDs() const {
+  return num_fds_;
+}
+
+bool ProcstatsSource::scan(uint64_t now) {
+  ++generation_;
+  pending_.clear();
+  pending_pos_ = 0;
+
+  rewinddir(dir_);
+  for (;;) {
+    errno = 0;
+    auto entry = readdir(dir_);
+    if (!entry) {
+      break;
+    }
+
+    pid_t pid;
+    if (!parsePid(entry->d_name, &pid)) {
+      continue;
+    }
+
+    auto& process = processes_[pid];
+    if (process.generation == 0) {
+      process.pid = pid;
+      for (auto& fd : process.fds) {
+        fd = -1;
+      }
+    }
+
+    /* a process that exited in the meantime is evicted below */
+    if (!sampleProcess(&process, now)) {
+      continue;
+    }
+
+    process.generation = generation_;
+    if (process.matches && process.has_prev) {
+      pending_.emplace_back(&process);
+    }
+  }
+
+  if (errno != 0) {
+    return false;
+  }
+
+  for (auto iter = processes_.begin(); iter != processes_.end(); ) {
+    if (iter->second.generation == generation_) {
+      ++iter;
+    } else {
+      closeFiles(&iter->second);
+      iter = processes_.erase(iter);
+    }
+  }
+
+  if (limit_ > 0 && pending_.size() > limit_) {
+    std::partial_sort(
+        pending_.begin(),
+        pending_.begin() + limit_,
+        pending_.end(),
+        [] (const Process* a, const Process* b) {
+          return a->cpu_delta > b->cpu_delta;
+        });
+
+    pending_.resize(limit_);
+  }
+
+  return true;
+}
+
+bool ProcstatsSource::sampleProcess(Process* process, uint64_t now) {
+  bool cached = process->fds[FILE_STAT] >= 0;
+  auto len = readProcessFile(process, FILE_STAT);
+  if (len < 0 && cached) {
+    /* the process is gone, but its pid may have been reused already */
+    closeFiles(process);
+    len = readProcessFile(process, FILE_STAT);
+  }
+
+  if (len < 0) {
+    return false;
+  }
+
+  bool has_prev = process->generation != 0;
+  bool prev_matches = process->matches;
+  auto prev = process->cur;
+  auto prev_time = process->time;
+
+  memset(&process->cur, 0, sizeof(Sample));
+  if (!parseStat(buf_.get(), buf_.get() + len, process)) {
+    return false;
+  }
+
+  /* a pid that was reused since the previous tick. If the files had been
+   * open, the read above would have failed, so they belong to the new process
+   * already */
+  if (has_prev && process->cur.start_time != prev.start_time) {
+    has_prev = false;
+    process->io_denied = false;
+  }
+
+  process->prev = prev;
+  process->prev_time = prev_time;
+  process->time = now;
+  process->matches = matchCommand(*process);
+  if (!process->matches) {
+    process->has_prev = false;
+    closeFiles(process);
+    return true;
+  }
+
+  /* status and io were not read while the command didn't match */
+  process->has_prev = has_prev && prev_matches;
+
+  len = readProcessFile(process, FILE_STATUS);
+  if (len >= 0) {
+    parseStatus(buf_.get(), buf_.get() + len, &process->cur);
+  }
+
+  /* io is only readable for our own processes unless we are privileged */
+  if (!process->io_denied) {
+    len = readProcessFile(process, FILE_IO);
+    if (len >= 0) {
+      parseIO(buf_.get(), buf_.get() + len, &process->cur);
+    } else if (errno == EACCES || errno == EPERM) {
+      process->io_denied = true;
+    }
+  }
+
+  process->cpu_delta = 0;
+  if (process->has_prev) {
+    process->cpu_delta = ProcParser::counterDelta(
+        process->cur.utime + process->cur.stime,
+        prev.utime + prev.stime);
+  }
+
+  return true;
+}
+
+/**
+ * Reads one of the files of a process into buf_. The file is opened relative
+ * to the /proc directory fd and kept open for the next tick if there are fds
+ * left in the budget
+ */
+ssize_t ProcstatsSource::readProcessFile(Process* process, size_t idx) {
+  auto& fd = process->fds[idx];
+  if (fd < 0) {
+    char path[64];
+    snprintf(
+        path,
+        sizeof(path),
+        "%d/%s",
+        int(process->pid),
+        kProcessFileNames[idx]);
+
+    fd = openat(dir_fd_, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return -1;
+    }
+
+    ++num_fds_;
+  }
+
+  auto len = ProcFile::readFD(fd, buf_.get(), kReadBufferSize);
+  if (len < 0 || num_fds_ > max_fds_) {
+    auto err = errno;
+    close(fd);
+    fd = -1;
+    --num_fds_;
+    errno = err;
+  }
+
+  return len;
+}
+
+bool ProcstatsSource::matchCommand(const Process& process) const {
+  if (commands_.empty()) {
+    return true;
+  }
+
+  for (const auto& c : commands_) {
+    if (c.size() == process.comm_len &&
+        memcmp(c.data(), process.comm, process.comm_len) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool ProcstatsSource::parseStat(
+    const char* begin,
+    const char* end,
+    Process* process) {
+  /* 1234 (comm) S 1 1234 1234 0 -1 4194560 ... -- comm may contain spaces
+   * and parens, so it ends at the last ')' */
+  auto comm_begin = static_cast<const char*>(memchr(begin, '(', end - begin));
+  auto comm_end = static_cast<const char*>(memrchr(begin, ')', end - begin));
+  if (!comm_begin || !comm_end || comm_end < comm_begin) {
+    return false;
+  }
+
+  ++comm_begin;
+  process->comm_len = std::min(
+      size_t(comm_end - comm_begin),
+      sizeof(process->comm) - 1);
+  memcpy(process->comm, comm_begin, process->comm_len);
+
+  auto cur = ProcParser::skipBlanks(comm_end + 1, end);
+  if (cur == end) {
+    return false;
+  }
+
+  process->state = *cur++;
+
+  auto sample = &process->cur;
+  uint64_t ppid = 0;
+  size_t field = 4;
+  for (; field <= 24 && cur < end; ++field) {
+    uint64_t* value;
+    switch (field) {
+      case 4: value = &ppid; break;
+      case 10: value = &sample->minflt; break;
+      case 12: value = &sample->majflt; break;
+      case 14: value = &sample->utime; break;
+      case 15: value = &sample->stime; break;
+      case 20: value = &sample->num_threads; break;
+      case 22: value = &sample->start_time; break;
+      case 24: value = &sample->rss_pages; break;
+      default: value = nullptr; break;
+    }
+
+    if (value) {
+      cur = ProcParser::scanUInt(cur, end, value);
+    } else {
+      cur = ProcParser::skipField(cur, end);
+    }
+  }
+
+  process->ppid = ppid;
+  return field > 24;
+}
+
+void ProcstatsSource::parseStatus(
+    const char* begin,
+    const char* end,
+    Sample* sample) {
+  /* VmSwap is missing for kernel threads */
+  size_t found = 0;
+  for (auto cur = begin; cur < end && found < 4; ) {
+    if (ProcParser::matchKey(cur, end, "Uid:", 4)) {
+      ProcParser::scanUInt(cur + 4, end, &sample->uid);
+      ++found;
+    } else if (ProcParser::matchKey(cur, end, "VmSwap:", 7)) {
+      ProcParser::scanUInt(cur + 7, end, &sample->swap_kb);
+      ++found;
+    } else if (ProcParser::matchKey(cur, end, "voluntary_ctxt_switches:", 24)) {
+      ProcParser::scanUInt(cur + 24, end, &sample->voluntary_ctxsw);
+      ++found;
+    } else if (
+        ProcParser::matchKey(cur, end, "nonvoluntary_ctxt_switches:", 27)) {
+      ProcParser::scanUInt(cur + 27, end, &sample->involuntary_ctxsw);
+      ++found;
+    }
+
+    cur = ProcParser::nextLine(cur, end);
+  }
+}
+
+void ProcstatsSource::parseIO(
+    const char* begin,
+    const char* end,
+    Sample* sample) {
+  size_t found = 0;
+  for (auto cur = begin; cur < end && found < kNumIOFields; ) {
+    for (size_t i = 0; i < kNumIOFields; ++i) {
+      const auto& f = kIOFields[i];
+      if (ProcParser::matchKey(cur, end, f.key, f.key_len)) {
+        ProcParser::scanUInt(cur + f.key_len, end, &sample->io[i]);
+        ++found;
+        break;
+      }
+    }
+
+    cur = ProcParser::nextLine(cur, end);
+  }
+
+  sample->has_io = true;
+}
+
+void ProcstatsSource::closeFiles(Process* process) {
+  for (auto& fd : process->fds) {
+    if (fd >= 0) {
+      close(fd);
+      fd = -1;
+      --num_fds_;
+    }
+  }
+}
+
+size_t ProcstatsSource::formatEvent(
+    const Process& process,
+    char* out,
+    size_t out_size) const {
+  const auto& cur = process.cur;
+  const auto& prev = process.prev;
+  auto interval = process.time > process.prev_time ?
+      process.time - process.prev_time :
+      0;
+
+  EventWriter w(out, out_size);
+  w.addUInt("pid", process.pid);
+  w.addUInt("ppid", process.ppid);
+  w.addString("command", process.comm, process.comm_len);
+  w.addString("state", &process.state, 1);
+  w.addUInt("uid", cur.uid);
+  w.addUInt("threads", cur.num_threads);
+
+  /* percent of one cpu */
+  auto cpu_user = ProcParser::counterRate(cur.utime, prev.utime, interval);
+  auto cpu_system = ProcParser::counterRate(cur.stime, prev.stime, interval);
+  w.addFixed2("cpu_user", cpu_user * 100 / clock_ticks_);
+  w.addFixed2("cpu_system", cpu_system * 100 / clock_ticks_);
+
+  w.addUInt("rss_bytes", cur.rss_pages * page_size_);
+  w.addUInt("swap_bytes", cur.swap_kb * 1024);
+  w.addFixed2(
+      "minor_faults_per_sec",
+      ProcParser::counterRate(cur.minflt, prev.minflt, interval));
+  w.addFixed2(
+      "major_faults_per_sec",
+      ProcParser::counterRate(cur.majflt, prev.majflt, interval));
+  w.addFixed2(
+      "voluntary_ctx_switches_per_sec",
+      ProcParser::counterRate(
+          cur.voluntary_ctxsw,
+          prev.voluntary_ctxsw,
+          interval));
+  w.addFixed2(
+      "involuntary_ctx_switches_per_sec",
+      ProcParser::counterRate(
+          cur.involuntary_ctxsw,
+          prev.involuntary_ctxsw,
+          interval));
+
+  if (cur.has_io && prev.has_io) {
+    for (size_t i = 0; i < kNumIOFields; ++i) {
+      w.addFixed2(
+          kIOFields[i].json_name,
+          ProcParser::counterRate(cur.io[i], prev.io[i], interval));
+    }
+  }
+
+  return w.finish();
+}
+
+ReturnCode ProcstatsSourcePlugin::pluginAttach(
+    const PropertyList& config,
+    void** userdata) {
+  std::string proc_dir = "/proc";
+  config.get("proc_dir", &proc_dir);
+
+  std::unique_ptr<ProcstatsSource> source(new ProcstatsSource());
+
+  std::vector<std::vector<std::string>> commands;
+  config.get("command", &commands);
+  for (const auto& c : commands) {
+    for (const auto& name : c) {
+      source->addCommandFilter(name);
+    }
+  }
+
+  std::string limit;
+  if (config.get("limit", &limit)) {
+    try {
+      source->setLimit(std::stoull(limit));
+    } catch (...) {
+      return ReturnCode::error(
+          "EINVAL",
+          "invalid value for limit: '%s'",
+          limit.c_str());
+    }
+  }
+
+  auto rc = source->open(proc_dir, MonotonicClock::now());
+  if (!rc.isSuccess()) {
+    return rc;
+  }
+
+  *userdata = source.release();
+  return ReturnCode::success();
+}
+
+void ProcstatsSourcePlugin::pluginDetach(void* userdata) {
+  delete static_cast<ProcstatsSource*>(userdata);
+}
+
+ReturnCode ProcstatsSourcePlugin::pluginGetNextEvent(
+    void* userdata,
+    std::string* event_json) {
+  return static_cast<ProcstatsSource*>(userdata)->getNextEvent(
+      MonotonicClock::now(),
+      event_json);
+}
+
+bool ProcstatsSourcePlugin::pluginHasPendingEvent(void* userdata) {
+  return static_cast<ProcstatsSource*>(userdata)->hasPendingEvent();
+}
+
+} // namespace evcollect
+
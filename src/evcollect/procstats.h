@@ -0,0 +1,179 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <dirent.h>
+#include <sys/types.h>
+#include <evcollect/evcollect.h>
+#include <evcollect/plugin.h>
+
+namespace evcollect {
+
+/**
+ * Samples cpu, memory, page fault, context switch and io counters of every
+ * process (or of the processes with a matching command name) from
+ * /proc/[pid]/{stat,status,io} and emits one event per process and tick.
+ *
+ * Processes are kept in a table indexed by pid that holds the previous sample
+ * and, up to a limit on the number of fds, the open stat, status and io files
+ * of the process, which are re-read with pread() on every tick. Files of
+ * processes over the limit are opened with openat() relative to the /proc
+ * directory fd. Each scan of /proc bumps a generation counter; processes that
+ * were not seen in the latest scan are evicted. A pid that is reused by a new
+ * process is detected by its changed start time.
+ */
+class ProcstatsSource {
+public:
+
+  static const size_t kMaxFDs = 16384;
+
+  ProcstatsSource();
+  ~ProcstatsSource();
+
+  ProcstatsSource(const ProcstatsSource& other) = delete;
+  ProcstatsSource& operator=(const ProcstatsSource& other) = delete;
+
+  /**
+   * Only report processes whose command (the comm field, at most 15
+   * characters) equals one of the given names
+   */
+  void addCommandFilter(const std::string& command);
+
+  /**
+   * Only report the n processes that used the most cpu time since the
+   * previous tick. Zero (the default) reports all processes
+   */
+  void setLimit(size_t n);
+
+  /**
+   * Open proc_dir (usually /proc) and take the first sample, which serves as
+   * the baseline for the rates reported by the first events
+   */
+  ReturnCode open(const std::string& proc_dir, uint64_t now);
+
+  /**
+   * Scans all processes and returns the event of the first one; the other
+   * processes are returned by the following calls while hasPendingEvent()
+   * returns true
+   */
+  ReturnCode getNextEvent(uint64_t now, std::string* event_json);
+  bool hasPendingEvent() const;
+
+  size_t getNumProcesses() const;
+  size_t getNumFDs() const;
+
+protected:
+
+  struct Sample {
+    uint64_t utime;
+    uint64_t stime;
+    uint64_t minflt;
+    uint64_t majflt;
+    uint64_t num_threads;
+    uint64_t rss_pages;
+    uint64_t start_time;
+    uint64_t voluntary_ctxsw;
+    uint64_t involuntary_ctxsw;
+    uint64_t swap_kb;
+    uint64_t uid;
+    uint64_t io[4];
+    bool has_io;
+  };
+
+  enum { FILE_STAT, FILE_STATUS, FILE_IO, kNumProcessFiles };
+
+  struct Process {
+    pid_t pid;
+    pid_t ppid;
+    int fds[kNumProcessFiles];
+    uint64_t generation;
+    bool has_prev;
+    bool matches;
+    bool io_denied;
+    char state;
+    char comm[16];
+    size_t comm_len;
+    uint64_t time;
+    uint64_t prev_time;
+    uint64_t cpu_delta;
+    Sample cur;
+    Sample prev;
+  };
+
+  static const size_t kReadBufferSize = 8192;
+  static const size_t kMaxEventSize = 2048;
+
+  bool scan(uint64_t now);
+  bool sampleProcess(Process* process, uint64_t now);
+  ssize_t readProcessFile(Process* process, size_t idx);
+  bool matchCommand(const Process& process) const;
+  bool parseStat(const char* begin, const char* end, Process* process);
+  void parseStatus(const char* begin, const char* end, Sample* sample);
+  void parseIO(const char* begin, const char* end, Sample* sample);
+  void closeFiles(Process* process);
+  size_t formatEvent(const Process& process, char* out, size_t out_size) const;
+
+  std::string proc_dir_;
+  DIR* dir_;
+  int dir_fd_;
+  size_t num_fds_;
+  size_t max_fds_;
+  uint64_t generation_;
+  std::unordered_map<pid_t, Process> processes_;
+  std::vector<std::string> commands_;
+  size_t limit_;
+  std::vector<Process*> pending_;
+  size_t pending_pos_;
+  std::unique_ptr<char[]> buf_;
+  uint64_t clock_ticks_;
+  uint64_t page_size_;
+  char out_[kMaxEventSize];
+};
+
+class ProcstatsSourcePlugin : public SourcePlugin {
+public:
+
+  static void registerPlugin(PluginMap* plugin_map);
+
+  ReturnCode pluginAttach(
+      const PropertyList& config,
+      void** userdata) override;
+
+  void pluginDetach(
+      void* userdata) override;
+
+  ReturnCode pluginGetNextEvent(
+      void* userdata,
+      std::string* event_json) override;
+
+  bool pluginHasPendingEvent(
+      void* userdata) override;
+
+};
+
+} // namespace evcollect
+
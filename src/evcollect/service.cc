@@ -21,17 +21,29 @@
  * commercial activities involving this program without disclosing the source
  * code of your own applications
  */
+#include <algorithm>
 #include <string>
 #include <set>
 #include <regex>
 #include <dlfcn.h>
+#include <poll.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <evcollect/service.h>
 #include <evcollect/config.h>
+#include <evcollect/host_metadata.h>
+#include <evcollect/http_scrape.h>
 #include <evcollect/plugin.h>
 #include <evcollect/logfile.h>
+#include <evcollect/logfile_output.h>
+#include <evcollect/cgroups.h>
+#include <evcollect/diskstats.h>
+#include <evcollect/netstats.h>
+#include <evcollect/procstats.h>
+#include <evcollect/shell.h>
+#include <evcollect/syslog_source.h>
+#include <evcollect/sysstats.h>
 #include <evcollect/util/logging.h>
 #include <evcollect/util/time.h>
 
@@ -43,9 +55,12 @@ std::string mergeEvents(const std::string& base, const std::string& overlay) {
   return overlay;
 }
 
+const size_t kNoPollFD = size_t(-1);
+
 struct EventSourceBinding {
   SourcePlugin* plugin;
   void* userdata;
+  size_t poll_idx; /* index into poll_fds_ or kNoPollFD */
 };
 
 struct EventBinding {
@@ -53,9 +68,11 @@ struct EventBinding {
   uint64_t interval_micros;
   std::vector<EventSourceBinding> sources;
   uint64_t next_tick;
+  bool add_host_metadata;
 };
 
 struct TargetBinding {
+  std::string name;
   OutputPlugin* plugin;
   void* userdata;
 };
@@ -75,13 +92,26 @@ public:
   ReturnCode loadPlugin(const std::string& plugin) override;
   ReturnCode loadPlugin(bool (*init_fn)(evcollect_ctx_t* ctx)) override;
 
+  ReturnCode getTargetStats(
+      std::vector<std::pair<std::string, std::string>>* stats) override;
+
+  void setStatsInterval(uint64_t interval_micros) override;
+
   ReturnCode run() override;
   void kill() override;
 
 protected:
 
+  void logTargetStats();
+
   ReturnCode processEvent(EventBinding* binding);
 
+  void pollSources(bool check_fds);
+
+  ReturnCode pollSource(
+      EventBinding* binding,
+      const EventSourceBinding& source);
+
   ReturnCode emitEvent(
       EventBinding* binding,
       uint64_t time,
@@ -95,11 +125,15 @@ protected:
   PluginContext plugin_ctx_;
   std::vector<std::unique_ptr<EventBinding>> event_bindings_;
   std::vector<std::unique_ptr<TargetBinding>> targets_;
+  HostMetadata host_metadata_;
   std::multiset<
       EventBinding*,
       std::function<bool (EventBinding*, EventBinding*)>> queue_;
   int listen_fd_;
   int wakeup_pipe_[2];
+  std::vector<struct pollfd> poll_fds_;
+  uint64_t stats_interval_;
+  uint64_t stats_next_tick_;
 };
 
 ServiceImpl::ServiceImpl(
@@ -111,9 +145,22 @@ ServiceImpl::ServiceImpl(
     queue_([] (EventBinding* a, EventBinding* b) {
       return a->next_tick < b->next_tick;
     }),
-    listen_fd_(-1) {
+    listen_fd_(-1),
+    stats_interval_(0),
+    stats_next_tick_(0) {
   plugin_ctx_.plugin_map = &plugin_map_;
+  plugin_ctx_.host_metadata = &host_metadata_;
   LogfileSourcePlugin::registerPlugin(&plugin_map_);
+  LogfileOutputPlugin::registerPlugin(&plugin_map_);
+  SysstatsSourcePlugin::registerPlugin(&plugin_map_);
+  ShellSourcePlugin::registerPlugin(&plugin_map_);
+  ProcstatsSourcePlugin::registerPlugin(&plugin_map_);
+  NetdevSourcePlugin::registerPlugin(&plugin_map_);
+  NetsnmpSourcePlugin::registerPlugin(&plugin_map_);
+  DiskstatsSourcePlugin::registerPlugin(&plugin_map_);
+  CgroupSourcePlugin::registerPlugin(&plugin_map_);
+  SyslogSourcePlugin::registerPlugin(&plugin_map_);
+  ScrapeSourcePlugin::registerPlugin(&plugin_map_);
 
   if (pipe(wakeup_pipe_) < 0) {
     logFatal("pipe() failed");
@@ -140,9 +187,14 @@ ReturnCode ServiceImpl::addEvent(const EventConfig* binding) {
   std::unique_ptr<EventBinding> ev_binding(new EventBinding());
   ev_binding->event_name = binding->event_name;
   ev_binding->interval_micros = binding->interval_micros;
+  ev_binding->add_host_metadata = binding->add_host_metadata;
+  if (binding->add_host_metadata) {
+    host_metadata_.start();
+  }
 
   for (const auto& source : binding->sources) {
     EventSourceBinding ev_source;
+    ev_source.poll_idx = kNoPollFD;
     {
       auto rc = plugin_map_.getSourcePlugin(
           source.plugin_name,
@@ -174,6 +226,7 @@ ReturnCode ServiceImpl::addEvent(const EventConfig* binding) {
 
 ReturnCode ServiceImpl::addTarget(const TargetConfig* binding) {
   std::unique_ptr<TargetBinding> trgt_binding(new TargetBinding());
+  trgt_binding->name = binding->plugin_value;
 
   {
     auto rc = plugin_map_.getOutputPlugin(
@@ -264,6 +317,63 @@ ReturnCode ServiceImpl::loadPlugin(bool (*init_fn)(evcollect_ctx_t* ctx)) {
   }
 }
 
+/**
+ * Calls the asynchronous sources whose fd is readable or whose deadline has
+ * passed and emits the events they completed
+ */
+void ServiceImpl::pollSources(bool check_fds) {
+  auto now = MonotonicClock::now();
+  for (const auto& binding : event_bindings_) {
+    for (const auto& src : binding->sources) {
+      int fd = -1;
+      uint64_t deadline = 0;
+      if (!src.plugin->pluginGetPollFD(src.userdata, &fd, &deadline)) {
+        continue;
+      }
+
+      bool ready =
+          (deadline > 0 && deadline <= now) ||
+          (check_fds &&
+           src.poll_idx != kNoPollFD &&
+           poll_fds_[src.poll_idx].revents != 0);
+
+      if (!ready) {
+        continue;
+      }
+
+      auto rc = pollSource(binding.get(), src);
+      if (!rc.isSuccess()) {
+        logError(
+            "Error while processing event '$0': $1",
+            binding->event_name,
+            rc.getMessage());
+      }
+    }
+  }
+}
+
+ReturnCode ServiceImpl::pollSource(
+    EventBinding* binding,
+    const EventSourceBinding& source) {
+  std::string event_buf;
+  do {
+    event_buf.clear();
+    auto rc = source.plugin->pluginPollEvent(source.userdata, &event_buf);
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+
+    if (!event_buf.empty()) {
+      rc = emitEvent(binding, WallClock::unixMicros(), event_buf);
+      if (!rc.isSuccess()) {
+        return rc;
+      }
+    }
+  } while (source.plugin->pluginHasPendingEvent(source.userdata));
+
+  return ReturnCode::success();
+}
+
 ReturnCode ServiceImpl::emitEvent(
     EventBinding* binding,
     uint64_t time,
@@ -273,6 +383,11 @@ ReturnCode ServiceImpl::emitEvent(
   evdata.event_name = binding->event_name;
   evdata.event_data = event_data;
 
+  if (binding->add_host_metadata) {
+    auto host = host_metadata_.getSnapshot();
+    HostMetadata::addToEvent(host->fragment, &evdata.event_data);
+  }
+
   logDebug("EMIT: $0 => $1", evdata.event_name, evdata.event_data);
   return deliverEvent(evdata);
 }
@@ -297,37 +412,66 @@ ReturnCode ServiceImpl::run() {
   while (true) {
     auto now = MonotonicClock::now();
     auto job = *queue_.begin();
-    auto sleep = job->next_tick - now;
+    auto next_tick = job->next_tick;
+    if (stats_interval_ > 0 && stats_next_tick_ < next_tick) {
+      next_tick = stats_next_tick_;
+    }
 
-    fd_set sleep_fdset;
-    FD_ZERO(&sleep_fdset);
-    FD_SET(wakeup_pipe_[0], &sleep_fdset);
+    poll_fds_.clear();
+    poll_fds_.push_back({ wakeup_pipe_[0], POLLIN, 0 });
+    size_t listen_idx = kNoPollFD;
     if (listen_fd_ > 0) {
-      FD_SET(listen_fd_, &sleep_fdset);
+      listen_idx = poll_fds_.size();
+      poll_fds_.push_back({ listen_fd_, POLLIN, 0 });
+    }
+
+    for (const auto& binding : event_bindings_) {
+      for (auto& src : binding->sources) {
+        src.poll_idx = kNoPollFD;
+
+        int fd = -1;
+        uint64_t deadline = 0;
+        if (!src.plugin->pluginGetPollFD(src.userdata, &fd, &deadline)) {
+          continue;
+        }
+
+        if (fd >= 0) {
+          src.poll_idx = poll_fds_.size();
+          poll_fds_.push_back({ fd, POLLIN, 0 });
+        }
+
+        if (deadline > 0 && deadline < next_tick) {
+          next_tick = deadline;
+        }
+      }
     }
 
-    struct timeval sleep_tv;
-    sleep_tv.tv_sec = sleep / 1000000;
-    sleep_tv.tv_usec = sleep % 1000000;
+    /* round up, waking up before the deadline would just spin */
+    auto sleep = next_tick > now ? next_tick - now : 0;
+    auto sleep_ms = std::min(
+        (sleep + kMicrosPerMilli - 1) / kMicrosPerMilli,
+        uint64_t(kMicrosPerDay / kMicrosPerMilli));
 
-    int select_rc = select(
-        wakeup_pipe_[0] + 1,
-        &sleep_fdset,
-        NULL,
-        NULL,
-        &sleep_tv);
+    int poll_rc = poll(poll_fds_.data(), poll_fds_.size(), int(sleep_ms));
 
-    if (select_rc > 0) {
-      if (FD_ISSET(wakeup_pipe_[0], &sleep_fdset)) {
+    pollSources(poll_rc > 0);
+
+    if (poll_rc > 0) {
+      if (poll_fds_[0].revents != 0) {
         return ReturnCode::success();
       }
-      if (listen_fd_ > 0 && FD_ISSET(listen_fd_, &sleep_fdset)) {
+      if (listen_idx != kNoPollFD && poll_fds_[listen_idx].revents != 0) {
         logInfo("Monitor attached");
         continue;
       }
     }
 
     now = MonotonicClock::now();
+    if (stats_interval_ > 0 && stats_next_tick_ <= now) {
+      logTargetStats();
+      stats_next_tick_ = now + stats_interval_;
+    }
+
     if (job->next_tick > now) {
       continue;
     }
@@ -404,6 +548,41 @@ ReturnCode ServiceImpl::processEvent(EventBinding* binding) {
   return ReturnCode::success();
 }
 
+ReturnCode ServiceImpl::getTargetStats(
+    std::vector<std::pair<std::string, std::string>>* stats) {
+  for (const auto& t : targets_) {
+    std::string target_stats;
+    auto rc = t->plugin->pluginGetStats(t->userdata, &target_stats);
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+
+    if (!target_stats.empty()) {
+      stats->emplace_back(t->name, std::move(target_stats));
+    }
+  }
+
+  return ReturnCode::success();
+}
+
+void ServiceImpl::setStatsInterval(uint64_t interval_micros) {
+  stats_interval_ = interval_micros;
+  stats_next_tick_ = MonotonicClock::now() + interval_micros;
+}
+
+void ServiceImpl::logTargetStats() {
+  std::vector<std::pair<std::string, std::string>> stats;
+  auto rc = getTargetStats(&stats);
+  if (!rc.isSuccess()) {
+    logError("Error while collecting output stats: $0", rc.getMessage());
+    return;
+  }
+
+  for (const auto& s : stats) {
+    logInfo("Stats for output '$0': $1", s.first, s.second);
+  }
+}
+
 void ServiceImpl::kill() {
   char data = 0;
   int rc = write(wakeup_pipe_[1], &data, 1);
@@ -24,6 +24,7 @@
 #pragma once
 #include <string>
 #include <set>
+#include <vector>
 #include <mutex>
 #include <condition_variable>
 #include <evcollect/evcollect.h>
@@ -46,6 +47,19 @@ public:
   virtual ReturnCode loadPlugin(const std::string& plugin) = 0;
   virtual ReturnCode loadPlugin(bool (*init_fn)(evcollect_ctx_t* ctx)) = 0;
 
+  /**
+   * Returns a list of (output name, stats) pairs where stats is the JSON
+   * object returned by the output plugin. Outputs without stats are omitted
+   */
+  virtual ReturnCode getTargetStats(
+      std::vector<std::pair<std::string, std::string>>* stats) = 0;
+
+  /**
+   * Log the stats of all outputs every interval_micros. Zero (the default)
+   * disables the stats log
+   */
+  virtual void setStatsInterval(uint64_t interval_micros) = 0;
+
   virtual ReturnCode run() = 0;
   virtual void kill() = 0;
 
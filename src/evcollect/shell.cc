@@ -0,0 +1,574 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <evcollect/shell.h>
+#include <evcollect/util/logging.h>
+#include <evcollect/util/time.h>
+
+extern char** environ;
+
+namespace evcollect {
+
+class ShellSource {
+public:
+
+  enum class Mode { SPAWN, COPROCESS };
+
+  static const size_t kMaxOutputSize = 1024 * 1024;
+  static const uint64_t kReapIntervalMicros = 10000;
+
+  ShellSource(
+      ShellSourcePlugin* plugin,
+      const std::string& command,
+      Mode mode,
+      uint64_t timeout);
+
+  ~ShellSource();
+
+  ReturnCode getNextEvent(std::string* event_json);
+  bool hasPendingEvent() const;
+  bool getPollFD(int* fd, uint64_t* deadline) const;
+
+protected:
+
+  ReturnCode getNextEventSpawn(uint64_t now, std::string* event_json);
+  ReturnCode getNextEventCoprocess(uint64_t now, std::string* event_json);
+
+  ReturnCode spawn();
+  ReturnCode readOutput();
+  bool reap();
+  void terminate();
+  bool popLine(std::string* line);
+
+  ShellSourcePlugin* plugin_;
+  std::string command_;
+  Mode mode_;
+  uint64_t timeout_;
+  pid_t pid_;
+  int status_;
+  int stdin_fd_;
+  int stdout_fd_;
+  bool awaiting_;
+  uint64_t deadline_;
+  std::string buf_;
+};
+
+ShellSource::ShellSource(
+    ShellSourcePlugin* plugin,
+    const std::string& command,
+    Mode mode,
+    uint64_t timeout) :
+    plugin_(plugin),
+    command_(command),
+    mode_(mode),
+    timeout_(timeout),
+    pid_(-1),
+    status_(0),
+    stdin_fd_(-1),
+    stdout_fd_(-1),
+    awaiting_(false),
+    deadline_(0) {}
+
+ShellSource::~ShellSource() {
+  terminate();
+}
+
+ReturnCode ShellSource::spawn() {
+  if (plugin_->num_running_ >= plugin_->max_running_) {
+    return ReturnCode::error(
+        "EIO",
+        "not running '%s': too many scripts running (max_concurrent=%zu)",
+        command_.c_str(),
+        plugin_->max_running_);
+  }
+
+  int stdout_pipe[2] = { -1, -1 };
+  int stdin_pipe[2] = { -1, -1 };
+  if (pipe2(stdout_pipe, O_CLOEXEC) != 0 ||
+      (mode_ == Mode::COPROCESS && pipe2(stdin_pipe, O_CLOEXEC) != 0)) {
+    auto err = errno;
+    for (auto fd : { stdout_pipe[0], stdout_pipe[1] }) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+
+    return ReturnCode::error("EIO", "pipe() failed: %s", strerror(err));
+  }
+
+  posix_spawn_file_actions_t file_actions;
+  posix_spawn_file_actions_init(&file_actions);
+  posix_spawn_file_actions_adddup2(&file_actions, stdout_pipe[1], 1);
+  if (mode_ == Mode::COPROCESS) {
+    posix_spawn_file_actions_adddup2(&file_actions, stdin_pipe[0], 0);
+  } else {
+    posix_spawn_file_actions_addopen(
+        &file_actions,
+        0,
+        "/dev/null",
+        O_RDONLY,
+        0);
+  }
+
+  /* the daemon ignores SIGPIPE, which would otherwise be inherited. the child
+     gets its own process group so that a timeout kills the whole pipeline */
+  sigset_t sigmask;
+  sigset_t sigdefault;
+  sigemptyset(&sigmask);
+  sigemptyset(&sigdefault);
+  sigaddset(&sigdefault, SIGPIPE);
+  sigaddset(&sigdefault, SIGTERM);
+  sigaddset(&sigdefault, SIGINT);
+  sigaddset(&sigdefault, SIGHUP);
+
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setflags(
+      &attr,
+      POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+  posix_spawnattr_setpgroup(&attr, 0);
+  posix_spawnattr_setsigmask(&attr, &sigmask);
+  posix_spawnattr_setsigdefault(&attr, &sigdefault);
+
+  const char* argv[] = { "/bin/sh", "-c", command_.c_str(), nullptr };
+  auto rc = posix_spawn(
+      &pid_,
+      "/bin/sh",
+      &file_actions,
+      &attr,
+      const_cast<char* const*>(argv),
+      environ);
+
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&file_actions);
+  close(stdout_pipe[1]);
+  if (stdin_pipe[0] >= 0) {
+    close(stdin_pipe[0]);
+  }
+
+  if (rc != 0) {
+    pid_ = -1;
+    close(stdout_pipe[0]);
+    if (stdin_pipe[1] >= 0) {
+      close(stdin_pipe[1]);
+    }
+
+    return ReturnCode::error(
+        "EIO",
+        "posix_spawn(%s) failed: %s",
+        command_.c_str(),
+        strerror(rc));
+  }
+
+  ++plugin_->num_running_;
+  stdout_fd_ = stdout_pipe[0];
+  stdin_fd_ = stdin_pipe[1];
+  fcntl(stdout_fd_, F_SETFL, fcntl(stdout_fd_, F_GETFL) | O_NONBLOCK);
+  if (stdin_fd_ >= 0) {
+    fcntl(stdin_fd_, F_SETFL, fcntl(stdin_fd_, F_GETFL) | O_NONBLOCK);
+  }
+
+  buf_.clear();
+  return ReturnCode::success();
+}
+
+/**
+ * Reads everything that is currently available from the child's stdout.
+ * Closes the pipe on EOF
+ */
+ReturnCode ShellSource::readOutput() {
+  while (stdout_fd_ >= 0) {
+    char chunk[4096];
+    auto rc = read(stdout_fd_, chunk, sizeof(chunk));
+    if (rc < 0) {
+      switch (errno) {
+        case EINTR:
+          continue;
+        case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+        case EWOULDBLOCK:
+#endif
+          return ReturnCode::success();
+        default:
+          return ReturnCode::error(
+              "EIO",
+              "read() from '%s' failed: %s",
+              command_.c_str(),
+              strerror(errno));
+      }
+    }
+
+    if (rc == 0) {
+      close(stdout_fd_);
+      stdout_fd_ = -1;
+      break;
+    }
+
+    if (buf_.size() + rc > kMaxOutputSize) {
+      return ReturnCode::error(
+          "EIO",
+          "output of '%s' exceeds %zu bytes",
+          command_.c_str(),
+          kMaxOutputSize);
+    }
+
+    buf_.append(chunk, rc);
+  }
+
+  return ReturnCode::success();
+}
+
+bool ShellSource::reap() {
+  if (pid_ < 0) {
+    return true;
+  }
+
+  auto rc = waitpid(pid_, &status_, WNOHANG);
+  if (rc == 0 || (rc < 0 && errno == EINTR)) {
+    return false;
+  }
+
+  pid_ = -1;
+  --plugin_->num_running_;
+  return true;
+}
+
+/**
+ * Kills the child (and everything it started) and releases its pipes
+ */
+void ShellSource::terminate() {
+  if (pid_ > 0) {
+    kill(-pid_, SIGKILL);
+    while (waitpid(pid_, &status_, 0) < 0 && errno == EINTR);
+    pid_ = -1;
+    --plugin_->num_running_;
+  }
+
+  if (stdout_fd_ >= 0) {
+    close(stdout_fd_);
+    stdout_fd_ = -1;
+  }
+
+  if (stdin_fd_ >= 0) {
+    close(stdin_fd_);
+    stdin_fd_ = -1;
+  }
+
+  awaiting_ = false;
+  buf_.clear();
+}
+
+bool ShellSource::popLine(std::string* line) {
+  for (;;) {
+    auto eol = buf_.find('\n');
+    if (eol == std::string::npos) {
+      return false;
+    }
+
+    line->assign(buf_, 0, eol);
+    buf_.erase(0, eol + 1);
+    if (line->find_first_not_of(" \t\r") != std::string::npos) {
+      return true;
+    }
+  }
+}
+
+ReturnCode ShellSource::getNextEvent(std::string* event_json) {
+  auto now = MonotonicClock::now();
+  switch (mode_) {
+    case Mode::SPAWN:
+      return getNextEventSpawn(now, event_json);
+    case Mode::COPROCESS:
+      return getNextEventCoprocess(now, event_json);
+  }
+
+  return ReturnCode::success();
+}
+
+/**
+ * Starts the command when called on a tick while no run is in progress,
+ * otherwise collects the output of the current run. The event is emitted once
+ * the child closed stdout and exited
+ */
+ReturnCode ShellSource::getNextEventSpawn(
+    uint64_t now,
+    std::string* event_json) {
+  if (pid_ < 0 && stdout_fd_ < 0) {
+    deadline_ = now + timeout_;
+    return spawn();
+  }
+
+  auto rc = readOutput();
+  if (!rc.isSuccess()) {
+    terminate();
+    return rc;
+  }
+
+  if (stdout_fd_ < 0 && reap()) {
+    auto status = status_;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      buf_.clear();
+      return ReturnCode::error(
+          "EIO",
+          "'%s' failed with %s %i",
+          command_.c_str(),
+          WIFEXITED(status) ? "exit code" : "signal",
+          WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+    }
+
+    auto begin = buf_.find_first_not_of(" \t\r\n");
+    if (begin != std::string::npos) {
+      auto end = buf_.find_last_not_of(" \t\r\n");
+      event_json->append(buf_, begin, end - begin + 1);
+    }
+
+    buf_.clear();
+    return ReturnCode::success();
+  }
+
+  if (now >= deadline_) {
+    terminate();
+    return ReturnCode::error(
+        "EIO",
+        "'%s' timed out after %llums, killed",
+        command_.c_str(),
+        (unsigned long long) (timeout_ / 1000));
+  }
+
+  return ReturnCode::success();
+}
+
+/**
+ * On a tick, asks the coprocess for the next event by writing a newline to
+ * its stdin, then emits the next line it prints. The coprocess is restarted
+ * on the following tick if it exits or doesn't answer within the timeout
+ */
+ReturnCode ShellSource::getNextEventCoprocess(
+    uint64_t now,
+    std::string* event_json) {
+  std::string line;
+  if (popLine(&line)) {
+    awaiting_ = false;
+    *event_json += line;
+    return ReturnCode::success();
+  }
+
+  if (pid_ < 0) {
+    auto rc = spawn();
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  if (!awaiting_) {
+    ssize_t rc;
+    do {
+      rc = write(stdin_fd_, "\n", 1);
+    } while (rc < 0 && errno == EINTR);
+
+    if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      terminate();
+      return ReturnCode::error(
+          "EIO",
+          "write() to coprocess '%s' failed: %s",
+          command_.c_str(),
+          strerror(errno));
+    }
+
+    awaiting_ = true;
+    deadline_ = now + timeout_;
+  }
+
+  auto rc = readOutput();
+  if (!rc.isSuccess()) {
+    terminate();
+    return rc;
+  }
+
+  if (popLine(&line)) {
+    awaiting_ = false;
+    *event_json += line;
+    return ReturnCode::success();
+  }
+
+  if (stdout_fd_ < 0) {
+    terminate();
+    return ReturnCode::error(
+        "EIO",
+        "coprocess '%s' exited",
+        command_.c_str());
+  }
+
+  if (now >= deadline_) {
+    terminate();
+    return ReturnCode::error(
+        "EIO",
+        "coprocess '%s' did not respond within %llums, killed",
+        command_.c_str(),
+        (unsigned long long) (timeout_ / 1000));
+  }
+
+  return ReturnCode::success();
+}
+
+bool ShellSource::hasPendingEvent() const {
+  return mode_ == Mode::COPROCESS && buf_.find('\n') != std::string::npos;
+}
+
+bool ShellSource::getPollFD(int* fd, uint64_t* deadline) const {
+  switch (mode_) {
+    case Mode::SPAWN:
+      if (pid_ < 0 && stdout_fd_ < 0) {
+        return false;
+      }
+      break;
+    case Mode::COPROCESS:
+      if (!awaiting_) {
+        return false;
+      }
+      break;
+  }
+
+  *fd = stdout_fd_;
+  *deadline = deadline_;
+
+  /* stdout was closed but the child hasn't exited yet */
+  if (stdout_fd_ < 0) {
+    auto reap_deadline = MonotonicClock::now() + kReapIntervalMicros;
+    if (reap_deadline < *deadline) {
+      *deadline = reap_deadline;
+    }
+  }
+
+  return true;
+}
+
+ShellSourcePlugin::ShellSourcePlugin() :
+    num_running_(0),
+    max_running_(kDefaultMaxConcurrent),
+    max_running_set_(false) {}
+
+void ShellSourcePlugin::registerPlugin(PluginMap* plugin_map) {
+  plugin_map->registerSourcePlugin(
+      "shell",
+      std::unique_ptr<SourcePlugin>(new ShellSourcePlugin()));
+}
+
+ReturnCode ShellSourcePlugin::pluginAttach(
+    const PropertyList& config,
+    void** userdata) {
+  std::string command;
+  if (!config.get("shell", &command) || command.empty()) {
+    return ReturnCode::error("EINVAL", "shell needs a command");
+  }
+
+  auto mode = ShellSource::Mode::SPAWN;
+  std::string mode_str;
+  if (config.get("mode", &mode_str)) {
+    if (mode_str == "coprocess") {
+      mode = ShellSource::Mode::COPROCESS;
+    } else if (mode_str != "spawn") {
+      return ReturnCode::error(
+          "EINVAL",
+          "invalid mode: '%s' -- must be 'spawn' or 'coprocess'",
+          mode_str.c_str());
+    }
+  }
+
+  uint64_t timeout = kDefaultTimeoutMicros;
+  std::string timeout_str;
+  if (config.get("timeout_ms", &timeout_str)) {
+    try {
+      timeout = std::stoull(timeout_str) * 1000;
+    } catch (...) {
+      return ReturnCode::error(
+          "EINVAL",
+          "invalid value for timeout_ms: '%s'",
+          timeout_str.c_str());
+    }
+  }
+
+  std::string max_concurrent_str;
+  if (config.get("max_concurrent", &max_concurrent_str)) {
+    size_t max_concurrent;
+    try {
+      max_concurrent = std::stoull(max_concurrent_str);
+    } catch (...) {
+      max_concurrent = 0;
+    }
+
+    if (max_concurrent == 0) {
+      return ReturnCode::error(
+          "EINVAL",
+          "invalid value for max_concurrent: '%s'",
+          max_concurrent_str.c_str());
+    }
+
+    if (max_running_set_ && max_concurrent != max_running_) {
+      return ReturnCode::error(
+          "EINVAL",
+          "conflicting values for max_concurrent: %zu and %zu -- the limit " \
+          "is shared by all shell sources",
+          max_running_,
+          max_concurrent);
+    }
+
+    max_running_ = max_concurrent;
+    max_running_set_ = true;
+  }
+
+  *userdata = new ShellSource(this, command, mode, timeout);
+  return ReturnCode::success();
+}
+
+void ShellSourcePlugin::pluginDetach(void* userdata) {
+  delete static_cast<ShellSource*>(userdata);
+}
+
+ReturnCode ShellSourcePlugin::pluginGetNextEvent(
+    void* userdata,
+    std::string* event_json) {
+  return static_cast<ShellSource*>(userdata)->getNextEvent(event_json);
+}
+
+bool ShellSourcePlugin::pluginHasPendingEvent(void* userdata) {
+  return static_cast<ShellSource*>(userdata)->hasPendingEvent();
+}
+
+bool ShellSourcePlugin::pluginGetPollFD(
+    void* userdata,
+    int* fd,
+    uint64_t* deadline) {
+  return static_cast<ShellSource*>(userdata)->getPollFD(fd, deadline);
+}
+
+} // namespace evcollect
+
@@ -0,0 +1,80 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <string>
+#include <evcollect/evcollect.h>
+#include <evcollect/plugin.h>
+
+namespace evcollect {
+
+class ShellSource;
+
+/**
+ * Runs a shell command on every tick and emits its output as the event. The
+ * command is started with posix_spawn and its stdout is read from a
+ * non-blocking pipe by the service loop, so a slow script does not hold up
+ * other events. In coprocess mode one long-lived child is kept running and
+ * asked for a new JSON line on every tick by writing a newline to its stdin
+ */
+class ShellSourcePlugin : public SourcePlugin {
+friend class ShellSource;
+public:
+
+  static const uint64_t kDefaultTimeoutMicros = 10000000;
+  static const size_t kDefaultMaxConcurrent = 16;
+
+  ShellSourcePlugin();
+
+  static void registerPlugin(PluginMap* plugin_map);
+
+  ReturnCode pluginAttach(
+      const PropertyList& config,
+      void** userdata) override;
+
+  void pluginDetach(
+      void* userdata) override;
+
+  ReturnCode pluginGetNextEvent(
+      void* userdata,
+      std::string* event_json) override;
+
+  bool pluginHasPendingEvent(
+      void* userdata) override;
+
+  bool pluginGetPollFD(
+      void* userdata,
+      int* fd,
+      uint64_t* deadline) override;
+
+protected:
+
+  /* limit on concurrently running scripts, shared by all shell sources. It
+     may be set by any of them, but all must agree on the value */
+  size_t num_running_;
+  size_t max_running_;
+  bool max_running_set_;
+};
+
+} // namespace evcollect
+
@@ -0,0 +1,898 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <evcollect/syslog_source.h>
+#include <evcollect/util/logging.h>
+#include <evcollect/util/procfs.h>
+
+namespace evcollect {
+
+void SyslogSourcePlugin::registerPlugin(PluginMap* plugin_map) {
+  plugin_map->registerSourcePlugin(
+      "syslog",
+      std::unique_ptr<SourcePlugin>(new SyslogSourcePlugin()));
+}
+
+namespace {
+
+const char* kFacilityNames[] = {
+  "kern", "user", "mail", "daemon", "auth", "syslog", "lpr", "news", "uucp",
+  "cron", "authpriv", "ftp", "ntp", "security", "console", "solaris-cron",
+  "local0", "local1", "local2", "local3", "local4", "local5", "local6",
+  "local7"
+};
+
+const char* kSeverityNames[] = {
+  "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+};
+
+/* longest TAG accepted in RFC3164 messages (RFC3164 itself says 32) */
+const size_t kMaxTagLength = 64;
+
+bool isDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+SyslogMessage::Field makeField(const char* begin, const char* end) {
+  SyslogMessage::Field field;
+  field.data = begin;
+  field.size = end - begin;
+  return field;
+}
+
+const char* findChar(const char* begin, const char* end, char c) {
+  auto pos = static_cast<const char*>(memchr(begin, c, end - begin));
+  return pos ? pos : end;
+}
+
+/* "Mmm dd hh:mm:ss", the day is padded with a space */
+bool isBSDTimestamp(const char* cur, const char* end) {
+  if (end - cur < 15 || (end - cur > 15 && cur[15] != ' ')) {
+    return false;
+  }
+
+  return
+      cur[0] >= 'A' && cur[0] <= 'Z' &&
+      cur[1] >= 'a' && cur[1] <= 'z' &&
+      cur[2] >= 'a' && cur[2] <= 'z' &&
+      cur[3] == ' ' &&
+      (cur[4] == ' ' || isDigit(cur[4])) && isDigit(cur[5]) &&
+      cur[6] == ' ' &&
+      isDigit(cur[7]) && isDigit(cur[8]) && cur[9] == ':' &&
+      isDigit(cur[10]) && isDigit(cur[11]) && cur[12] == ':' &&
+      isDigit(cur[13]) && isDigit(cur[14]);
+}
+
+/* rsyslog and others send RFC3339 timestamps in RFC3164 messages */
+bool isISOTimestamp(const char* cur, const char* end) {
+  return
+      end - cur >= 10 &&
+      isDigit(cur[0]) && isDigit(cur[1]) && isDigit(cur[2]) &&
+      isDigit(cur[3]) && cur[4] == '-';
+}
+
+void addField(
+    EventWriter* writer,
+    const char* key,
+    const SyslogMessage::Field& field) {
+  if (field.size > 0) {
+    writer->addString(key, field.data, field.size);
+  }
+}
+
+std::string formatAddress(const struct sockaddr* addr) {
+  char buf[INET6_ADDRSTRLEN];
+  const void* src;
+  switch (addr->sa_family) {
+    case AF_INET:
+      src = &((const struct sockaddr_in*) addr)->sin_addr;
+      break;
+    case AF_INET6:
+      src = &((const struct sockaddr_in6*) addr)->sin6_addr;
+      break;
+    default:
+      return std::string();
+  }
+
+  if (!inet_ntop(addr->sa_family, src, buf, sizeof(buf))) {
+    return std::string();
+  }
+
+  return buf;
+}
+
+} // namespace
+
+bool SyslogParser::parse(
+    const char* begin,
+    const char* end,
+    SyslogMessage* msg) {
+  memset(msg, 0, sizeof(SyslogMessage));
+
+  while (end > begin && (end[-1] == '\n' || end[-1] == '\r' || !end[-1])) {
+    --end;
+  }
+
+  msg->facility = kDefaultPriority >> 3;
+  msg->severity = kDefaultPriority & 7;
+  msg->message = makeField(begin, end);
+
+  /* <PRI> */
+  auto cur = begin;
+  if (cur == end || *cur != '<') {
+    return false;
+  }
+
+  int pri = 0;
+  for (++cur; cur < end && isDigit(*cur) && cur - begin <= 3; ++cur) {
+    pri = pri * 10 + (*cur - '0');
+  }
+
+  if (cur == begin + 1 || cur == end || *cur != '>' || pri > 191) {
+    return false;
+  }
+
+  msg->facility = pri >> 3;
+  msg->severity = pri & 7;
+  ++cur;
+
+  /* RFC5424 messages continue with VERSION SP */
+  if (cur < end && *cur >= '1' && *cur <= '9') {
+    int version = 0;
+    auto v = cur;
+    for (; v < end && isDigit(*v) && v - cur < 3; ++v) {
+      version = version * 10 + (*v - '0');
+    }
+
+    if (v < end && *v == ' ') {
+      msg->version = version;
+      parseRFC5424(v + 1, end, msg);
+      return true;
+    }
+  }
+
+  parseRFC3164(cur, end, msg);
+  return true;
+}
+
+/**
+ * TIMESTAMP SP HOSTNAME SP APP-NAME SP PROCID SP MSGID SP STRUCTURED-DATA
+ * [SP MSG]
+ */
+void SyslogParser::parseRFC5424(
+    const char* cur,
+    const char* end,
+    SyslogMessage* msg) {
+  SyslogMessage::Field* header[] = {
+    &msg->timestamp,
+    &msg->hostname,
+    &msg->app_name,
+    &msg->procid,
+    &msg->msgid
+  };
+
+  for (auto field : header) {
+    auto field_end = findChar(cur, end, ' ');
+    if (field_end - cur != 1 || *cur != '-') {
+      *field = makeField(cur, field_end);
+    }
+
+    cur = field_end < end ? field_end + 1 : end;
+  }
+
+  /* "-" or one or more [SD-ID PARAM-NAME="PARAM-VALUE" ...] elements, the
+   * values may contain escaped quotes and brackets */
+  if (cur < end && *cur == '-') {
+    ++cur;
+  } else {
+    auto sd_begin = cur;
+    while (cur < end && *cur == '[') {
+      bool quoted = false;
+      for (++cur; cur < end; ++cur) {
+        if (quoted) {
+          if (*cur == '\\' && cur + 1 < end) {
+            ++cur;
+          } else if (*cur == '"') {
+            quoted = false;
+          }
+        } else if (*cur == '"') {
+          quoted = true;
+        } else if (*cur == ']') {
+          ++cur;
+          break;
+        }
+      }
+    }
+
+    msg->structured_data = makeField(sd_begin, cur);
+  }
+
+  if (cur < end && *cur == ' ') {
+    ++cur;
+  }
+
+  /* the message may start with a UTF-8 BOM */
+  if (end - cur >= 3 && memcmp(cur, "\xef\xbb\xbf", 3) == 0) {
+    cur += 3;
+  }
+
+  msg->message = makeField(cur, end);
+}
+
+/**
+ * [TIMESTAMP SP HOSTNAME SP] [TAG["[" PID "]"]":" SP] MSG
+ */
+void SyslogParser::parseRFC3164(
+    const char* cur,
+    const char* end,
+    SyslogMessage* msg) {
+  const char* timestamp_end = nullptr;
+  if (isBSDTimestamp(cur, end)) {
+    timestamp_end = cur + 15;
+  } else if (isISOTimestamp(cur, end)) {
+    timestamp_end = findChar(cur, end, ' ');
+  }
+
+  /* without a timestamp there is no hostname either */
+  if (timestamp_end) {
+    msg->timestamp = makeField(cur, timestamp_end);
+    cur = timestamp_end < end ? timestamp_end + 1 : end;
+
+    auto host_end = findChar(cur, end, ' ');
+    if (host_end > cur &&
+        host_end < end &&
+        host_end[-1] != ':' &&
+        findChar(cur, host_end, '[') == host_end) {
+      msg->hostname = makeField(cur, host_end);
+      cur = host_end + 1;
+    }
+  }
+
+  auto tag_end = cur;
+  while (tag_end < end &&
+         tag_end - cur < kMaxTagLength &&
+         *tag_end != ':' &&
+         *tag_end != '[' &&
+         *tag_end != ' ') {
+    ++tag_end;
+  }
+
+  if (tag_end > cur && tag_end < end && (*tag_end == ':' || *tag_end == '[')) {
+    auto pos = tag_end;
+    SyslogMessage::Field procid = { nullptr, 0 };
+    if (*pos == '[') {
+      auto pid_end = findChar(pos, end, ']');
+      if (pid_end == end) {
+        msg->message = makeField(cur, end);
+        return;
+      }
+
+      procid = makeField(pos + 1, pid_end);
+      pos = pid_end + 1;
+    }
+
+    if (pos < end && *pos == ':') {
+      ++pos;
+    }
+
+    if (pos < end && *pos == ' ') {
+      ++pos;
+    }
+
+    msg->app_name = makeField(cur, tag_end);
+    msg->procid = procid;
+    cur = pos;
+  }
+
+  msg->message = makeField(cur, end);
+}
+
+const char* SyslogParser::getFacilityName(int facility) {
+  if (facility < 0 || facility >= int(sizeof(kFacilityNames) / sizeof(char*))) {
+    return "unknown";
+  }
+
+  return kFacilityNames[facility];
+}
+
+const char* SyslogParser::getSeverityName(int severity) {
+  if (severity < 0 || severity > 7) {
+    return "unknown";
+  }
+
+  return kSeverityNames[severity];
+}
+
+ReturnCode SyslogSource::parseTransport(
+    const std::string& str,
+    Transport* transport) {
+  if (str == "udp") {
+    *transport = Transport::UDP;
+    return ReturnCode::success();
+  }
+
+  if (str == "tcp") {
+    *transport = Transport::TCP;
+    return ReturnCode::success();
+  }
+
+  if (str == "both") {
+    *transport = Transport::BOTH;
+    return ReturnCode::success();
+  }
+
+  return ReturnCode::error(
+      "EINVAL",
+      "invalid transport: '%s' -- must be 'udp', 'tcp' or 'both'",
+      str.c_str());
+}
+
+SyslogSource::SyslogSource(Transport transport) :
+    transport_(transport),
+    recv_buffer_size_(kDefaultRecvBufferSize),
+    port_(0),
+    epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+    udp_fd_(-1),
+    tcp_fd_(-1),
+    recv_buf_(new char[kBatchSize * kMaxMessageSize]),
+    out_(new char[kMaxEventSize]),
+    pending_pos_(0),
+    budget_(0),
+    num_messages_(0),
+    num_errors_(0) {}
+
+SyslogSource::~SyslogSource() {
+  for (const auto& c : conns_) {
+    close(c.first);
+  }
+
+  if (udp_fd_ >= 0) {
+    close(udp_fd_);
+  }
+
+  if (tcp_fd_ >= 0) {
+    close(tcp_fd_);
+  }
+
+  if (epoll_fd_ >= 0) {
+    close(epoll_fd_);
+  }
+}
+
+void SyslogSource::setRecvBufferSize(size_t bytes) {
+  recv_buffer_size_ = bytes;
+}
+
+ReturnCode SyslogSource::bindSocket(
+    int type,
+    const std::string& host,
+    uint16_t* port) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = type;
+  hints.ai_flags = AI_PASSIVE;
+
+  struct addrinfo* addrs = nullptr;
+  auto port_str = std::to_string(*port);
+  int gai_rc = getaddrinfo(
+      host.empty() ? nullptr : host.c_str(),
+      port_str.c_str(),
+      &hints,
+      &addrs);
+
+  if (gai_rc != 0) {
+    return ReturnCode::error(
+        "EIO",
+        "getaddrinfo(%s) failed: %s",
+        host.c_str(),
+        gai_strerror(gai_rc));
+  }
+
+  auto rc = ReturnCode::error("EIO", "no addresses for %s", host.c_str());
+  for (auto addr = addrs; addr; addr = addr->ai_next) {
+    int fd = socket(
+        addr->ai_family,
+        addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+        addr->ai_protocol);
+
+    if (fd < 0) {
+      rc = ReturnCode::error("EIO", "socket() failed: %s", strerror(errno));
+      continue;
+    }
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (type == SOCK_DGRAM) {
+      /* SO_RCVBUFFORCE ignores rmem_max but needs CAP_NET_ADMIN */
+      int rcvbuf = recv_buffer_size_;
+#ifdef SO_RCVBUFFORCE
+      if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf))) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+      }
+#else
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+#endif
+    }
+
+    if (bind(fd, addr->ai_addr, addr->ai_addrlen) != 0 ||
+        (type == SOCK_STREAM && ::listen(fd, 128) != 0)) {
+      rc = ReturnCode::error(
+          "EIO",
+          "bind(%s:%u) failed: %s",
+          host.c_str(),
+          *port,
+          strerror(errno));
+      close(fd);
+      continue;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      rc = ReturnCode::error(
+          "EIO",
+          "epoll_ctl() failed: %s",
+          strerror(errno));
+      close(fd);
+      continue;
+    }
+
+    struct sockaddr_storage local;
+    socklen_t local_len = sizeof(local);
+    getsockname(fd, (struct sockaddr*) &local, &local_len);
+    switch (local.ss_family) {
+      case AF_INET:
+        *port = ntohs(((struct sockaddr_in*) &local)->sin_port);
+        break;
+      case AF_INET6:
+        *port = ntohs(((struct sockaddr_in6*) &local)->sin6_port);
+        break;
+    }
+
+    if (type == SOCK_DGRAM) {
+      udp_fd_ = fd;
+    } else {
+      tcp_fd_ = fd;
+    }
+
+    rc = ReturnCode::success();
+    break;
+  }
+
+  freeaddrinfo(addrs);
+  return rc;
+}
+
+ReturnCode SyslogSource::listen(const std::string& host, uint16_t port) {
+  if (epoll_fd_ < 0) {
+    return ReturnCode::error("EIO", "epoll_create1() failed");
+  }
+
+  if (transport_ != Transport::TCP) {
+    auto rc = bindSocket(SOCK_DGRAM, host, &port);
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  if (transport_ != Transport::UDP) {
+    auto rc = bindSocket(SOCK_STREAM, host, &port);
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  port_ = port;
+  return ReturnCode::success();
+}
+
+uint16_t SyslogSource::getPort() const {
+  return port_;
+}
+
+ReturnCode SyslogSource::getNextEvent(std::string* event_json) {
+  if (pending_pos_ >= event_ends_.size()) {
+    events_.clear();
+    event_ends_.clear();
+    pending_pos_ = 0;
+    receive();
+  }
+
+  if (pending_pos_ < event_ends_.size()) {
+    size_t begin = pending_pos_ > 0 ? event_ends_[pending_pos_ - 1] : 0;
+    event_json->append(events_, begin, event_ends_[pending_pos_] - begin);
+    ++pending_pos_;
+  }
+
+  return ReturnCode::success();
+}
+
+bool SyslogSource::hasPendingEvent() const {
+  return pending_pos_ < event_ends_.size();
+}
+
+int SyslogSource::getPollFD() const {
+  return epoll_fd_;
+}
+
+uint64_t SyslogSource::getNumMessages() const {
+  return num_messages_;
+}
+
+uint64_t SyslogSource::getNumErrors() const {
+  return num_errors_;
+}
+
+/**
+ * Reads from all ready sockets until kMaxMessagesPerPoll messages were
+ * received. Sockets are level triggered, so whatever is left makes the epoll
+ * fd readable again
+ */
+void SyslogSource::receive() {
+  budget_ = kMaxMessagesPerPoll;
+
+  struct epoll_event evs[kBatchSize];
+  int n = epoll_wait(epoll_fd_, evs, kBatchSize, 0);
+  for (int i = 0; i < n && budget_ > 0; ++i) {
+    int fd = evs[i].data.fd;
+    if (fd == udp_fd_) {
+      receiveUDP();
+      continue;
+    }
+
+    if (fd == tcp_fd_) {
+      acceptConnections();
+      continue;
+    }
+
+    auto conn = conns_.find(fd);
+    if (conn != conns_.end() && !readConnection(&conn->second)) {
+      closeConnection(fd);
+    }
+  }
+}
+
+void SyslogSource::receiveUDP() {
+  struct mmsghdr msgs[kBatchSize];
+  struct iovec iovs[kBatchSize];
+  struct sockaddr_storage addrs[kBatchSize];
+
+  while (budget_ > 0) {
+    size_t batch_size = budget_ < kBatchSize ? budget_ : kBatchSize;
+    memset(msgs, 0, sizeof(struct mmsghdr) * batch_size);
+    for (size_t i = 0; i < batch_size; ++i) {
+      iovs[i].iov_base = recv_buf_.get() + i * kMaxMessageSize;
+      iovs[i].iov_len = kMaxMessageSize;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    }
+
+    int n = recvmmsg(udp_fd_, msgs, batch_size, MSG_DONTWAIT, nullptr);
+    if (n <= 0) {
+      if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        logWarning("syslog: recvmmsg() failed: $0", strerror(errno));
+      }
+
+      return;
+    }
+
+    for (int i = 0; i < n; ++i) {
+      /* most datagrams come from a handful of senders */
+      auto addr = reinterpret_cast<const char*>(&addrs[i]);
+      auto addr_len = msgs[i].msg_hdr.msg_namelen;
+      if (udp_remote_sockaddr_.compare(0, std::string::npos, addr, addr_len)) {
+        udp_remote_sockaddr_.assign(addr, addr_len);
+        udp_remote_addr_ = formatAddress((const struct sockaddr*) addr);
+      }
+
+      auto begin = static_cast<const char*>(iovs[i].iov_base);
+      addMessage(
+          begin,
+          begin + msgs[i].msg_len,
+          udp_remote_addr_,
+          msgs[i].msg_hdr.msg_flags & MSG_TRUNC);
+    }
+
+    if (size_t(n) < batch_size) {
+      return;
+    }
+  }
+}
+
+void SyslogSource::acceptConnections() {
+  for (;;) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd = accept4(
+        tcp_fd_,
+        (struct sockaddr*) &addr,
+        &addr_len,
+        SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        logWarning("syslog: accept() failed: $0", strerror(errno));
+      }
+
+      return;
+    }
+
+    auto remote_addr = formatAddress((const struct sockaddr*) &addr);
+    if (conns_.size() >= kMaxConnections) {
+      logWarning(
+          "syslog: too many connections, closing connection from $0",
+          remote_addr);
+      close(fd);
+      continue;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      logWarning("syslog: epoll_ctl() failed: $0", strerror(errno));
+      close(fd);
+      continue;
+    }
+
+    auto& conn = conns_[fd];
+    conn.fd = fd;
+    conn.remote_addr = remote_addr;
+    conn.buf.clear();
+    conn.skip_line = false;
+  }
+}
+
+/**
+ * Reads once from the connection and adds all complete messages. Returns
+ * false if the connection should be closed
+ */
+bool SyslogSource::readConnection(Connection* conn) {
+  auto len = read(conn->fd, recv_buf_.get(), kBatchSize * kMaxMessageSize);
+  if (len < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  }
+
+  if (len == 0) {
+    /* the last message of a newline framed stream may lack the newline */
+    if (!conn->buf.empty() && !conn->skip_line && !isDigit(conn->buf[0])) {
+      auto begin = conn->buf.data();
+      addMessage(begin, begin + conn->buf.size(), conn->remote_addr, false);
+    }
+
+    return false;
+  }
+
+  conn->buf.append(recv_buf_.get(), len);
+
+  auto begin = conn->buf.data();
+  auto end = begin + conn->buf.size();
+  auto cur = begin;
+  while (cur < end) {
+    if (conn->skip_line) {
+      auto nl = findChar(cur, end, '\n');
+      if (nl == end) {
+        cur = end;
+        break;
+      }
+
+      conn->skip_line = false;
+      cur = nl + 1;
+      continue;
+    }
+
+    /* octet counting: MSG-LEN SP SYSLOG-MSG */
+    if (isDigit(*cur)) {
+      size_t msg_len = 0;
+      auto pos = cur;
+      for (; pos < end && isDigit(*pos) && pos - cur < 6; ++pos) {
+        msg_len = msg_len * 10 + (*pos - '0');
+      }
+
+      if (pos == end) {
+        break;
+      }
+
+      if (*pos != ' ' || msg_len > kMaxMessageSize) {
+        logWarning(
+            "syslog: invalid frame from $0, closing connection",
+            conn->remote_addr);
+        return false;
+      }
+
+      if (size_t(end - pos - 1) < msg_len) {
+        break;
+      }
+
+      addMessage(pos + 1, pos + 1 + msg_len, conn->remote_addr, false);
+      cur = pos + 1 + msg_len;
+      continue;
+    }
+
+    /* newline framing; overlong lines are truncated */
+    auto nl = findChar(cur, end, '\n');
+    if (nl == end) {
+      if (size_t(end - cur) > kMaxMessageSize) {
+        addMessage(cur, cur + kMaxMessageSize, conn->remote_addr, true);
+        conn->skip_line = true;
+        cur = end;
+      }
+
+      break;
+    }
+
+    if (nl > cur && !(nl == cur + 1 && *cur == '\r')) {
+      addMessage(cur, nl, conn->remote_addr, false);
+    }
+
+    cur = nl + 1;
+  }
+
+  conn->buf.erase(0, cur - begin);
+  return true;
+}
+
+void SyslogSource::closeConnection(int fd) {
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  close(fd);
+  conns_.erase(fd);
+}
+
+void SyslogSource::addMessage(
+    const char* begin,
+    const char* end,
+    const std::string& remote_addr,
+    bool truncated) {
+  SyslogMessage msg;
+  bool valid = SyslogParser::parse(begin, end, &msg);
+
+  ++num_messages_;
+  if (!valid || truncated) {
+    ++num_errors_;
+  }
+
+  if (budget_ > 0) {
+    --budget_;
+  }
+
+  auto facility = SyslogParser::getFacilityName(msg.facility);
+  auto severity = SyslogParser::getSeverityName(msg.severity);
+
+  EventWriter w(out_.get(), kMaxEventSize);
+  w.addString("facility", facility, strlen(facility));
+  w.addString("severity", severity, strlen(severity));
+  addField(&w, "timestamp", msg.timestamp);
+  addField(&w, "hostname", msg.hostname);
+  addField(&w, "app_name", msg.app_name);
+  addField(&w, "procid", msg.procid);
+  addField(&w, "msgid", msg.msgid);
+  addField(&w, "structured_data", msg.structured_data);
+  w.addString("message", msg.message.data, msg.message.size);
+  if (!remote_addr.empty()) {
+    w.addString("remote_addr", remote_addr.data(), remote_addr.size());
+  }
+
+  auto len = w.finish();
+  if (len == 0) {
+    return;
+  }
+
+  events_.append(out_.get(), len);
+  event_ends_.emplace_back(events_.size());
+}
+
+ReturnCode SyslogSourcePlugin::pluginAttach(
+    const PropertyList& config,
+    void** userdata) {
+  auto transport = SyslogSource::Transport::UDP;
+  std::string transport_str;
+  if (config.get("transport", &transport_str)) {
+    auto rc = SyslogSource::parseTransport(transport_str, &transport);
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  std::string host = "0.0.0.0";
+  config.get("host", &host);
+
+  uint64_t port = SyslogSource::kDefaultPort;
+  std::string port_str;
+  if (config.get("port", &port_str)) {
+    try {
+      port = std::stoull(port_str);
+    } catch (...) {
+      port = 0x10000;
+    }
+
+    if (port > 0xffff) {
+      return ReturnCode::error(
+          "EINVAL",
+          "invalid value for port: '%s'",
+          port_str.c_str());
+    }
+  }
+
+  std::unique_ptr<SyslogSource> source(new SyslogSource(transport));
+
+  std::string rcvbuf;
+  if (config.get("rcvbuf", &rcvbuf)) {
+    try {
+      source->setRecvBufferSize(std::stoull(rcvbuf));
+    } catch (...) {
+      return ReturnCode::error(
+          "EINVAL",
+          "invalid value for rcvbuf: '%s'",
+          rcvbuf.c_str());
+    }
+  }
+
+  auto rc = source->listen(host, port);
+  if (!rc.isSuccess()) {
+    return rc;
+  }
+
+  *userdata = source.release();
+  return ReturnCode::success();
+}
+
+void SyslogSourcePlugin::pluginDetach(void* userdata) {
+  delete static_cast<SyslogSource*>(userdata);
+}
+
+ReturnCode SyslogSourcePlugin::pluginGetNextEvent(
+    void* userdata,
+    std::string* event_json) {
+  return static_cast<SyslogSource*>(userdata)->getNextEvent(event_json);
+}
+
+bool SyslogSourcePlugin::pluginHasPendingEvent(void* userdata) {
+  return static_cast<SyslogSource*>(userdata)->hasPendingEvent();
+}
+
+bool SyslogSourcePlugin::pluginGetPollFD(
+    void* userdata,
+    int* fd,
+    uint64_t* deadline) {
+  *fd = static_cast<SyslogSource*>(userdata)->getPollFD();
+  *deadline = 0;
+  return true;
+}
+
+} // namespace evcollect
+
@@ -0,0 +1,217 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <evcollect/evcollect.h>
+#include <evcollect/plugin.h>
+
+namespace evcollect {
+
+/**
+ * The header fields of a syslog message. All fields point into the parsed
+ * buffer; fields that are not present (or the nil value "-" in RFC5424) are
+ * empty
+ */
+struct SyslogMessage {
+  struct Field {
+    const char* data;
+    size_t size;
+  };
+
+  int facility;
+  int severity;
+  /* 0 for RFC3164 messages */
+  int version;
+  Field timestamp;
+  Field hostname;
+  Field app_name;
+  Field procid;
+  Field msgid;
+  Field structured_data;
+  Field message;
+};
+
+/**
+ * Hand written parser for RFC5424 and RFC3164 ("BSD") syslog messages. The
+ * format is detected from the version number following the PRI. RFC3164
+ * doesn't define much beyond the PRI and implementations differ, so that
+ * part is parsed leniently: timestamp and hostname are optional and anything
+ * that doesn't look like a TAG[PID]: prefix is treated as the message
+ */
+class SyslogParser {
+public:
+
+  /* facility user, severity notice (RFC3164 4.3.3) */
+  static const int kDefaultPriority = 13;
+
+  /**
+   * Parse the message in [begin, end). Returns false if the message doesn't
+   * start with a valid PRI; in that case it is returned as the message with
+   * the default priority
+   */
+  static bool parse(const char* begin, const char* end, SyslogMessage* msg);
+
+  static const char* getFacilityName(int facility);
+  static const char* getSeverityName(int severity);
+
+protected:
+
+  static void parseRFC5424(
+      const char* cur,
+      const char* end,
+      SyslogMessage* msg);
+
+  static void parseRFC3164(
+      const char* cur,
+      const char* end,
+      SyslogMessage* msg);
+};
+
+/**
+ * Receives syslog messages over UDP and/or TCP and emits one event per
+ * message.
+ *
+ * All sockets are registered with an epoll instance whose fd is handed to the
+ * service loop (see SourcePlugin::pluginGetPollFD), so the source is only
+ * called when there is something to read. Each call reads up to
+ * kMaxMessagesPerPoll messages (datagrams with recvmmsg, in batches of
+ * kBatchSize) and formats them into one buffer that is then handed out event
+ * by event; anything left is picked up on the next turn of the service loop
+ * as the epoll fd stays readable.
+ *
+ * TCP connections may use octet counting or newline framing (RFC6587); the
+ * framing is detected per message
+ */
+class SyslogSource {
+public:
+
+  enum class Transport { UDP, TCP, BOTH };
+
+  static const uint16_t kDefaultPort = 514;
+  static const size_t kDefaultRecvBufferSize = 8 * 1024 * 1024;
+  static const size_t kBatchSize = 64;
+  static const size_t kMaxMessageSize = 16384;
+  /* every byte of the message escaped, plus the keys and the remote addr */
+  static const size_t kMaxEventSize = 8 * kMaxMessageSize;
+  static const size_t kMaxMessagesPerPoll = 4096;
+  static const size_t kMaxConnections = 1024;
+
+  static ReturnCode parseTransport(const std::string& str, Transport* t);
+
+  SyslogSource(Transport transport);
+  ~SyslogSource();
+
+  SyslogSource(const SyslogSource& other) = delete;
+  SyslogSource& operator=(const SyslogSource& other) = delete;
+
+  void setRecvBufferSize(size_t bytes);
+
+  /**
+   * Bind the sockets. Port 0 picks a free port, see getPort()
+   */
+  ReturnCode listen(const std::string& host, uint16_t port);
+
+  uint16_t getPort() const;
+
+  ReturnCode getNextEvent(std::string* event_json);
+  bool hasPendingEvent() const;
+  int getPollFD() const;
+
+  uint64_t getNumMessages() const;
+
+  /* truncated messages and messages without a valid PRI */
+  uint64_t getNumErrors() const;
+
+protected:
+
+  struct Connection {
+    int fd;
+    std::string remote_addr;
+    std::string buf;
+    /* discard everything up to the next newline */
+    bool skip_line;
+  };
+
+  ReturnCode bindSocket(int type, const std::string& host, uint16_t* port);
+  void receive();
+  void receiveUDP();
+  void acceptConnections();
+  bool readConnection(Connection* conn);
+  void closeConnection(int fd);
+  void addMessage(
+      const char* begin,
+      const char* end,
+      const std::string& remote_addr,
+      bool truncated);
+
+  Transport transport_;
+  size_t recv_buffer_size_;
+  uint16_t port_;
+  int epoll_fd_;
+  int udp_fd_;
+  int tcp_fd_;
+  std::unordered_map<int, Connection> conns_;
+  std::unique_ptr<char[]> recv_buf_;
+  std::unique_ptr<char[]> out_;
+  std::string udp_remote_addr_;
+  std::string udp_remote_sockaddr_;
+  std::string events_;
+  std::vector<size_t> event_ends_;
+  size_t pending_pos_;
+  size_t budget_;
+  uint64_t num_messages_;
+  uint64_t num_errors_;
+};
+
+class SyslogSourcePlugin : public SourcePlugin {
+public:
+
+  static void registerPlugin(PluginMap* plugin_map);
+
+  ReturnCode pluginAttach(
+      const PropertyList& config,
+      void** userdata) override;
+
+  void pluginDetach(
+      void* userdata) override;
+
+  ReturnCode pluginGetNextEvent(
+      void* userdata,
+      std::string* event_json) override;
+
+  bool pluginHasPendingEvent(
+      void* userdata) override;
+
+  bool pluginGetPollFD(
+      void* userdata,
+      int* fd,
+      uint64_t* deadline) override;
+
+};
+
+} // namespace evcollect
+
@@ -0,0 +1,395 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <errno.h>
+#include <string.h>
+#include <evcollect/sysstats.h>
+#include <evcollect/util/time.h>
+
+namespace evcollect {
+
+void SysstatsSourcePlugin::registerPlugin(PluginMap* plugin_map) {
+  plugin_map->registerSourcePlugin(
+      "linux.sysstats",
+      std::unique_ptr<SourcePlugin>(new SysstatsSourcePlugin()));
+}
+
+namespace {
+
+struct ProcField {
+  const char* key;
+  size_t key_len;
+  const char* json_name;
+};
+
+/* values are reported in kB and converted to bytes */
+const ProcField kMemFields[] = {
+  { "MemTotal:", 9, "mem_total" },
+  { "MemFree:", 8, "mem_free" },
+  { "MemAvailable:", 13, "mem_available" },
+  { "Buffers:", 8, "mem_buffers" },
+  { "Cached:", 7, "mem_cached" },
+  { "Dirty:", 6, "mem_dirty" },
+  { "SwapTotal:", 10, "swap_total" },
+  { "SwapFree:", 9, "swap_free" }
+};
+
+/* monotonic counters, reported as per second rates */
+const ProcField kVMFields[] = {
+  { "pgpgin ", 7, "pgpgin_per_sec" },
+  { "pgpgout ", 8, "pgpgout_per_sec" },
+  { "pswpin ", 7, "pswpin_per_sec" },
+  { "pswpout ", 8, "pswpout_per_sec" },
+  { "pgfault ", 8, "pgfault_per_sec" },
+  { "pgmajfault ", 11, "pgmajfault_per_sec" }
+};
+
+const char* kCPUFieldNames[] = {
+  "cpu_user",
+  "cpu_nice",
+  "cpu_system",
+  "cpu_idle",
+  "cpu_iowait",
+  "cpu_irq",
+  "cpu_softirq",
+  "cpu_steal"
+};
+
+const char* kPressureFileNames[] = { "cpu", "memory", "io" };
+
+const char* kPressurePrefixes[] = { "psi_cpu_", "psi_memory_", "psi_io_" };
+
+const char* kPressureFieldNames[] = {
+  "some_avg10",
+  "some_avg60",
+  "full_avg10",
+  "full_avg60"
+};
+
+} // namespace
+
+SysstatsSource::SysstatsSource() :
+    cur_(&samples_[0]),
+    prev_(&samples_[1]) {
+  memset(samples_, 0, sizeof(samples_));
+}
+
+ReturnCode SysstatsSource::open(const std::string& proc_dir, uint64_t now) {
+  std::pair<const char*, ProcFile*> files[] = {
+    { "/stat", &stat_ },
+    { "/meminfo", &meminfo_ },
+    { "/loadavg", &loadavg_ },
+  };
+
+  for (const auto& f : files) {
+    auto rc = f.second->open(proc_dir + f.first, false);
+    if (!rc.isSuccess()) {
+      return rc;
+    }
+  }
+
+  /* vmstat and pressure stall information are not available everywhere */
+  vmstat_.open(proc_dir + "/vmstat", true);
+  for (size_t i = 0; i < kNumPressureFiles; ++i) {
+    auto path = proc_dir + "/pressure/" + kPressureFileNames[i];
+    pressure_[i].open(path, true);
+  }
+
+  if (!takeSample(now, prev_)) {
+    return ReturnCode::error(
+        "EIO",
+        "error while reading from %s: %s",
+        proc_dir.c_str(),
+        strerror(errno));
+  }
+
+  return ReturnCode::success();
+}
+
+bool SysstatsSource::takeSample(uint64_t now, Sample* sample) {
+  memset(sample, 0, sizeof(Sample));
+  sample->time = now;
+
+  if (!stat_.read() || !meminfo_.read() || !loadavg_.read()) {
+    return false;
+  }
+
+  parseStat(stat_.begin(), stat_.end(), sample);
+  parseMeminfo(meminfo_.begin(), meminfo_.end(), sample);
+  parseLoadavg(loadavg_.begin(), loadavg_.end(), sample);
+
+  if (vmstat_.isOpen() && vmstat_.read()) {
+    parseVmstat(vmstat_.begin(), vmstat_.end(), sample);
+  }
+
+  for (size_t i = 0; i < kNumPressureFiles; ++i) {
+    auto& f = pressure_[i];
+    if (f.isOpen() && f.read()) {
+      parsePressure(f.begin(), f.end(), i, sample);
+    }
+  }
+
+  return true;
+}
+
+void SysstatsSource::parseStat(
+    const char* begin,
+    const char* end,
+    Sample* sample) {
+  for (auto cur = begin; cur < end; cur = ProcParser::nextLine(cur, end)) {
+    if (ProcParser::matchKey(cur, end, "cpu ", 4)) {
+      cur += 4;
+      for (size_t i = 0; i < kNumCPUFields; ++i) {
+        cur = ProcParser::scanUInt(cur, end, &sample->cpu[i]);
+      }
+    } else if (ProcParser::matchKey(cur, end, "ctxt ", 5)) {
+      ProcParser::scanUInt(cur + 5, end, &sample->stat[STAT_CTXT]);
+    } else if (ProcParser::matchKey(cur, end, "processes ", 10)) {
+      ProcParser::scanUInt(cur + 10, end, &sample->stat[STAT_PROCESSES]);
+    } else if (ProcParser::matchKey(cur, end, "procs_running ", 14)) {
+      ProcParser::scanUInt(cur + 14, end, &sample->stat[STAT_PROCS_RUNNING]);
+    } else if (ProcParser::matchKey(cur, end, "procs_blocked ", 14)) {
+      ProcParser::scanUInt(cur + 14, end, &sample->stat[STAT_PROCS_BLOCKED]);
+      break; // last line we're interested in
+    }
+  }
+}
+
+void SysstatsSource::parseMeminfo(
+    const char* begin,
+    const char* end,
+    Sample* sample) {
+  size_t found = 0;
+  for (auto cur = begin; cur < end && found < kNumMemFields; ) {
+    for (size_t i = 0; i < kNumMemFields; ++i) {
+      const auto& f = kMemFields[i];
+      if (ProcParser::matchKey(cur, end, f.key, f.key_len)) {
+        ProcParser::scanUInt(cur + f.key_len, end, &sample->mem[i]);
+        sample->mem[i] *= 1024;
+        ++found;
+        break;
+      }
+    }
+
+    cur = ProcParser::nextLine(cur, end);
+  }
+}
+
+void SysstatsSource::parseLoadavg(
+    const char* begin,
+    const char* end,
+    Sample* sample) {
+  /* 0.52 0.58 0.59 2/1234 5678 */
+  auto cur = begin;
+  for (size_t i = 0; i < 3; ++i) {
+    cur = ProcParser::scanFixed2(cur, end, &sample->load[i]);
+  }
+
+  uint64_t running;
+  cur = ProcParser::scanUInt(cur, end, &running);
+  if (cur < end && *cur == '/') {
+    ProcParser::scanUInt(cur + 1, end, &sample->procs_total);
+  }
+}
+
+void SysstatsSource::parseVmstat(
+    const char* begin,
+    const char* end,
+    Sample* sample) {
+  size_t found = 0;
+  for (auto cur = begin; cur < end && found < kNumVMFields; ) {
+    for (size_t i = 0; i < kNumVMFields; ++i) {
+      const auto& f = kVMFields[i];
+      if (ProcParser::matchKey(cur, end, f.key, f.key_len)) {
+        ProcParser::scanUInt(cur + f.key_len, end, &sample->vm[i]);
+        ++found;
+        break;
+      }
+    }
+
+    cur = ProcParser::nextLine(cur, end);
+  }
+
+  sample->has_vm = true;
+}
+
+void SysstatsSource::parsePressure(
+    const char* begin,
+    const char* end,
+    size_t idx,
+    Sample* sample) {
+  /* some avg10=0.00 avg60=0.00 avg300=0.00 total=0 */
+  for (auto cur = begin; cur < end; cur = ProcParser::nextLine(cur, end)) {
+    size_t line;
+    if (ProcParser::matchKey(cur, end, "some ", 5)) {
+      line = 0;
+    } else if (ProcParser::matchKey(cur, end, "full ", 5)) {
+      line = 1;
+    } else {
+      continue;
+    }
+
+    cur += 5;
+    if (!ProcParser::matchKey(cur, end, "avg10=", 6)) {
+      continue;
+    }
+
+    cur = ProcParser::scanFixed2(
+        cur + 6,
+        end,
+        &sample->pressure[idx][line * 2]);
+    cur = ProcParser::skipBlanks(cur, end);
+    if (!ProcParser::matchKey(cur, end, "avg60=", 6)) {
+      continue;
+    }
+
+    ProcParser::scanFixed2(
+        cur + 6,
+        end,
+        &sample->pressure[idx][line * 2 + 1]);
+    sample->has_pressure[idx][line] = true;
+  }
+}
+
+ReturnCode SysstatsSource::getNextEvent(
+    uint64_t now,
+    std::string* event_json) {
+  if (!takeSample(now, cur_)) {
+    return ReturnCode::error(
+        "EIO",
+        "error while reading system stats: %s",
+        strerror(errno));
+  }
+
+  auto len = formatEvent(out_, sizeof(out_));
+  std::swap(cur_, prev_);
+
+  if (len == 0) {
+    return ReturnCode::error("EIO", "system stats event too large");
+  }
+
+  event_json->append(out_, len);
+  return ReturnCode::success();
+}
+
+size_t SysstatsSource::formatEvent(char* out, size_t out_size) const {
+  EventWriter w(out, out_size);
+
+  uint64_t cpu_total = 0;
+  uint64_t cpu_delta[kNumCPUFields];
+  for (size_t i = 0; i < kNumCPUFields; ++i) {
+    cpu_delta[i] = ProcParser::counterDelta(cur_->cpu[i], prev_->cpu[i]);
+    cpu_total += cpu_delta[i];
+  }
+
+  if (cpu_total > 0) {
+    for (size_t i = 0; i < kNumCPUFields; ++i) {
+      w.addFixed2(
+          kCPUFieldNames[i],
+          (cpu_delta[i] * 10000 + cpu_total / 2) / cpu_total);
+    }
+  }
+
+  auto interval = cur_->time > prev_->time ? cur_->time - prev_->time : 0;
+  w.addFixed2(
+      "context_switches_per_sec",
+      ProcParser::counterRate(
+          cur_->stat[STAT_CTXT],
+          prev_->stat[STAT_CTXT],
+          interval));
+  w.addFixed2(
+      "forks_per_sec",
+      ProcParser::counterRate(
+          cur_->stat[STAT_PROCESSES],
+          prev_->stat[STAT_PROCESSES],
+          interval));
+  w.addUInt("procs_running", cur_->stat[STAT_PROCS_RUNNING]);
+  w.addUInt("procs_blocked", cur_->stat[STAT_PROCS_BLOCKED]);
+  w.addUInt("procs_total", cur_->procs_total);
+
+  w.addFixed2("load1", cur_->load[0]);
+  w.addFixed2("load5", cur_->load[1]);
+  w.addFixed2("load15", cur_->load[2]);
+
+  for (size_t i = 0; i < kNumMemFields; ++i) {
+    w.addUInt(kMemFields[i].json_name, cur_->mem[i]);
+  }
+
+  if (cur_->has_vm && prev_->has_vm) {
+    for (size_t i = 0; i < kNumVMFields; ++i) {
+      w.addFixed2(
+          kVMFields[i].json_name,
+          ProcParser::counterRate(cur_->vm[i], prev_->vm[i], interval));
+    }
+  }
+
+  for (size_t i = 0; i < kNumPressureFiles; ++i) {
+    for (size_t j = 0; j < kNumPressureFields; ++j) {
+      if (!cur_->has_pressure[i][j / 2]) {
+        continue;
+      }
+
+      w.addFixed2(
+          kPressurePrefixes[i],
+          kPressureFieldNames[j],
+          cur_->pressure[i][j]);
+    }
+  }
+
+  return w.finish();
+}
+
+ReturnCode SysstatsSourcePlugin::pluginAttach(
+    const PropertyList& config,
+    void** userdata) {
+  std::string proc_dir = "/proc";
+  config.get("proc_dir", &proc_dir);
+
+  std::unique_ptr<SysstatsSource> source(new SysstatsSource());
+  auto rc = source->open(proc_dir, MonotonicClock::now());
+  if (!rc.isSuccess()) {
+    return rc;
+  }
+
+  *userdata = source.release();
+  return ReturnCode::success();
+}
+
+void SysstatsSourcePlugin::pluginDetach(void* userdata) {
+  delete static_cast<SysstatsSource*>(userdata);
+}
+
+ReturnCode SysstatsSourcePlugin::pluginGetNextEvent(
+    void* userdata,
+    std::string* event_json) {
+  return static_cast<SysstatsSource*>(userdata)->getNextEvent(
+      MonotonicClock::now(),
+      event_json);
+}
+
+bool SysstatsSourcePlugin::pluginHasPendingEvent(void* userdata) {
+  return false;
+}
+
+} // namespace evcollect
+
@@ -0,0 +1,127 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <memory>
+#include <string>
+#include <evcollect/evcollect.h>
+#include <evcollect/plugin.h>
+#include <evcollect/util/procfs.h>
+
+namespace evcollect {
+
+/**
+ * Samples system wide cpu, memory, load, paging and pressure stats from
+ * /proc. The files are opened once and re-read with pread into preallocated
+ * buffers on every tick; parsing and formatting the event does not allocate
+ */
+class SysstatsSource {
+public:
+
+  SysstatsSource();
+
+  /**
+   * Open the files below proc_dir (usually /proc) and take the first sample,
+   * which serves as the baseline for the cpu percentages and rates reported
+   * by the first event
+   */
+  ReturnCode open(const std::string& proc_dir, uint64_t now);
+
+  ReturnCode getNextEvent(uint64_t now, std::string* event_json);
+
+protected:
+
+  enum { CPU_USER, CPU_NICE, CPU_SYSTEM, CPU_IDLE, CPU_IOWAIT, CPU_IRQ,
+      CPU_SOFTIRQ, CPU_STEAL, kNumCPUFields };
+
+  enum { STAT_CTXT, STAT_PROCESSES, STAT_PROCS_RUNNING, STAT_PROCS_BLOCKED,
+      kNumStatFields };
+
+  enum { PSI_CPU, PSI_MEMORY, PSI_IO, kNumPressureFiles };
+
+  /* some/full x avg10/avg60, in hundredths of a percent */
+  static const size_t kNumPressureFields = 4;
+  static const size_t kNumMemFields = 8;
+  static const size_t kNumVMFields = 6;
+  static const size_t kMaxEventSize = 4096;
+
+  struct Sample {
+    uint64_t time;
+    uint64_t cpu[kNumCPUFields];
+    uint64_t stat[kNumStatFields];
+    uint64_t mem[kNumMemFields];
+    uint64_t vm[kNumVMFields];
+    bool has_vm;
+    uint64_t load[3];
+    uint64_t procs_total;
+    uint64_t pressure[kNumPressureFiles][kNumPressureFields];
+    bool has_pressure[kNumPressureFiles][2];
+  };
+
+  bool takeSample(uint64_t now, Sample* sample);
+  void parseStat(const char* begin, const char* end, Sample* sample);
+  void parseMeminfo(const char* begin, const char* end, Sample* sample);
+  void parseLoadavg(const char* begin, const char* end, Sample* sample);
+  void parseVmstat(const char* begin, const char* end, Sample* sample);
+  void parsePressure(
+      const char* begin,
+      const char* end,
+      size_t idx,
+      Sample* sample);
+
+  size_t formatEvent(char* out, size_t out_size) const;
+
+  ProcFile stat_;
+  ProcFile meminfo_;
+  ProcFile loadavg_;
+  ProcFile vmstat_;
+  ProcFile pressure_[kNumPressureFiles];
+  Sample samples_[2];
+  Sample* cur_;
+  Sample* prev_;
+  char out_[kMaxEventSize];
+};
+
+class SysstatsSourcePlugin : public SourcePlugin {
+public:
+
+  static void registerPlugin(PluginMap* plugin_map);
+
+  ReturnCode pluginAttach(
+      const PropertyList& config,
+      void** userdata) override;
+
+  void pluginDetach(
+      void* userdata) override;
+
+  ReturnCode pluginGetNextEvent(
+      void* userdata,
+      std::string* event_json) override;
+
+  bool pluginHasPendingEvent(
+      void* userdata) override;
+
+};
+
+} // namespace evcollect
+
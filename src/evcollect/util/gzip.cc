@@ -0,0 +1,91 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <string.h>
+#include "gzip.h"
+
+#ifdef HAVE_ZLIB
+
+GzipCompressor::GzipCompressor(
+    int level) :
+    initialized_(false),
+    level_(level) {
+  memset(&zstream_, 0, sizeof(zstream_));
+}
+
+GzipCompressor::~GzipCompressor() {
+  if (initialized_) {
+    deflateEnd(&zstream_);
+  }
+}
+
+ReturnCode GzipCompressor::compress(
+    const char* data,
+    size_t size,
+    std::string* out) {
+  if (initialized_) {
+    if (deflateReset(&zstream_) != Z_OK) {
+      return ReturnCode::error("EIO", "deflateReset() failed");
+    }
+  } else {
+    int rc = deflateInit2(
+        &zstream_,
+        level_,
+        Z_DEFLATED,
+        15 + 16, /* 32k window, gzip header */
+        8,
+        Z_DEFAULT_STRATEGY);
+
+    if (rc != Z_OK) {
+      return ReturnCode::error("EIO", "deflateInit2() failed: %i", rc);
+    }
+
+    initialized_ = true;
+  }
+
+  out->resize(deflateBound(&zstream_, size));
+  zstream_.next_in = (Bytef*) data;
+  zstream_.avail_in = size;
+  zstream_.next_out = (Bytef*) &(*out)[0];
+  zstream_.avail_out = out->size();
+
+  int rc = deflate(&zstream_, Z_FINISH);
+  if (rc != Z_STREAM_END) {
+    return ReturnCode::error("EIO", "deflate() failed: %i", rc);
+  }
+
+  out->resize(zstream_.total_out);
+  return ReturnCode::success();
+}
+
+ReturnCode GzipCompressor::compress(
+    const std::string& data,
+    std::string* out) {
+  return compress(data.data(), data.size(), out);
+}
+
+int GzipCompressor::getLevel() const {
+  return level_;
+}
+
+#endif
@@ -0,0 +1,65 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <stdlib.h>
+#include <string>
+#include "return_code.h"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifdef HAVE_ZLIB
+
+/**
+ * Compresses buffers into the gzip format. The underlying z_stream is
+ * allocated once and reset for every call to compress, so a compressor should
+ * be kept around (per thread) and reused
+ */
+class GzipCompressor {
+public:
+
+  static const int kDefaultLevel = Z_DEFAULT_COMPRESSION;
+
+  GzipCompressor(int level = kDefaultLevel);
+  ~GzipCompressor();
+
+  GzipCompressor(const GzipCompressor& other) = delete;
+  GzipCompressor& operator=(const GzipCompressor& other) = delete;
+
+  /**
+   * Compress size bytes from data into out. The previous contents of out are
+   * replaced
+   */
+  ReturnCode compress(const char* data, size_t size, std::string* out);
+  ReturnCode compress(const std::string& data, std::string* out);
+
+  int getLevel() const;
+
+protected:
+  z_stream zstream_;
+  bool initialized_;
+  int level_;
+};
+
+#endif
@@ -0,0 +1,131 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include "histogram.h"
+
+LogHistogram::LogHistogram() : count_(0), sum_(0), max_(0) {
+  for (auto& b : buckets_) {
+    b.store(0, std::memory_order_relaxed);
+  }
+}
+
+void LogHistogram::record(uint64_t value) {
+  buckets_[getBucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+
+  auto max = max_.load(std::memory_order_relaxed);
+  while (value > max &&
+         !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+}
+
+void LogHistogram::mergeInto(LogHistogram* other) const {
+  for (size_t i = 0; i < kNumBuckets; ++i) {
+    auto n = buckets_[i].load(std::memory_order_relaxed);
+    if (n > 0) {
+      other->buckets_[i].fetch_add(n, std::memory_order_relaxed);
+    }
+  }
+
+  other->count_.fetch_add(getCount(), std::memory_order_relaxed);
+  other->sum_.fetch_add(getSum(), std::memory_order_relaxed);
+
+  auto value = getMax();
+  auto max = other->max_.load(std::memory_order_relaxed);
+  while (value > max &&
+         !other->max_.compare_exchange_weak(
+              max,
+              value,
+              std::memory_order_relaxed)) {}
+}
+
+uint64_t LogHistogram::getCount() const {
+  return count_.load(std::memory_order_relaxed);
+}
+
+uint64_t LogHistogram::getSum() const {
+  return sum_.load(std::memory_order_relaxed);
+}
+
+uint64_t LogHistogram::getMax() const {
+  return max_.load(std::memory_order_relaxed);
+}
+
+uint64_t LogHistogram::getPercentile(double p) const {
+  /* sum up the buckets instead of using count_ so that a concurrent
+     record() can not make us run past the last bucket */
+  uint64_t total = 0;
+  for (const auto& b : buckets_) {
+    total += b.load(std::memory_order_relaxed);
+  }
+
+  if (total == 0) {
+    return 0;
+  }
+
+  uint64_t rank = total * p / 100.0;
+  if (rank == 0) {
+    rank = 1;
+  }
+
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kNumBuckets; ++i) {
+    seen += buckets_[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      auto max = getMax();
+      auto upper = getBucketUpperBound(i);
+      return max > 0 && max < upper ? max : upper;
+    }
+  }
+
+  return getMax();
+}
+
+/**
+ * Values below kSubBuckets map to themselves. Above that, the index is made
+ * up of the position of the most significant bit (the "major" bucket) and
+ * the kSubBucketBits bits right below it (the sub-bucket)
+ */
+size_t LogHistogram::getBucketIndex(uint64_t value) {
+  if (value < kSubBuckets) {
+    return value;
+  }
+
+  size_t msb = 63 - __builtin_clzll(value);
+  size_t shift = msb - kSubBucketBits;
+  return (shift + 1) * kSubBuckets + ((value >> shift) & (kSubBuckets - 1));
+}
+
+uint64_t LogHistogram::getBucketUpperBound(size_t idx) {
+  size_t major = idx / kSubBuckets;
+  size_t sub = idx % kSubBuckets;
+  if (major == 0) {
+    return sub;
+  }
+
+  /* for the very last bucket the shift overflows to zero, so the result
+     wraps around to UINT64_MAX */
+  size_t shift = major - 1;
+  return ((uint64_t(kSubBuckets + sub + 1)) << shift) - 1;
+}
+
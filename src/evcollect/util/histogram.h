@@ -0,0 +1,77 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <atomic>
+#include <stdlib.h>
+#include <stdint.h>
+
+/**
+ * A histogram with logarithmic buckets in the style of HdrHistogram: values
+ * are grouped by their most significant bit and each power-of-two range is
+ * split into kSubBuckets linear sub-buckets. This covers the full uint64_t
+ * range in a fixed number of buckets while bounding the relative error of
+ * any reported percentile by 1/kSubBuckets.
+ *
+ * record() is a handful of relaxed atomic operations and may be called from
+ * any number of threads. Readers get a consistent view of each individual
+ * bucket, but not necessarily of the histogram as a whole.
+ */
+class LogHistogram {
+public:
+
+  static const size_t kSubBucketBits = 3;
+  static const size_t kSubBuckets = 1 << kSubBucketBits;
+  static const size_t kNumBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+  LogHistogram();
+  LogHistogram(const LogHistogram& other) = delete;
+  LogHistogram& operator=(const LogHistogram& other) = delete;
+
+  void record(uint64_t value);
+
+  /**
+   * Add all values recorded in this histogram to other
+   */
+  void mergeInto(LogHistogram* other) const;
+
+  uint64_t getCount() const;
+  uint64_t getSum() const;
+  uint64_t getMax() const;
+
+  /**
+   * Returns the upper bound of the bucket that contains the p-th percentile
+   * (0 < p <= 100), or zero if the histogram is empty
+   */
+  uint64_t getPercentile(double p) const;
+
+  static size_t getBucketIndex(uint64_t value);
+  static uint64_t getBucketUpperBound(size_t idx);
+
+protected:
+  std::atomic<uint64_t> buckets_[kNumBuckets];
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+  std::atomic<uint64_t> max_;
+};
+
@@ -0,0 +1,387 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include "procfs.h"
+#include "time.h"
+
+namespace {
+
+const size_t kInitialBufferSize = 4096;
+const size_t kMaxBufferSize = 1024 * 1024;
+
+} // namespace
+
+ProcFile::ProcFile() : fd_(-1), buf_size_(0), len_(0) {}
+
+ProcFile::~ProcFile() {
+  close();
+}
+
+ReturnCode ProcFile::open(const std::string& path, bool optional) {
+  return openAt(AT_FDCWD, path, optional);
+}
+
+ReturnCode ProcFile::openAt(
+    int dirfd,
+    const std::string& path,
+    bool optional) {
+  close();
+
+  fd_ = ::openat(dirfd, path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0) {
+    if (optional) {
+      return ReturnCode::success();
+    }
+
+    return ReturnCode::error(
+        "EIO",
+        "open(%s) failed: %s",
+        path.c_str(),
+        strerror(errno));
+  }
+
+  if (buf_size_ < kInitialBufferSize) {
+    buf_.reset(new char[kInitialBufferSize]);
+    buf_size_ = kInitialBufferSize;
+  }
+
+  /* leave room to spare so that the file can grow a bit before the next
+     sample has to grow the buffer again */
+  bool rc = read();
+  while (rc && len_ + len_ / 2 >= buf_size_ && buf_size_ < kMaxBufferSize) {
+    grow();
+    rc = read();
+  }
+
+  if (!rc) {
+    auto err = errno;
+    close();
+
+    if (optional) {
+      return ReturnCode::success();
+    }
+
+    return ReturnCode::error(
+        "EIO",
+        "read(%s) failed: %s",
+        path.c_str(),
+        strerror(err));
+  }
+
+  return ReturnCode::success();
+}
+
+void ProcFile::close() {
+  if (fd_ >= 0) {
+    ::close(fd_);
+    fd_ = -1;
+  }
+
+  len_ = 0;
+}
+
+bool ProcFile::isOpen() const {
+  return fd_ >= 0;
+}
+
+bool ProcFile::read() {
+  for (;;) {
+    auto rc = readFD(fd_, buf_.get(), buf_size_);
+    if (rc < 0) {
+      len_ = 0;
+      return false;
+    }
+
+    len_ = rc;
+
+    /* a full buffer means the file may have been cut off */
+    if (len_ < buf_size_ || buf_size_ >= kMaxBufferSize) {
+      return true;
+    }
+
+    grow();
+  }
+}
+
+void ProcFile::grow() {
+  buf_size_ = std::min(buf_size_ * 2, kMaxBufferSize);
+  buf_.reset(new char[buf_size_]);
+  len_ = 0;
+}
+
+const char* ProcFile::begin() const {
+  return buf_.get();
+}
+
+const char* ProcFile::end() const {
+  return buf_.get() + len_;
+}
+
+ssize_t ProcFile::readAt(int dirfd, const char* path, char* buf, size_t size) {
+  int fd = ::openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+
+  auto rc = readFD(fd, buf, size);
+  auto err = errno;
+  ::close(fd);
+  errno = err;
+  return rc;
+}
+
+ssize_t ProcFile::readFD(int fd, char* buf, size_t size) {
+  size_t len = 0;
+  while (len < size) {
+    auto rc = pread(fd, buf + len, size - len, len);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      return -1;
+    }
+
+    if (rc == 0) {
+      break;
+    }
+
+    len += rc;
+  }
+
+  return len;
+}
+
+bool ProcParser::matchKey(
+    const char* begin,
+    const char* end,
+    const char* key,
+    size_t key_len) {
+  return size_t(end - begin) > key_len && memcmp(begin, key, key_len) == 0;
+}
+
+const char* ProcParser::nextLine(const char* begin, const char* end) {
+  auto nl = static_cast<const char*>(memchr(begin, '\n', end - begin));
+  return nl ? nl + 1 : end;
+}
+
+const char* ProcParser::skipBlanks(const char* cur, const char* end) {
+  while (cur < end && (*cur == ' ' || *cur == '\t')) {
+    ++cur;
+  }
+
+  return cur;
+}
+
+const char* ProcParser::skipField(const char* cur, const char* end) {
+  cur = skipBlanks(cur, end);
+  while (cur < end && *cur != ' ' && *cur != '\t' && *cur != '\n') {
+    ++cur;
+  }
+
+  return cur;
+}
+
+const char* ProcParser::scanUInt(
+    const char* cur,
+    const char* end,
+    uint64_t* value) {
+  cur = skipBlanks(cur, end);
+
+  uint64_t v = 0;
+  for (; cur < end && *cur >= '0' && *cur <= '9'; ++cur) {
+    v = v * 10 + (*cur - '0');
+  }
+
+  *value = v;
+  return cur;
+}
+
+const char* ProcParser::scanFixed2(
+    const char* cur,
+    const char* end,
+    uint64_t* value) {
+  uint64_t v;
+  cur = scanUInt(cur, end, &v);
+  v *= 100;
+
+  if (cur < end && *cur == '.') {
+    ++cur;
+    for (uint64_t m = 10; cur < end && *cur >= '0' && *cur <= '9'; ++cur) {
+      v += (*cur - '0') * m;
+      m /= 10;
+    }
+  }
+
+  *value = v;
+  return cur;
+}
+
+uint64_t ProcParser::counterDelta(uint64_t cur, uint64_t prev) {
+  return cur > prev ? cur - prev : 0;
+}
+
+uint64_t ProcParser::wrappingCounterDelta(uint64_t cur, uint64_t prev) {
+  static const uint64_t kWrap = uint64_t(1) << 32;
+  if (cur >= prev) {
+    return cur - prev;
+  }
+
+  if (prev >= kWrap) {
+    return 0;
+  }
+
+  /* a wrap leaves prev near the top and cur near the bottom of the 32 bit
+     range; anything further apart is a reset (e.g. the device was replaced) */
+  auto delta = cur + kWrap - prev;
+  return delta < kWrap / 2 ? delta : 0;
+}
+
+uint64_t ProcParser::counterRate(
+    uint64_t cur,
+    uint64_t prev,
+    uint64_t interval) {
+  return rate(counterDelta(cur, prev), interval);
+}
+
+uint64_t ProcParser::rate(uint64_t delta, uint64_t interval) {
+  if (interval == 0) {
+    return 0;
+  }
+
+  return uint64_t(double(delta) * 100 * kMicrosPerSecond / interval + 0.5);
+}
+
+EventWriter::EventWriter(char* out, size_t out_size) :
+    begin_(out),
+    cur_(out),
+    end_(out + out_size),
+    overflow_(false) {
+  append('{');
+}
+
+void EventWriter::addUInt(const char* key, uint64_t value) {
+  addKey(key, nullptr);
+  appendUInt(value);
+}
+
+void EventWriter::addUInt(
+    const char* prefix,
+    const char* key,
+    uint64_t value) {
+  addKey(prefix, key);
+  appendUInt(value);
+}
+
+void EventWriter::addFixed2(const char* key, uint64_t value) {
+  addFixed2(nullptr, key, value);
+}
+
+void EventWriter::addFixed2(
+    const char* prefix,
+    const char* key,
+    uint64_t value) {
+  addKey(prefix, key);
+  appendUInt(value / 100);
+  append('.');
+  append('0' + (value / 10) % 10);
+  append('0' + value % 10);
+}
+
+void EventWriter::addString(
+    const char* key,
+    const char* value,
+    size_t value_len) {
+  static const char kHexDigits[] = "0123456789abcdef";
+
+  addKey(key, nullptr);
+  append('"');
+  for (size_t i = 0; i < value_len; ++i) {
+    unsigned char c = value[i];
+    if (c == '"' || c == '\\') {
+      append('\\');
+      append(c);
+    } else if (c < 0x20) {
+      append("\\u00");
+      append(kHexDigits[c >> 4]);
+      append(kHexDigits[c & 0xf]);
+    } else {
+      append(c);
+    }
+  }
+
+  append('"');
+}
+
+size_t EventWriter::finish() {
+  append('}');
+  return overflow_ ? 0 : cur_ - begin_;
+}
+
+void EventWriter::append(char c) {
+  if (cur_ < end_) {
+    *cur_++ = c;
+  } else {
+    overflow_ = true;
+  }
+}
+
+void EventWriter::append(const char* str) {
+  for (; *str; ++str) {
+    append(*str);
+  }
+}
+
+void EventWriter::appendUInt(uint64_t value) {
+  char digits[20];
+  size_t n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0);
+
+  while (n > 0) {
+    append(digits[--n]);
+  }
+}
+
+void EventWriter::addKey(const char* prefix, const char* key) {
+  if (cur_ - begin_ > 1) {
+    append(',');
+  }
+
+  append('"');
+  if (prefix) {
+    append(prefix);
+  }
+  if (key) {
+    append(key);
+  }
+  append("\":");
+}
+
@@ -0,0 +1,179 @@
+/**
+ * Copyright (c) 2016 DeepCortex GmbH <legal@eventql.io>
+ * Authors:
+ *   - Paul Asmuth <paul@eventql.io>
+ *
+ * This program is free software: you can redistribute it and/or modify it under
+ * the terms of the GNU Affero General Public License ("the license") as
+ * published by the Free Software Foundation, either version 3 of the License,
+ * or any later version.
+ *
+ * In accordance with Section 7(e) of the license, the licensing of the Program
+ * under the license does not imply a trademark license. Therefore any rights,
+ * title and interest in our trademarks remain entirely with us.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the license for more details.
+ *
+ * You can be released from the requirements of the license by purchasing a
+ * commercial license. Buying such a license is mandatory as soon as you develop
+ * commercial activities involving this program without disclosing the source
+ * code of your own applications
+ */
+#pragma once
+#include <memory>
+#include <string>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "return_code.h"
+
+/**
+ * A file below /proc (or /sys) that is opened once and re-read with pread
+ * into a buffer that is reused across samples
+ */
+class ProcFile {
+public:
+
+  ProcFile();
+  ~ProcFile();
+
+  ProcFile(const ProcFile& other) = delete;
+  ProcFile& operator=(const ProcFile& other) = delete;
+
+  /**
+   * Open the file and size the buffer so that the current contents fit with
+   * room to spare. If optional is true, a file that can't be opened or read is
+   * not an error and isOpen() returns false afterwards
+   */
+  ReturnCode open(const std::string& path, bool optional);
+  ReturnCode openAt(int dirfd, const std::string& path, bool optional);
+
+  void close();
+  bool isOpen() const;
+
+  /**
+   * Re-read the file from the start. If the contents fill the whole buffer,
+   * it is doubled and the file read again (up to 1MB, beyond which the
+   * contents are cut off)
+   */
+  bool read();
+
+  const char* begin() const;
+  const char* end() const;
+
+  /**
+   * Read a file relative to dirfd into buf in one go (openat, read, close).
+   * Returns the number of bytes read or -1 on error, with errno set
+   */
+  static ssize_t readAt(int dirfd, const char* path, char* buf, size_t size);
+
+  /**
+   * Read from the start of an open file into buf. Returns the number of bytes
+   * read or -1 on error, with errno set
+   */
+  static ssize_t readFD(int fd, char* buf, size_t size);
+
+protected:
+
+  void grow();
+
+  int fd_;
+  std::unique_ptr<char[]> buf_;
+  size_t buf_size_;
+  size_t len_;
+};
+
+/**
+ * Allocation free scanners for the line based formats used in /proc
+ */
+class ProcParser {
+public:
+
+  /**
+   * Returns true if the line at begin starts with key (and has at least one
+   * more character)
+   */
+  static bool matchKey(
+      const char* begin,
+      const char* end,
+      const char* key,
+      size_t key_len);
+
+  static const char* nextLine(const char* begin, const char* end);
+  static const char* skipBlanks(const char* cur, const char* end);
+  static const char* skipField(const char* cur, const char* end);
+
+  static const char* scanUInt(const char* cur, const char* end, uint64_t* v);
+
+  /**
+   * Scans a decimal like "12.34" into hundredths (1234). Further digits are
+   * truncated
+   */
+  static const char* scanFixed2(
+      const char* cur,
+      const char* end,
+      uint64_t* value);
+
+  /**
+   * Difference between two samples of a monotonic counter. Counters that went
+   * backwards (e.g. because the process or device was replaced) count as
+   * zero
+   */
+  static uint64_t counterDelta(uint64_t cur, uint64_t prev);
+
+  /**
+   * Like counterDelta, but for counters that are only 32 bits wide on some
+   * kernels (network and block device stats): a smaller current value is
+   * taken as a wraparound if both values are close to the 32 bit boundary
+   * (the wrapped delta is less than 2^31) and as a reset otherwise
+   */
+  static uint64_t wrappingCounterDelta(uint64_t cur, uint64_t prev);
+
+  /**
+   * Returns the per second rate of a counter in hundredths, interval is in
+   * microseconds
+   */
+  static uint64_t counterRate(uint64_t cur, uint64_t prev, uint64_t interval);
+  static uint64_t rate(uint64_t delta, uint64_t interval);
+
+};
+
+/**
+ * Formats a flat JSON object into a fixed size buffer. Output that doesn't
+ * fit is dropped and reported by finish()
+ */
+class EventWriter {
+public:
+
+  EventWriter(char* out, size_t out_size);
+
+  void addUInt(const char* key, uint64_t value);
+  void addUInt(const char* prefix, const char* key, uint64_t value);
+
+  /* value is given in hundredths */
+  void addFixed2(const char* key, uint64_t value);
+  void addFixed2(const char* prefix, const char* key, uint64_t value);
+
+  void addString(const char* key, const char* value, size_t value_len);
+
+  /**
+   * Closes the object and returns its length, or zero if the output did not
+   * fit into the buffer
+   */
+  size_t finish();
+
+protected:
+
+  void append(char c);
+  void append(const char* str);
+  void appendUInt(uint64_t value);
+  void addKey(const char* prefix, const char* key);
+
+  char* begin_;
+  char* cur_;
+  char* end_;
+  bool overflow_;
+};
+
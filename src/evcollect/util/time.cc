@@ -33,6 +33,7 @@
 #endif
 #include "time.h"
 #include "stringutil.h"
+#include "logging.h"
 
 UnixTime WallClock::now() {
   return UnixTime(WallClock::getUnixMicros());
@@ -86,6 +87,19 @@ uint64_t MonotonicClock::now() {
 #endif
 }
 
+uint64_t ThreadCPUClock::now() {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+    return 0;
+  } else {
+    return std::uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+  }
+#else
+  return 0;
+#endif
+}
+
 UnixTime::UnixTime() :
     utc_micros_(WallClock::unixMicros()) {}
 
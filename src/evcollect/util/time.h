@@ -69,6 +69,15 @@ public:
   static uint64_t now();
 };
 
+class ThreadCPUClock {
+public:
+
+  /**
+   * Returns the CPU time consumed by the calling thread in microseconds
+   */
+  static uint64_t now();
+};
+
 class UnixTime {
 public:
 